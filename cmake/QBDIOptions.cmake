@@ -6,6 +6,8 @@ set(__add_qbdi_options ON)
 
 option(FORCE_DISABLE_AVX "Force disable AVX support in case dynamic support detection is buggy" OFF)
 option(ASAN "Enable AddressSanitizer (ASAN) for debugging (May be slow down)" OFF)
+option(SHADOW_RETURN_STACK "Speed up returns with a shadow return stack (X86 and X86_64 only)" ON)
+option(DUAL_MAPPED_CODE "Map the ExecBlock code twice instead of switching its permissions (Linux and Android only, the code is shared with forked children)" OFF)
 
 option(LOG_DEBUG "Enable Debug log level" OFF)
 
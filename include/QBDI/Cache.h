@@ -0,0 +1,49 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "Platform.h"
+#include "State.h"
+
+#ifdef __cplusplus
+namespace QBDI {
+#endif
+
+/*! Statistics of the translation cache
+ */
+typedef struct {
+    rword targetCacheHits;   /*!< Indirect branches which found their target in the target cache */
+    rword targetCacheMisses; /*!< Indirect branches which returned to the VM to find their target */
+    rword traces;            /*!< Hot basic blocks retranslated as the head of a trace */
+    rword traceSideExits;    /*!< Side exits of the traces which returned to the VM and were linked */
+} CacheStats;
+
+/*! Statistics of an indirect branch using the target cache
+ */
+typedef struct {
+    rword address; /*!< Address of the indirect branch */
+    rword hits;    /*!< Executions which found their target in the target cache */
+    rword misses;  /*!< Executions which returned to the VM to find their target */
+} TargetCacheStats;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _CACHE_H_
@@ -18,6 +18,8 @@
 #ifndef _CALLBACK_H_
 #define _CALLBACK_H_
 
+#include <stddef.h>
+
 #include "Platform.h"
 #include "State.h"
 #include "Bitmask.h"
@@ -133,6 +135,16 @@ typedef struct {
     MemoryAccessType type; /*!< Memory access type (READ / WRITE) */
 } MemoryAccess;
 
+/*! Memory trace callback function type.
+ *
+ * @param[in] vm            VM instance of the callback.
+ * @param[in] accesses      The traced memory accesses in execution order. The array is only valid
+ *                          until the callback returns.
+ * @param[in] count         The number of memory accesses in the array.
+ * @param[in] data          User defined data which can be defined when starting the trace.
+ */
+typedef void (*MemoryTraceCallback)(VMInstanceRef vm, const MemoryAccess *accesses, size_t count, void *data);
+
 #ifdef __cplusplus
 } // QBDI::
 #endif
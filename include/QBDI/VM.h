@@ -24,6 +24,7 @@
 #include <cstdarg>
 
 #include "Platform.h"
+#include "Cache.h"
 #include "Callback.h"
 #include "Errors.h"
 #include "State.h"
@@ -37,6 +38,12 @@ class Engine;
 class InstrRule;
 // Forward declaration of private memCBInfo
 struct MemCBInfo;
+// Forward declaration of private CounterArray
+class CounterArray;
+// Forward declaration of private MemoryTrace
+struct MemoryTrace;
+// Forward declaration of private MemoryFilter
+class MemoryFilter;
 
 class QBDI_EXPORT VM {
     private:
@@ -47,6 +54,13 @@ class QBDI_EXPORT VM {
     uint32_t memCBID;
     uint32_t memReadGateCBID;
     uint32_t memWriteGateCBID;
+    uint32_t memReadWriteGateCBID;
+    std::vector<std::pair<uint32_t, CounterArray*>>* counters;
+    MemoryTrace* memoryTrace;
+    std::vector<MemoryTrace*>* retiredTraces;
+    bool running;
+    MemoryFilter* memReadFilter;
+    MemoryFilter* memWriteFilter;
 
     public:
     /*! Construct a new VM for a given CPU with specific attributes
@@ -224,6 +238,24 @@ class QBDI_EXPORT VM {
      */
     uint32_t    addCodeCB(InstPosition pos, InstCallback cbk, void *data);
 
+    /*! Register a fast callback event for every instruction executed. A fast callback is called
+     *  directly from the instrumented code on the host stack instead of leaving the ExecBlock,
+     *  which is much cheaper for callbacks triggered very often. Returning BREAK_TO_VM or STOP
+     *  still leaves the ExecBlock. On architectures without fast callback support, a regular
+     *  callback is registered.
+     *
+     * @param[in] pos    Relative position of the event callback (PREINST / POSTINST).
+     * @param[in] cbk    A function pointer to the callback.
+     * @param[in] data   User defined data passed to the callback.
+     * @param[in] state  Save the guest state for the callback. Otherwise only the registers
+     *                   which can be modified by the callback call are saved and the callback
+     *                   receives NULL GPRState and FPRState pointers, which is cheaper.
+     *
+     * @return The id of the registered instrumentation (or VMError::INVALID_EVENTID
+     * in case of failure).
+     */
+    uint32_t    addFastCodeCB(InstPosition pos, InstCallback cbk, void *data, bool state = true);
+
      /*! Register a callback for when a specific address is executed.
      *
      * @param[in] address  Code address which will trigger the callback.
@@ -263,7 +295,10 @@ class QBDI_EXPORT VM {
     
     /*! Add a virtual callback which is triggered for any memory access at a specific address 
      *  matching the access type. Virtual callbacks are called via callback forwarding by a 
-     *  gate callback triggered on every memory access. This incurs a high performance cost.
+     *  gate callback. For QBDI::MEMORY_READ and QBDI::MEMORY_WRITE, the instrumented code only
+     *  calls the gate for the accesses which may hit a watched range, reads are reported before the
+     *  instruction and writes after it. QBDI::MEMORY_READ_WRITE ranges are checked after every
+     *  instruction accessing the memory and the callback is triggered once per instruction.
      *
      * @param[in] address  Code address which will trigger the callback.
      * @param[in] type     A mode bitfield: either QBDI::MEMORY_READ, QBDI::MEMORY_WRITE or both
@@ -278,7 +313,10 @@ class QBDI_EXPORT VM {
 
     /*! Add a virtual callback which is triggered for any memory access in a specific address range 
      *  matching the access type. Virtual callbacks are called via callback forwarding by a 
-     *  gate callback triggered on every memory access. This incurs a high performance cost.
+     *  gate callback. For QBDI::MEMORY_READ and QBDI::MEMORY_WRITE, the instrumented code only
+     *  calls the gate for the accesses which may hit a watched range, reads are reported before the
+     *  instruction and writes after it. QBDI::MEMORY_READ_WRITE ranges are checked after every
+     *  instruction accessing the memory and the callback is triggered once per instruction.
      *
      * @param[in] start    Start of the address range which will trigger the callback.
      * @param[in] end      End of the address range which will trigger the callback.
@@ -292,6 +330,59 @@ class QBDI_EXPORT VM {
      */
     uint32_t    addMemRangeCB(rword start, rword end, MemoryAccessType type, InstCallback cbk, void *data);
 
+    /*! Count the executions of the basic blocks starting in an address range. The counters are
+     *  incremented directly by the instrumented code without any callback. A basic block entered
+     *  in its middle isn't counted.
+     *
+     * @param[in] start    Start of the address range of the counted basic blocks.
+     * @param[in] end      End of the address range of the counted basic blocks.
+     *
+     * @return The id of the registered instrumentation (or VMError::INVALID_EVENTID
+     * in case of failure).
+     */
+    uint32_t    addBlockCounter(rword start, rword end);
+
+    /*! Count the executions of the instructions in an address range. The counters are incremented
+     *  directly by the instrumented code without any callback.
+     *
+     * @param[in] start    Start of the address range of the counted instructions.
+     * @param[in] end      End of the address range of the counted instructions.
+     *
+     * @return The id of the registered instrumentation (or VMError::INVALID_EVENTID
+     * in case of failure).
+     */
+    uint32_t    addInstCounter(rword start, rword end);
+
+    /*! Obtain the execution counters of a counter instrumentation starting at an index, without
+     *  copying them. Each instrumentation has its own counters, a counter is added the first time
+     *  a counted address is translated. The counters are stored in chunks which never move: the
+     *  returned pointer reads the live counters and stays valid for the life of the VM, even after
+     *  the instrumentation is deleted. All the counters are read by calling it again with
+     *  index + size until size is 0.
+     *
+     * @param[in]  id     The id of the counter instrumentation.
+     * @param[in]  index  The index of the first counter.
+     * @param[out] size   Will be set to the number of consecutive counters from the index (or 0 if
+     *                    no counter has this index).
+     *
+     * @return A pointer to the counter of the index (or NULL if no counter has this index).
+     */
+    const rword* getCounters(uint32_t id, size_t index, size_t* size) const;
+
+    /*! Obtain the index of the counter of an address in the counters of a counter instrumentation.
+     *
+     * @param[in]  id       The id of the counter instrumentation.
+     * @param[in]  address  A counted address.
+     * @param[out] index    Will be set to the index of the counter of the address.
+     *
+     * @return True if the address has a counter.
+     */
+    bool        getCounterIndex(uint32_t id, rword address, size_t* index) const;
+
+    /*! Set all the execution counters to zero.
+     */
+    void        resetCounters();
+
 
     /*! Register a callback event for a specific VM event.
      *
@@ -351,6 +442,49 @@ class QBDI_EXPORT VM {
      */
     std::vector<MemoryAccess> getBBMemoryAccess() const;
 
+    /*! Obtain the memory accesses made by the last executed instruction without allocating.
+     *  The accesses are copied to a caller provided buffer.
+     *
+     * @param[out] out  The buffer receiving the memory accesses, can be NULL if cap is 0.
+     * @param[in]  cap  The number of elements of the buffer.
+     *
+     * @return The number of memory accesses made by the instruction. Only the first cap are copied
+     *         if it is larger than cap.
+     */
+    size_t getInstMemoryAccess(MemoryAccess* out, size_t cap) const;
+
+    /*! Obtain the memory accesses made by the last executed basic block without allocating.
+     *  The accesses are copied to a caller provided buffer.
+     *
+     * @param[out] out  The buffer receiving the memory accesses, can be NULL if cap is 0.
+     * @param[in]  cap  The number of elements of the buffer.
+     *
+     * @return The number of memory accesses made by the basic block. Only the first cap are copied
+     *         if it is larger than cap.
+     */
+    size_t getBBMemoryAccess(MemoryAccess* out, size_t cap) const;
+
+    /*! Stream the memory accesses to a trace buffer using inline instrumentation. The records are
+     *  appended by the instrumented code and delivered in batches to the callback when the buffer
+     *  could overflow, at the end of a run and when the trace is stopped. Only one trace can be
+     *  active at a time and the basic block chaining is disabled while the trace is active.
+     *
+     * @param[in] type     Memory mode bitfield to trace: either QBDI::MEMORY_READ,
+     *                     QBDI::MEMORY_WRITE or both (QBDI::MEMORY_READ_WRITE).
+     * @param[in] size     The number of records of the trace buffer. The buffer is grown if
+     *                     a single sequence could exceed it.
+     * @param[in] cbk      A function pointer to the callback receiving the records.
+     * @param[in] data     User defined data passed to the callback.
+     *
+     * @return True if the memory trace is supported and started, False if not or in case of error.
+     */
+    bool        startMemoryTrace(MemoryAccessType type, size_t size, MemoryTraceCallback cbk, void *data);
+
+    /*! Deliver the remaining records of the memory trace and remove its instrumentation. Can be
+     *  called from the trace callback, the records it received stay valid until it returns.
+     */
+    void        stopMemoryTrace();
+
     /*! Pre-cache a known basic block
      *
      * @param[in] pc   Start address of a basic block
@@ -371,6 +505,69 @@ class QBDI_EXPORT VM {
     */
     void clearAllCache();
 
+    /*! Set the maximum amount of memory used by the translation cache. When the budget is
+     *  exceeded, the least recently executed regions of the cache are evicted until it uses three
+     *  quarters of the budget. The budget is a soft limit as the region being executed is never
+     *  evicted.
+     *
+     * @param[in] budget Size in bytes of the translation cache budget, 0 (default) for no limit.
+     *
+    */
+    void setCacheBudget(size_t budget);
+
+    /*! Obtain the statistics of the translation cache. The counters of the evicted or cleared
+     *  ExecBlocks are kept.
+     *
+     * @param[out] stats The structure receiving the statistics.
+     *
+    */
+    void getCacheStats(CacheStats* stats) const;
+
+    /*! Obtain the hits and misses of every indirect branch using the target cache. Only the
+     *  ExecBlocks currently in the translation cache are reported, an indirect branch translated
+     *  several times, for example inside a trace, has one entry per translation.
+     *
+     * @return A vector of statistics, one per translated indirect branch.
+    */
+    std::vector<TargetCacheStats> getTargetCacheStats() const;
+
+    /*! Enable the persistent decode cache and load a cache file created by a previous run.
+     *  Instructions found in the cache are neither disassembled nor patched again, but they are
+     *  still instrumented and assembled. The cache is keyed by module and offset, and the
+     *  instruction bytes are checked before an entry is reused.
+     *
+     * @param[in] path Path of the cache file.
+     *
+     * @return True if the file was loaded. Otherwise the cache is still enabled, but empty.
+    */
+    bool loadDecodeCache(const char* path);
+
+    /*! Save the decode cache to a file which can be loaded by the next runs.
+     *
+     * @param[in] path Path of the cache file.
+     *
+     * @return True if the file was written, false if the cache isn't enabled or on error.
+    */
+    bool saveDecodeCache(const char* path);
+
+    /*! Enable or disable the speculative translation. When enabled, a worker thread disassembles
+     *  and patches the static successors of every new basic block before they are reached. The
+     *  instrumentation and the assembly are still done by the execution thread, which also checks
+     *  that the code was not modified since it was patched. Disabled by default.
+     *
+     * @param[in] enable True to start the worker thread, false to stop it.
+    */
+    void setSpeculativeTranslation(bool enable);
+
+    /*! Enable or disable the peephole optimization of the instrumented code, which removes the
+     *  redundant register spills and constant loads produced when several instrumentations apply
+     *  to the same instruction. Enabled by default, the translation cache is flushed when the
+     *  setting changes.
+     *
+     * @param[in] enable True to optimize the instrumented code.
+    */
+    void setPatchOptimization(bool enable);
+
 };
 
 } // QBDI::
@@ -22,6 +22,7 @@
 #include <stdarg.h>
 
 #include "Platform.h"
+#include "Cache.h"
 #include "Callback.h"
 #include "Errors.h"
 #include "State.h"
@@ -220,7 +221,10 @@ QBDI_EXPORT uint32_t qbdi_addMemAccessCB(VMInstanceRef instance, MemoryAccessTyp
 
 /*! Add a virtual callback which is triggered for any memory access at a specific address 
  *  matching the access type. Virtual callbacks are called via callback forwarding by a 
- *  gate callback triggered on every memory access. This incurs a high performance cost.
+ *  gate callback. For QBDI::MEMORY_READ and QBDI::MEMORY_WRITE, the instrumented code only
+ *  calls the gate for the accesses which may hit a watched range, reads are reported before the
+ *  instruction and writes after it. QBDI::MEMORY_READ_WRITE ranges are checked after every
+ *  instruction accessing the memory and the callback is triggered once per instruction.
  *
  * @param[in] instance  VM instance.
  * @param[in] address  Code address which will trigger the callback.
@@ -235,7 +239,10 @@ QBDI_EXPORT uint32_t qbdi_addMemAddrCB(VMInstanceRef instance, rword address, Me
 
 /*! Add a virtual callback which is triggered for any memory access in a specific address range 
  *  matching the access type. Virtual callbacks are called via callback forwarding by a 
- *  gate callback triggered on every memory access. This incurs a high performance cost.
+ *  gate callback. For QBDI::MEMORY_READ and QBDI::MEMORY_WRITE, the instrumented code only
+ *  calls the gate for the accesses which may hit a watched range, reads are reported before the
+ *  instruction and writes after it. QBDI::MEMORY_READ_WRITE ranges are checked after every
+ *  instruction accessing the memory and the callback is triggered once per instruction.
  *
  * @param[in] instance  VM instance.
  * @param[in] start    Start of the address range which will trigger the callback.
@@ -274,6 +281,26 @@ QBDI_EXPORT uint32_t qbdi_addMnemonicCB(VMInstanceRef instance, const char* mnem
  */
 QBDI_EXPORT uint32_t qbdi_addCodeCB(VMInstanceRef instance, InstPosition pos, InstCallback cbk, void *data);
 
+/*! Register a fast callback event for every instruction executed. A fast callback is called
+ *  directly from the instrumented code on the host stack instead of leaving the ExecBlock,
+ *  which is much cheaper for callbacks triggered very often. Returning QBDI_BREAK_TO_VM or
+ *  QBDI_STOP still leaves the ExecBlock. On architectures without fast callback support, a regular
+ *  callback is registered.
+ *
+ * @param[in] instance   VM instance.
+ * @param[in] pos        Relative position of the event callback (QBDI_PREINST / QBDI_POSTINST).
+ * @param[in] cbk        A function pointer to the callback.
+ * @param[in] data       User defined data passed to the callback.
+ * @param[in] state      Save the guest state for the callback. Otherwise only the registers
+ *                       which can be modified by the callback call are saved and the callback
+ *                       receives NULL GPRState and FPRState pointers, which is cheaper. Unlike
+ *                       QBDI::VM::addFastCodeCB it has no default, pass true to save the state.
+ *
+ * @return The id of the registered instrumentation (or QBDI_INVALID_EVENTID
+ * in case of failure).
+ */
+QBDI_EXPORT uint32_t qbdi_addFastCodeCB(VMInstanceRef instance, InstPosition pos, InstCallback cbk, void *data, bool state);
+
 /*! Register a callback for when a specific address is executed.
  *
  * @param[in] instance  VM instance.
@@ -301,6 +328,65 @@ QBDI_EXPORT uint32_t qbdi_addCodeAddrCB(VMInstanceRef instance, rword address, I
  */
 QBDI_EXPORT uint32_t qbdi_addCodeRangeCB(VMInstanceRef instance, rword start, rword end, InstPosition pos, InstCallback cbk, void *data);
 
+/*! Count the executions of the basic blocks starting in an address range. The counters are
+ *  incremented directly by the instrumented code without any callback. A basic block entered
+ *  in its middle isn't counted.
+ *
+ * @param[in] instance  VM instance.
+ * @param[in] start     Start of the address range of the counted basic blocks.
+ * @param[in] end       End of the address range of the counted basic blocks.
+ *
+ * @return The id of the registered instrumentation (or QBDI_INVALID_EVENTID
+ * in case of failure).
+ */
+QBDI_EXPORT uint32_t qbdi_addBlockCounter(VMInstanceRef instance, rword start, rword end);
+
+/*! Count the executions of the instructions in an address range. The counters are incremented
+ *  directly by the instrumented code without any callback.
+ *
+ * @param[in] instance  VM instance.
+ * @param[in] start     Start of the address range of the counted instructions.
+ * @param[in] end       End of the address range of the counted instructions.
+ *
+ * @return The id of the registered instrumentation (or QBDI_INVALID_EVENTID
+ * in case of failure).
+ */
+QBDI_EXPORT uint32_t qbdi_addInstCounter(VMInstanceRef instance, rword start, rword end);
+
+/*! Obtain the execution counters of a counter instrumentation starting at an index, without
+ *  copying them. Each instrumentation has its own counters, a counter is added the first time a
+ *  counted address is translated. The counters are stored in chunks which never move: the
+ *  returned pointer reads the live counters and stays valid for the life of the VM, even after
+ *  the instrumentation is deleted. All the counters are read by calling it again with
+ *  index + size until size is 0.
+ *
+ * @param[in]  instance  VM instance.
+ * @param[in]  id        The id of the counter instrumentation.
+ * @param[in]  index     The index of the first counter.
+ * @param[out] size      Will be set to the number of consecutive counters from the index (or 0
+ *                       if no counter has this index).
+ *
+ * @return A pointer to the counter of the index (or NULL if no counter has this index).
+ */
+QBDI_EXPORT const rword* qbdi_getCounters(VMInstanceRef instance, uint32_t id, size_t index, size_t* size);
+
+/*! Obtain the index of the counter of an address in the counters of a counter instrumentation.
+ *
+ * @param[in]  instance  VM instance.
+ * @param[in]  id        The id of the counter instrumentation.
+ * @param[in]  address   A counted address.
+ * @param[out] index     Will be set to the index of the counter of the address.
+ *
+ * @return True if the address has a counter.
+ */
+QBDI_EXPORT bool qbdi_getCounterIndex(VMInstanceRef instance, uint32_t id, rword address, size_t* index);
+
+/*! Set all the execution counters to zero.
+ *
+ * @param[in] instance  VM instance.
+ */
+QBDI_EXPORT void qbdi_resetCounters(VMInstanceRef instance);
+
 /*! Register a callback event for a specific VM event.
  *
  * @param[in] instance  VM instance.
@@ -370,6 +456,54 @@ QBDI_EXPORT MemoryAccess* qbdi_getInstMemoryAccess(VMInstanceRef instance, size_
  */
 QBDI_EXPORT MemoryAccess* qbdi_getBBMemoryAccess(VMInstanceRef instance, size_t* size);
 
+/*! Obtain the memory accesses made by the last executed instruction without allocating.
+ *  The accesses are copied to a caller provided buffer.
+ *
+ *  @param[in]  instance     VM instance.
+ *  @param[out] out          The buffer receiving the memory accesses, can be NULL if cap is 0.
+ *  @param[in]  cap          The number of elements of the buffer.
+ *
+ * @return The number of memory accesses made by the instruction. Only the first cap are copied
+ *         if it is larger than cap.
+ */
+QBDI_EXPORT size_t qbdi_readInstMemoryAccess(VMInstanceRef instance, MemoryAccess* out, size_t cap);
+
+/*! Obtain the memory accesses made by the last executed basic block without allocating.
+ *  The accesses are copied to a caller provided buffer.
+ *
+ *  @param[in]  instance     VM instance.
+ *  @param[out] out          The buffer receiving the memory accesses, can be NULL if cap is 0.
+ *  @param[in]  cap          The number of elements of the buffer.
+ *
+ * @return The number of memory accesses made by the basic block. Only the first cap are copied
+ *         if it is larger than cap.
+ */
+QBDI_EXPORT size_t qbdi_readBBMemoryAccess(VMInstanceRef instance, MemoryAccess* out, size_t cap);
+
+/*! Stream the memory accesses to a trace buffer using inline instrumentation. The records are
+ *  appended by the instrumented code and delivered in batches to the callback when the buffer
+ *  could overflow, at the end of a run and when the trace is stopped. Only one trace can be
+ *  active at a time and the basic block chaining is disabled while the trace is active.
+ *
+ * @param[in] instance  VM instance.
+ * @param[in] type      Memory mode bitfield to trace: either QBDI_MEMORY_READ,
+ *                      QBDI_MEMORY_WRITE or both (QBDI_MEMORY_READ_WRITE).
+ * @param[in] size      The number of records of the trace buffer. The buffer is grown if
+ *                      a single sequence could exceed it.
+ * @param[in] cbk       A function pointer to the callback receiving the records.
+ * @param[in] data      User defined data passed to the callback.
+ *
+ * @return True if the memory trace is supported and started, False if not or in case of error.
+ */
+QBDI_EXPORT bool qbdi_startMemoryTrace(VMInstanceRef instance, MemoryAccessType type, size_t size, MemoryTraceCallback cbk, void *data);
+
+/*! Deliver the remaining records of the memory trace and remove its instrumentation. Can be
+ *  called from the trace callback, the records it received stay valid until it returns.
+ *
+ * @param[in] instance  VM instance.
+ */
+QBDI_EXPORT void qbdi_stopMemoryTrace(VMInstanceRef instance);
+
 /*! Pre-cache a known basic block
  *
  *  @param[in]  instance     VM instance.
@@ -394,6 +528,78 @@ QBDI_EXPORT void qbdi_clearCache(VMInstanceRef instance, rword start, rword end)
  */
 QBDI_EXPORT void qbdi_clearAllCache(VMInstanceRef instance);
 
+/*! Set the maximum amount of memory used by the translation cache. When the budget is
+ *  exceeded, the least recently executed regions of the cache are evicted until it uses three
+ *  quarters of the budget. The budget is a soft limit as the region being executed is never
+ *  evicted.
+ *
+ * @param[in] instance     VM instance.
+ * @param[in] budget       Size in bytes of the translation cache budget, 0 (default) for no limit.
+ */
+QBDI_EXPORT void qbdi_setCacheBudget(VMInstanceRef instance, size_t budget);
+
+/*! Obtain the statistics of the translation cache. The counters of the evicted or cleared
+ *  ExecBlocks are kept.
+ *
+ * @param[in]  instance     VM instance.
+ * @param[out] stats        The structure receiving the statistics.
+ */
+QBDI_EXPORT void qbdi_getCacheStats(VMInstanceRef instance, CacheStats* stats);
+
+/*! Obtain the hits and misses of every indirect branch using the target cache. Only the
+ *  ExecBlocks currently in the translation cache are reported, an indirect branch translated
+ *  several times, for example inside a trace, has one entry per translation.
+ *  Return NULL and a size of 0 if no indirect branch uses the target cache.
+ *
+ * @param[in]  instance     VM instance.
+ * @param[out] size         Will be set to the number of elements in the returned array.
+ *
+ * @return An array of statistics, one per translated indirect branch. It must be freed by the
+ *         caller.
+ */
+QBDI_EXPORT TargetCacheStats* qbdi_getTargetCacheStats(VMInstanceRef instance, size_t* size);
+
+/*! Enable the persistent decode cache and load a cache file created by a previous run.
+ *  Instructions found in the cache are neither disassembled nor patched again, but they are
+ *  still instrumented and assembled. The cache is keyed by module and offset, and the
+ *  instruction bytes are checked before an entry is reused.
+ *
+ * @param[in] instance     VM instance.
+ * @param[in] path         Path of the cache file.
+ *
+ * @return True if the file was loaded. Otherwise the cache is still enabled, but empty.
+ */
+QBDI_EXPORT bool qbdi_loadDecodeCache(VMInstanceRef instance, const char* path);
+
+/*! Save the decode cache to a file which can be loaded by the next runs.
+ *
+ * @param[in] instance     VM instance.
+ * @param[in] path         Path of the cache file.
+ *
+ * @return True if the file was written, false if the cache isn't enabled or on error.
+ */
+QBDI_EXPORT bool qbdi_saveDecodeCache(VMInstanceRef instance, const char* path);
+
+/*! Enable or disable the speculative translation. When enabled, a worker thread disassembles
+ *  and patches the static successors of every new basic block before they are reached. The
+ *  instrumentation and the assembly are still done by the execution thread, which also checks
+ *  that the code was not modified since it was patched. Disabled by default.
+ *
+ * @param[in] instance     VM instance.
+ * @param[in] enable       True to start the worker thread, false to stop it.
+ */
+QBDI_EXPORT void qbdi_setSpeculativeTranslation(VMInstanceRef instance, bool enable);
+
+/*! Enable or disable the peephole optimization of the instrumented code, which removes the
+ *  redundant register spills and constant loads produced when several instrumentations apply
+ *  to the same instruction. Enabled by default, the translation cache is flushed when the
+ *  setting changes.
+ *
+ * @param[in] instance     VM instance.
+ * @param[in] enable       True to optimize the instrumented code.
+ */
+QBDI_EXPORT void qbdi_setPatchOptimization(VMInstanceRef instance, bool enable);
+
 #ifdef __cplusplus
 } // "C"
 } // QBDI::
@@ -0,0 +1,517 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "Engine/DecodeCache.h"
+#include "Patch/Patch.h"
+#include "Patch/RelocatableInst.h"
+#include "Utility/LogSys.h"
+#include "Version.h"
+
+namespace QBDI {
+
+static const char DECODE_CACHE_MAGIC[8] = {'Q', 'B', 'D', 'I', 'D', 'E', 'C', '4'};
+
+enum DecodedOperandKind : uint8_t {
+    OPERAND_KIND_REG = 1,
+    OPERAND_KIND_IMM = 2,
+    OPERAND_KIND_FPIMM = 3,
+    // Immediate of a patch relative to the instruction address
+    OPERAND_KIND_ADDRESS = 4,
+};
+
+namespace {
+
+class CacheReader {
+private:
+
+    const char* cur;
+    const char* end;
+
+public:
+
+    CacheReader(const char* start, const char* end) : cur(start), end(end) {}
+
+    bool read(void* out, size_t size) {
+        if(static_cast<size_t>(end - cur) < size) {
+            return false;
+        }
+        memcpy(out, cur, size);
+        cur += size;
+        return true;
+    }
+
+    template<typename T> bool read(T& out) {
+        return read(&out, sizeof(T));
+    }
+
+    bool read(std::string& out) {
+        uint32_t size;
+        if(!read(size) || static_cast<size_t>(end - cur) < size) {
+            return false;
+        }
+        out.assign(cur, size);
+        cur += size;
+        return true;
+    }
+};
+
+template<typename T> void writeValue(FILE* file, const T& value) {
+    fwrite(&value, sizeof(T), 1, file);
+}
+
+void writeString(FILE* file, const std::string& value) {
+    writeValue(file, static_cast<uint32_t>(value.size()));
+    fwrite(value.data(), 1, value.size(), file);
+}
+
+bool readOperands(CacheReader& reader, std::vector<DecodedOperand>& operands) {
+    uint8_t numOperands;
+    if(!reader.read(numOperands)) {
+        return false;
+    }
+    for(uint8_t o = 0; o < numOperands; o++) {
+        DecodedOperand op;
+        if(!reader.read(op.kind) || !reader.read(op.value)) {
+            return false;
+        }
+        operands.push_back(op);
+    }
+    return true;
+}
+
+void writeOperands(FILE* file, const std::vector<DecodedOperand>& operands) {
+    writeValue(file, static_cast<uint8_t>(operands.size()));
+    for(const DecodedOperand& op: operands) {
+        writeValue(file, op.kind);
+        writeValue(file, op.value);
+    }
+}
+
+// The entries are used without being decoded again, a corrupted one would crash the patching
+bool isKnown(uint32_t opcode, const std::vector<DecodedOperand>& operands, bool relative,
+             const llvm::MCInstrInfo* MCII, const llvm::MCRegisterInfo* MRI) {
+    bool known = opcode < MCII->getNumOpcodes();
+    for(const DecodedOperand& op: operands) {
+        if(op.kind == OPERAND_KIND_REG) {
+            known = known && op.value < MRI->getNumRegs();
+        }
+        else {
+            known = known && (op.kind == OPERAND_KIND_IMM || op.kind == OPERAND_KIND_FPIMM ||
+                              (relative && op.kind == OPERAND_KIND_ADDRESS));
+        }
+    }
+    return known;
+}
+
+bool encodeOperands(const llvm::MCInst& inst, std::vector<DecodedOperand>& operands) {
+    for(const llvm::MCOperand& op: inst) {
+        DecodedOperand operand;
+        if(op.isReg()) {
+            operand = DecodedOperand {OPERAND_KIND_REG, op.getReg()};
+        }
+        else if(op.isImm()) {
+            operand = DecodedOperand {OPERAND_KIND_IMM, static_cast<uint64_t>(op.getImm())};
+        }
+        else if(op.isFPImm()) {
+            double value = op.getFPImm();
+            operand.kind = OPERAND_KIND_FPIMM;
+            memcpy(&operand.value, &value, sizeof(value));
+        }
+        else {
+            // Expressions and nested instructions are never produced by the disassembler nor
+            // the patch rules
+            return false;
+        }
+        operands.push_back(operand);
+    }
+    return true;
+}
+
+void decodeOperands(llvm::MCInst& inst, const std::vector<DecodedOperand>& operands, rword address) {
+    for(const DecodedOperand& op: operands) {
+        switch(op.kind) {
+            case OPERAND_KIND_REG:
+                inst.addOperand(llvm::MCOperand::createReg(static_cast<unsigned>(op.value)));
+                break;
+            case OPERAND_KIND_IMM:
+                inst.addOperand(llvm::MCOperand::createImm(static_cast<int64_t>(op.value)));
+                break;
+            case OPERAND_KIND_FPIMM: {
+                double value;
+                memcpy(&value, &op.value, sizeof(value));
+                inst.addOperand(llvm::MCOperand::createFPImm(value));
+                break;
+            }
+            case OPERAND_KIND_ADDRESS:
+                inst.addOperand(llvm::MCOperand::createImm(
+                    static_cast<int64_t>(static_cast<rword>(address + op.value))));
+                break;
+        }
+    }
+}
+
+}
+
+bool DecodeCache::load(const char* path, const llvm::MCInstrInfo* MCII, const llvm::MCRegisterInfo* MRI) {
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(path);
+    if(!buffer) {
+        LogDebug("DecodeCache::load", "Failed to open decode cache %s", path);
+        return false;
+    }
+    CacheReader reader((*buffer)->getBufferStart(), (*buffer)->getBufferEnd());
+    char magic[sizeof(DECODE_CACHE_MAGIC)];
+    uint32_t version, numModules;
+    std::string fileFingerprint;
+    if(!reader.read(magic, sizeof(magic)) || memcmp(magic, DECODE_CACHE_MAGIC, sizeof(magic)) != 0 ||
+       !reader.read(version) || version != QBDI_VERSION ||
+       !reader.read(fileFingerprint) || fileFingerprint != fingerprint ||
+       !reader.read(numModules)) {
+        LogWarning("DecodeCache::load", "Decode cache %s was created by another QBDI configuration", path);
+        return false;
+    }
+    // Parse everything before merging to ignore truncated files
+    std::map<std::string, std::unordered_map<rword, DecodedInst>> loaded;
+    for(uint32_t m = 0; m < numModules; m++) {
+        std::string name;
+        uint32_t numInsts;
+        if(!reader.read(name) || !reader.read(numInsts)) {
+            LogWarning("DecodeCache::load", "Decode cache %s is truncated", path);
+            return false;
+        }
+        std::unordered_map<rword, DecodedInst>& insts = loaded[name];
+        for(uint32_t i = 0; i < numInsts; i++) {
+            uint64_t offset;
+            uint8_t modifyPC, useFPR;
+            uint32_t numRelocs;
+            DecodedInst inst;
+            bool valid = reader.read(offset) && reader.read(inst.opcode) && reader.read(inst.flags) &&
+                         reader.read(inst.size) && inst.size <= sizeof(inst.bytes) &&
+                         reader.read(inst.bytes, inst.size) && readOperands(reader, inst.operands) &&
+                         reader.read(modifyPC) && reader.read(useFPR) && reader.read(numRelocs);
+            inst.modifyPC = modifyPC != 0;
+            inst.useFPR = useFPR != 0;
+            for(uint32_t r = 0; valid && r < numRelocs; r++) {
+                DecodedReloc reloc;
+                valid = reader.read(reloc.kind) && reader.read(reloc.opn) && reader.read(reloc.offset) &&
+                        reader.read(reloc.opcode) && reader.read(reloc.flags) &&
+                        readOperands(reader, reloc.operands);
+                inst.patch.push_back(std::move(reloc));
+            }
+            if(!valid) {
+                LogWarning("DecodeCache::load", "Decode cache %s is truncated", path);
+                return false;
+            }
+            bool known = isKnown(inst.opcode, inst.operands, false, MCII, MRI);
+            for(const DecodedReloc& reloc: inst.patch) {
+                known = known && isKnown(reloc.opcode, reloc.operands, true, MCII, MRI) &&
+                        reloc.kind >= RELOC_NO_RELOC && reloc.kind <= RELOC_GUEST_INST;
+                // The relocations modify an immediate operand
+                if(known && reloc.kind != RELOC_NO_RELOC && reloc.kind != RELOC_GUEST_INST) {
+                    known = reloc.opn < reloc.operands.size() &&
+                            (reloc.operands[reloc.opn].kind == OPERAND_KIND_IMM ||
+                             reloc.operands[reloc.opn].kind == OPERAND_KIND_ADDRESS);
+                }
+            }
+            if(!known) {
+                LogWarning("DecodeCache::load", "Decode cache %s is corrupted", path);
+                return false;
+            }
+            insts[static_cast<rword>(offset)] = std::move(inst);
+        }
+    }
+    for(auto& module: loaded) {
+        DecodedModuleEntries& entries = modules[module.first];
+        for(auto& entry: module.second) {
+            if(entries.insts.insert(std::move(entry)).second) {
+                numInsts++;
+            }
+        }
+    }
+    evict(maxInsts, nullptr);
+    LogDebug("DecodeCache::load", "Loaded %" PRIu32 " modules from decode cache %s", numModules, path);
+    return true;
+}
+
+bool DecodeCache::save(const char* path) const {
+    FILE* file = fopen(path, "wb");
+    if(file == nullptr) {
+        LogWarning("DecodeCache::save", "Failed to create decode cache %s", path);
+        return false;
+    }
+    fwrite(DECODE_CACHE_MAGIC, 1, sizeof(DECODE_CACHE_MAGIC), file);
+    writeValue(file, static_cast<uint32_t>(QBDI_VERSION));
+    writeString(file, fingerprint);
+    uint32_t numModules = 0;
+    for(const auto& module: modules) {
+        if(!module.second.insts.empty()) {
+            numModules++;
+        }
+    }
+    writeValue(file, numModules);
+    for(const auto& module: modules) {
+        if(module.second.insts.empty()) {
+            continue;
+        }
+        writeString(file, module.first);
+        writeValue(file, static_cast<uint32_t>(module.second.insts.size()));
+        for(const auto& entry: module.second.insts) {
+            const DecodedInst& inst = entry.second;
+            writeValue(file, static_cast<uint64_t>(entry.first));
+            writeValue(file, inst.opcode);
+            writeValue(file, inst.flags);
+            writeValue(file, inst.size);
+            fwrite(inst.bytes, 1, inst.size, file);
+            writeOperands(file, inst.operands);
+            writeValue(file, static_cast<uint8_t>(inst.modifyPC));
+            writeValue(file, static_cast<uint8_t>(inst.useFPR));
+            writeValue(file, static_cast<uint32_t>(inst.patch.size()));
+            for(const DecodedReloc& reloc: inst.patch) {
+                writeValue(file, reloc.kind);
+                writeValue(file, reloc.opn);
+                writeValue(file, reloc.offset);
+                writeValue(file, reloc.opcode);
+                writeValue(file, reloc.flags);
+                writeOperands(file, reloc.operands);
+            }
+        }
+    }
+    bool success = ferror(file) == 0;
+    success = (fclose(file) == 0) && success;
+    if(!success) {
+        LogWarning("DecodeCache::save", "Failed to write decode cache %s", path);
+    }
+    return success;
+}
+
+void DecodeCache::refreshRanges() {
+    std::vector<MemoryMap> maps = getCurrentProcessMaps(true);
+    std::map<std::string, rword> bases;
+
+    // The module base is its lowest mapping
+    for(const MemoryMap& m: maps) {
+        if(m.name.empty()) {
+            continue;
+        }
+        std::map<std::string, rword>::iterator base = bases.find(m.name);
+        if(base == bases.end() || m.range.start < base->second) {
+            bases[m.name] = m.range.start;
+        }
+    }
+    ranges.clear();
+    for(const MemoryMap& m: maps) {
+        if(!(m.permission & QBDI::PF_EXEC)) {
+            continue;
+        }
+        // Anonymous and special mappings ([vdso], ...) are not persisted
+        if(m.name.empty() || m.name[0] == '[') {
+            ranges.push_back(DecodedModule {m.range, 0, nullptr});
+        }
+        else {
+            ranges.push_back(DecodedModule {m.range, bases[m.name], &modules[m.name]});
+        }
+    }
+    std::sort(ranges.begin(), ranges.end(), [](const DecodedModule& a, const DecodedModule& b) {
+        return a.range.start < b.range.start;
+    });
+}
+
+void DecodeCache::evict(size_t target, const DecodedModuleEntries* live) {
+    if(numInsts <= target) {
+        return;
+    }
+    // Evict the least recently used modules first, the live one is kept
+    std::vector<std::pair<uint64_t, DecodedModuleEntries*>> candidates;
+    for(auto& module: modules) {
+        if(!module.second.insts.empty() && &module.second != live) {
+            candidates.push_back(std::make_pair(module.second.lastUse, &module.second));
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    for(const auto& candidate: candidates) {
+        if(numInsts <= target) {
+            break;
+        }
+        // The module keeps its place in the ranges, only its entries are freed
+        numInsts -= candidate.second->insts.size();
+        candidate.second->insts.clear();
+    }
+}
+
+const DecodedModule* DecodeCache::findModule(rword address) {
+    for(int attempt = 0; attempt < 2; attempt++) {
+        std::vector<DecodedModule>::const_iterator it = std::upper_bound(ranges.begin(), ranges.end(), address,
+            [](rword address, const DecodedModule& m) {
+                return address < m.range.start;
+            });
+        if(it != ranges.begin() && (it - 1)->range.contains(address)) {
+            return &*(it - 1);
+        }
+        // Unknown address, a module may have been loaded since the last refresh
+        if(attempt == 0) {
+            refreshRanges();
+        }
+    }
+    return nullptr;
+}
+
+bool DecodeCache::lookup(llvm::MCInst& inst, uint64_t& size, rword address, llvm::ArrayRef<uint8_t> code,
+                         Patch* patch) {
+    const DecodedModule* module = findModule(address);
+    if(module == nullptr || module->entries == nullptr) {
+        return false;
+    }
+    std::unordered_map<rword, DecodedInst>::const_iterator it = module->entries->insts.find(address - module->base);
+    if(it == module->entries->insts.end()) {
+        return false;
+    }
+    const DecodedInst& decoded = it->second;
+    // The module may have changed since the entry was created
+    if(code.size() < decoded.size || memcmp(decoded.bytes, code.data(), decoded.size) != 0) {
+        LogDebug("DecodeCache::lookup", "Stale decode cache entry at 0x%" PRIRWORD, address);
+        return false;
+    }
+    module->entries->lastUse = ++useClock;
+    inst.clear();
+    inst.setOpcode(decoded.opcode);
+    // The prefixes (REP, LOCK, ...) are kept in the flags
+    inst.setFlags(decoded.flags);
+    decodeOperands(inst, decoded.operands, address);
+    size = decoded.size;
+    if(patch != nullptr && !decoded.patch.empty()) {
+        Patch cached(inst, address, size);
+        cached.setModifyPC(decoded.modifyPC);
+        cached.setMerge(false);
+        cached.setUseFPR(decoded.useFPR);
+        for(const DecodedReloc& reloc: decoded.patch) {
+            llvm::MCInst relocInst;
+            relocInst.setOpcode(reloc.opcode);
+            relocInst.setFlags(reloc.flags);
+            decodeOperands(relocInst, reloc.operands, address);
+            cached.append(makeRelocatableInst(static_cast<RelocatableInstKind>(reloc.kind), relocInst,
+                                              reloc.opn, static_cast<rword>(reloc.offset)));
+        }
+        *patch = std::move(cached);
+    }
+    return true;
+}
+
+void DecodeCache::insert(const llvm::MCInst& inst, uint64_t size, rword address, llvm::ArrayRef<uint8_t> code) {
+    DecodedInst decoded;
+    if(size > sizeof(decoded.bytes) || size > code.size()) {
+        return;
+    }
+    const DecodedModule* module = findModule(address);
+    if(module == nullptr || module->entries == nullptr) {
+        return;
+    }
+    decoded.opcode = inst.getOpcode();
+    decoded.flags = inst.getFlags();
+    decoded.size = static_cast<uint8_t>(size);
+    memcpy(decoded.bytes, code.data(), size);
+    decoded.modifyPC = false;
+    decoded.useFPR = false;
+    if(!encodeOperands(inst, decoded.operands)) {
+        return;
+    }
+    DecodedModuleEntries* entries = module->entries;
+    entries->lastUse = ++useClock;
+    rword offset = address - module->base;
+    std::unordered_map<rword, DecodedInst>::iterator it = entries->insts.find(offset);
+    if(it != entries->insts.end()) {
+        it->second = std::move(decoded);
+        return;
+    }
+    // Make room for the new entry, it is dropped if the module alone fills the cache
+    if(numInsts >= maxInsts) {
+        evict(maxInsts - 1, entries);
+        if(numInsts >= maxInsts) {
+            return;
+        }
+    }
+    entries->insts.insert(std::make_pair(offset, std::move(decoded)));
+    numInsts++;
+}
+
+void DecodeCache::insertPatch(const Patch& patch, const Patch& probe, rword address) {
+    const DecodedModule* module = findModule(address);
+    if(module == nullptr || module->entries == nullptr) {
+        return;
+    }
+    std::unordered_map<rword, DecodedInst>::iterator it = module->entries->insts.find(address - module->base);
+    if(it == module->entries->insts.end() || patch.metadata.merge ||
+       patch.metadata.modifyPC != probe.metadata.modifyPC || patch.insts.size() != probe.insts.size()) {
+        return;
+    }
+    std::vector<DecodedReloc> relocs(patch.insts.size());
+    for(size_t i = 0; i < patch.insts.size(); i++) {
+        DecodedReloc& reloc = relocs[i];
+        const llvm::MCInst& inst = patch.insts[i]->inst;
+        const llvm::MCInst& probeInst = probe.insts[i]->inst;
+        unsigned int opn, probeOpn;
+        rword offset, probeOffset;
+        RelocatableInstKind kind = patch.insts[i]->getKind(&opn, &offset);
+        if(kind == RELOC_NONE || kind != probe.insts[i]->getKind(&probeOpn, &probeOffset) ||
+           opn != probeOpn || offset != probeOffset || inst.getOpcode() != probeInst.getOpcode() ||
+           inst.getFlags() != probeInst.getFlags() || inst.getNumOperands() != probeInst.getNumOperands() ||
+           !encodeOperands(inst, reloc.operands)) {
+            LogDebug("DecodeCache::insertPatch", "Patch of 0x%" PRIRWORD " can't be persisted", address);
+            return;
+        }
+        // Only the immediates derived from the address differ between the patch and the probe
+        for(unsigned int o = 0; o < inst.getNumOperands(); o++) {
+            const llvm::MCOperand& op = inst.getOperand(o);
+            const llvm::MCOperand& probeOp = probeInst.getOperand(o);
+            bool same;
+            if(op.isImm() && probeOp.isImm() && op.getImm() != probeOp.getImm()) {
+                rword value = static_cast<rword>(op.getImm());
+                same = static_cast<rword>(probeOp.getImm()) - value == DECODE_CACHE_PROBE_DELTA &&
+                       static_cast<int64_t>(value) == op.getImm();
+                reloc.operands[o] = DecodedOperand {OPERAND_KIND_ADDRESS, static_cast<uint64_t>(value - address)};
+            }
+            else if(op.isImm()) {
+                same = probeOp.isImm();
+            }
+            else if(op.isReg()) {
+                same = probeOp.isReg() && op.getReg() == probeOp.getReg();
+            }
+            else {
+                same = probeOp.isFPImm() && op.getFPImm() == probeOp.getFPImm();
+            }
+            if(!same) {
+                LogDebug("DecodeCache::insertPatch", "Patch of 0x%" PRIRWORD " can't be persisted", address);
+                return;
+            }
+        }
+        reloc.kind = kind;
+        reloc.opn = opn;
+        reloc.offset = offset;
+        reloc.opcode = inst.getOpcode();
+        reloc.flags = inst.getFlags();
+    }
+    DecodedInst& decoded = it->second;
+    decoded.modifyPC = patch.metadata.modifyPC;
+    decoded.useFPR = patch.metadata.useFPR;
+    decoded.patch = std::move(relocs);
+}
+
+}
@@ -0,0 +1,179 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef DECODECACHE_H
+#define DECODECACHE_H
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/MC/MCInst.h"
+#include "llvm/MC/MCInstrInfo.h"
+#include "llvm/MC/MCRegisterInfo.h"
+
+#include "Memory.hpp"
+#include "State.h"
+
+namespace QBDI {
+
+class Patch;
+
+struct DecodedOperand {
+    uint8_t     kind;
+    uint64_t    value;
+};
+
+struct DecodedReloc {
+    uint8_t                     kind;
+    uint32_t                    opn;
+    uint64_t                    offset;
+    uint32_t                    opcode;
+    uint32_t                    flags;
+    std::vector<DecodedOperand> operands;
+};
+
+struct DecodedInst {
+    uint32_t                    opcode;
+    uint32_t                    flags;
+    uint8_t                     size;
+    uint8_t                     bytes[16];
+    std::vector<DecodedOperand> operands;
+    // Output of the patch rules, empty if the patch of the instruction isn't persisted
+    bool                        modifyPC;
+    bool                        useFPR;
+    std::vector<DecodedReloc>   patch;
+};
+
+struct DecodedModuleEntries {
+    uint64_t                                lastUse;
+    std::unordered_map<rword, DecodedInst>  insts;
+
+    DecodedModuleEntries() : lastUse(0) {}
+};
+
+struct DecodedModule {
+    Range<rword>    range;
+    rword           base;
+    // nullptr for anonymous memory which can't be persisted
+    DecodedModuleEntries* entries;
+};
+
+// Default maximum number of decoded instructions kept by a cache
+static const size_t DECODE_CACHE_MAX_INSTS = 1 << 20;
+// Distance of the second generation of a patch, which tells the immediates derived from the
+// instruction address. It is a multiple of the page size such that the alignments of the address
+// are kept.
+static const rword DECODE_CACHE_PROBE_DELTA = 0x100000;
+
+/*! Persistent cache of the decoded instructions of the process modules. Instructions are keyed by
+ *  module path and offset from the module base, such that the cache stays valid across runs with
+ *  a different memory layout. Each entry keeps the original instruction bytes which are compared
+ *  with the code in memory before being reused. The cache belongs to a single engine and is only
+ *  used by its execution thread.
+ *
+ *  The output of the patch rules is persisted as well. The patches only depend on the instruction
+ *  and its address, the immediates derived from the address are stored relative to it and
+ *  rebased when the patch is created again. The instrumentation and the assembly depend on the
+ *  ExecBlocks and callbacks of the process and are always done again.
+ */
+class DecodeCache {
+private:
+
+    std::string                                         fingerprint;
+    std::map<std::string, DecodedModuleEntries>         modules;
+    std::vector<DecodedModule>                          ranges;
+    size_t                                              numInsts;
+    size_t                                              maxInsts;
+    uint64_t                                            useClock;
+
+    const DecodedModule* findModule(rword address);
+
+    void refreshRanges();
+
+    void evict(size_t target, const DecodedModuleEntries* live);
+
+public:
+
+    /*! Construct a new decode cache. When the cache is full, the entries of the least recently
+     *  used modules are evicted.
+     *
+     * @param[in] fingerprint  Identifier of the disassembler configuration (target, cpu and
+     *                         features). Cache files created with another configuration are
+     *                         rejected.
+     * @param[in] maxInsts     Maximum number of decoded instructions kept by the cache.
+     */
+    DecodeCache(const std::string& fingerprint, size_t maxInsts = DECODE_CACHE_MAX_INSTS) :
+        fingerprint(fingerprint), numInsts(0), maxInsts(maxInsts), useClock(0) {}
+
+    /*! Load the entries of a cache file, merging them with the current ones. The whole file is
+     *  rejected if one of its instructions uses an unknown opcode or register.
+     *
+     * @param[in] path  Path of the cache file.
+     * @param[in] MCII  LLVM instruction info of the disassembler configuration.
+     * @param[in] MRI   LLVM register info of the disassembler configuration.
+     *
+     * @return True if the file was loaded.
+     */
+    bool load(const char* path, const llvm::MCInstrInfo* MCII, const llvm::MCRegisterInfo* MRI);
+
+    /*! Save the cache entries to a file.
+     *
+     * @param[in] path  Path of the cache file.
+     *
+     * @return True if the file was written.
+     */
+    bool save(const char* path) const;
+
+    /*! Lookup the decoded instruction at an address, and its patch if it was persisted.
+     *
+     * @param[out] inst     The decoded instruction.
+     * @param[out] size     The size of the instruction.
+     * @param[in]  address  Address of the instruction.
+     * @param[in]  code     The current code starting at the address.
+     * @param[out] patch    If not null, receives the patch of the instruction. It is left empty
+     *                      if the patch wasn't persisted.
+     *
+     * @return True if the instruction was found and its bytes are unchanged.
+     */
+    bool lookup(llvm::MCInst& inst, uint64_t& size, rword address, llvm::ArrayRef<uint8_t> code,
+                Patch* patch = nullptr);
+
+    /*! Add a decoded instruction to the cache. Instructions outside of a module are ignored.
+     *
+     * @param[in] inst     The decoded instruction.
+     * @param[in] size     The size of the instruction.
+     * @param[in] address  Address of the instruction.
+     * @param[in] code     The code starting at the address.
+     */
+    void insert(const llvm::MCInst& inst, uint64_t size, rword address, llvm::ArrayRef<uint8_t> code);
+
+    /*! Persist the patch of a cached instruction. The patch is only kept if all its relocations
+     *  can be persisted and if the probe only differs by the immediates derived from the address.
+     *
+     * @param[in] patch    The patch generated at the instruction address.
+     * @param[in] probe    The same patch generated at the address plus DECODE_CACHE_PROBE_DELTA.
+     * @param[in] address  Address of the instruction.
+     */
+    void insertPatch(const Patch& patch, const Patch& probe, rword address);
+};
+
+}
+
+#endif // DECODECACHE_H
@@ -15,6 +15,7 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <algorithm>
 #include <bitset>
 
 #include "Engine.h"
@@ -33,6 +34,8 @@
 #include "llvm/Support/TargetSelect.h"
 
 #include "Platform.h"
+#include "Engine/DecodeCache.h"
+#include "Engine/SpeculativeTranslator.h"
 #include "ExecBlock/ExecBlockManager.h"
 #include "ExecBroker/ExecBroker.h"
 #include "Patch/Types.h"
@@ -40,6 +43,8 @@
 #include "Patch/PatchRule.h"
 #include "Patch/InstrRules.h"
 #include "Patch/InstInfo.h"
+#include "Patch/Liveness.h"
+#include "Patch/PatchOptimizer.h"
 #include "Utility/Assembly.h"
 #include "Utility/LogSys.h"
 #include "Utility/System.h"
@@ -51,11 +56,12 @@
 namespace QBDI {
 
 Engine::Engine(const std::string& _cpu, const std::vector<std::string>& _mattrs, VMInstanceRef vminstance)
-    : cpu(_cpu), mattrs(_mattrs), vminstance(vminstance), instrRulesCounter(0), vmCallbacksCounter(0) {
+    : cpu(_cpu), mattrs(_mattrs), vminstance(vminstance), instrRulesCounter(0), vmCallbacksCounter(0),
+      vmCallbacksDispatch(0), vmCallbacksDeleted(false), chainStop(0),
+      vmState(VMState {static_cast<VMEvent>(0), 0, 0, 0, 0, 0}), vmCallbacksMask(static_cast<VMEvent>(0)) {
 
     std::string          error;
     std::string          featuresStr;
-    const llvm::Target*  processTarget;
 
     llvm::InitializeAllTargetInfos();
     llvm::InitializeAllTargetMCs();
@@ -118,6 +124,13 @@ Engine::Engine(const std::string& _cpu, const std::vector<std::string>& _mattrs,
 
     // Get default Patch rules for this architecture
     patchRules = getDefaultPatchRules();
+    patchRuleIndex = std::unique_ptr<PatchRuleIndex>(new PatchRuleIndex());
+    patchRuleIndex->build(patchRules, MCII.get());
+    instrRuleIndex = std::unique_ptr<InstrRuleIndex>(new InstrRuleIndex());
+    instrRuleIndexValid = false;
+    liveness = std::unique_ptr<Liveness>(new Liveness(MCII.get(), MRI.get()));
+    optimizer = std::unique_ptr<PatchOptimizer>(new PatchOptimizer(MCII.get(), *liveness));
+    patchOptimization = true;
 
     gprState = std::unique_ptr<GPRState>(new GPRState);
     fprState = std::unique_ptr<FPRState>(new FPRState);
@@ -131,6 +144,8 @@ Engine::Engine(const std::string& _cpu, const std::vector<std::string>& _mattrs,
 }
 
 Engine::~Engine() {
+    // The worker uses the patch rules and the LLVM objects
+    speculator.reset();
     delete assembly;
     delete blockManager;
     delete execBroker;
@@ -195,25 +210,38 @@ bool Engine::instrumentAllExecutableMaps() {
     return execBroker->instrumentAllExecutableMaps();
 }
 
+// Chained sequences bypass the instrumented range check of the run loop, they need to be unlinked
+// when ranges are removed.
+
 void Engine::removeInstrumentedRange(rword start, rword end) {
     execBroker->removeInstrumentedRange(Range<rword>(start, end));
+    blockManager->unlinkAll();
 }
 
 bool Engine::removeInstrumentedModule(const std::string& name) {
+    blockManager->unlinkAll();
     return execBroker->removeInstrumentedModule(name);
 }
 
 bool Engine::removeInstrumentedModuleFromAddr(rword addr) {
+    blockManager->unlinkAll();
     return execBroker->removeInstrumentedModuleFromAddr(addr);
 }
 
 void Engine::removeAllInstrumentedRanges() {
     execBroker->removeAllInstrumentedRanges();
+    blockManager->unlinkAll();
 }
 
-std::vector<Patch> Engine::patch(rword start) {
+std::vector<Patch> Engine::patch(rword start, const Assembly& disassembler, DecodeCache* cache) {
     std::vector<Patch> basicBlock;
-    const llvm::ArrayRef<uint8_t> code((uint8_t*) start, (size_t) -1);
+    // The code is read in place, it is known to be mapped
+    const llvm::ArrayRef<uint8_t> code((const uint8_t*) start, (size_t) ((rword) -1 - start));
+    RequireAction("Engine::patch", tryPatch(start, code, disassembler, cache, basicBlock), abort());
+    return basicBlock;
+}
+
+bool Engine::tryPatch(rword start, llvm::ArrayRef<uint8_t> code, const Assembly& disassembler, DecodeCache* cache, std::vector<Patch>& basicBlock) {
     bool basicBlockEnd = false;
     rword i = 0;
     LogDebug("Engine::patch", "Patching basic block at address 0x%" PRIRWORD, start);
@@ -228,29 +256,55 @@ std::vector<Patch> Engine::patch(rword start) {
 
         // Aggregate a complete patch
         do {
-            // Disassemble
-            dstatus = assembly->getInstruction(inst, instSize, code.slice(i), i);
             address = start + i;
-            RequireAction("Engine::patch", llvm::MCDisassembler::Success == dstatus, abort());
+            // The disassembler never reads the code past the end
+            if(i >= code.size()) {
+                LogDebug("Engine::patch", "Basic block 0x%" PRIRWORD " crosses the end of the code", start);
+                return false;
+            }
+            // Disassemble and patch, unless it was done by a previous run. The persisted patches
+            // are never merged with the previous instruction.
+            Patch persisted;
+            if(cache == nullptr || !cache->lookup(inst, instSize, address, code.slice(i),
+                                                  patch.insts.size() == 0 ? &persisted : nullptr)) {
+                dstatus = disassembler.getInstruction(inst, instSize, code.slice(i), i);
+                if(dstatus != llvm::MCDisassembler::Success) {
+                    LogDebug("Engine::patch", "Failed to disassemble 0x%" PRIRWORD, address);
+                    return false;
+                }
+                if(cache != nullptr) {
+                    cache->insert(inst, instSize, address, code.slice(i));
+                }
+            }
             LogCallback(LogPriority::DEBUG, "Engine::patch", [&] (FILE *log) -> void {
                 std::string disass;
                 llvm::raw_string_ostream disassOs(disass);
-                assembly->printDisasm(inst, disassOs);
+                disassembler.printDisasm(inst, disassOs);
                 disassOs.flush();
                 fprintf(log, "Patching 0x%" PRIRWORD " %s", address, disass.c_str());
             });
+            if(persisted.insts.size() != 0) {
+                LogDebug("Engine::patch", "Patch reused from the decode cache");
+                patch = std::move(persisted);
+                i += instSize;
+                continue;
+            }
             // Patch & merge
-            for(uint32_t j = 0; j < patchRules.size(); j++) {
-                if(patchRules[j]->canBeApplied(&inst, address, instSize, MCII.get())) {
-                    LogDebug("Engine::patch", "Patch rule %" PRIu32 " applied", j);
-                    if(patch.insts.size() == 0) {
-                        patch = patchRules[j]->generate(&inst, address, instSize, MCII.get(), MRI.get());
-                    }
-                    else {
-                        LogDebug("Engine::patch", "Previous instruction merged");
-                        patch = patchRules[j]->generate(&inst, address, instSize, MCII.get(), MRI.get(), &patch);
+            uint32_t j = patchRuleIndex->find(patchRules, &inst, address, instSize, MCII.get());
+            if(j != PatchRuleIndex::NOT_FOUND) {
+                LogDebug("Engine::patch", "Patch rule %" PRIu32 " applied", j);
+                if(patch.insts.size() == 0) {
+                    patch = patchRules[j]->generate(&inst, address, instSize, MCII.get(), MRI.get());
+                    // A second generation at another address tells the immediates to rebase
+                    if(cache != nullptr && !patch.metadata.merge) {
+                        cache->insertPatch(patch,
+                            patchRules[j]->generate(&inst, address + DECODE_CACHE_PROBE_DELTA, instSize, MCII.get(), MRI.get()),
+                            address);
                     }
-                    break;
+                }
+                else {
+                    LogDebug("Engine::patch", "Previous instruction merged");
+                    patch = patchRules[j]->generate(&inst, address, instSize, MCII.get(), MRI.get(), &patch);
                 }
             }
             i += instSize;
@@ -265,13 +319,59 @@ std::vector<Patch> Engine::patch(rword start) {
         basicBlock.push_back(patch);
     }
 
-    return basicBlock;
+    return true;
 }
 
 void Engine::instrument(std::vector<Patch> &basicBlock) {
     LogDebug("Engine::instrument", "Instrumenting basic block [0x%" PRIRWORD ", 0x%" PRIRWORD "]",
              basicBlock.front().metadata.address, basicBlock.back().metadata.address);
-    for(Patch& patch : basicBlock) {
+    // The index is rebuilt after the instrumentation rules changed
+    if(!instrRuleIndexValid) {
+        instrRuleIndex->build(instrRules, MCII.get());
+        instrRuleIndexValid = true;
+    }
+    // Collect the rules applying to each instruction. The host observes the guest state around
+    // the instructions with a break to host, and at the sequence boundaries when they are
+    // signaled, the registers must be live there.
+    bool observeAll = (vmCallbacksMask & (SEQUENCE_ENTRY | SEQUENCE_EXIT)) != 0;
+    size_t stopPatch = basicBlock.size();
+    appliedRules.clear();
+    appliedStart.resize(basicBlock.size() + 1);
+    observed.assign(basicBlock.size(), observeAll);
+    for(size_t i = 0; i < basicBlock.size(); i++) {
+        const Patch& patch = basicBlock[i];
+        appliedStart[i] = appliedRules.size();
+        if (stopRule != nullptr && stopRule->canBeApplied(patch, MCII.get())) {
+            stopPatch = i;
+            observed[i] = true;
+        }
+        // Only the rules which can apply to this instruction are tested
+        instrRuleIndex->getCandidates(patch.metadata, instrCandidates);
+        for (uint32_t candidate: instrCandidates) {
+            const std::shared_ptr<InstrRule>& rule = instrRules[candidate].second;
+            if (rule->canBeApplied(patch, MCII.get())) { // Push MCII
+                appliedRules.push_back(candidate);
+                if (rule->getBreakToHost()) {
+                    observed[i] = true;
+                }
+            }
+        }
+    }
+    appliedStart[basicBlock.size()] = appliedRules.size();
+    appliedBlockRules.clear();
+    for (uint32_t i = 0; i < blockRules.size(); i++) {
+        const std::shared_ptr<InstrRule>& rule = blockRules[i].second;
+        if (rule->canBeApplied(basicBlock.front(), MCII.get())) {
+            appliedBlockRules.push_back(i);
+            if (rule->getBreakToHost()) {
+                observed[0] = true;
+            }
+        }
+    }
+    liveness->compute(basicBlock, observed);
+
+    for(size_t i = 0; i < basicBlock.size(); i++) {
+        Patch& patch = basicBlock[i];
         LogCallback(LogPriority::DEBUG, "Engine::instrument", [&] (FILE *log) -> void {
             std::string disass;
             llvm::raw_string_ostream disassOs(disass);
@@ -279,25 +379,118 @@ void Engine::instrument(std::vector<Patch> &basicBlock) {
             disassOs.flush();
             fprintf(log, "Instrumenting 0x%" PRIRWORD " %s", patch.metadata.address, disass.c_str());
         });
-        // Instrument
-        for (const auto& item: instrRules) {
-            const std::shared_ptr<InstrRule>& rule = item.second;
-            if (rule->canBeApplied(patch, MCII.get())) { // Push MCII
-                rule->instrument(patch, MCII.get(), MRI.get());
-                LogDebug("Engine::instrument", "Instrumentation rule %" PRIu32 " applied", item.first);
-            }
+        for (size_t j = appliedStart[i]; j < appliedStart[i + 1]; j++) {
+            const auto& item = instrRules[appliedRules[j]];
+            item.second->instrument(patch, MCII.get(), MRI.get());
+            LogDebug("Engine::instrument", "Instrumentation rule %" PRIu32 " applied", item.first);
         }
     }
+    // Block rules are applied after the instruction rules, their PREINST instrumentation runs first
+    Patch& entry = basicBlock.front();
+    for (uint32_t i: appliedBlockRules) {
+        const auto& item = blockRules[i];
+        item.second->instrument(entry, MCII.get(), MRI.get());
+        LogDebug("Engine::instrument", "Block instrumentation rule %" PRIu32 " applied", item.first);
+    }
+    // The stop address callback is applied last: the PREINST instrumentation is prepended, so it
+    // stops the execution before any other callback of the stop address is called
+    if (stopPatch != basicBlock.size()) {
+        stopRule->instrument(basicBlock[stopPatch], MCII.get(), MRI.get());
+        LogDebug("Engine::instrument", "Stop address instrumentation applied");
+    }
 }
 
 
 void Engine::handleNewBasicBlock(rword pc) {
-    // disassemble and patch new basic block
-    Patch::Vec basicBlock = patch(pc);
+    Patch::Vec basicBlock;
+    // use the basic block patched by the speculative translation if available
+    if(speculator == nullptr || !speculator->take(pc, basicBlock)) {
+        // disassemble and patch new basic block
+        basicBlock = patch(pc, *assembly, decodeCache.get());
+    }
     // instrument it
     instrument(basicBlock);
+    // Remove the redundant code of the stacked instrumentations
+    if(patchOptimization) {
+        optimizer->optimize(basicBlock);
+    }
     // Write it in the cache
     blockManager->writeBasicBlock(basicBlock);
+    // Patch its successors in the background
+    if(speculator != nullptr) {
+        requestSuccessors(basicBlock);
+    }
+}
+
+bool Engine::handleHotBasicBlock(rword pc) {
+    Patch::Vec trace;
+    std::vector<rword> basicBlocks;
+    rword address = pc;
+
+    LogDebug("Engine::handleHotBasicBlock", "Forming a trace from hot basic block 0x%" PRIRWORD, pc);
+    while(basicBlocks.size() < TRACE_MAX_BLOCKS) {
+        // Each basic block is instrumented on its own, the rules apply as if it was not in a trace
+        Patch::Vec basicBlock = patch(address, *assembly, decodeCache.get());
+        instrument(basicBlock);
+        if(patchOptimization) {
+            optimizer->optimize(basicBlock);
+        }
+        trace.insert(trace.end(), basicBlock.begin(), basicBlock.end());
+        basicBlocks.push_back(address);
+        // Calls and indirect branches end the trace
+        const InstMetadata& last = trace.back().metadata;
+        if(!last.modifyPC || getReturnAddress(last) != 0) {
+            break;
+        }
+        std::vector<rword> successors = getChainTargets(last);
+        // The loop is closed, the exit of the trace is chained back to itself
+        if(std::find(successors.begin(), successors.end(), pc) != successors.end()) {
+            break;
+        }
+        // The forward successors are chained after their first dispatch, their dispatch counts
+        // can't tell the hot path. The conditional exits count the successor they go to and only
+        // the most frequent one is followed. Without counts, the fallthrough is followed if it was
+        // executed, else the branch target.
+        std::reverse(successors.begin(), successors.end());
+        rword taken = 0;
+        rword fallthrough = 0;
+        if(successors.size() == 2 && blockManager->getBranchCounts(address, &taken, &fallthrough) &&
+           taken + fallthrough > 0) {
+            successors.resize(1);
+            if(taken > fallthrough) {
+                successors[0] = getChainTargets(last)[0];
+            }
+        }
+        rword next = 0;
+        for(rword successor : successors) {
+            if(blockManager->getExecutions(successor) > 0 && execBroker->isInstrumented(successor) &&
+               std::find(basicBlocks.begin(), basicBlocks.end(), successor) == basicBlocks.end()) {
+                next = successor;
+                break;
+            }
+        }
+        if(next == 0) {
+            break;
+        }
+        address = next;
+    }
+    return blockManager->writeTrace(trace);
+}
+
+
+void Engine::requestSuccessors(const std::vector<Patch> &basicBlock) {
+    const InstMetadata& last = basicBlock.back().metadata;
+    std::vector<rword> successors = getChainTargets(last);
+    rword returnAddress = getReturnAddress(last);
+    if(returnAddress != 0) {
+        successors.push_back(returnAddress);
+    }
+    for(rword successor: successors) {
+        if(execBroker->isInstrumented(successor) && !blockManager->isCached(successor)) {
+            LogDebug("Engine::requestSuccessors", "Speculative translation of 0x%" PRIRWORD, successor);
+            speculator->request(successor);
+        }
+    }
 }
 
 
@@ -314,6 +507,8 @@ bool Engine::precacheBasicBlock(rword pc) {
 bool Engine::run(rword start, rword stop) {
     rword         currentPC = start;
     bool          hasRan = false;
+    ExecBlock*    chainBlock = nullptr;
+    uint16_t      chainInstID = 0;
     curGPRState = gprState.get();
     curFPRState = fprState.get();
 
@@ -322,23 +517,39 @@ bool Engine::run(rword start, rword stop) {
         return false;
     }
 
+    // A stop address inside the instrumented code can be in the middle of a sequence and needs
+    // an instrumentation, otherwise it is only reached between two sequences.
+    if(stop != chainStop || execBroker->isInstrumented(stop) != (stopRule != nullptr)) {
+        setStopAddress(stop);
+    }
+
     // Execute basic block per basic block
     do {
         // If this PC is not instrumented try to transfer execution
         if(execBroker->isInstrumented(currentPC) == false &&
            execBroker->canTransferExecution(curGPRState)) {
+            // The native code returns through the broker, the return record pushed by the call
+            // would never be popped
+            if(SHADOW_RETURN_STACK && curExecBlock != nullptr) {
+                curExecBlock->resetReturnStack();
+            }
             curExecBlock = nullptr;
+            chainBlock = nullptr;
             LogDebug("Engine::run", "Executing 0x%" PRIRWORD " through execBroker", currentPC);
             // transfer execution
-            signalEvent(EXEC_TRANSFER_CALL, currentPC, curGPRState, curFPRState);
+            vmState = VMState {static_cast<VMEvent>(0), currentPC, currentPC, currentPC, currentPC, 0};
+            signalEvent(EXEC_TRANSFER_CALL, curGPRState, curFPRState);
             execBroker->transferExecution(currentPC, curGPRState, curFPRState);
-            signalEvent(EXEC_TRANSFER_RETURN, currentPC, curGPRState, curFPRState);
+            signalEvent(EXEC_TRANSFER_RETURN, curGPRState, curFPRState);
         }
         // Else execute through DBI
         else {
             VMEvent event = VMEvent::SEQUENCE_ENTRY;
             LogDebug("Engine::run", "Executing 0x%" PRIRWORD " through DBI", currentPC);
 
+            // Does an instrumentation change require the retranslation of this region?
+            blockManager->revalidate(currentPC);
+
             // Is cache flush pending?
             if(blockManager->isFlushPending()) {
                 // Backup fprState and gprState
@@ -348,18 +559,43 @@ bool Engine::run(rword start, rword stop) {
                 curFPRState = fprState.get();
                 // Commit the flush
                 blockManager->flushCommit();
+                chainBlock = nullptr;
             }
 
             // Test if we have it in cache
-            curExecBlock = blockManager->getProgrammedExecBlock(currentPC);
+            const SeqLoc* seqLoc = nullptr;
+            curExecBlock = blockManager->getProgrammedExecBlock(currentPC, &seqLoc);
             if(curExecBlock == nullptr) {
                 LogDebug("Engine::run", "Cache miss for 0x%" PRIRWORD ", patching & instrumenting new basic block", currentPC);
                 handleNewBasicBlock(currentPC);
                 // Signal a new basic block
                 event |= BASIC_BLOCK_NEW;
                 // Set new basic block as current
-                curExecBlock = blockManager->getProgrammedExecBlock(currentPC);
+                curExecBlock = blockManager->getProgrammedExecBlock(currentPC, &seqLoc);
             }
+            // Hot basic blocks are retranslated with their executed successors as a trace.
+            // The backward branches are only chained to a basic block once it is hot such that the
+            // iterations of the loops keep being counted.
+            bool traceHead = false;
+            if(TRACE_MAX_BLOCKS > 1 && vmCallbacks.empty() &&
+               (curExecBlock->getSeqType(curExecBlock->getCurrentSeqID()) & (SeqType::Entry | SeqType::Trace)) == SeqType::Entry) {
+                uint32_t executions = curExecBlock->countExecution();
+                if(executions == TRACE_THRESHOLD && handleHotBasicBlock(currentPC)) {
+                    curExecBlock = blockManager->getProgrammedExecBlock(currentPC, &seqLoc);
+                }
+                traceHead = executions < TRACE_THRESHOLD;
+            }
+
+            // The SeqLoc can be moved by a translation from a callback, keep a copy of its bounds
+            vmState = VMState {static_cast<VMEvent>(0), seqLoc->bbStart, seqLoc->bbEnd, seqLoc->seqStart, seqLoc->seqEnd, 0};
+
+            // Lazily chain the previous sequence to this one. VM events are signaled from the host
+            // between sequences and thus prevent chaining.
+            if(chainBlock == curExecBlock && vmCallbacks.empty() && currentPC != stop &&
+               !(traceHead && currentPC <= chainBlock->getInstMetadata(chainInstID)->address)) {
+                curExecBlock->linkExit(chainInstID, currentPC, curExecBlock->getCurrentSeqID());
+            }
+            chainBlock = nullptr;
 
             // Set context if necessary
             if(&(curExecBlock->getContext()->gprState) != curGPRState || &(curExecBlock->getContext()->fprState) != curFPRState) {
@@ -373,12 +609,15 @@ bool Engine::run(rword start, rword stop) {
             if ((curExecBlock->getSeqType(curExecBlock->getCurrentSeqID()) & SeqType::Entry) > 0) {
                 event |= BASIC_BLOCK_ENTRY;
             }
-            signalEvent(event, currentPC, curGPRState, curFPRState);
+            signalEvent(event, curGPRState, curFPRState);
 
             // Execute
             hasRan = true;
             switch(curExecBlock->execute()) {
                 case CONTINUE:
+                    chainBlock = curExecBlock;
+                    chainInstID = curExecBlock->getCurrentInstID();
+                    break;
                 case BREAK_TO_VM:
                     break;
                 case STOP:
@@ -394,7 +633,7 @@ bool Engine::run(rword start, rword stop) {
             if ((curExecBlock->getSeqType(curExecBlock->getCurrentSeqID()) & SeqType::Exit) > 0) {
                 event |= BASIC_BLOCK_EXIT;
             }
-            signalEvent(event, currentPC, curGPRState, curFPRState);
+            signalEvent(event, curGPRState, curFPRState);
         }
         // Get next block PC
         currentPC = QBDI_GPR_GET(curGPRState, REG_PC);
@@ -410,16 +649,23 @@ bool Engine::run(rword start, rword stop) {
     return hasRan;
 }
 
-uint32_t Engine::addInstrRule(InstrRule rule) {
+uint32_t Engine::addInstrRule(InstrRule rule, bool blockEntry) {
     uint32_t id = instrRulesCounter++;
     RequireAction("Engine::addInstrRule", id < EVENTID_VM_MASK, return VMError::INVALID_EVENTID);
-    blockManager->clearCache(rule.affectedRange());
+    InstrRule::SharedPtr sharedRule = rule;
+    // The translated sequences are checked against the new rule when next dispatched
+    blockManager->invalidateInstrumentation(sharedRule);
+    if(blockEntry) {
+        blockRules.push_back(std::make_pair(id, sharedRule));
+        return id;
+    }
+    instrRuleIndexValid = false;
     switch(rule.getPosition()) {
         case InstPosition::PREINST:
-            instrRules.insert(instrRules.begin(), std::make_pair(id, (InstrRule::SharedPtr) rule));
+            instrRules.insert(instrRules.begin(), std::make_pair(id, sharedRule));
             break;
         case InstPosition::POSTINST:
-            instrRules.push_back(std::make_pair(id, (InstrRule::SharedPtr) rule));
+            instrRules.push_back(std::make_pair(id, sharedRule));
             break;
     }
     return id;
@@ -428,42 +674,100 @@ uint32_t Engine::addInstrRule(InstrRule rule) {
 uint32_t Engine::addVMEventCB(VMEvent mask, VMCallback cbk, void *data) {
     uint32_t id = vmCallbacksCounter++;
     RequireAction("Engine::addVMEventCB", id < EVENTID_VM_MASK, return VMError::INVALID_EVENTID);
+    bool sequenceSignaled = (vmCallbacksMask & (SEQUENCE_ENTRY | SEQUENCE_EXIT)) != 0;
     vmCallbacks.push_back(std::make_pair(id, CallbackRegistration {mask, cbk, data}));
+    updateVMCallbacksMask();
+    // The liveness of the translated code assumed the sequence boundaries inside a basic block
+    // were not observed
+    if(!sequenceSignaled && (mask & (SEQUENCE_ENTRY | SEQUENCE_EXIT)) != 0) {
+        blockManager->clearCache(Range<rword>(0, (rword) -1));
+    }
+    // Traces span several basic blocks and would hide their entries and exits
+    if((mask & (BASIC_BLOCK_ENTRY | BASIC_BLOCK_EXIT | SEQUENCE_ENTRY | SEQUENCE_EXIT)) != 0) {
+        blockManager->clearTraces();
+    }
+    // Chained sequences would not be signaled
+    blockManager->unlinkAll();
     return id | EVENTID_VM_MASK;
 }
 
-void Engine::signalEvent(VMEvent event, rword currentPC, GPRState *gprState, FPRState *fprState) {
-    static VMState vmState;
-    static rword lastUpdatePC = 0;
+static VMAction stopCallback(VMInstanceRef vm, GPRState* gprState, FPRState* fprState, void* data) {
+    return VMAction::STOP;
+}
 
+void Engine::setStopAddress(rword stop) {
+    LogDebug("Engine::setStopAddress", "New stop address 0x%" PRIRWORD, stop);
+    // Existing links could jump over a new stop address
+    if(stop != chainStop) {
+        blockManager->unlinkAll();
+        chainStop = stop;
+    }
+    // Only the basic blocks containing the previous and the new stop address are retranslated
+    if(stopRule != nullptr) {
+        blockManager->clearBasicBlocks(stopRule->affectedRange());
+        stopRule.reset();
+    }
+    if(execBroker->isInstrumented(stop)) {
+        stopRule = std::make_shared<InstrRule>(
+            AddressIs(stop),
+            getCallbackGenerator(stopCallback, nullptr),
+            InstPosition::PREINST,
+            true
+        );
+        blockManager->clearBasicBlocks(stopRule->affectedRange());
+    }
+}
+
+void Engine::updateVMCallbacksMask() {
+    vmCallbacksMask = static_cast<VMEvent>(0);
     for(const auto& item : vmCallbacks) {
-        const QBDI::CallbackRegistration& r = item.second;
-        if(event & r.mask) {
-            if(lastUpdatePC != currentPC) {
-                lastUpdatePC = currentPC;
-                if(curExecBlock != nullptr) {
-                    const SeqLoc* seqLoc    = blockManager->getSeqLoc(currentPC);
-                    vmState.basicBlockStart = seqLoc->bbStart;
-                    vmState.basicBlockEnd   = seqLoc->bbEnd;
-                    vmState.sequenceStart   = seqLoc->seqStart;
-                    vmState.sequenceEnd     = seqLoc->seqEnd;
-                }
-                else {
-                    vmState = VMState {event, currentPC, currentPC, currentPC, currentPC, 0};
-                }
-            }
-            vmState.event = event;
+        vmCallbacksMask |= item.second.mask;
+    }
+}
+
+void Engine::signalEvent(VMEvent event, GPRState *gprState, FPRState *fprState) {
+    // Most events have no callback registered
+    if((event & vmCallbacksMask) == 0) {
+        return;
+    }
+    vmState.event = event;
+    // Callbacks can add and delete callbacks: the ones registered when the event is signaled are
+    // called, unless they have been deleted in the meantime. The added ones are after them and the
+    // deleted ones are only erased once the dispatch is over.
+    size_t registered = vmCallbacks.size();
+    vmCallbacksDispatch++;
+    for(size_t i = 0; i < registered; i++) {
+        const QBDI::CallbackRegistration r = vmCallbacks[i].second;
+        if(r.cbk != nullptr && (event & r.mask)) {
             r.cbk(vminstance, &vmState, gprState, fprState, r.data);
         }
     }
+    vmCallbacksDispatch--;
+    if(vmCallbacksDispatch == 0 && vmCallbacksDeleted) {
+        eraseDeletedVMCallbacks();
+    }
+}
+
+void Engine::eraseDeletedVMCallbacks() {
+    vmCallbacks.erase(std::remove_if(vmCallbacks.begin(), vmCallbacks.end(),
+        [](const std::pair<uint32_t, CallbackRegistration>& item) {
+            return item.second.cbk == nullptr;
+        }), vmCallbacks.end());
+    vmCallbacksDeleted = false;
 }
 
 bool Engine::deleteInstrumentation(uint32_t id) {
     if (id & EVENTID_VM_MASK) {
         id &= ~EVENTID_VM_MASK;
         for(size_t i = 0; i < vmCallbacks.size(); i++) {
-            if(vmCallbacks[i].first == id) {
-                vmCallbacks.erase(vmCallbacks.begin() + i);
+            if(vmCallbacks[i].first == id && vmCallbacks[i].second.cbk != nullptr) {
+                // The callbacks being dispatched are only marked as deleted
+                vmCallbacks[i].second = CallbackRegistration {static_cast<VMEvent>(0), nullptr, nullptr};
+                vmCallbacksDeleted = true;
+                if(vmCallbacksDispatch == 0) {
+                    eraseDeletedVMCallbacks();
+                }
+                updateVMCallbacksMask();
                 return true;
             }
         }
@@ -471,8 +775,16 @@ bool Engine::deleteInstrumentation(uint32_t id) {
     else {
         for(size_t i = 0; i < instrRules.size(); i++) {
             if(instrRules[i].first == id) {
-                blockManager->clearCache(instrRules[i].second->affectedRange());
+                blockManager->invalidateInstrumentation(instrRules[i].second);
                 instrRules.erase(instrRules.begin() + i);
+                instrRuleIndexValid = false;
+                return true;
+            }
+        }
+        for(size_t i = 0; i < blockRules.size(); i++) {
+            if(blockRules[i].first == id) {
+                blockManager->invalidateInstrumentation(blockRules[i].second);
+                blockRules.erase(blockRules.begin() + i);
                 return true;
             }
         }
@@ -481,8 +793,23 @@ bool Engine::deleteInstrumentation(uint32_t id) {
 }
 
 void Engine::deleteAllInstrumentations() {
+    for(const auto& item: instrRules) {
+        blockManager->invalidateInstrumentation(item.second);
+    }
+    for(const auto& item: blockRules) {
+        blockManager->invalidateInstrumentation(item.second);
+    }
     instrRules.clear();
-    vmCallbacks.clear();
+    blockRules.clear();
+    instrRuleIndexValid = false;
+    for(auto& item: vmCallbacks) {
+        item.second = CallbackRegistration {static_cast<VMEvent>(0), nullptr, nullptr};
+    }
+    vmCallbacksDeleted = true;
+    if(vmCallbacksDispatch == 0) {
+        eraseDeletedVMCallbacks();
+    }
+    updateVMCallbacksMask();
 }
 
 const InstAnalysis* Engine::analyzeInstMetadata(const InstMetadata* instMetadata, AnalysisType type) {
@@ -490,10 +817,75 @@ const InstAnalysis* Engine::analyzeInstMetadata(const InstMetadata* instMetadata
 }
 
 void Engine::clearAllCache() {
+    if(speculator != nullptr) {
+        speculator->discard(Range<rword>(0, (rword) -1));
+    }
     blockManager->clearCache();
 }
 
+void Engine::setSpeculativeTranslation(bool enable) {
+    if(!enable) {
+        speculator.reset();
+    }
+    else if(speculator == nullptr) {
+        // The worker needs its own disassembler
+        auto MAB = std::unique_ptr<llvm::MCAsmBackend>(
+            processTarget->createMCAsmBackend(*MSTI, *MRI, llvm::MCTargetOptions())
+        );
+        // The decode cache is only used by the execution thread
+        speculator.reset(new SpeculativeTranslator(
+            std::unique_ptr<Assembly>(new Assembly(*MCTX, std::move(MAB), *MCII, *processTarget, *MSTI)),
+            [this] (rword address, llvm::ArrayRef<uint8_t> code, const Assembly& disassembler, std::vector<Patch>& basicBlock) -> bool {
+                return tryPatch(address, code, disassembler, nullptr, basicBlock);
+            }
+        ));
+    }
+}
+
+void Engine::setPatchOptimization(bool enable) {
+    if(enable != patchOptimization) {
+        patchOptimization = enable;
+        blockManager->clearCache(Range<rword>(0, (rword) -1));
+    }
+}
+
+void Engine::setCacheBudget(size_t budget) {
+    blockManager->setCacheBudget(budget);
+}
+
+void Engine::getCacheStats(CacheStats* stats) const {
+    blockManager->getCacheStats(stats);
+}
+
+std::vector<TargetCacheStats> Engine::getTargetCacheStats() const {
+    return blockManager->getTargetCacheStats();
+}
+
+bool Engine::loadDecodeCache(const char* path) {
+    RequireAction("Engine::loadDecodeCache", path != nullptr, return false);
+    if(decodeCache == nullptr) {
+        // Decoding only depends on the target and the subtarget features
+        std::string fingerprint = tripleName + ";" + cpu;
+        for(const std::string& attr: mattrs) {
+            fingerprint += ";" + attr;
+        }
+        decodeCache.reset(new DecodeCache(fingerprint));
+    }
+    return decodeCache->load(path, MCII.get(), MRI.get());
+}
+
+bool Engine::saveDecodeCache(const char* path) const {
+    RequireAction("Engine::saveDecodeCache", path != nullptr, return false);
+    if(decodeCache == nullptr) {
+        return false;
+    }
+    return decodeCache->save(path);
+}
+
 void Engine::clearCache(rword start, rword end) {
+    if(speculator != nullptr) {
+        speculator->discard(Range<rword>(start, end));
+    }
     blockManager->clearCache(Range<rword>(start, end));
 }
 
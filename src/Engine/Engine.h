@@ -28,6 +28,7 @@
 #include <malloc.h>
 #endif
 
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/MC/MCAsmBackend.h"
 #include "llvm/MC/MCAsmInfo.h"
 #include "llvm/MC/MCContext.h"
@@ -36,6 +37,7 @@
 #include "llvm/MC/MCObjectFileInfo.h"
 #include "llvm/MC/MCRegisterInfo.h"
 #include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/Support/TargetRegistry.h"
 
 #include "Callback.h"
 #include "InstAnalysis.h"
@@ -45,12 +47,18 @@
 namespace QBDI {
 
 class Assembly;
+class DecodeCache;
 class ExecBlock;
 class ExecBlockManager;
 class ExecBroker;
 class PatchRule;
+class PatchRuleIndex;
 class InstrRule;
+class InstrRuleIndex;
+class Liveness;
+class PatchOptimizer;
 class Patch;
+class SpeculativeTranslator;
 
 const static uint16_t MEM_READ_ADDRESS_TAG  = 0xfff0;
 const static uint16_t MEM_WRITE_ADDRESS_TAG = 0xfff1;
@@ -72,6 +80,7 @@ private:
     std::unique_ptr<llvm::MCObjectFileInfo>  MOFI;
     std::unique_ptr<llvm::MCRegisterInfo>    MRI;
     std::unique_ptr<llvm::MCSubtargetInfo>   MSTI;
+    const llvm::Target*                      processTarget;
     std::string                              tripleName;
     std::string                              cpu;
     std::vector<std::string>                 mattrs;
@@ -80,26 +89,55 @@ private:
     Assembly*                                                       assembly;
     ExecBlockManager*                                               blockManager;
     ExecBroker*                                                     execBroker;
+    std::unique_ptr<DecodeCache>                                    decodeCache;
+    std::unique_ptr<SpeculativeTranslator>                          speculator;
     std::vector<std::shared_ptr<PatchRule>>                         patchRules;
+    std::unique_ptr<PatchRuleIndex>                                 patchRuleIndex;
     std::vector<std::pair<uint32_t, std::shared_ptr<InstrRule>>>    instrRules;
+    std::vector<std::pair<uint32_t, std::shared_ptr<InstrRule>>>    blockRules;
+    std::unique_ptr<InstrRuleIndex>                                 instrRuleIndex;
+    bool                                                            instrRuleIndexValid;
+    std::vector<uint32_t>                                           instrCandidates;
+    std::vector<uint32_t>                                           appliedRules;
+    std::vector<size_t>                                             appliedStart;
+    std::vector<uint32_t>                                           appliedBlockRules;
+    std::vector<bool>                                               observed;
+    std::unique_ptr<Liveness>                                       liveness;
+    std::unique_ptr<PatchOptimizer>                                 optimizer;
+    bool                                                            patchOptimization;
     uint32_t                                                        instrRulesCounter;
     std::vector<std::pair<uint32_t, CallbackRegistration>>          vmCallbacks;
     uint32_t                                                        vmCallbacksCounter;
+    uint32_t                                                        vmCallbacksDispatch;
+    bool                                                            vmCallbacksDeleted;
     std::unique_ptr<GPRState>                                       gprState;
     std::unique_ptr<FPRState>                                       fprState;
     GPRState*                                                       curGPRState;
     FPRState*                                                       curFPRState;
     ExecBlock*                                                      curExecBlock;
+    rword                                                           chainStop;
+    std::shared_ptr<InstrRule>                                      stopRule;
+    VMState                                                         vmState;
+    VMEvent                                                         vmCallbacksMask;
 
-    std::vector<Patch> patch(rword start);
+    std::vector<Patch> patch(rword start, const Assembly& disassembler, DecodeCache* cache);
+    bool tryPatch(rword start, llvm::ArrayRef<uint8_t> code, const Assembly& disassembler, DecodeCache* cache, std::vector<Patch>& basicBlock);
 
     void initGPRState();
     void initFPRState();
 
     void instrument(std::vector<Patch> &basicBlock);
     void handleNewBasicBlock(rword pc);
+    bool handleHotBasicBlock(rword pc);
+    void requestSuccessors(const std::vector<Patch> &basicBlock);
 
-    void signalEvent(VMEvent kind, rword currentBasicBlock, GPRState *gprState, FPRState *fprState);
+    void signalEvent(VMEvent kind, GPRState *gprState, FPRState *fprState);
+
+    void updateVMCallbacksMask();
+
+    void eraseDeletedVMCallbacks();
+
+    void setStopAddress(rword stop);
 
 public:
 
@@ -200,12 +238,13 @@ public:
 
     /*! Add a custom instrumentation rule to the engine. Requires internal headers
      *
-     * @param[in] rule A custom instrumentation rule.
+     * @param[in] rule        A custom instrumentation rule.
+     * @param[in] blockEntry  Only apply the rule to the first instruction of the basic blocks.
      *
      * @return The id of the registered instrumentation (or VMError::INVALID_EVENTID
      * in case of failure).
      */
-    uint32_t addInstrRule(InstrRule rule);
+    uint32_t addInstrRule(InstrRule rule, bool blockEntry = false);
 
     /*! Register a callback event for a specific VM event.
      *
@@ -272,6 +311,55 @@ public:
     /*! Clear the entire translation cache.
     */
     void clearAllCache();
+
+    /*! Set the maximum amount of memory used by the translation cache.
+     *
+     * @param[in] budget Size in bytes of the translation cache budget, 0 for no limit.
+     *
+    */
+    void setCacheBudget(size_t budget);
+
+    /*! Obtain the statistics of the translation cache.
+     *
+     * @param[out] stats The structure receiving the statistics.
+     *
+    */
+    void getCacheStats(CacheStats* stats) const;
+
+    /*! Obtain the statistics of every indirect branch using the target cache.
+     *
+     * @return A vector of statistics, one per translated indirect branch.
+    */
+    std::vector<TargetCacheStats> getTargetCacheStats() const;
+
+    /*! Enable the persistent decode cache and load the entries of a cache file.
+     *
+     * @param[in] path Path of the cache file.
+     *
+     * @return True if the file was loaded. The cache is enabled (and empty) otherwise.
+    */
+    bool loadDecodeCache(const char* path);
+
+    /*! Save the entries of the decode cache to a file.
+     *
+     * @param[in] path Path of the cache file.
+     *
+     * @return True if the file was written.
+    */
+    bool saveDecodeCache(const char* path) const;
+
+    /*! Enable or disable the speculative translation worker thread.
+     *
+     * @param[in] enable True to start the worker, false to stop it.
+    */
+    void setSpeculativeTranslation(bool enable);
+
+    /*! Enable or disable the peephole optimization of the instrumented code. The translation
+     *  cache is flushed when the setting changes.
+     *
+     * @param[in] enable True to optimize the new translations.
+    */
+    void setPatchOptimization(bool enable);
 };
 
 } // QBDI::
@@ -0,0 +1,124 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <algorithm>
+#include <cstring>
+
+#include "Engine/SpeculativeTranslator.h"
+#include "Utility/Assembly.h"
+#include "Utility/LogSys.h"
+#include "Utility/System.h"
+
+namespace QBDI {
+
+SpeculativeTranslator::SpeculativeTranslator(std::unique_ptr<Assembly> assembly, PatchFunction patchBasicBlock) :
+    assembly(std::move(assembly)), patchBasicBlock(patchBasicBlock), code(SPECULATIVE_CODE_MAX), generation(0), stop(false) {
+    worker = std::thread(&SpeculativeTranslator::run, this);
+}
+
+SpeculativeTranslator::~SpeculativeTranslator() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+    }
+    wakeup.notify_one();
+    worker.join();
+}
+
+void SpeculativeTranslator::run() {
+    std::unique_lock<std::mutex> guard(lock);
+    while(true) {
+        wakeup.wait(guard, [this] { return stop || !requests.empty(); });
+        if(stop) {
+            return;
+        }
+        rword address = requests.front();
+        uint64_t requestGeneration = generation;
+        requests.pop_front();
+        // Patching is done without the lock, the execution thread never waits for the worker
+        guard.unlock();
+        LogDebug("SpeculativeTranslator::run", "Patching basic block 0x%" PRIRWORD, address);
+        // The successors are only guessed, they may not be code or not be mapped anymore
+        size_t size = readMemory(code.data(), address, code.size());
+        std::vector<Patch> basicBlock;
+        bool patched = size != 0 && patchBasicBlock(address, llvm::ArrayRef<uint8_t>(code.data(), size), *assembly, basicBlock);
+        guard.lock();
+        // The code may have been discarded while it was being patched
+        if(!patched || requestGeneration != generation || ready.size() >= SPECULATIVE_READY_MAX) {
+            known.erase(address);
+            continue;
+        }
+        // Keep the bytes of the patched instructions to check them when the result is taken
+        size = static_cast<size_t>(basicBlock.back().metadata.endAddress() - address);
+        Result& result = ready[address];
+        result.code.assign(code.begin(), code.begin() + size);
+        result.basicBlock = std::move(basicBlock);
+    }
+}
+
+void SpeculativeTranslator::request(rword address) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(known.count(address) != 0 || ready.size() >= SPECULATIVE_READY_MAX) {
+            return;
+        }
+        known.insert(address);
+        requests.push_back(address);
+    }
+    wakeup.notify_one();
+}
+
+bool SpeculativeTranslator::take(rword address, std::vector<Patch>& basicBlock) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::map<rword, Result>::iterator it = ready.find(address);
+    if(it == ready.end()) {
+        return false;
+    }
+    // The basic block is about to be executed, its code is read like when it is patched by the
+    // execution thread
+    bool unchanged = memcmp(reinterpret_cast<const void*>(address), it->second.code.data(), it->second.code.size()) == 0;
+    if(unchanged) {
+        basicBlock = std::move(it->second.basicBlock);
+    }
+    else {
+        LogDebug("SpeculativeTranslator::take", "Code of basic block 0x%" PRIRWORD " was modified, dropping it", address);
+    }
+    ready.erase(it);
+    known.erase(address);
+    return unchanged;
+}
+
+void SpeculativeTranslator::discard(Range<rword> range) {
+    std::lock_guard<std::mutex> guard(lock);
+    generation++;
+    requests.erase(std::remove_if(requests.begin(), requests.end(), [&range](rword address) {
+        return range.contains(address);
+    }), requests.end());
+    // Basic blocks starting before the range can still overlap it
+    for(std::map<rword, Result>::iterator it = ready.begin(); it != ready.end() && it->first < range.end;) {
+        if(Range<rword>(it->first, it->second.basicBlock.back().metadata.endAddress()).overlaps(range)) {
+            known.erase(it->first);
+            it = ready.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    known.erase(known.lower_bound(range.start), known.lower_bound(range.end));
+}
+
+}
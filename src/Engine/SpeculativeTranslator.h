@@ -0,0 +1,119 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SPECULATIVETRANSLATOR_H
+#define SPECULATIVETRANSLATOR_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+
+#include "Range.h"
+#include "State.h"
+#include "Patch/Patch.h"
+
+namespace QBDI {
+
+class Assembly;
+
+// Maximum number of speculatively patched basic blocks waiting to be used
+static const size_t SPECULATIVE_READY_MAX = 1024;
+// Maximum number of bytes of code copied for a speculatively patched basic block
+static const size_t SPECULATIVE_CODE_MAX = 4096;
+
+/*! Worker thread disassembling and patching basic blocks before they are executed. The worker
+ *  uses its own disassembler and only produces uninstrumented patches: instrumenting and writing
+ *  them in the cache is left to the execution thread when the basic block is first reached.
+ *  The code is copied with a read which tolerates unmapped memory, the guessed successors may
+ *  have been unmapped since they were requested. The copy is kept with the patches and compared
+ *  with the code in memory when they are taken, as the code may have been modified since.
+ */
+class SpeculativeTranslator {
+public:
+
+    using PatchFunction = std::function<bool(rword, llvm::ArrayRef<uint8_t>, const Assembly&, std::vector<Patch>&)>;
+
+private:
+
+    std::unique_ptr<Assembly>                   assembly;
+    PatchFunction                               patchBasicBlock;
+    std::mutex                                  lock;
+    std::condition_variable                     wakeup;
+    std::deque<rword>                           requests;
+    std::set<rword>                             known;
+    struct Result {
+        std::vector<Patch>   basicBlock;
+        std::vector<uint8_t> code;
+    };
+
+    std::map<rword, Result>                     ready;
+    std::vector<uint8_t>                        code;
+    uint64_t                                    generation;
+    bool                                        stop;
+    std::thread                                 worker;
+
+    void run();
+
+public:
+
+    /*! Start a new speculative translation worker.
+     *
+     * @param[in] assembly        Assembly used by the worker to disassemble code.
+     * @param[in] patchBasicBlock Function disassembling and patching the basic block at an address
+     *                            from a copy of its code. It returns false if the code cannot be
+     *                            disassembled or if the basic block does not fit in the copy.
+     */
+    SpeculativeTranslator(std::unique_ptr<Assembly> assembly, PatchFunction patchBasicBlock);
+
+    /*! Stop the worker and wait for it to finish its current basic block.
+     */
+    ~SpeculativeTranslator();
+
+    /*! Queue the translation of a basic block.
+     *
+     * @param[in] address Address of the basic block.
+     */
+    void request(rword address);
+
+    /*! Take the result of a speculative translation. The result is dropped if the code of the
+     *  basic block in memory differs from the code which was patched.
+     *
+     * @param[in]  address    Address of the basic block.
+     * @param[out] basicBlock The patched basic block.
+     *
+     * @return True if the basic block was available and its code is unchanged.
+     */
+    bool take(rword address, std::vector<Patch>& basicBlock);
+
+    /*! Discard the requests and results of basic blocks starting in a range.
+     *
+     * @param[in] range The range of code to discard.
+     */
+    void discard(Range<rword> range);
+};
+
+}
+
+#endif // SPECULATIVETRANSLATOR_H
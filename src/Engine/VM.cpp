@@ -15,6 +15,8 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <algorithm>
+
 #include "VM.h"
 #include "Range.h"
 #include "Errors.h"
@@ -22,6 +24,8 @@
 
 #include "Engine/Engine.h"
 #include "Patch/InstrRules.h"
+#include "Patch/CounterArray.h"
+#include "Patch/MemoryFilter.h"
 #include "Utility/LogSys.h"
 
 // Mask to identify Virtual Callback events
@@ -36,15 +40,20 @@ struct MemCBInfo {
     void* data;
 };
 
+// An instruction makes at most a read and a write access
+static const size_t MEM_GATE_MAX_ACCESS = 4;
+
 VMAction memReadGate(VMInstanceRef vm, GPRState* gprState, FPRState* fprState, void* data) {
     std::vector<std::pair<uint32_t, MemCBInfo>>* memCBInfos = static_cast<std::vector<std::pair<uint32_t, MemCBInfo>>*>(data);
-    std::vector<MemoryAccess> memAccesses = vm->getInstMemoryAccess();
+    MemoryAccess memAccesses[MEM_GATE_MAX_ACCESS];
+    size_t count = std::min(vm->getInstMemoryAccess(memAccesses, MEM_GATE_MAX_ACCESS), MEM_GATE_MAX_ACCESS);
     VMAction action = VMAction::CONTINUE;
-    for(const MemoryAccess& memAccess : memAccesses) {
+    for(size_t j = 0; j < count; j++) {
+        const MemoryAccess& memAccess = memAccesses[j];
         Range<rword> accessRange(memAccess.accessAddress, memAccess.accessAddress + memAccess.size);
         for(size_t i = 0; i < memCBInfos->size(); i++) {
             // Check access type
-            if((*memCBInfos)[i].second.type == MEMORY_READ && (memAccess.type & (*memCBInfos)[i].second.type)) {
+            if((*memCBInfos)[i].second.type == MEMORY_READ && memAccess.type == MEMORY_READ) {
                 // Check access range
                 if((*memCBInfos)[i].second.range.overlaps(accessRange)) {
                     // Forward to virtual callback
@@ -62,13 +71,15 @@ VMAction memReadGate(VMInstanceRef vm, GPRState* gprState, FPRState* fprState, v
 
 VMAction memWriteGate(VMInstanceRef vm, GPRState* gprState, FPRState* fprState, void* data) {
     std::vector<std::pair<uint32_t, MemCBInfo>>* memCBInfos = static_cast<std::vector<std::pair<uint32_t, MemCBInfo>>*>(data);
-    std::vector<MemoryAccess> memAccesses = vm->getInstMemoryAccess();
+    MemoryAccess memAccesses[MEM_GATE_MAX_ACCESS];
+    size_t count = std::min(vm->getInstMemoryAccess(memAccesses, MEM_GATE_MAX_ACCESS), MEM_GATE_MAX_ACCESS);
     VMAction action = VMAction::CONTINUE;
-    for(const MemoryAccess& memAccess : memAccesses) {
+    for(size_t j = 0; j < count; j++) {
+        const MemoryAccess& memAccess = memAccesses[j];
         Range<rword> accessRange(memAccess.accessAddress, memAccess.accessAddress + memAccess.size);
         for(size_t i = 0; i < memCBInfos->size(); i++) {
             // Check access type
-            if(((*memCBInfos)[i].second.type & MEMORY_WRITE) && (memAccess.type & (*memCBInfos)[i].second.type)) {
+            if((*memCBInfos)[i].second.type == MEMORY_WRITE && memAccess.type == MEMORY_WRITE) {
                 // Check access range
                 if((*memCBInfos)[i].second.range.overlaps(accessRange)) {
                     // Forward to virtual callback
@@ -84,19 +95,115 @@ VMAction memWriteGate(VMInstanceRef vm, GPRState* gprState, FPRState* fprState,
     return action;
 }
 
-VMAction stopCallback(VMInstanceRef vm, GPRState* gprState, FPRState* fprState, void* data) {
-    return VMAction::STOP;
+VMAction memReadWriteGate(VMInstanceRef vm, GPRState* gprState, FPRState* fprState, void* data) {
+    std::vector<std::pair<uint32_t, MemCBInfo>>* memCBInfos = static_cast<std::vector<std::pair<uint32_t, MemCBInfo>>*>(data);
+    MemoryAccess memAccesses[MEM_GATE_MAX_ACCESS];
+    size_t count = std::min(vm->getInstMemoryAccess(memAccesses, MEM_GATE_MAX_ACCESS), MEM_GATE_MAX_ACCESS);
+    VMAction action = VMAction::CONTINUE;
+    for(size_t i = 0; i < memCBInfos->size(); i++) {
+        if((*memCBInfos)[i].second.type != MEMORY_READ_WRITE) {
+            continue;
+        }
+        // The callback is called once per instruction, whatever the number of accesses in range
+        for(size_t j = 0; j < count; j++) {
+            Range<rword> accessRange(memAccesses[j].accessAddress, memAccesses[j].accessAddress + memAccesses[j].size);
+            if((*memCBInfos)[i].second.range.overlaps(accessRange)) {
+                // Forward to virtual callback
+                VMAction ret = (*memCBInfos)[i].second.cbk(vm, gprState, fprState, (*memCBInfos)[i].second.data);
+                // Always keep the most extreme action as the return
+                if(ret > action) {
+                    action = ret;
+                }
+                break;
+            }
+        }
+    }
+    return action;
+}
+
+void updateMemFilters(const std::vector<std::pair<uint32_t, MemCBInfo>>* memCBInfos, MemoryFilter* readFilter, MemoryFilter* writeFilter) {
+    if(readFilter != nullptr) {
+        readFilter->clear();
+    }
+    if(writeFilter != nullptr) {
+        writeFilter->clear();
+    }
+    for(const std::pair<uint32_t, MemCBInfo>& info : *memCBInfos) {
+        if(readFilter != nullptr && info.second.type == MEMORY_READ) {
+            readFilter->add(info.second.range);
+        }
+        if(writeFilter != nullptr && info.second.type == MEMORY_WRITE) {
+            writeFilter->add(info.second.range);
+        }
+    }
+}
+
+struct MemoryTrace {
+    MemoryAccess*               cursor;
+    std::vector<MemoryAccess>   buffer;
+    MemoryTraceCallback         cbk;
+    void*                       data;
+    std::vector<uint32_t>       instrumentations;
+    bool                        flushing;
+};
+
+static void flushMemoryTrace(VMInstanceRef vm, MemoryTrace* trace) {
+    size_t count = trace->cursor - trace->buffer.data();
+    trace->cursor = trace->buffer.data();
+    if(count > 0) {
+        trace->flushing = true;
+        trace->cbk(vm, trace->buffer.data(), count, trace->data);
+        trace->flushing = false;
+    }
+}
+
+VMAction memoryTraceGate(VMInstanceRef vm, const VMState* vmState, GPRState* gprState, FPRState* fprState, void* data) {
+    MemoryTrace* trace = static_cast<MemoryTrace*>(data);
+    // An instruction is at least one byte long and appends at most one read and one write record,
+    // the records of the sequence are thus bounded by twice its size.
+    size_t needed = 2 * (vmState->sequenceEnd - vmState->sequenceStart);
+    size_t used = trace->cursor - trace->buffer.data();
+    if(used + needed > trace->buffer.size()) {
+        // The sequence is executed with the records even if the callback stops the trace
+        flushMemoryTrace(vm, trace);
+        // The instrumented code only knows the cursor, the buffer can be reallocated
+        if(needed > trace->buffer.size()) {
+            LogDebug("memoryTraceGate", "Growing the memory trace buffer to %zu records", needed);
+            trace->buffer.resize(needed);
+            trace->cursor = trace->buffer.data();
+        }
+    }
+    return VMAction::CONTINUE;
 }
 
 VM::VM(const std::string& cpu, const std::vector<std::string>& mattrs) :
-    memoryLoggingLevel(0), memCBID(0), memReadGateCBID(VMError::INVALID_EVENTID), memWriteGateCBID(VMError::INVALID_EVENTID) {
+    memoryLoggingLevel(0), memCBID(0), memReadGateCBID(VMError::INVALID_EVENTID), memWriteGateCBID(VMError::INVALID_EVENTID),
+    memReadWriteGateCBID(VMError::INVALID_EVENTID) {
     engine = new Engine(cpu, mattrs, this);
     memCBInfos = new std::vector<std::pair<uint32_t, MemCBInfo>>;
+    counters = new std::vector<std::pair<uint32_t, CounterArray*>>;
+    memoryTrace = nullptr;
+    retiredTraces = new std::vector<MemoryTrace*>;
+    running = false;
+    memReadFilter = nullptr;
+    memWriteFilter = nullptr;
 }
 
 VM::~VM() {
     delete memCBInfos;
     delete engine;
+    // The arrays are referenced by the instrumented code, they are freed with the VM
+    for(const auto& item: *counters) {
+        delete item.second;
+    }
+    delete counters;
+    delete memoryTrace;
+    for(MemoryTrace* trace : *retiredTraces) {
+        delete trace;
+    }
+    delete retiredTraces;
+    delete memReadFilter;
+    delete memWriteFilter;
 }
 
 GPRState* VM::getGPRState() const {
@@ -153,9 +260,18 @@ bool VM::removeInstrumentedModuleFromAddr(rword addr) {
 }
 
 bool VM::run(rword start, rword stop) {
-    uint32_t stopCB = addCodeAddrCB(stop, InstPosition::PREINST, stopCallback, nullptr);
+    running = true;
     bool ret = engine->run(start, stop);
-    deleteInstrumentation(stopCB);
+    running = false;
+    // Deliver the records of the last sequences
+    if(memoryTrace != nullptr) {
+        flushMemoryTrace(this, memoryTrace);
+    }
+    // The code referencing the stopped traces is retranslated before being executed again
+    for(MemoryTrace* trace : *retiredTraces) {
+        delete trace;
+    }
+    retiredTraces->clear();
     return ret;
 }
 
@@ -223,6 +339,18 @@ uint32_t VM::addCodeCB(InstPosition pos, InstCallback cbk, void *data) {
     ));
 }
 
+uint32_t VM::addFastCodeCB(InstPosition pos, InstCallback cbk, void *data, bool state) {
+    RequireAction("VM::addFastCodeCB", cbk != nullptr, return VMError::INVALID_EVENTID);
+    return addInstrRule(InstrRule(
+        True(),
+        getCallbackGenerator(cbk, data),
+        pos,
+        true,
+        true,
+        state
+    ));
+}
+
 uint32_t VM::addCodeAddrCB(rword address, InstPosition pos, InstCallback cbk, void *data) {
     RequireAction("VM::addCodeAddrCB", cbk != nullptr, return VMError::INVALID_EVENTID);
     return addInstrRule(InstrRule(
@@ -287,18 +415,108 @@ uint32_t VM::addMemRangeCB(rword start, rword end, MemoryAccessType type, InstCa
     RequireAction("VM::addMemRangeCB", start < end, return VMError::INVALID_EVENTID);
     RequireAction("VM::addMemRangeCB", type & MEMORY_READ_WRITE, return VMError::INVALID_EVENTID);
     RequireAction("VM::addMemRangeCB", cbk != nullptr, return VMError::INVALID_EVENTID);
-    if((type == MEMORY_READ) && memReadGateCBID == VMError::INVALID_EVENTID) {
-        memReadGateCBID = addMemAccessCB(MEMORY_READ, memReadGate, memCBInfos);
-    }
-    if((type & MEMORY_WRITE) && memWriteGateCBID == VMError::INVALID_EVENTID) {
-        memWriteGateCBID = addMemAccessCB(MEMORY_READ_WRITE, memWriteGate, memCBInfos);
-    }
     uint32_t id = memCBID++;
     RequireAction("VM::addMemRangeCB", id < EVENTID_VIRTCB_MASK, return VMError::INVALID_EVENTID);
+#if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
+    // The gates of the read and write ranges are only called for the accesses passing the filters
+    // of the watched ranges. Reads can't be filtered after the instruction, the read and write
+    // ranges are checked by a gate called after every instruction accessing the memory.
+    if(type == MEMORY_READ && memReadGateCBID == VMError::INVALID_EVENTID) {
+        recordMemoryAccess(MEMORY_READ);
+        if(memReadFilter == nullptr) {
+            memReadFilter = new MemoryFilter(memReadGate, memCBInfos);
+        }
+        memReadGateCBID = addInstrRule(InstrRule(
+            DoesReadAccess(),
+            {GetReadAddress(Temp(0))},
+            InstPosition::PREINST,
+            memReadFilter
+        ));
+    }
+    if(type == MEMORY_WRITE && memWriteGateCBID == VMError::INVALID_EVENTID) {
+        recordMemoryAccess(MEMORY_WRITE);
+        if(memWriteFilter == nullptr) {
+            memWriteFilter = new MemoryFilter(memWriteGate, memCBInfos);
+        }
+        memWriteGateCBID = addInstrRule(InstrRule(
+            DoesWriteAccess(),
+            {GetWriteAddress(Temp(0))},
+            InstPosition::POSTINST,
+            memWriteFilter
+        ));
+    }
+    if(type == MEMORY_READ_WRITE && memReadWriteGateCBID == VMError::INVALID_EVENTID) {
+        memReadWriteGateCBID = addMemAccessCB(MEMORY_READ_WRITE, memReadWriteGate, memCBInfos);
+    }
+#endif
     memCBInfos->push_back(std::make_pair(id, MemCBInfo {type, Range<rword>(start, end), cbk, data}));
+    updateMemFilters(memCBInfos, memReadFilter, memWriteFilter);
     return id | EVENTID_VIRTCB_MASK;
 }
 
+static uint32_t addCounterArray(std::vector<std::pair<uint32_t, CounterArray*>>* counters, uint32_t id, CounterArray* array) {
+    if(id == VMError::INVALID_EVENTID) {
+        delete array;
+        return id;
+    }
+    counters->push_back(std::make_pair(id, array));
+    return id;
+}
+
+static const CounterArray* getCounterArray(const std::vector<std::pair<uint32_t, CounterArray*>>* counters, uint32_t id) {
+    for(const auto& item: *counters) {
+        if(item.first == id) {
+            return item.second;
+        }
+    }
+    return nullptr;
+}
+
+uint32_t VM::addBlockCounter(rword start, rword end) {
+    RequireAction("VM::addBlockCounter", start < end, return VMError::INVALID_EVENTID);
+    // Each registration has its own counters, the counted ranges can overlap
+    CounterArray* array = new CounterArray();
+    return addCounterArray(counters, engine->addInstrRule(InstrRule(
+        InstructionInRange(start, end),
+        {IncrementCounter(Temp(0), Temp(1), array)},
+        InstPosition::PREINST,
+        false
+    ), true), array);
+}
+
+uint32_t VM::addInstCounter(rword start, rword end) {
+    RequireAction("VM::addInstCounter", start < end, return VMError::INVALID_EVENTID);
+    CounterArray* array = new CounterArray();
+    return addCounterArray(counters, addInstrRule(InstrRule(
+        InstructionInRange(start, end),
+        {IncrementCounter(Temp(0), Temp(1), array)},
+        InstPosition::PREINST,
+        false
+    )), array);
+}
+
+const rword* VM::getCounters(uint32_t id, size_t index, size_t* size) const {
+    RequireAction("VM::getCounters", size != nullptr, return nullptr);
+    const CounterArray* array = getCounterArray(counters, id);
+    if(array == nullptr) {
+        *size = 0;
+        return nullptr;
+    }
+    return array->getCounters(index, size);
+}
+
+bool VM::getCounterIndex(uint32_t id, rword address, size_t* index) const {
+    RequireAction("VM::getCounterIndex", index != nullptr, return false);
+    const CounterArray* array = getCounterArray(counters, id);
+    return array != nullptr && array->getIndex(address, index);
+}
+
+void VM::resetCounters() {
+    for(const auto& item: *counters) {
+        item.second->reset();
+    }
+}
+
 uint32_t VM::addVMEventCB(VMEvent mask, VMCallback cbk, void *data) {
     RequireAction("VM::addVMEventCB", mask != 0, return VMError::INVALID_EVENTID);
     RequireAction("VM::addVMEventCB", cbk != nullptr, return VMError::INVALID_EVENTID);
@@ -311,6 +529,7 @@ bool VM::deleteInstrumentation(uint32_t id) {
         for(size_t i = 0; i < memCBInfos->size(); i++) {
             if((*memCBInfos)[i].first == id) {
                 memCBInfos->erase(memCBInfos->begin() + i);
+                updateMemFilters(memCBInfos, memReadFilter, memWriteFilter);
                 return true;
             }
         }
@@ -322,10 +541,13 @@ bool VM::deleteInstrumentation(uint32_t id) {
 }
 
 void VM::deleteAllInstrumentations() {
+    stopMemoryTrace();
     engine->deleteAllInstrumentations();
     memReadGateCBID = VMError::INVALID_EVENTID;
     memWriteGateCBID = VMError::INVALID_EVENTID;
+    memReadWriteGateCBID = VMError::INVALID_EVENTID;
     memCBInfos->clear();
+    updateMemFilters(memCBInfos, memReadFilter, memWriteFilter);
     memoryLoggingLevel = 0;
 }
 
@@ -373,39 +595,94 @@ bool VM::recordMemoryAccess(MemoryAccessType type) {
 #endif
 }
 
-std::vector<MemoryAccess> VM::getInstMemoryAccess() const {
-    const ExecBlock* curExecBlock = engine->getCurExecBlock();
-    if(curExecBlock == nullptr) {
-        return {};
+bool VM::startMemoryTrace(MemoryAccessType type, size_t size, MemoryTraceCallback cbk, void* data) {
+#if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
+    RequireAction("VM::startMemoryTrace", (type & MEMORY_READ_WRITE) != 0, return false);
+    RequireAction("VM::startMemoryTrace", size > 0, return false);
+    RequireAction("VM::startMemoryTrace", cbk != nullptr, return false);
+    RequireAction("VM::startMemoryTrace", memoryTrace == nullptr, return false);
+
+    memoryTrace = new MemoryTrace();
+    memoryTrace->buffer.resize(size);
+    memoryTrace->cursor = memoryTrace->buffer.data();
+    memoryTrace->cbk = cbk;
+    memoryTrace->data = data;
+    memoryTrace->flushing = false;
+    if(type & MEMORY_READ) {
+        memoryTrace->instrumentations.push_back(addInstrRule(InstrRule(
+            DoesReadAccess(),
+            {TraceMemoryAccess(Temp(0), Temp(1), Temp(2), MEMORY_READ, &memoryTrace->cursor)},
+            PREINST,
+            false
+        )));
     }
-    uint16_t instID = curExecBlock->getCurrentInstID();
-    std::vector<MemoryAccess> memAccess;
-    std::vector<ShadowInfo> shadows = curExecBlock->queryShadowByInst(instID, ANY);
-    LogDebug("VM::getInstMemoryAccess", "Got %zu shadows for Instruction %" PRIu16, shadows.size(), instID);
+    if(type & MEMORY_WRITE) {
+        memoryTrace->instrumentations.push_back(addInstrRule(InstrRule(
+            DoesWriteAccess(),
+            {TraceMemoryAccess(Temp(0), Temp(1), Temp(2), MEMORY_WRITE, &memoryTrace->cursor)},
+            POSTINST,
+            false
+        )));
+    }
+    // Bound checking is done by the host before each sequence
+    memoryTrace->instrumentations.push_back(engine->addVMEventCB(SEQUENCE_ENTRY, memoryTraceGate, memoryTrace));
+    return true;
+#else
+    return false;
+#endif
+}
+
+void VM::stopMemoryTrace() {
+    MemoryTrace* trace = memoryTrace;
+    if(trace == nullptr) {
+        return;
+    }
+    // Detached first such that the callback can't stop it again or can start a new trace
+    memoryTrace = nullptr;
+    if(!trace->flushing) {
+        flushMemoryTrace(this, trace);
+    }
+    for(uint32_t id : trace->instrumentations) {
+        engine->deleteInstrumentation(id);
+    }
+    // The instrumentation is removed lazily, the sequence being executed keeps appending records
+    // to the buffer until the end of the run
+    if(running || trace->flushing) {
+        retiredTraces->push_back(trace);
+    }
+    else {
+        delete trace;
+    }
+}
 
+// Decode the memory accesses of a shadow range made of address and value shadow pairs. At most
+// cap accesses are written to out but every access is counted.
+static size_t readMemoryAccess(const ExecBlock* execBlock, bool isPreInst, const ShadowInfo* shadows,
+                               size_t size, MemoryAccess* out, size_t cap) {
+    size_t count = 0;
     size_t i = 0;
-    while(i < shadows.size()) {
+    while(i < size) {
         auto access = MemoryAccess();
 
         if(shadows[i].tag == MEM_READ_ADDRESS_TAG) {
             access.type = MEMORY_READ;
-            access.size = getReadSize(curExecBlock->getOriginalMCInst(instID));
+            access.size = getReadSize(execBlock->getOriginalMCInst(shadows[i].instID));
         }
-        else if(engine->isPreInst() == false && shadows[i].tag == MEM_WRITE_ADDRESS_TAG) {
+        else if(isPreInst == false && shadows[i].tag == MEM_WRITE_ADDRESS_TAG) {
             access.type = MEMORY_WRITE;
-            access.size = getWriteSize(curExecBlock->getOriginalMCInst(instID));
+            access.size = getWriteSize(execBlock->getOriginalMCInst(shadows[i].instID));
         }
         else {
             i += 1;
             continue;
         }
-        access.accessAddress = curExecBlock->getShadow(shadows[i].shadowID);
-        access.instAddress = curExecBlock->getInstAddress(shadows[i].instID);
+        access.instAddress = execBlock->getInstAddress(shadows[i].instID);
+        access.accessAddress = execBlock->getShadow(shadows[i].shadowID);
         i += 1;
 
-        if(i >= shadows.size()) {
+        if(i >= size || shadows[i-1].instID != shadows[i].instID) {
             LogError(
-                "Engine::getInstMemoryAccess",
+                "VM::readMemoryAccess",
                 "An address shadow is not followed by a shadow for instruction at address %" PRIx64,
                 access.instAddress
             );
@@ -413,11 +690,11 @@ std::vector<MemoryAccess> VM::getInstMemoryAccess() const {
         }
 
         if(shadows[i].tag == MEM_VALUE_TAG) {
-            access.value = curExecBlock->getShadow(shadows[i].shadowID);
+            access.value = execBlock->getShadow(shadows[i].shadowID);
         }
         else {
             LogError(
-                "Engine::getInstMemoryAccess",
+                "VM::readMemoryAccess",
                 "An address shadow is not followed by a value shadow for instruction at address %" PRIx64,
                 access.instAddress
             );
@@ -425,69 +702,54 @@ std::vector<MemoryAccess> VM::getInstMemoryAccess() const {
         }
 
         // we found our access and its value, record access
-        memAccess.push_back(access);
+        if(count < cap) {
+            out[count] = access;
+        }
+        count += 1;
         i += 1;
     }
-    return memAccess;
+    return count;
 }
 
-std::vector<MemoryAccess> VM::getBBMemoryAccess() const {
+size_t VM::getInstMemoryAccess(MemoryAccess* out, size_t cap) const {
     const ExecBlock* curExecBlock = engine->getCurExecBlock();
     if(curExecBlock == nullptr) {
-        return {};
+        return 0;
     }
-    uint16_t bbID = curExecBlock->getCurrentSeqID();
     uint16_t instID = curExecBlock->getCurrentInstID();
-    std::vector<MemoryAccess> memAccess;
-    std::vector<ShadowInfo> shadows = curExecBlock->queryShadowBySeq(bbID, ANY);
-    LogDebug("VM::getBBMemoryAccess", "Got %zu shadows for Basic Block %" PRIu16 " stopping at Instruction %" PRIu16,
-             shadows.size(), bbID, instID);
+    size_t size = 0;
+    const ShadowInfo* shadows = curExecBlock->getInstShadows(instID, instID, &size);
+    LogDebug("VM::getInstMemoryAccess", "Got %zu shadows for Instruction %" PRIu16, size, instID);
 
-    size_t i = 0;
-    while(i < shadows.size() && shadows[i].instID <= instID) {
-        auto access = MemoryAccess();
+    return readMemoryAccess(curExecBlock, engine->isPreInst(), shadows, size, out, cap);
+}
 
-        if(shadows[i].tag == MEM_READ_ADDRESS_TAG) {
-            access.type = MEMORY_READ;
-            access.size = getReadSize(curExecBlock->getOriginalMCInst(shadows[i].instID));
-        }
-        else if(engine->isPreInst() == false && shadows[i].tag == MEM_WRITE_ADDRESS_TAG) {
-            access.type = MEMORY_WRITE;
-            access.size = getWriteSize(curExecBlock->getOriginalMCInst(shadows[i].instID));
-        }
-        else {
-            i += 1;
-            continue;
-        }
-        access.instAddress = curExecBlock->getInstAddress(shadows[i].instID);
-        access.accessAddress = curExecBlock->getShadow(shadows[i].shadowID);
-        i += 1;
+size_t VM::getBBMemoryAccess(MemoryAccess* out, size_t cap) const {
+    const ExecBlock* curExecBlock = engine->getCurExecBlock();
+    if(curExecBlock == nullptr) {
+        return 0;
+    }
+    uint16_t seqID = curExecBlock->getCurrentSeqID();
+    uint16_t instID = curExecBlock->getCurrentInstID();
+    // A trace holds several basic blocks, and a sequence can start in the middle of a basic block
+    uint16_t startID = std::max(curExecBlock->getSeqStart(seqID), curExecBlock->getBBStart(instID));
+    size_t size = 0;
+    const ShadowInfo* shadows = curExecBlock->getInstShadows(startID, instID, &size);
+    LogDebug("VM::getBBMemoryAccess", "Got %zu shadows for Basic Block starting at Instruction %" PRIu16 " stopping at Instruction %" PRIu16,
+             size, startID, instID);
 
-        if(i >= shadows.size() || curExecBlock->getInstAddress(shadows[i-1].instID) != curExecBlock->getInstAddress(shadows[i].instID)) {
-            LogError(
-                "VM::getBBMemoryAccess",
-                "An address shadow is not followed by a shadow for instruction at address %" PRIx64,
-                access.instAddress
-            );
-            continue;
-        }
+    return readMemoryAccess(curExecBlock, engine->isPreInst(), shadows, size, out, cap);
+}
 
-        if(shadows[i].tag == MEM_VALUE_TAG) {
-            access.value = curExecBlock->getShadow(shadows[i].shadowID);
-        }
-        else {
-            LogError(
-                "Engine::getBBMemoryAccess",
-                "An address shadow is not followed by a value shadow for instruction at address %" PRIx64,
-                access.instAddress
-            );
-            continue;
-        }
+std::vector<MemoryAccess> VM::getInstMemoryAccess() const {
+    std::vector<MemoryAccess> memAccess(getInstMemoryAccess(nullptr, 0));
+    getInstMemoryAccess(memAccess.data(), memAccess.size());
+    return memAccess;
+}
 
-        // we found our access and its value, record access
-        memAccess.push_back(access);
-        i += 1;
-    }
+std::vector<MemoryAccess> VM::getBBMemoryAccess() const {
+    std::vector<MemoryAccess> memAccess(getBBMemoryAccess(nullptr, 0));
+    getBBMemoryAccess(memAccess.data(), memAccess.size());
     return memAccess;
 }
 
@@ -500,6 +762,35 @@ void VM::clearAllCache() {
     engine->clearAllCache();
 }
 
+void VM::setCacheBudget(size_t budget) {
+    engine->setCacheBudget(budget);
+}
+
+void VM::getCacheStats(CacheStats* stats) const {
+    RequireAction("VM::getCacheStats", stats != nullptr, return);
+    engine->getCacheStats(stats);
+}
+
+std::vector<TargetCacheStats> VM::getTargetCacheStats() const {
+    return engine->getTargetCacheStats();
+}
+
+bool VM::loadDecodeCache(const char* path) {
+    return engine->loadDecodeCache(path);
+}
+
+bool VM::saveDecodeCache(const char* path) {
+    return engine->saveDecodeCache(path);
+}
+
+void VM::setSpeculativeTranslation(bool enable) {
+    engine->setSpeculativeTranslation(enable);
+}
+
+void VM::setPatchOptimization(bool enable) {
+    engine->setPatchOptimization(enable);
+}
+
 void VM::clearCache(rword start, rword end) {
     engine->clearCache(start, end);
 }
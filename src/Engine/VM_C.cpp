@@ -15,6 +15,8 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <algorithm>
+
 #include "Platform.h"
 #include "Errors.h"
 #include "VM_C.h"
@@ -143,6 +145,11 @@ uint32_t qbdi_addCodeCB(VMInstanceRef instance, InstPosition pos, InstCallback c
     return static_cast<VM*>(instance)->addCodeCB(pos, cbk, data);
 }
 
+uint32_t qbdi_addFastCodeCB(VMInstanceRef instance, InstPosition pos, InstCallback cbk, void *data, bool state) {
+    RequireAction("VM_C::addFastCodeCB", instance, return VMError::INVALID_EVENTID);
+    return static_cast<VM*>(instance)->addFastCodeCB(pos, cbk, data, state);
+}
+
 uint32_t qbdi_addCodeAddrCB(VMInstanceRef instance, rword address, InstPosition pos, InstCallback cbk, void *data) {
     RequireAction("VM_C::addCodeAddrCB", instance, return VMError::INVALID_EVENTID);
     return static_cast<VM*>(instance)->addCodeAddrCB(address, pos, cbk, data);
@@ -168,6 +175,32 @@ uint32_t qbdi_addMemRangeCB(VMInstanceRef instance, rword start, rword end, Memo
     return static_cast<VM*>(instance)->addMemRangeCB(start, end, type, cbk, data);
 }
 
+uint32_t qbdi_addBlockCounter(VMInstanceRef instance, rword start, rword end) {
+    RequireAction("VM_C::addBlockCounter", instance, return VMError::INVALID_EVENTID);
+    return static_cast<VM*>(instance)->addBlockCounter(start, end);
+}
+
+uint32_t qbdi_addInstCounter(VMInstanceRef instance, rword start, rword end) {
+    RequireAction("VM_C::addInstCounter", instance, return VMError::INVALID_EVENTID);
+    return static_cast<VM*>(instance)->addInstCounter(start, end);
+}
+
+const rword* qbdi_getCounters(VMInstanceRef instance, uint32_t id, size_t index, size_t* size) {
+    RequireAction("VM_C::getCounters", instance, return nullptr);
+    RequireAction("VM_C::getCounters", size, return nullptr);
+    return static_cast<VM*>(instance)->getCounters(id, index, size);
+}
+
+bool qbdi_getCounterIndex(VMInstanceRef instance, uint32_t id, rword address, size_t* index) {
+    RequireAction("VM_C::getCounterIndex", instance, return false);
+    return static_cast<VM*>(instance)->getCounterIndex(id, address, index);
+}
+
+void qbdi_resetCounters(VMInstanceRef instance) {
+    RequireAction("VM_C::resetCounters", instance, return);
+    static_cast<VM*>(instance)->resetCounters();
+}
+
 uint32_t qbdi_addVMEventCB(VMInstanceRef instance, VMEvent mask, VMCallback cbk, void *data) {
     RequireAction("VM_C::addVMEventCB", instance, return VMError::INVALID_EVENTID);
     return static_cast<VM*>(instance)->addVMEventCB(mask, cbk, data);
@@ -196,39 +229,53 @@ bool qbdi_recordMemoryAccess(VMInstanceRef instance, MemoryAccessType type) {
 MemoryAccess* qbdi_getInstMemoryAccess(VMInstanceRef instance, size_t* size) {
     RequireAction("VM_C::getInstMemoryAccess", instance, return nullptr);
     RequireAction("VM_C::getInstMemoryAccess", size, return nullptr);
-    *size = 0;
-    std::vector<MemoryAccess> ma_vec = static_cast<VM*>(instance)->getInstMemoryAccess();
+    *size = static_cast<VM*>(instance)->getInstMemoryAccess(nullptr, 0);
     // Do not allocate if no shadows
-    if(ma_vec.size() == 0) {
+    if(*size == 0) {
         return NULL;
     }
     // Allocate and copy
-    *size = ma_vec.size();
     MemoryAccess* ma_arr = static_cast<MemoryAccess*>(malloc(*size * sizeof(MemoryAccess)));
-    for(size_t i = 0; i < *size; i++) {
-        ma_arr[i] = ma_vec[i];
-    }
+    static_cast<VM*>(instance)->getInstMemoryAccess(ma_arr, *size);
     return ma_arr;
 }
 
+size_t qbdi_readInstMemoryAccess(VMInstanceRef instance, MemoryAccess* out, size_t cap) {
+    RequireAction("VM_C::readInstMemoryAccess", instance, return 0);
+    RequireAction("VM_C::readInstMemoryAccess", out != nullptr || cap == 0, return 0);
+    return static_cast<VM*>(instance)->getInstMemoryAccess(out, cap);
+}
+
 MemoryAccess* qbdi_getBBMemoryAccess(VMInstanceRef instance, size_t* size) {
     RequireAction("VM_C::getBBMemoryAccess", instance, return nullptr);
     RequireAction("VM_C::getBBMemoryAccess", size, return nullptr);
-    *size = 0;
-    std::vector<MemoryAccess> ma_vec = static_cast<VM*>(instance)->getBBMemoryAccess();
+    *size = static_cast<VM*>(instance)->getBBMemoryAccess(nullptr, 0);
     // Do not allocate if no shadows
-    if(ma_vec.size() == 0) {
+    if(*size == 0) {
         return NULL;
     }
     // Allocate and copy
-    *size = ma_vec.size();
     MemoryAccess* ma_arr = static_cast<MemoryAccess*>(malloc(*size * sizeof(MemoryAccess)));
-    for(size_t i = 0; i < *size; i++) {
-        ma_arr[i] = ma_vec[i];
-    }
+    static_cast<VM*>(instance)->getBBMemoryAccess(ma_arr, *size);
     return ma_arr;
 }
 
+size_t qbdi_readBBMemoryAccess(VMInstanceRef instance, MemoryAccess* out, size_t cap) {
+    RequireAction("VM_C::readBBMemoryAccess", instance, return 0);
+    RequireAction("VM_C::readBBMemoryAccess", out != nullptr || cap == 0, return 0);
+    return static_cast<VM*>(instance)->getBBMemoryAccess(out, cap);
+}
+
+bool qbdi_startMemoryTrace(VMInstanceRef instance, MemoryAccessType type, size_t size, MemoryTraceCallback cbk, void *data) {
+    RequireAction("VM_C::startMemoryTrace", instance, return false);
+    return static_cast<VM*>(instance)->startMemoryTrace(type, size, cbk, data);
+}
+
+void qbdi_stopMemoryTrace(VMInstanceRef instance) {
+    RequireAction("VM_C::stopMemoryTrace", instance, return);
+    static_cast<VM*>(instance)->stopMemoryTrace();
+}
+
 bool qbdi_precacheBasicBlock(VMInstanceRef instance, rword pc) {
     RequireAction("VM_C::precacheBasicBlock", instance, return false);
     return static_cast<VM*>(instance)->precacheBasicBlock(pc);
@@ -238,6 +285,50 @@ void qbdi_clearAllCache(VMInstanceRef instance) {
     static_cast<VM*>(instance)->clearAllCache();
 }
 
+void qbdi_setCacheBudget(VMInstanceRef instance, size_t budget) {
+    RequireAction("VM_C::setCacheBudget", instance, return);
+    static_cast<VM*>(instance)->setCacheBudget(budget);
+}
+
+void qbdi_getCacheStats(VMInstanceRef instance, CacheStats* stats) {
+    RequireAction("VM_C::getCacheStats", instance, return);
+    static_cast<VM*>(instance)->getCacheStats(stats);
+}
+
+TargetCacheStats* qbdi_getTargetCacheStats(VMInstanceRef instance, size_t* size) {
+    RequireAction("VM_C::getTargetCacheStats", instance, return nullptr);
+    RequireAction("VM_C::getTargetCacheStats", size, return nullptr);
+    std::vector<TargetCacheStats> stats = static_cast<VM*>(instance)->getTargetCacheStats();
+    *size = stats.size();
+    // Do not allocate if no indirect branch
+    if(*size == 0) {
+        return NULL;
+    }
+    TargetCacheStats* stats_arr = static_cast<TargetCacheStats*>(malloc(*size * sizeof(TargetCacheStats)));
+    std::copy(stats.begin(), stats.end(), stats_arr);
+    return stats_arr;
+}
+
+bool qbdi_loadDecodeCache(VMInstanceRef instance, const char* path) {
+    RequireAction("VM_C::loadDecodeCache", instance, return false);
+    return static_cast<VM*>(instance)->loadDecodeCache(path);
+}
+
+bool qbdi_saveDecodeCache(VMInstanceRef instance, const char* path) {
+    RequireAction("VM_C::saveDecodeCache", instance, return false);
+    return static_cast<VM*>(instance)->saveDecodeCache(path);
+}
+
+void qbdi_setSpeculativeTranslation(VMInstanceRef instance, bool enable) {
+    RequireAction("VM_C::setSpeculativeTranslation", instance, return);
+    static_cast<VM*>(instance)->setSpeculativeTranslation(enable);
+}
+
+void qbdi_setPatchOptimization(VMInstanceRef instance, bool enable) {
+    RequireAction("VM_C::setPatchOptimization", instance, return);
+    static_cast<VM*>(instance)->setPatchOptimization(enable);
+}
+
 void qbdi_clearCache(VMInstanceRef instance, rword start, rword end) {
     static_cast<VM*>(instance)->clearCache(start, end);
 }
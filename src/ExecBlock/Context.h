@@ -69,6 +69,10 @@ struct HostState {
     rword callback;
     rword data;
     rword origin;
+    rword execBlock;
+    rword fastCallback;
+    rword fastCallbackNoState;
+    rword skipFPR;
 };
 
 /*! X86 / X86_64 Execution context.
@@ -115,6 +119,10 @@ struct HostState {
     rword callback;
     rword data;
     rword origin;
+    rword execBlock;
+    rword fastCallback;
+    rword fastCallbackNoState;
+    rword skipFPR;
 };
 
 /*! ARM Execution context.
@@ -15,6 +15,8 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <algorithm>
+
 #include "llvm/Support/Format.h"
 #include "Patch/PatchRule.h"
 #include "ExecBlock.h"
@@ -26,6 +28,7 @@
 
 #if defined(QBDI_OS_WIN)
     #if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
+        extern "C" void qbdi_runCodeBlockGPR(void *codeBlock);
         extern "C" void qbdi_runCodeBlockSSE(void *codeBlock);
         extern "C" void qbdi_runCodeBlockAVX(void *codeBlock);
     #else
@@ -33,6 +36,7 @@
     #endif
 #else
     #if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
+        extern void qbdi_runCodeBlockGPR(void *codeBlock) asm ("__qbdi_runCodeBlockGPR");
         extern void qbdi_runCodeBlockSSE(void *codeBlock) asm ("__qbdi_runCodeBlockSSE");
         extern void qbdi_runCodeBlockAVX(void *codeBlock) asm ("__qbdi_runCodeBlockAVX");
     #else
@@ -45,9 +49,11 @@ namespace QBDI {
 uint32_t ExecBlock::epilogueSize = 0;
 RelocatableInst::SharedPtrVec ExecBlock::execBlockPrologue = RelocatableInst::SharedPtrVec();
 RelocatableInst::SharedPtrVec ExecBlock::execBlockEpilogue = RelocatableInst::SharedPtrVec();
+RelocatableInst::SharedPtrVec ExecBlock::execBlockFastCallback = RelocatableInst::SharedPtrVec();
+RelocatableInst::SharedPtrVec ExecBlock::execBlockFastCallbackNoState = RelocatableInst::SharedPtrVec();
 void (*ExecBlock::runCodeBlockFct)(void*) = NULL;
 
-ExecBlock::ExecBlock(Assembly &assembly, VMInstanceRef vminstance) : vminstance(vminstance), assembly(assembly) {
+ExecBlock::ExecBlock(Assembly &assembly, VMInstanceRef vminstance, bool dualMappedCode) : vminstance(vminstance), assembly(assembly) {
     // Allocate memory blocks
     std::error_code ec;
 #ifdef QBDI_OS_IOS
@@ -62,21 +68,56 @@ ExecBlock::ExecBlock(Assembly &assembly, VMInstanceRef vminstance) : vminstance(
              mflags |= PF::MF_EXEC;
 #endif
 
-    // Allocate 2 pages block
-    codeBlock = QBDI::allocateMappedMemory(2*pageSize, nullptr, mflags, ec);
+    // The target cache keys and values need to fit in a single page
+    Require("ExecBlock::ExecBlock", 2 * TARGET_CACHE_SIZE * sizeof(rword) <= pageSize);
+    // The shadow return stack top, empty record and entries need to fit in a single page
+    Require("ExecBlock::ExecBlock", (3 + RETURN_STACK_SIZE) * sizeof(rword) <= pageSize);
+    // The target cache and the shadow return stack pages are only allocated if they are used
+    uint64_t cachePages = (TARGET_CACHE_EXIT_SIZE > 0 ? 1 : 0) + (SHADOW_RETURN_STACK ? 1 : 0);
+    uint64_t blockSize = (2 + cachePages) * pageSize;
+    dualMapped = false;
+    if(dualMappedCode) {
+        // The code page is also mapped as RW to write sequences without switching its permissions
+        codeBlock = QBDI::allocateDualMappedMemory(blockSize, pageSize, writeBlock, ec);
+        dualMapped = codeBlock.base() != nullptr;
+        if(!dualMapped) {
+            LogDebug("ExecBlock::ExecBlock", "Dual mapping of the code block failed (%s), falling back to permission switches",
+                     ec.message().c_str());
+        }
+    }
+    if(!dualMapped) {
+        codeBlock = QBDI::allocateMappedMemory(blockSize, nullptr, mflags, ec);
+    }
     RequireAction("ExecBlock::ExecBlock", codeBlock.base() != nullptr, abort());
-    // Split it in two blocks
+    // Split it in three blocks, the last one holds the target cache and the shadow return stack
     dataBlock = llvm::sys::MemoryBlock(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(codeBlock.base()) + pageSize), pageSize);
+    cacheBlock = llvm::sys::MemoryBlock(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(codeBlock.base()) + 2*pageSize), cachePages*pageSize);
     codeBlock = llvm::sys::MemoryBlock(codeBlock.base(), pageSize);
-    LogDebug("ExecBlock::ExecBlock", "codeBlock @ 0x%" PRIRWORD " | dataBlock @ 0x%" PRIRWORD, reinterpret_cast<rword>(codeBlock.base()), reinterpret_cast<rword>(dataBlock.base()));
+    if(!dualMapped) {
+        writeBlock = codeBlock;
+    }
+    LogDebug("ExecBlock::ExecBlock", "codeBlock @ 0x%" PRIRWORD " | dataBlock @ 0x%" PRIRWORD " | cacheBlock @ 0x%" PRIRWORD,
+             reinterpret_cast<rword>(codeBlock.base()), reinterpret_cast<rword>(dataBlock.base()), reinterpret_cast<rword>(cacheBlock.base()));
 
     // Other initializations
     context = static_cast<Context*>(dataBlock.base());
     shadows = reinterpret_cast<rword*>(reinterpret_cast<rword>(dataBlock.base()) + sizeof(Context));
+    targetCache = nullptr;
+    returnStack = nullptr;
+    if(TARGET_CACHE_EXIT_SIZE > 0) {
+        targetCache = static_cast<rword*>(cacheBlock.base());
+    }
+    if(SHADOW_RETURN_STACK) {
+        returnStack = reinterpret_cast<rword*>(reinterpret_cast<rword>(cacheBlock.base()) + (cachePages - 1) * pageSize);
+    }
     shadowIdx = 0;
+    sideExitLinks = 0;
     currentSeq = 0;
     currentInst = 0;
-    codeStream = new memory_ostream(codeBlock);
+    pendingAction = CONTINUE;
+    // The guest FPR are switched once an instruction using them is written
+    context->hostState.skipFPR = LAZY_FPR ? 1 : 0;
+    codeStream = new memory_ostream(writeBlock);
     pageState = RW;
 
     // Epilogue and prologue management.
@@ -84,9 +125,11 @@ ExecBlock::ExecBlock(Assembly &assembly, VMInstanceRef vminstance) : vminstance(
     if(epilogueSize == 0) {
         execBlockPrologue = getExecBlockPrologue();
         execBlockEpilogue = getExecBlockEpilogue();
+        execBlockFastCallback = getFastCallbackTrampoline(reinterpret_cast<rword>(&ExecBlock::fastCallbackDispatch), true);
+        execBlockFastCallbackNoState = getFastCallbackTrampoline(reinterpret_cast<rword>(&ExecBlock::fastCallbackNoStateDispatch), false);
         // Only way to know the epilogue size is to JIT is somewhere
         for(auto &inst: execBlockEpilogue) {
-            assembly.writeInstruction(inst->reloc(this), codeStream);
+            assembly.writeInstruction(inst->reloc(this), codeStream, inst->getTemplateOperand());
         }
         epilogueSize = codeStream->current_pos();
         codeStream->seek(0);
@@ -106,18 +149,33 @@ ExecBlock::ExecBlock(Assembly &assembly, VMInstanceRef vminstance) : vminstance(
     // JIT prologue and epilogue
     codeStream->seek(codeBlock.size() - epilogueSize);
     for(auto &inst: execBlockEpilogue) {
-        assembly.writeInstruction(inst->reloc(this), codeStream);
+        assembly.writeInstruction(inst->reloc(this), codeStream, inst->getTemplateOperand());
     }
     codeStream->seek(0);
     for(auto &inst: execBlockPrologue) {
-        assembly.writeInstruction(inst->reloc(this), codeStream);
+        assembly.writeInstruction(inst->reloc(this), codeStream, inst->getTemplateOperand());
+    }
+    // JIT the fast callback trampolines after the prologue
+    context->hostState.execBlock = reinterpret_cast<rword>(this);
+    context->hostState.fastCallback = getCurrentPC();
+    for(auto &inst: execBlockFastCallback) {
+        assembly.writeInstruction(inst->reloc(this), codeStream, inst->getTemplateOperand());
+    }
+    context->hostState.fastCallbackNoState = getCurrentPC();
+    for(auto &inst: execBlockFastCallbackNoState) {
+        assembly.writeInstruction(inst->reloc(this), codeStream, inst->getTemplateOperand());
     }
+    resetTargetCache();
+    resetReturnStack();
 }
 
 ExecBlock::~ExecBlock() {
-    // Reunite the 2 blocks before freeing them
-    codeBlock = llvm::sys::MemoryBlock(codeBlock.base(), codeBlock.size() + dataBlock.size());
+    // Reunite the 3 blocks before freeing them
+    codeBlock = llvm::sys::MemoryBlock(codeBlock.base(), codeBlock.size() + dataBlock.size() + cacheBlock.size());
     QBDI::releaseMappedMemory(codeBlock);
+    if(dualMapped) {
+        QBDI::releaseMappedMemory(writeBlock);
+    }
     delete codeStream;
 }
 
@@ -173,6 +231,13 @@ void ExecBlock::run() {
 #else
     llvm::sys::Memory::InvalidateInstructionCache(codeBlock.base(), codeBlock.size());
 #endif // QBDI_OS_IOS
+#if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
+    // The host FPR are left untouched if the guest FPR are not switched
+    if(context->hostState.skipFPR != 0) {
+        qbdi_runCodeBlockGPR(codeBlock.base());
+        return;
+    }
+#endif
     runCodeBlockFct(codeBlock.base());
 }
 
@@ -182,17 +247,24 @@ VMAction ExecBlock::execute() {
     do {
         context->hostState.callback = (rword) 0;
         context->hostState.data = (rword) 0;
+        // Chained exits overwrite it with the instruction they are leaving from
+        context->hostState.origin = (rword) seqRegistry[currentSeq].endInstID;
 
         LogDebug("ExecBlock::execute", "Execution of ExecBlock %p resumed at 0x%" PRIRWORD,
                  this, context->hostState.selector);
         run();
 
-        if(context->hostState.callback != 0) {
-            currentInst = context->hostState.origin;
+        updateCurrentInst();
+        // A fast callback requested to stop the execution of the ExecBlock
+        if(pendingAction != CONTINUE) {
+            VMAction r = pendingAction;
+            pendingAction = CONTINUE;
+            return r;
+        }
 
+        if(context->hostState.callback != 0) {
             LogDebug("ExecBlock::execute", "Callback request by ExecBlock %p for callback 0x%" PRIRWORD,
                      this, context->hostState.callback);
-            Require("ExecBlock::execute", currentInst < instMetadata.size());
 
             VMAction r = (reinterpret_cast<InstCallback>(context->hostState.callback))(
                 vminstance,
@@ -213,14 +285,48 @@ VMAction ExecBlock::execute() {
             }
         }
     } while(context->hostState.callback != 0);
-    currentInst = seqRegistry[currentSeq].endInstID;
 
     return CONTINUE;
 }
 
+void ExecBlock::updateCurrentInst() {
+    currentInst = context->hostState.origin;
+    Require("ExecBlock::updateCurrentInst", currentInst < instMetadata.size());
+    // Execution may have been chained to another sequence
+    if(currentInst < seqRegistry[currentSeq].startInstID || currentInst > seqRegistry[currentSeq].endInstID) {
+        currentSeq = instRegistry[currentInst].seqID;
+    }
+}
+
+void ExecBlock::fastCallbackDispatch(ExecBlock* execBlock) {
+    fastCallbackCall(execBlock, &execBlock->context->gprState, &execBlock->context->fprState);
+}
+
+void ExecBlock::fastCallbackNoStateDispatch(ExecBlock* execBlock) {
+    fastCallbackCall(execBlock, nullptr, nullptr);
+}
+
+void ExecBlock::fastCallbackCall(ExecBlock* execBlock, GPRState* gprState, FPRState* fprState) {
+    Context* context = execBlock->context;
+
+    execBlock->updateCurrentInst();
+    VMAction r = (reinterpret_cast<InstCallback>(context->hostState.callback))(
+        execBlock->vminstance,
+        gprState, fprState,
+        (void*) context->hostState.data
+    );
+    context->hostState.callback = (rword) 0;
+    // Leave the ExecBlock through the epilogue, execute() will return the action
+    if(r != CONTINUE) {
+        execBlock->pendingAction = r;
+        context->hostState.selector = execBlock->getEpilogueAddress();
+    }
+}
+
 SeqWriteResult ExecBlock::writeSequence(std::vector<Patch>::const_iterator seqIt, std::vector<Patch>::const_iterator seqEnd, SeqType seqType) {
     rword startOffset = (rword)codeStream->current_pos();
     uint16_t startInstID = getNextInstID();
+    uint16_t bbStartInstID = startInstID;
     uint16_t seqID = getNextSeqID();
     unsigned patchWritten = 0;
 
@@ -253,7 +359,7 @@ SeqWriteResult ExecBlock::writeSequence(std::vector<Patch>::const_iterator seqIt
         // Attempt to write a complete patch. If not, rollback to the last complete patch written
         for(const RelocatableInst::SharedPtr& inst : seqIt->insts) {
             if(getEpilogueOffset() > MINIMAL_BLOCK_SIZE) {
-                assembly.writeInstruction(inst->reloc(this), codeStream);
+                assembly.writeInstruction(inst->reloc(this), codeStream, inst->getTemplateOperand());
             }
             else {
                 // Not enough space left, rollback
@@ -261,6 +367,31 @@ SeqWriteResult ExecBlock::writeSequence(std::vector<Patch>::const_iterator seqIt
                 break;
             }
         }
+        // Inside a trace, the successor of an inner basic block which is not the next patch is
+        // reached through a side exit written after its terminator
+        ChainInfo sideExit {getNextInstID(), 0, 0, true};
+        if(!rollback && seqIt->metadata.modifyPC && seqIt + 1 != seqEnd) {
+            for(rword target : getChainTargets(seqIt->metadata)) {
+                if(target != (seqIt + 1)->metadata.address) {
+                    sideExit.target = target;
+                }
+            }
+        }
+        if(sideExit.target != 0) {
+            sideExit.shadowID = newShadow();
+            setShadow(sideExit.shadowID, getEpilogueAddress());
+            RelocatableInst::SharedPtrVec exit = getSideExit(seqIt->metadata, sideExit.instID, (seqIt + 1)->metadata.address,
+                                                             Offset(getShadowOffset(sideExit.shadowID)));
+            for(const RelocatableInst::SharedPtr& inst : exit) {
+                if(getEpilogueOffset() > MINIMAL_BLOCK_SIZE) {
+                    assembly.writeInstruction(inst->reloc(this), codeStream, inst->getTemplateOperand());
+                }
+                else {
+                    rollback = true;
+                    break;
+                }
+            }
+        }
 
         if(rollback) {
             LogDebug("ExecBlock::writeBasicBlock", "Not enough space left, rolling back to offset 0x%" PRIRWORD, rollbackOffset);
@@ -274,55 +405,252 @@ SeqWriteResult ExecBlock::writeSequence(std::vector<Patch>::const_iterator seqIt
                 LogDebug("ExecBlock::writeBasicBlock", "NULL rollback, nothing written to ExecBlock %p", this);
                 return {EXEC_BLOCK_FULL, 0, 0};
             }
-            // Because we didn't wrote the full sequence, only keep the Entry bit
-            seqType = static_cast<SeqType>(seqType & SeqType::Entry);
+            // Because we didn't wrote the full sequence, only keep the Entry and Trace bits
+            seqType = static_cast<SeqType>(seqType & (SeqType::Entry | SeqType::Trace));
             break;
         }
         else {
             // Complete instruction was written, we add the metadata
             instMetadata.push_back(seqIt->metadata);
             // Register instruction
-            instRegistry.push_back(InstInfo {seqID, static_cast<uint16_t>(rollbackOffset)});
+            instRegistry.push_back(InstInfo {
+                seqID,
+                static_cast<uint16_t>(rollbackOffset),
+                static_cast<uint16_t>(rollbackShadowRegistry),
+                static_cast<uint16_t>(shadowRegistry.size() - rollbackShadowRegistry),
+                bbStartInstID
+            });
+            // The instructions following a terminator inside a trace start a new basic block
+            if(seqIt->metadata.modifyPC) {
+                bbStartInstID = getNextInstID();
+            }
+            if(seqIt->metadata.useFPR) {
+                requireFPR();
+            }
+            if(sideExit.target != 0) {
+                chainRegistry.push_back(sideExit);
+            }
             // Update indexes
             seqIt++;
             patchWritten += 1;
         }
     }
+    uint16_t endInstID = getNextInstID() - 1;
+    std::vector<rword> chainTargets;
     // If it's a rollback or a non-exit sequence, add a terminator
     if((seqType & SeqType::Exit) == 0) {
         LogDebug("ExecBlock::writeBasicBlock", "Writting terminator to ExecBlock %p to finish non-exit sequence", this);
         RelocatableInst::SharedPtrVec terminator = getTerminator(seqIt->metadata.address);
         for(RelocatableInst::SharedPtr &inst : terminator) {
-            assembly.writeInstruction(inst->reloc(this), codeStream);
+            assembly.writeInstruction(inst->reloc(this), codeStream, inst->getTemplateOperand());
+        }
+        chainTargets.push_back(seqIt->metadata.address);
+    }
+    else {
+        chainTargets = getChainTargets(instMetadata[endInstID]);
+    }
+    RelocatableInst::SharedPtrVec chainExit;
+    RelocatableInst::SharedPtrVec returnStackCode;
+    rword returnStackOffset = reinterpret_cast<rword>(returnStack) - getDataBlockBase();
+    rword returnAddress = getReturnAddress(instMetadata[endInstID]);
+    // All the parts of the exit are selected at once such that their code fits in the space left.
+    // Exits without static successors look up their target in the target cache, returns first
+    // check the shadow return stack and calls push a return record on it.
+    bool targetCache = (seqType & SeqType::Exit) && chainTargets.empty() &&
+                       TARGET_CACHE_EXIT_SIZE > 0 && getEpilogueOffset() > TARGET_CACHE_EXIT_SIZE;
+    uint32_t exitSize = targetCache ? TARGET_CACHE_EXIT_SIZE : MINIMAL_BLOCK_SIZE;
+    uint32_t returnStackSize = 0;
+    if(SHADOW_RETURN_STACK && targetCache && isReturn(instMetadata[endInstID]) &&
+       getEpilogueOffset() > exitSize + RETURN_STACK_CHECK_SIZE) {
+        returnStackSize = RETURN_STACK_CHECK_SIZE;
+        returnSites.push_back(endInstID);
+        returnStackCode = getReturnStackCheck(endInstID, Offset(returnStackOffset),
+                                              Offset(returnStackOffset + 3 * sizeof(rword)));
+    }
+    else if(SHADOW_RETURN_STACK && (seqType & SeqType::Exit) && returnAddress != 0 &&
+            getEpilogueOffset() > exitSize + RETURN_STACK_PUSH_SIZE) {
+        returnStackSize = RETURN_STACK_PUSH_SIZE;
+        // A return record is made of two consecutive shadows
+        uint16_t record = newShadow();
+        uint16_t continuation = newShadow();
+        setShadow(record, returnAddress);
+        setShadow(continuation, getEpilogueAddress());
+        returnRegistry.push_back(ChainInfo {endInstID, continuation, returnAddress, false});
+        returnStackCode = getReturnStackPush(Offset(returnStackOffset), Offset(returnStackOffset + 3 * sizeof(rword)),
+                                             Offset(getShadowOffset(record)));
+    }
+    if(targetCache) {
+        uint16_t hits = newShadow();
+        uint16_t misses = newShadow();
+        setShadow(hits, 0);
+        setShadow(misses, 0);
+        targetCacheRegistry.push_back(TargetCacheSite {endInstID, hits, misses});
+        chainExit = getTargetCacheExit(endInstID,
+                                       Offset(reinterpret_cast<rword>(cacheBlock.base()) - getDataBlockBase()),
+                                       Offset(getShadowOffset(hits)), Offset(getShadowOffset(misses)));
+    }
+    else {
+        // Conditional exits compare the guest PC with the taken target, if their code doesn't fit
+        // the sequence returns to the host which dispatches the guest PC
+        if(chainTargets.size() == 2 && getEpilogueOffset() <= CONDITIONAL_EXIT_SIZE) {
+            chainTargets.clear();
+        }
+        // Allocate one chain slot per static successor, unlinked slots jump to the epilogue
+        std::vector<Offset> chainSlots;
+        for(rword target : chainTargets) {
+            uint16_t slot = newShadow();
+            setShadow(slot, getEpilogueAddress());
+            chainRegistry.push_back(ChainInfo {endInstID, slot, target, false});
+            chainSlots.push_back(Offset(getShadowOffset(slot)));
         }
+        // Conditional exits count the successor they go to, which lets a trace follow the most
+        // frequent one
+        std::vector<Offset> counters;
+        if(chainTargets.size() == 2) {
+            uint16_t taken = newShadow();
+            uint16_t fallthrough = newShadow();
+            setShadow(taken, 0);
+            setShadow(fallthrough, 0);
+            branchRegistry.push_back(BranchSite {endInstID, taken, fallthrough});
+            counters.push_back(Offset(getShadowOffset(taken)));
+            counters.push_back(Offset(getShadowOffset(fallthrough)));
+        }
+        chainExit = getChainExit(instMetadata[endInstID], endInstID, chainSlots, counters);
+    }
+    // JIT the sequence exit, the shadow return stack code comes first
+    rword returnStackStart = codeStream->current_pos();
+    for(RelocatableInst::SharedPtr &inst : returnStackCode) {
+        assembly.writeInstruction(inst->reloc(this), codeStream, inst->getTemplateOperand());
     }
-    // JIT the jump to epilogue
-    RelocatableInst::SharedPtrVec jmpEpilogue = JmpEpilogue();
-    for(RelocatableInst::SharedPtr &inst : jmpEpilogue) {
-        assembly.writeInstruction(inst->reloc(this), codeStream);
+    Require("ExecBlock::writeSequence", codeStream->current_pos() - returnStackStart <= returnStackSize);
+    for(RelocatableInst::SharedPtr &inst : chainExit) {
+        assembly.writeInstruction(inst->reloc(this), codeStream, inst->getTemplateOperand());
     }
     // Register sequence
-    uint16_t endInstID = getNextInstID() - 1;
-    seqRegistry.push_back(SeqInfo {startInstID, endInstID, seqType});
+    seqRegistry.push_back(SeqInfo {startInstID, endInstID, seqType, 0});
     // Return write results
     unsigned bytesWritten = static_cast<unsigned>(codeStream->current_pos() - startOffset);
     return SeqWriteResult {seqID, bytesWritten, patchWritten};
 }
 
+void ExecBlock::requireFPR() {
+    if(context->hostState.skipFPR != 0) {
+        LogDebug("ExecBlock::requireFPR", "ExecBlock %p now switches the guest FPR", this);
+        context->hostState.skipFPR = 0;
+    }
+}
+
 uint16_t ExecBlock::splitSequence(uint16_t instID) {
     Require("ExecBlock::splitSequence", instID < instRegistry.size());
     uint16_t seqID = instRegistry[instID].seqID;
     seqRegistry.push_back(SeqInfo {
         instID,
         seqRegistry[seqID].endInstID,
-        static_cast<SeqType>(SeqType::Entry | seqRegistry[seqID].type)
+        static_cast<SeqType>(SeqType::Entry | seqRegistry[seqID].type),
+        0
     });
     return getNextSeqID() - 1;
 }
 
+bool ExecBlock::linkExit(uint16_t instID, rword target, uint16_t seqID) {
+    RequireAction("ExecBlock::linkExit", seqID < seqRegistry.size(), return false);
+    RequireAction("ExecBlock::linkExit", instMetadata[seqRegistry[seqID].startInstID].address == target, return false);
+
+    for(const ChainInfo& chain : chainRegistry) {
+        if(chain.instID == instID && chain.target == target) {
+            LogDebug("ExecBlock::linkExit", "Chaining exit of instID %" PRIu16 " to seqID %" PRIu16 " in ExecBlock %p",
+                     instID, seqID, this);
+            setShadow(chain.shadowID, reinterpret_cast<rword>(codeBlock.base()) +
+                      static_cast<rword>(instRegistry[seqRegistry[seqID].startInstID].offset));
+            if(chain.sideExit) {
+                sideExitLinks++;
+            }
+            return true;
+        }
+    }
+    rword seqAddress = reinterpret_cast<rword>(codeBlock.base()) +
+                       static_cast<rword>(instRegistry[seqRegistry[seqID].startInstID].offset);
+    bool linked = false;
+    if(std::find(returnSites.begin(), returnSites.end(), instID) != returnSites.end()) {
+        for(const ChainInfo& ret : returnRegistry) {
+            if(ret.target == target) {
+                LogDebug("ExecBlock::linkExit", "Linking return record of instID %" PRIu16 " to seqID %" PRIu16 " in ExecBlock %p",
+                         ret.instID, seqID, this);
+                setShadow(ret.shadowID, seqAddress);
+                linked = true;
+            }
+        }
+    }
+    for(const TargetCacheSite& site : targetCacheRegistry) {
+        if(site.instID == instID) {
+            size_t idx = target % TARGET_CACHE_SIZE;
+            LogDebug("ExecBlock::linkExit", "Caching target 0x%" PRIRWORD " of instID %" PRIu16 " to seqID %" PRIu16 " in ExecBlock %p",
+                     target, instID, seqID, this);
+            targetCache[idx] = target;
+            targetCache[TARGET_CACHE_SIZE + idx] = seqAddress;
+            linked = true;
+            break;
+        }
+    }
+    return linked;
+}
+
+void ExecBlock::unlinkAll() {
+    LogDebug("ExecBlock::unlinkAll", "Unlinking all sequences of ExecBlock %p", this);
+    for(const ChainInfo& chain : chainRegistry) {
+        setShadow(chain.shadowID, getEpilogueAddress());
+    }
+    for(const ChainInfo& ret : returnRegistry) {
+        setShadow(ret.shadowID, getEpilogueAddress());
+    }
+    resetTargetCache();
+    resetReturnStack();
+}
+
+void ExecBlock::resetTargetCache() {
+    if(targetCache == nullptr) {
+        return;
+    }
+    // Guest code can't be located at address 0, the key of an empty entry never matches
+    for(size_t i = 0; i < TARGET_CACHE_SIZE; i++) {
+        targetCache[i] = 0;
+        targetCache[TARGET_CACHE_SIZE + i] = getEpilogueAddress();
+    }
+}
+
+void ExecBlock::resetReturnStack() {
+    if(returnStack == nullptr) {
+        return;
+    }
+    // The first rword is the top index, followed by the empty return record and the entries
+    returnStack[0] = 0;
+    returnStack[1] = 0;
+    returnStack[2] = getEpilogueAddress();
+    for(size_t i = 0; i < RETURN_STACK_SIZE; i++) {
+        returnStack[3 + i] = reinterpret_cast<rword>(&returnStack[1]);
+    }
+}
+
+std::vector<TargetCacheStats> ExecBlock::getTargetCacheStats() const {
+    std::vector<TargetCacheStats> stats;
+
+    for(const TargetCacheSite& site : targetCacheRegistry) {
+        stats.push_back(TargetCacheStats {
+            getInstAddress(site.instID),
+            getShadow(site.hitShadowID),
+            getShadow(site.missShadowID)
+        });
+    }
+    return stats;
+}
+
 void ExecBlock::makeRX() {
     LogDebug("ExecBlock::makeRX", "Making ExecBlock %p RX", this);
-    if(pageState != RX) {
+    if(pageState != RX && dualMapped) {
+        llvm::sys::Memory::InvalidateInstructionCache(codeBlock.base(), codeBlock.size());
+        pageState = RX;
+    }
+    else if(pageState != RX) {
         RequireAction(
             "ExecBlock::makeRX",
             !llvm::sys::Memory::protectMappedMemory(codeBlock, PF::MF_READ | PF::MF_EXEC),
@@ -334,7 +662,10 @@ void ExecBlock::makeRX() {
 
 void ExecBlock::makeRW() {
     LogDebug("ExecBlock::makeRW", "Making ExecBlock %p RW", this);
-    if(pageState != RW) {
+    if(pageState != RW && dualMapped) {
+        pageState = RW;
+    }
+    else if(pageState != RW) {
         RequireAction(
             "ExecBlock::makeRW",
             !llvm::sys::Memory::protectMappedMemory(codeBlock, PF::MF_READ | PF::MF_WRITE),
@@ -428,30 +759,36 @@ uint16_t ExecBlock::getSeqEnd(uint16_t seqID) const {
     return seqRegistry[seqID].endInstID;
 }
 
-std::vector<ShadowInfo> ExecBlock::queryShadowByInst(uint16_t instID, uint16_t tag) const {
-    std::vector<ShadowInfo> result;
-
-    for(const auto& reg: shadowRegistry) {
-        if((instID == ANY || reg.instID == instID) &&
-           (tag    == ANY || reg.tag    == tag)) {
-            result.push_back(reg);
-        }
-    }
-
-    return result;
+uint16_t ExecBlock::getBBStart(uint16_t instID) const {
+    Require("ExecBlock::getBBStart", instID < instRegistry.size());
+    return instRegistry[instID].bbStartInstID;
 }
 
-std::vector<ShadowInfo> ExecBlock::queryShadowBySeq(uint16_t seqID, uint16_t tag) const {
-    std::vector<ShadowInfo> result;
+uint32_t ExecBlock::getSeqExecutions(uint16_t seqID) const {
+    Require("ExecBlock::getSeqExecutions", seqID < seqRegistry.size());
+    return seqRegistry[seqID].executions;
+}
 
-    for(const auto& reg: shadowRegistry) {
-        if((seqID == ANY || reg.seqID  == seqID)  &&
-           (tag   == ANY || reg.tag   == tag)) {
-            result.push_back(reg);
+bool ExecBlock::getSeqBranchCounts(uint16_t seqID, rword* taken, rword* fallthrough) const {
+    RequireAction("ExecBlock::getSeqBranchCounts", seqID < seqRegistry.size(), return false);
+    for(const BranchSite& site : branchRegistry) {
+        if(site.instID == seqRegistry[seqID].endInstID) {
+            *taken = getShadow(site.takenShadowID);
+            *fallthrough = getShadow(site.fallthroughShadowID);
+            return true;
         }
     }
+    return false;
+}
 
-    return result;
+const ShadowInfo* ExecBlock::getInstShadows(uint16_t startInstID, uint16_t endInstID, size_t* size) const {
+    *size = 0;
+    RequireAction("ExecBlock::getInstShadows", startInstID <= endInstID && endInstID < instRegistry.size(), return nullptr);
+    // Shadows are registered in instruction order, the range is contiguous
+    size_t start = instRegistry[startInstID].shadowOffset;
+    size_t end = instRegistry[endInstID].shadowOffset + instRegistry[endInstID].shadowSize;
+    *size = end - start;
+    return shadowRegistry.data() + start;
 }
 
 float ExecBlock::occupationRatio() const {
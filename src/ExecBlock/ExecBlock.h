@@ -26,9 +26,11 @@
 #include "llvm/Support/Process.h"
 #include "llvm/Support/Memory.h"
 
+#include "Cache.h"
 #include "Callback.h"
 #include "Context.h"
 #include "Patch/Types.h"
+#include "Utility/Arena.h"
 #include "Utility/memory_ostream.h"
 #include "Utility/Assembly.h"
 
@@ -37,20 +39,32 @@ namespace QBDI {
 class RelocatableInst;
 class Patch;
 
+#if defined(_QBDI_DUAL_MAPPED_CODE)
+static const bool DUAL_MAPPED_CODE = true;
+#else
+static const bool DUAL_MAPPED_CODE = false;
+#endif
+
 enum SeqType {
     Entry = 1,
     Exit  = 1<<1,
+    Trace = 1<<2,
 };
 
 struct InstInfo {
     uint16_t seqID;
     uint16_t offset;
+    uint16_t shadowOffset;
+    uint16_t shadowSize;
+    // A trace sequence holds several basic blocks
+    uint16_t bbStartInstID;
 };
 
 struct SeqInfo {
     uint16_t startInstID;
     uint16_t endInstID;
     SeqType  type;
+    uint32_t executions;
 };
 
 struct SeqWriteResult {
@@ -66,10 +80,31 @@ struct ShadowInfo {
     uint16_t shadowID;
 };
 
+struct ChainInfo {
+    uint16_t instID;
+    uint16_t shadowID;
+    rword    target;
+    bool     sideExit;
+};
+
+struct TargetCacheSite {
+    uint16_t instID;
+    uint16_t hitShadowID;
+    uint16_t missShadowID;
+};
+
+struct BranchSite {
+    uint16_t instID;
+    uint16_t takenShadowID;
+    uint16_t fallthroughShadowID;
+};
+
 static const uint16_t EXEC_BLOCK_FULL = 0xFFFF;
 
-/*! Manages the concept of an exec block made of two contiguous memory blocks (one for the code,
- *  the other for the data) used to store and execute instrumented basic blocks.
+/*! Manages the concept of an exec block made of three contiguous memory blocks (one for the code,
+ *  one for the data and, on the architectures supporting them, one for the indirect branch target
+ *  cache and the shadow return stack)
+ *  used to store and execute instrumented basic blocks.
  */
 class ExecBlock {
 private:
@@ -79,13 +114,17 @@ private:
     enum PageState {RX, RW};
 
     static uint32_t                                      epilogueSize;
-    static std::vector<std::shared_ptr<RelocatableInst>> execBlockPrologue;
-    static std::vector<std::shared_ptr<RelocatableInst>> execBlockEpilogue;
+    static std::vector<std::shared_ptr<RelocatableInst>, ArenaAllocator<std::shared_ptr<RelocatableInst>>> execBlockPrologue;
+    static std::vector<std::shared_ptr<RelocatableInst>, ArenaAllocator<std::shared_ptr<RelocatableInst>>> execBlockEpilogue;
+    static std::vector<std::shared_ptr<RelocatableInst>, ArenaAllocator<std::shared_ptr<RelocatableInst>>> execBlockFastCallback;
+    static std::vector<std::shared_ptr<RelocatableInst>, ArenaAllocator<std::shared_ptr<RelocatableInst>>> execBlockFastCallbackNoState;
     static void (*runCodeBlockFct)(void*);
 
     VMInstanceRef               vminstance;
     llvm::sys::MemoryBlock      codeBlock;
+    llvm::sys::MemoryBlock      writeBlock;
     llvm::sys::MemoryBlock      dataBlock;
+    llvm::sys::MemoryBlock      cacheBlock;
     memory_ostream*             codeStream;
     Assembly&                   assembly;
     Context*                    context;
@@ -95,9 +134,19 @@ private:
     std::vector<InstMetadata>   instMetadata;
     std::vector<InstInfo>       instRegistry;
     std::vector<SeqInfo>        seqRegistry;
+    std::vector<ChainInfo>      chainRegistry;
+    rword                       sideExitLinks;
+    rword*                      targetCache;
+    std::vector<TargetCacheSite> targetCacheRegistry;
+    std::vector<BranchSite>     branchRegistry;
+    rword*                      returnStack;
+    std::vector<ChainInfo>      returnRegistry;
+    std::vector<uint16_t>       returnSites;
     PageState                   pageState;
+    bool                        dualMapped;
     uint16_t                    currentSeq;
     uint16_t                    currentInst;
+    VMAction                    pendingAction;
 
     /*! Verify if the code block is in read execute mode.
      *
@@ -111,22 +160,59 @@ private:
      */
     bool isRW() const {return pageState == RW;}
 
-    /*! Changes the code block permissions to RX.
+    /*! Changes the code block permissions to RX. If the code block is dual mapped, only flush the
+     *  instruction cache.
      */
     void makeRX();
 
-    /*! Changes the code block permissions to RW.
+    /*! Changes the code block permissions to RW. If the code block is dual mapped, the code is
+     *  written through its RW mapping and the permissions are never changed.
      */
     void makeRW();
 
+    /*! Empty the indirect branch target cache, every key is invalid and every value points to the
+     *  epilogue.
+     */
+    void resetTargetCache();
+
+    /*! Update the current instruction and sequence from the origin written in the host state.
+     */
+    void updateCurrentInst();
+
+    /*! Dispatch a fast callback. Called from the fast callback trampoline on the host stack while
+     *  the ExecBlock is running. If the callback does not return CONTINUE, the selector is set to
+     *  the epilogue and the action is returned by execute().
+     *
+     * @param[in] execBlock  The running ExecBlock.
+     */
+    static void fastCallbackDispatch(ExecBlock* execBlock);
+
+    /*! Dispatch a fast callback which doesn't need the guest state. The guest state was not saved
+     *  by the trampoline, the callback receives NULL state pointers.
+     *
+     * @param[in] execBlock  The running ExecBlock.
+     */
+    static void fastCallbackNoStateDispatch(ExecBlock* execBlock);
+
+    /*! Call a fast callback and handle its action.
+     *
+     * @param[in] execBlock  The running ExecBlock.
+     * @param[in] gprState   The GPR state given to the callback.
+     * @param[in] fprState   The FPR state given to the callback.
+     */
+    static void fastCallbackCall(ExecBlock* execBlock, GPRState* gprState, FPRState* fprState);
+
 public:
 
     /*! Construct a new ExecBlock
      *
-     * @param[in] assembly    Assembly used to assemble instructions in the ExecBlock.
-     * @param[in] vminstance  Pointer to public engine interface
+     * @param[in] assembly        Assembly used to assemble instructions in the ExecBlock.
+     * @param[in] vminstance      Pointer to public engine interface
+     * @param[in] dualMappedCode  Try to map the code block twice instead of switching its
+     *                            permissions. Falls back to the permission switches if the
+     *                            platform doesn't support it.
      */
-    ExecBlock(Assembly& assembly, VMInstanceRef vminstance = nullptr);
+    ExecBlock(Assembly& assembly, VMInstanceRef vminstance = nullptr, bool dualMappedCode = DUAL_MAPPED_CODE);
 
     ~ExecBlock();
 
@@ -146,7 +232,8 @@ public:
     /*! Write a new sequence in the exec block. This function does not guarantee that the
      *  sequence will be written in its entierty and might stop before the end using an
      *  architecture specific terminator. Return 0 if the exec block was full and no instruction was
-     *  written.
+     *  written. The patches of a trace can contain several basic blocks, the terminator of an inner
+     *  basic block is followed by a side exit to its successor which is not the next patch.
      *
      * @param seqStart [in] Iterator to the start of a list of patches.
      * @param seqEnd   [in] Iterator to the end of a list of patches.
@@ -156,6 +243,11 @@ public:
      */
     SeqWriteResult writeSequence(std::vector<Patch>::const_iterator seqStart, std::vector<Patch>::const_iterator seqEnd, SeqType seqType);
 
+    /*! Switch the guest FPR on every entry and exit of the exec block. By default the guest FPR
+     *  are only switched once an instruction using them has been written in the exec block.
+     */
+    void requireFPR();
+
     /*! Split an existing sequence at instruction instID to create a new sequence.
      *
      * @param instID  [in] ID of the instruction where to split the sequence at.
@@ -187,6 +279,30 @@ public:
         return codeBlock.size() - epilogueSize - codeStream->current_pos();
     }
 
+    /*! Verify if the code block is written through a second RW mapping.
+     *
+     * @return Return true if the code block is dual mapped.
+     */
+    bool isDualMapped() const {
+        return dualMapped;
+    }
+
+    /*! Obtain the address of the exec block epilogue code.
+     *
+     * @return The address of the epilogue.
+     */
+    rword getEpilogueAddress() const {
+        return reinterpret_cast<rword>(codeBlock.base()) + codeBlock.size() - epilogueSize;
+    }
+
+    /*! Obtain the amount of memory mapped by the exec block.
+     *
+     * @return The size in bytes of the code, data and cache blocks.
+     */
+    size_t getMemorySize() const {
+        return codeBlock.size() + dataBlock.size() + cacheBlock.size();
+    }
+
     /*! Obtain the value of the PC where the ExecBlock is currently writing instructions.
      *
      * @return The PC value.
@@ -297,6 +413,40 @@ public:
      */
     uint16_t getSeqEnd(uint16_t seqID) const;
 
+    /*! Obtain the instruction id of the start of the basic block of an instruction. It differs
+     *  from the sequence start for the basic blocks following the head of a trace.
+     *
+     * @param instID The instruction ID.
+     *
+     * @return The instruction ID of the basic block start.
+     */
+    uint16_t getBBStart(uint16_t instID) const;
+
+    /*! Count a dispatch of the current sequence by the host. Chained executions are not counted.
+     *
+     * @return The number of dispatches of the current sequence.
+     */
+    uint32_t countExecution() { return ++seqRegistry[currentSeq].executions; }
+
+    /*! Obtain the number of dispatches of a specific sequence ID.
+     *
+     * @param seqID The sequence ID.
+     *
+     * @return The number of dispatches of the sequence.
+     */
+    uint32_t getSeqExecutions(uint16_t seqID) const;
+
+    /*! Obtain the number of times the conditional exit of a specific sequence ID went to each of
+     *  its successors. Chained executions are counted.
+     *
+     * @param[in]  seqID        The sequence ID.
+     * @param[out] taken        The number of exits to the branch target.
+     * @param[out] fallthrough  The number of exits to the fallthrough.
+     *
+     * @return False if the sequence doesn't end with a counted conditional exit.
+     */
+    bool getSeqBranchCounts(uint16_t seqID, rword* taken, rword* fallthrough) const;
+
     /*! Set the selector of the exec block to a specific sequence offset. Used to program the
      *  execution of a specific sequence within the exec block.
      *
@@ -304,6 +454,40 @@ public:
      */
     void selectSeq(uint16_t seqID);
 
+    /*! Chain the exit of a sequence directly to another sequence of the exec block. The link is
+     *  only established if the sequence ending with instID has a chain slot for this target or
+     *  ends with an indirect branch, in which case the target is inserted in the target cache.
+     *  Returns also link the return records of the calls returning to target.
+     *
+     *  @param instID [in] ID of the last instruction of the sequence to chain from.
+     *  @param target [in] Guest address of the successor.
+     *  @param seqID  [in] ID of the sequence starting at target.
+     *
+     *  @return True if the link was established.
+     */
+    bool linkExit(uint16_t instID, rword target, uint16_t seqID);
+
+    /*! Reset all the chain slots of the exec block to the epilogue and empty the target cache
+     *  and the shadow return stack, forcing every sequence to return to the host on exit.
+     */
+    void unlinkAll();
+
+    /*! Empty the shadow return stack, every entry points to a return record which never matches.
+     */
+    void resetReturnStack();
+
+    /*! Obtain the hit and miss counters of every indirect branch using the target cache.
+     *
+     *  @return A vector of statistics, one per indirect branch.
+     */
+    std::vector<TargetCacheStats> getTargetCacheStats() const;
+
+    /*! Obtain the number of times a side exit of a trace was linked to its target.
+     *
+     *  @return The number of side exit links.
+     */
+    rword getSideExitLinks() const { return sideExitLinks; }
+
     /*! Get a pointer to the context structure stored in the data block.
      *
      * @return The context pointer.
@@ -342,21 +526,16 @@ public:
      */
     rword getShadowOffset(uint16_t id) const;
 
-    /* Query registered shadows and returns a vector of matching shadowID
-     *
-     * @param
-     *
-     * @return a vector of shadowID matching the query
-     */
-    std::vector<ShadowInfo> queryShadowByInst(uint16_t instID, uint16_t tag) const;
-
-    /* Query registered shadows and returns a vector of matching shadowID
+    /* Get the registered shadows of a range of instructions. The shadows are indexed per
+     * instruction when written, no copy is made.
      *
-     * @param
+     * @param[in]  startInstID  The first instruction of the range.
+     * @param[in]  endInstID    The last instruction of the range (included).
+     * @param[out] size         Will be set to the number of shadows.
      *
-     * @return a vector of ShadowInfo matching the query
+     * @return a pointer to the first ShadowInfo of the range, ordered by instruction.
      */
-    std::vector<ShadowInfo> queryShadowBySeq(uint16_t seqID, uint16_t tag) const;
+    const ShadowInfo* getInstShadows(uint16_t startInstID, uint16_t endInstID, size_t* size) const;
 
     /* Compute the occupation ratio of the ExecBlock.
      *
@@ -18,6 +18,7 @@
 #include "Platform.h"
 #include "ExecBlock/ExecBlockManager.h"
 #include "Patch/PatchRule.h"
+#include "Patch/InstrRule.h"
 #include "Utility/LogSys.h"
 
 #include <cstdint>
@@ -33,7 +34,9 @@
 namespace QBDI {
 
 ExecBlockManager::ExecBlockManager(llvm::MCInstrInfo& MCII, llvm::MCRegisterInfo& MRI, Assembly& assembly, VMInstanceRef vminstance) :
-   total_translated_size(1), total_translation_size(1), vminstance(vminstance), MCII(MCII), MRI(MRI), assembly(assembly) {
+   seqLookup(SEQ_LOOKUP_SIZE, SeqLookupEntry {0, 0, nullptr, nullptr}), total_translated_size(1), total_translation_size(1),
+   cacheBudget(0), cacheSize(0), evictedSize(0), useClock(0), instrGeneration(0), staleRegions(0), retiredStats(CacheStats {0, 0, 0, 0}),
+   vminstance(vminstance), MCII(MCII), MRI(MRI), assembly(assembly) {
 }
 
 ExecBlockManager::~ExecBlockManager() {
@@ -51,7 +54,7 @@ float ExecBlockManager::getExpansionRatio() const {
 void ExecBlockManager::printCacheStatistics(FILE* output) const {
     float mean_occupation = 0.0;
     size_t region_overflow = 0;
-    fprintf(output, "\tCache made of %zu regions:\n", regions.size());
+    fprintf(output, "\tCache made of %zu regions using %zu bytes (budget: %zu bytes):\n", regions.size(), cacheSize, cacheBudget);
     for(size_t i = 0; i < regions.size(); i++) {
         float occupation = 0.0;
         for(size_t j = 0; j < regions[i].blocks.size(); j++) {
@@ -71,15 +74,67 @@ void ExecBlockManager::printCacheStatistics(FILE* output) const {
     }
     fprintf(output, "\tMean occupation ratio: %f\n", mean_occupation);
     fprintf(output, "\tRegion overflow count: %zu\n", region_overflow);
+    fprintf(output, "\tIndirect branch target cache:\n");
+    for(size_t i = 0; i < regions.size(); i++) {
+        for(size_t j = 0; j < regions[i].blocks.size(); j++) {
+            for(const TargetCacheStats& stats : regions[i].blocks[j]->getTargetCacheStats()) {
+                fprintf(output, "\t\t0x%" PRIRWORD ": %zu hits, %zu misses\n", stats.address,
+                        static_cast<size_t>(stats.hits), static_cast<size_t>(stats.misses));
+            }
+        }
+    }
+}
+
+static void addBlockStats(CacheStats* stats, const ExecBlock* block) {
+    for(const TargetCacheStats& site : block->getTargetCacheStats()) {
+        stats->targetCacheHits += site.hits;
+        stats->targetCacheMisses += site.misses;
+    }
+    stats->traceSideExits += block->getSideExitLinks();
+}
+
+void ExecBlockManager::getCacheStats(CacheStats* stats) const {
+    // The counters of the evicted blocks were kept when they were dropped
+    *stats = retiredStats;
+    for(const ExecRegion& region : regions) {
+        for(const ExecBlock* block : region.blocks) {
+            addBlockStats(stats, block);
+        }
+    }
+}
+
+std::vector<TargetCacheStats> ExecBlockManager::getTargetCacheStats() const {
+    std::vector<TargetCacheStats> stats;
+    for(const ExecRegion& region : regions) {
+        for(const ExecBlock* block : region.blocks) {
+            std::vector<TargetCacheStats> sites = block->getTargetCacheStats();
+            stats.insert(stats.end(), sites.begin(), sites.end());
+        }
+    }
+    return stats;
 }
 
-ExecBlock* ExecBlockManager::getProgrammedExecBlock(rword address) {
+ExecBlock* ExecBlockManager::getProgrammedExecBlock(rword address, const SeqLoc** programmedSeqLoc) {
     LogDebug("ExecBlockManager::getProgrammedExecBlock", "Looking up sequence at address %" PRIRWORD, address);
 
+    // Attempting seqLookup resolution, avoiding the region search and the map lookups
+    const SeqLookupEntry& entry = seqLookup[seqLookupIndex(address)];
+    if(entry.seqLoc != nullptr && entry.address == address) {
+        LogDebug("ExecBlockManager::getProgrammedExecBlock", "Found sequence 0x%" PRIRWORD " in lookup cache as seqID %" PRIu16,
+                 address, entry.seqLoc->seqID);
+        regions[entry.regionIdx].lastUse = ++useClock;
+        if(programmedSeqLoc != nullptr) {
+            *programmedSeqLoc = entry.seqLoc;
+        }
+        entry.block->selectSeq(entry.seqLoc->seqID);
+        return entry.block;
+    }
+
     size_t r = searchRegion(address);
 
     if(r < regions.size() && regions[r].covered.contains(address)) {
         ExecRegion& region = regions[r];
+        region.lastUse = ++useClock;
 
         // Attempting sequenceCache resolution
         const std::map<rword, SeqLoc>::const_iterator seqLoc = region.sequenceCache.find(address);
@@ -87,6 +142,10 @@ ExecBlock* ExecBlockManager::getProgrammedExecBlock(rword address) {
             LogDebug("ExecBlockManager::getProgrammedExecBlock", "Found sequence 0x%" PRIRWORD " in ExecBlock %p as seqID %" PRIu16,
                      address, region.blocks[seqLoc->second.blockIdx], seqLoc->second.seqID);
             // Select sequence and return execBlock
+            cacheSeqLookup(address, r, region.blocks[seqLoc->second.blockIdx], &(seqLoc->second));
+            if(programmedSeqLoc != nullptr) {
+                *programmedSeqLoc = &(seqLoc->second);
+            }
             region.blocks[seqLoc->second.blockIdx]->selectSeq(seqLoc->second.seqID);
             return region.blocks[seqLoc->second.blockIdx];
         }
@@ -100,7 +159,7 @@ ExecBlock* ExecBlockManager::getProgrammedExecBlock(rword address) {
             const SeqLoc& existingSeqLoc = region.sequenceCache[block->getInstMetadata(block->getSeqStart(existingSeqId))->address];
             // Creating a new sequence at that instruction and saving it in the sequenceCache
             uint16_t newSeqID = block->splitSequence(instLoc->second.instID);
-            regions[r].sequenceCache[address] = SeqLoc {
+            const SeqLoc& newSeqLoc = regions[r].sequenceCache[address] = SeqLoc {
                 instLoc->second.blockIdx,
                 newSeqID,
                 address,
@@ -108,6 +167,10 @@ ExecBlock* ExecBlockManager::getProgrammedExecBlock(rword address) {
                 address,
                 existingSeqLoc.seqEnd,
             };
+            cacheSeqLookup(address, r, block, &newSeqLoc);
+            if(programmedSeqLoc != nullptr) {
+                *programmedSeqLoc = &newSeqLoc;
+            }
             LogDebug("ExecBlockManager::getProgrammedExecBlock", "Splitted seqID %" PRIu16 " at instID %" PRIu16 " in ExecBlock %p as new sequence with seqID %" PRIu16,
                      existingSeqId, instLoc->second.instID, block, newSeqID);
             block->selectSeq(newSeqID);
@@ -119,6 +182,10 @@ ExecBlock* ExecBlockManager::getProgrammedExecBlock(rword address) {
 }
 
 const SeqLoc* ExecBlockManager::getSeqLoc(rword address) const {
+    const SeqLookupEntry& entry = seqLookup[seqLookupIndex(address)];
+    if(entry.seqLoc != nullptr && entry.address == address) {
+        return entry.seqLoc;
+    }
     size_t r = searchRegion(address);
     if(r < regions.size() && regions[r].covered.contains(address)) {
         const std::map<rword, SeqLoc>::const_iterator seqLoc = regions[r].sequenceCache.find(address);
@@ -129,6 +196,14 @@ const SeqLoc* ExecBlockManager::getSeqLoc(rword address) const {
     return nullptr;
 }
 
+bool ExecBlockManager::isCached(rword address) const {
+    if(getSeqLoc(address) != nullptr) {
+        return true;
+    }
+    size_t r = searchRegion(address);
+    return r < regions.size() && regions[r].covered.contains(address) && regions[r].instCache.count(address) != 0;
+}
+
 void ExecBlockManager::writeBasicBlock(const std::vector<Patch>& basicBlock) {
     unsigned translated = 0;
     unsigned translation = 0;
@@ -165,6 +240,7 @@ void ExecBlockManager::writeBasicBlock(const std::vector<Patch>& basicBlock) {
             // basic blocks can cause overflows.
             if(i >= region.blocks.size()) {
                 region.blocks.push_back(new ExecBlock(assembly, vminstance));
+                cacheSize += region.blocks.back()->getMemorySize();
             }
             // Determine sequence type
             SeqType seqType = (SeqType) 0;
@@ -175,7 +251,7 @@ void ExecBlockManager::writeBasicBlock(const std::vector<Patch>& basicBlock) {
             // Successful write
             if(res.seqID != EXEC_BLOCK_FULL) {
                 // Saving sequence in the sequence cache
-                regions[r].sequenceCache[basicBlock[patchIdx].metadata.address] = SeqLoc {
+                const SeqLoc& seqLoc = regions[r].sequenceCache[basicBlock[patchIdx].metadata.address] = SeqLoc {
                     (uint16_t) i,
                     res.seqID,
                     bbStart,
@@ -183,6 +259,7 @@ void ExecBlockManager::writeBasicBlock(const std::vector<Patch>& basicBlock) {
                     basicBlock[patchIdx].metadata.address,
                     basicBlock[patchIdx + res.patchWritten - 1].metadata.endAddress(),
                 };
+                cacheSeqLookup(basicBlock[patchIdx].metadata.address, r, region.blocks[i], &seqLoc);
                 // Generate instruction mapping cache
                 uint16_t startID = region.blocks[i]->getSeqStart(res.seqID);
                 for(size_t j = 0; j < res.patchWritten; j++) {
@@ -205,6 +282,96 @@ void ExecBlockManager::writeBasicBlock(const std::vector<Patch>& basicBlock) {
     total_translation_size += translation;
     total_translated_size += translated;
     updateRegionStat(r, translated);
+    region.lastUse = ++useClock;
+    // The new basic block is about to be executed, its region can't be evicted
+    enforceCacheBudget(r);
+}
+
+bool ExecBlockManager::writeTrace(const std::vector<Patch>& trace) {
+    rword head = trace.front().metadata.address;
+    size_t patchEnd = 0, blocks = 0;
+
+    size_t r = searchRegion(head);
+    RequireAction("ExecBlockManager::writeTrace", r < regions.size() && regions[r].covered.contains(head) &&
+                  regions[r].sequenceCache.count(head) != 0, return false);
+    ExecRegion& region = regions[r];
+
+    // The trace is only flushed with the region of its head, it is truncated to the basic blocks
+    // covered by this region
+    for(size_t i = 0; i < trace.size(); i++) {
+        if(!region.covered.contains(Range<rword>(trace[i].metadata.address, trace[i].metadata.endAddress()))) {
+            break;
+        }
+        if(trace[i].metadata.modifyPC) {
+            patchEnd = i + 1;
+            blocks++;
+        }
+    }
+    if(blocks < 2) {
+        LogDebug("ExecBlockManager::writeTrace", "Trace 0x%" PRIRWORD " has less than two basic blocks in region %zu", head, r);
+        return false;
+    }
+    LogDebug("ExecBlockManager::writeTrace", "Writting new trace 0x%" PRIRWORD " of %zu basic blocks", head, blocks);
+
+    for(size_t i = 0; true; i++) {
+        if(i >= region.blocks.size()) {
+            region.blocks.push_back(new ExecBlock(assembly, vminstance));
+            cacheSize += region.blocks.back()->getMemorySize();
+        }
+        SeqWriteResult res = region.blocks[i]->writeSequence(trace.begin(), trace.begin() + patchEnd,
+                                                             static_cast<SeqType>(SeqType::Entry | SeqType::Exit | SeqType::Trace));
+        if(res.seqID != EXEC_BLOCK_FULL) {
+            // The trace replaces the sequence of its head basic block, the previous one is only
+            // kept for the instructions already mapped to it
+            SeqLoc& seqLoc = region.sequenceCache[head];
+            seqLoc.blockIdx = static_cast<uint16_t>(i);
+            seqLoc.seqID = res.seqID;
+            seqLoc.seqEnd = trace[res.patchWritten - 1].metadata.endAddress();
+            cacheSeqLookup(head, r, region.blocks[i], &seqLoc);
+            LogDebug("ExecBlockManager::writeTrace",
+                     "Trace 0x%" PRIRWORD "-0x%" PRIRWORD " written in ExecBlock %p as seqID %" PRIu16,
+                     head, seqLoc.seqEnd, region.blocks[i], res.seqID);
+            total_translation_size += res.bytesWritten;
+            break;
+        }
+    }
+    region.traces++;
+    // Counted once, whatever happens to the block of the trace later
+    retiredStats.traces++;
+    // The predecessors are chained to the trace when next dispatched
+    for(ExecBlock* block: region.blocks) {
+        block->unlinkAll();
+    }
+    updateRegionStat(r, 0);
+    region.lastUse = ++useClock;
+    enforceCacheBudget(r);
+    return true;
+}
+
+uint32_t ExecBlockManager::getExecutions(rword address) const {
+    size_t r = searchRegion(address);
+    if(r < regions.size() && regions[r].covered.contains(address)) {
+        const std::map<rword, SeqLoc>::const_iterator seqLoc = regions[r].sequenceCache.find(address);
+        if(seqLoc != regions[r].sequenceCache.end()) {
+            return regions[r].blocks[seqLoc->second.blockIdx]->getSeqExecutions(seqLoc->second.seqID);
+        }
+    }
+    return 0;
+}
+
+bool ExecBlockManager::getBranchCounts(rword address, rword* taken, rword* fallthrough) const {
+    size_t r = searchRegion(address);
+    if(r < regions.size() && regions[r].covered.contains(address)) {
+        const std::map<rword, SeqLoc>::const_iterator seqLoc = regions[r].sequenceCache.find(address);
+        if(seqLoc != regions[r].sequenceCache.end()) {
+            const ExecBlock* block = regions[r].blocks[seqLoc->second.blockIdx];
+            // The exit of a trace belongs to its last basic block
+            if((block->getSeqType(seqLoc->second.seqID) & SeqType::Trace) == 0) {
+                return block->getSeqBranchCounts(seqLoc->second.seqID, taken, fallthrough);
+            }
+        }
+    }
+    return false;
 }
 
 size_t ExecBlockManager::searchRegion(rword address) const {
@@ -301,7 +468,15 @@ size_t ExecBlockManager::findRegion(Range<rword> codeRange) {
         codeRange.start,
         codeRange.end
     );
-    regions.insert(regions.begin() + insert, ExecRegion {codeRange, 0, 0, std::vector<ExecBlock*>()});
+    // Inserting a region can move the existing ones and their caches
+    clearSeqLookup();
+    // Pending flushes refer to region indexes
+    for(size_t& f: flushList) {
+        if(f >= insert) {
+            f++;
+        }
+    }
+    regions.insert(regions.begin() + insert, ExecRegion {codeRange, 0, 0, useClock, instrGeneration, std::vector<ExecBlock*>()});
     return insert;
 }
 
@@ -622,21 +797,144 @@ const InstAnalysis* ExecBlockManager::analyzeInstMetadata(const InstMetadata* in
 }
 
 
+void ExecBlockManager::cacheSeqLookup(rword address, size_t r, ExecBlock* block, const SeqLoc* seqLoc) {
+    SeqLookupEntry& entry = seqLookup[seqLookupIndex(address)];
+    entry.address = address;
+    entry.regionIdx = r;
+    entry.block = block;
+    entry.seqLoc = seqLoc;
+}
+
+void ExecBlockManager::clearSeqLookup() {
+    std::fill(seqLookup.begin(), seqLookup.end(), SeqLookupEntry {0, 0, nullptr, nullptr});
+}
+
+void ExecBlockManager::enforceCacheBudget(size_t live) {
+    // The regions already evicted are still counted until the next flushCommit
+    if(cacheBudget == 0 || cacheSize <= cacheBudget + evictedSize) {
+        return;
+    }
+    // Evicting below the budget amortizes the sort of the regions over the next translations
+    size_t lowWater = cacheBudget / 4 * CACHE_BUDGET_LOW_WATER;
+    // Regions already scheduled for flushing will be freed anyway
+    std::vector<bool> flushed(regions.size(), false);
+    for(size_t r: flushList) {
+        flushed[r] = true;
+    }
+    size_t remaining = 0;
+    std::vector<size_t> candidates;
+    for(size_t r = 0; r < regions.size(); r++) {
+        if(flushed[r]) {
+            continue;
+        }
+        for(ExecBlock* block: regions[r].blocks) {
+            remaining += block->getMemorySize();
+        }
+        if(r != live) {
+            candidates.push_back(r);
+        }
+    }
+    // Evict the least recently used regions first
+    std::sort(candidates.begin(), candidates.end(), [this](size_t a, size_t b) {
+        return regions[a].lastUse < regions[b].lastUse;
+    });
+    for(size_t r: candidates) {
+        if(remaining <= lowWater) {
+            break;
+        }
+        LogDebug("ExecBlockManager::enforceCacheBudget", "Evicting region %zu [0x%" PRIRWORD ", 0x%" PRIRWORD "]",
+                 r, regions[r].covered.start, regions[r].covered.end);
+        // The region may hold the current sequence, the erase is deferred to the next flushCommit
+        flushList.push_back(r);
+        for(ExecBlock* block: regions[r].blocks) {
+            remaining -= block->getMemorySize();
+            evictedSize += block->getMemorySize();
+            block->unlinkAll();
+        }
+    }
+}
+
 void ExecBlockManager::eraseRegion(size_t r) {
     LogDebug("ExecBlockManager::eraseRegion", "Erasing region %zu [0x%" PRIRWORD ", 0x%" PRIRWORD "]",
              r, regions[r].covered.start, regions[r].covered.end);
+    // The lookup cache references the blocks and sequences of the region
+    clearSeqLookup();
     // Delete cached blocks
     for(ExecBlock* block: regions[r].blocks) {
         LogDebug("ExecBlockManager::eraseRegion", "Dropping ExecBlock %p", block);
+        cacheSize -= block->getMemorySize();
+        addBlockStats(&retiredStats, block);
         delete block;
     }
     // Delete cached analysis
     for(std::pair<rword, InstAnalysis*> analysis: regions[r].analysisCache) {
         freeInstAnalysis(analysis.second);
     }
+    if(regions[r].instrGeneration != instrGeneration) {
+        staleRegions--;
+        if(staleRegions == 0) {
+            instrChanges.clear();
+        }
+    }
     regions.erase(regions.begin() + r);
 }
 
+void ExecBlockManager::invalidateInstrumentation(const std::shared_ptr<InstrRule>& rule) {
+    LogDebug("ExecBlockManager::invalidateInstrumentation", "Instrumentation generation %" PRIu32 " affects %zu regions",
+             instrGeneration + 1, regions.size());
+    // Every region is now older than the instrumentation and is checked when next dispatched
+    instrGeneration++;
+    instrChanges.push_back(InstrChange {instrGeneration, rule});
+    // The regions which are never dispatched again would keep the changes forever
+    if(instrChanges.size() > INSTR_CHANGES_MAX) {
+        instrChanges.erase(instrChanges.begin(), instrChanges.end() - INSTR_CHANGES_MAX);
+    }
+    staleRegions = regions.size();
+    // Chained sequences would not go through the dispatch
+    unlinkAll();
+}
+
+void ExecBlockManager::revalidate(rword address) {
+    if(staleRegions == 0) {
+        return;
+    }
+    size_t r = searchRegion(address);
+    if(r >= regions.size() || !regions[r].covered.contains(address) || regions[r].instrGeneration == instrGeneration) {
+        return;
+    }
+    ExecRegion& region = regions[r];
+    // Some of the changes since the translation of the region were dropped
+    if(region.instrGeneration + 1 < instrChanges.front().generation) {
+        LogDebug("ExecBlockManager::revalidate", "Region %zu [0x%" PRIRWORD ", 0x%" PRIRWORD "] missed too many instrumentation changes",
+                 r, region.covered.start, region.covered.end);
+        flushList.push_back(r);
+        return;
+    }
+    // Only the rules changed since the translation of the region can modify its instrumentation
+    for(const InstrChange& change: instrChanges) {
+        if(change.generation <= region.instrGeneration || !change.rule->affectedRange().overlaps(region.covered)) {
+            continue;
+        }
+        for(ExecBlock* block: region.blocks) {
+            for(uint16_t instID = 0; instID < block->getNextInstID(); instID++) {
+                if(change.rule->canBeApplied(*block->getInstMetadata(instID), &MCII)) {
+                    LogDebug("ExecBlockManager::revalidate", "Region %zu [0x%" PRIRWORD ", 0x%" PRIRWORD "] needs a retranslation",
+                             r, region.covered.start, region.covered.end);
+                    flushList.push_back(r);
+                    return;
+                }
+            }
+        }
+    }
+    LogDebug("ExecBlockManager::revalidate", "Region %zu [0x%" PRIRWORD ", 0x%" PRIRWORD "] is not affected by the instrumentation changes",
+             r, region.covered.start, region.covered.end);
+    region.instrGeneration = instrGeneration;
+    staleRegions--;
+    if(staleRegions == 0) {
+        instrChanges.clear();
+    }
+}
+
 void ExecBlockManager::clearCache(RangeSet<rword> rangeSet) {
     const std::vector<Range<rword>>& ranges = rangeSet.getRanges();
     for(Range<rword> r: ranges) {
@@ -658,6 +956,7 @@ void ExecBlockManager::flushCommit() {
             eraseRegion(r);
         }
         flushList.clear();
+        evictedSize = 0;
         // Clear global cache
         for(std::pair<rword, InstAnalysis*> analysis: analysisCache) {
             freeInstAnalysis(analysis.second);
@@ -672,8 +971,69 @@ void ExecBlockManager::clearCache(Range<rword> range) {
     for(i = 0; i < regions.size(); i++) {
         if(regions[i].covered.overlaps(range)) {
             flushList.push_back(i);
+            // Chained sequences must return to the host for the flush to be committed
+            for(ExecBlock* block: regions[i].blocks) {
+                block->unlinkAll();
+            }
+        }
+    }
+}
+
+void ExecBlockManager::unlinkAll() {
+    LogDebug("ExecBlockManager::unlinkAll", "Unlinking all sequences");
+    for(ExecRegion& region: regions) {
+        for(ExecBlock* block: region.blocks) {
+            block->unlinkAll();
+        }
+    }
+}
+
+void ExecBlockManager::clearTraces() {
+    LogDebug("ExecBlockManager::clearTraces", "Erasing the regions containing traces");
+    for(size_t i = 0; i < regions.size(); i++) {
+        if(regions[i].traces != 0) {
+            flushList.push_back(i);
+            for(ExecBlock* block: regions[i].blocks) {
+                block->unlinkAll();
+            }
+        }
+    }
+}
+
+void ExecBlockManager::clearBasicBlocks(RangeSet<rword> rangeSet) {
+    for(size_t i = 0; i < regions.size(); i++) {
+        ExecRegion& region = regions[i];
+        if(!rangeSet.overlaps(region.covered)) {
+            continue;
+        }
+        LogDebug("ExecBlockManager::clearBasicBlocks", "Dropping basic blocks of region %zu [0x%" PRIRWORD ", 0x%" PRIRWORD "]",
+                 i, region.covered.start, region.covered.end);
+        // The basic blocks included in a trace are not known, the whole region is retranslated
+        if(region.traces != 0) {
+            clearCache(region.covered);
+            continue;
+        }
+        // The sequences of the basic blocks are removed from the caches, their code is left
+        // unused in the ExecBlocks until the region is erased
+        RangeSet<rword> dropped;
+        for(std::map<rword, SeqLoc>::iterator it = region.sequenceCache.begin(); it != region.sequenceCache.end();) {
+            Range<rword> basicBlock(it->second.bbStart, it->second.bbEnd);
+            if(rangeSet.overlaps(basicBlock)) {
+                dropped.add(basicBlock);
+                it = region.sequenceCache.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        for(const Range<rword>& r: dropped.getRanges()) {
+            region.instCache.erase(region.instCache.lower_bound(r.start), region.instCache.lower_bound(r.end));
+        }
+        for(ExecBlock* block: region.blocks) {
+            block->unlinkAll();
         }
     }
+    clearSeqLookup();
 }
 
 void ExecBlockManager::clearCache() {
@@ -681,6 +1041,8 @@ void ExecBlockManager::clearCache() {
     while(regions.size() > 0) {
         eraseRegion(regions.size() - 1);
     }
+    flushList.clear();
+    evictedSize = 0;
 }
 
 }
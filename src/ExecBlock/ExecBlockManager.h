@@ -20,6 +20,7 @@
 
 #include <algorithm>
 #include <map>
+#include <memory>
 #include <vector>
 
 #include "Context.h"
@@ -32,6 +33,7 @@
 namespace QBDI {
 
 class RelocatableInst;
+class InstrRule;
 
 struct InstLoc {
     uint16_t blockIdx;
@@ -47,14 +49,39 @@ struct SeqLoc {
     rword seqEnd;
 };
 
+struct SeqLookupEntry {
+    rword           address;
+    size_t          regionIdx;
+    ExecBlock*      block;
+    const SeqLoc*   seqLoc;
+};
+
+// Number of entries of the direct mapped sequence lookup cache, must be a power of two
+static const size_t SEQ_LOOKUP_SIZE = 4096;
+
+// Once over budget, the cache is evicted down to this fraction of the budget, in quarters
+static const size_t CACHE_BUDGET_LOW_WATER = 3;
+
+// Maximum number of instrumentation changes checked when a stale region is dispatched, the regions
+// older than the dropped changes are retranslated instead
+static const size_t INSTR_CHANGES_MAX = 32;
+
+struct InstrChange {
+    uint32_t                    generation;
+    std::shared_ptr<InstrRule>  rule;
+};
+
 struct ExecRegion {
     Range<rword>                    covered;
     unsigned                        translated; 
     unsigned                        available;
+    uint64_t                        lastUse;
+    uint32_t                        instrGeneration;
     std::vector<ExecBlock*>         blocks;
     std::map<rword, SeqLoc>         sequenceCache;
     std::map<rword, InstLoc>        instCache;
     std::map<rword, InstAnalysis*>  analysisCache;
+    unsigned                        traces;
 };
 
 class ExecBlockManager {
@@ -63,8 +90,17 @@ private:
     std::vector<ExecRegion>         regions;
     std::map<rword, InstAnalysis*>  analysisCache;
     std::vector<size_t>             flushList;
+    std::vector<SeqLookupEntry>     seqLookup;
+    std::vector<InstrChange>        instrChanges;
     rword                           total_translated_size;
     rword                           total_translation_size;
+    size_t                          cacheBudget;
+    size_t                          cacheSize;
+    size_t                          evictedSize;
+    uint64_t                        useClock;
+    uint32_t                        instrGeneration;
+    size_t                          staleRegions;
+    CacheStats                      retiredStats;
 
     VMInstanceRef              vminstance;
     llvm::MCInstrInfo&         MCII;
@@ -73,6 +109,16 @@ private:
 
     void eraseRegion(size_t r);
 
+    static inline size_t seqLookupIndex(rword address) {
+        return static_cast<size_t>(address ^ (address >> 12)) & (SEQ_LOOKUP_SIZE - 1);
+    }
+
+    void cacheSeqLookup(rword address, size_t r, ExecBlock* block, const SeqLoc* seqLoc);
+
+    void clearSeqLookup();
+
+    void enforceCacheBudget(size_t live);
+
     size_t searchRegion(rword start) const;
 
     size_t findRegion(Range<rword> codeRange);
@@ -90,18 +136,44 @@ public:
 
     void printCacheStatistics(FILE* output) const;
 
-    ExecBlock* getProgrammedExecBlock(rword address);
+    void getCacheStats(CacheStats* stats) const;
+
+    std::vector<TargetCacheStats> getTargetCacheStats() const;
+
+    ExecBlock* getProgrammedExecBlock(rword address, const SeqLoc** programmedSeqLoc = nullptr);
 
     const SeqLoc* getSeqLoc(rword address) const;
 
+    bool isCached(rword address) const;
+
     void writeBasicBlock(const std::vector<Patch>& basicBlock);
 
+    bool writeTrace(const std::vector<Patch>& trace);
+
+    uint32_t getExecutions(rword address) const;
+
+    bool getBranchCounts(rword address, rword* taken, rword* fallthrough) const;
+
     const InstAnalysis* analyzeInstMetadata(const InstMetadata* instMetadata, AnalysisType type);
 
     bool isFlushPending() { return this->flushList.size() > 0; }
 
+    void invalidateInstrumentation(const std::shared_ptr<InstrRule>& rule);
+
+    void revalidate(rword address);
+
+    void setCacheBudget(size_t budget) { this->cacheBudget = budget; }
+
+    size_t getCacheSize() const { return this->cacheSize; }
+
     void flushCommit();
 
+    void unlinkAll();
+
+    void clearTraces();
+
+    void clearBasicBlocks(RangeSet<rword> rangeSet);
+
     void clearCache();
 
     void clearCache(Range<rword> range);
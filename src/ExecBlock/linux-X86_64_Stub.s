@@ -19,9 +19,45 @@
 
 .text
 
+.globl __qbdi_runCodeBlockGPR
 .globl __qbdi_runCodeBlockSSE
 .globl __qbdi_runCodeBlockAVX
 
+__qbdi_runCodeBlockGPR:
+    mov rdx, rsp;
+    and rsp, -16;
+    push r15;
+    push r14;
+    push r13;
+    push r12;
+    push r11;
+    push r10;
+    push r9;
+    push r8;
+    push rdi;
+    push rsi;
+    push rdx;
+    push rcx;
+    push rbx;
+    push rax;
+    call rdi;
+    pop rax;
+    pop rbx;
+    pop rcx;
+    pop rdx;
+    pop rsi;
+    pop rdi;
+    pop r8;
+    pop r9;
+    pop r10;
+    pop r11;
+    pop r12;
+    pop r13;
+    pop r14;
+    pop r15;
+    mov rsp, rdx;
+    ret;
+
 __qbdi_runCodeBlockSSE:
     mov rdx, rsp;
     sub rsp, 512;
@@ -19,9 +19,20 @@
 
 .text
 
+.globl __qbdi_runCodeBlockGPR
 .globl __qbdi_runCodeBlockSSE
 .globl __qbdi_runCodeBlockAVX
 
+__qbdi_runCodeBlockGPR:
+    mov eax, [esp+4]
+    mov edx, esp;
+    and esp, -16;
+    pushad;
+    call eax;
+    popad;
+    mov esp, edx;
+    ret;
+
 __qbdi_runCodeBlockSSE:
     mov eax, [esp+4]
     mov edx, esp;
@@ -14,11 +14,48 @@
 ; See the License for the specific language governing permissions and
 ; limitations under the License.
 
+PUBLIC qbdi_runCodeBlockGPR
 PUBLIC qbdi_runCodeBlockSSE
 PUBLIC qbdi_runCodeBlockAVX
 
 .CODE
 
+qbdi_runCodeBlockGPR PROC
+    mov rdx, rsp;
+    and rsp, -16;
+    push r15;
+    push r14;
+    push r13;
+    push r12;
+    push r11;
+    push r10;
+    push r9;
+    push r8;
+    push rdi;
+    push rsi;
+    push rdx;
+    push rcx;
+    push rbx;
+    push rax;
+    call rcx;
+    pop rax;
+    pop rbx;
+    pop rcx;
+    pop rdx;
+    pop rsi;
+    pop rdi;
+    pop r8;
+    pop r9;
+    pop r10;
+    pop r11;
+    pop r12;
+    pop r13;
+    pop r14;
+    pop r15;
+    mov rsp, rdx;
+    ret;
+qbdi_runCodeBlockGPR ENDP
+
 qbdi_runCodeBlockSSE PROC
     mov rdx, rsp;
     sub rsp, 512;
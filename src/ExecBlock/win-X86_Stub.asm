@@ -20,11 +20,23 @@
 
 _TEXT segment
 
+PUBLIC qbdi_runCodeBlockGPR
 PUBLIC qbdi_runCodeBlockSSE
 PUBLIC qbdi_runCodeBlockAVX
 
 .CODE
 
+qbdi_runCodeBlockGPR PROC
+    mov eax, [esp+4];
+    mov edx, esp;
+    and esp, -16;
+    pushad;
+    call eax;
+    popad;
+    mov esp, edx;
+    ret;
+qbdi_runCodeBlockGPR ENDP
+
 qbdi_runCodeBlockSSE PROC
     mov eax, [esp+4];
     mov edx, esp;
@@ -22,6 +22,8 @@ namespace QBDI {
 ExecBroker::ExecBroker(Assembly& assembly, VMInstanceRef vminstance) :
     transferBlock(assembly, vminstance) {
     pageSize = llvm::sys::Process::getPageSize();
+    // Native code is executed by the transfer block
+    transferBlock.requireFPR();
 }
 
 void ExecBroker::addInstrumentedRange(const Range<rword>& r) {
@@ -49,4 +49,9 @@ unsigned getImmediateSize(const llvm::MCInst* inst, const llvm::MCInstrDesc* des
     return sizeof(rword);
 }
 
+bool useFPR(const llvm::MCInst* inst, const llvm::MCInstrInfo* MCII, const llvm::MCRegisterInfo* MRI) {
+    // The ARM ExecBlock always switches the FPR
+    return true;
+}
+
 };
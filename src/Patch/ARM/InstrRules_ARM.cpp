@@ -16,14 +16,15 @@
  * limitations under the License.
  */
 #include "Patch/ARM/InstrRules_ARM.h"
+#include "Utility/LogSys.h"
 
 namespace QBDI {
 
 /* Genreate a series of RelocatableInst which when appended to an instrumentation code trigger a 
  * break to host. It receive in argument a temporary reg which will be used for computations then 
- * finally restored.
+ * finally restored. Fast callbacks are not supported and always break to the host.
 */
-RelocatableInst::SharedPtrVec getBreakToHost(Reg temp) {
+RelocatableInst::SharedPtrVec getBreakToHost(Reg temp, bool fastCallback, bool callbackState) {
     RelocatableInst::SharedPtrVec breakToHost;
 
     // Use the temporary register to compute PC + 16 which is the address which will follow this 
@@ -40,4 +41,11 @@ RelocatableInst::SharedPtrVec getBreakToHost(Reg temp) {
     return breakToHost;
 }
 
+/* Memory accesses are not instrumented on ARM, the memory filters can't be used.
+*/
+RelocatableInst::SharedPtrVec getFilteredBreakToHost(const MemoryFilter* filter, TempManager* temp_manager, bool setPC, rword pc) {
+    RequireAction("getFilteredBreakToHost", false && "Memory filters are not supported on ARM", abort());
+    return {};
+}
+
 }
@@ -30,7 +30,12 @@
 
 namespace QBDI {
 
-RelocatableInst::SharedPtrVec getBreakToHost(Reg temp);
+class MemoryFilter;
+class TempManager;
+
+RelocatableInst::SharedPtrVec getBreakToHost(Reg temp, bool fastCallback = false, bool callbackState = true);
+
+RelocatableInst::SharedPtrVec getFilteredBreakToHost(const MemoryFilter* filter, TempManager* temp_manager, bool setPC, rword pc);
 
 }
 
@@ -130,6 +130,20 @@ llvm::MCInst add(unsigned int dst, unsigned int src) {
     return inst;
 }
 
+llvm::MCInst addri(unsigned int dst, unsigned int src, rword imm) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::ARM::ADDri);
+    inst.addOperand(llvm::MCOperand::createReg(dst));
+    inst.addOperand(llvm::MCOperand::createReg(src));
+    inst.addOperand(llvm::MCOperand::createImm(imm));
+    inst.addOperand(llvm::MCOperand::createImm(14));
+    inst.addOperand(llvm::MCOperand::createReg(0));
+    inst.addOperand(llvm::MCOperand::createReg(0));
+
+    return inst;
+}
+
 RelocatableInst::SharedPtr Str(Reg reg, Reg base, Offset offset) {
     return NoReloc(stri12(reg, base, offset));
 }
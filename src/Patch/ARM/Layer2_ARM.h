@@ -37,6 +37,8 @@ llvm::MCInst mov(unsigned int dst, unsigned int src);
 
 llvm::MCInst add(unsigned int dst, unsigned int src);
 
+llvm::MCInst addri(unsigned int dst, unsigned int src, rword imm);
+
 llvm::MCInst pop(unsigned int reg, int64_t cond);
 
 llvm::MCInst push(unsigned int reg, int64_t cond);
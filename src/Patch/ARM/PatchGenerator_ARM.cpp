@@ -129,4 +129,18 @@ RelocatableInst::SharedPtrVec SimulatePopPC::generate(const llvm::MCInst *inst,
     return patch;
 }
 
+RelocatableInst::SharedPtrVec IncrementCounter::generate(const llvm::MCInst *inst,
+    rword address, rword instSize, TempManager *temp_manager, const Patch *toMerge) {
+    rword* counter = counters->getCounter(address);
+    Reg counterReg = temp_manager->getRegForTemp(temp);
+    Reg valueReg = temp_manager->getRegForTemp(value);
+
+    return {
+        Ldr(counterReg, Constant(reinterpret_cast<rword>(counter))),
+        NoReloc(ldri12(valueReg, counterReg, 0)),
+        NoReloc(addri(valueReg, valueReg, 1)),
+        NoReloc(stri12(valueReg, counterReg, 0)),
+    };
+}
+
 }
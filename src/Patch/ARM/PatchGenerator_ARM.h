@@ -23,6 +23,7 @@
 #include "Patch/RelocatableInst.h"
 #include "Patch/ARM/RelocatableInst_ARM.h"
 #include "Patch/PatchGenerator.h"
+#include "Patch/CounterArray.h"
 
 namespace QBDI {
 
@@ -301,6 +302,33 @@ public:
     bool modifyPC() {return true;}
 };
 
+class IncrementCounter : public PatchGenerator, public AutoAlloc<PatchGenerator, IncrementCounter> {
+    Temp          temp;
+    Temp          value;
+    CounterArray* counters;
+
+public:
+
+    /*! Increment the counter of the current instruction address in a counter array. The counter
+     * is allocated when the instruction is instrumented. The increment doesn't modify the flags.
+     *
+     * @param[in] temp      Any unused temporary, overwritten by this generator.
+     * @param[in] value     Any unused temporary, overwritten by this generator.
+     * @param[in] counters  The counter array which holds the counter.
+    */
+    IncrementCounter(Temp temp, Temp value, CounterArray* counters) : temp(temp), value(value), counters(counters) {}
+
+    /*! Output:
+     *
+     * LDR REG32 temp, MEM32 Shadow(IMM32 counter)
+     * LDR REG32 value, MEM32 [temp]
+     * ADD REG32 value, REG32 value, IMM32 1
+     * STR MEM32 [temp], REG32 value
+    */
+    RelocatableInst::SharedPtrVec generate(const llvm::MCInst *inst,
+        rword address, rword instSize, TempManager *temp_manager, const Patch *toMerge);
+};
+
 }
 
 #endif
@@ -253,6 +253,11 @@ PatchRule::SharedPtrVec getDefaultPatchRules() {
     return rules;
 }
 
+// Fast callbacks are not supported on ARM, they break to the host like regular callbacks
+RelocatableInst::SharedPtrVec getFastCallbackTrampoline(rword dispatcher, bool state) {
+    return {};
+}
+
 // Patch allowing to terminate a basic block early by writing address into DataBlock[Offset(PC)]
 RelocatableInst::SharedPtrVec getTerminator(rword address) {
     RelocatableInst::SharedPtrVec terminator;
@@ -265,4 +270,39 @@ RelocatableInst::SharedPtrVec getTerminator(rword address) {
     return terminator;
 }
 
+// Sequence chaining is not supported on ARM: no static successor is ever reported and
+// sequences always exit through the epilogue.
+std::vector<rword> getChainTargets(const InstMetadata& metadata) {
+    return {};
+}
+
+RelocatableInst::SharedPtrVec getChainExit(const InstMetadata& metadata, uint16_t instID, const std::vector<Offset>& slots,
+                                           const std::vector<Offset>& counters) {
+    return JmpEpilogue();
+}
+
+RelocatableInst::SharedPtrVec getSideExit(const InstMetadata& metadata, uint16_t instID, rword next, Offset slot) {
+    return JmpEpilogue();
+}
+
+RelocatableInst::SharedPtrVec getTargetCacheExit(uint16_t instID, Offset cache, Offset hits, Offset misses) {
+    return JmpEpilogue();
+}
+
+rword getReturnAddress(const InstMetadata& metadata) {
+    return 0;
+}
+
+bool isReturn(const InstMetadata& metadata) {
+    return false;
+}
+
+RelocatableInst::SharedPtrVec getReturnStackPush(Offset top, Offset entries, Offset record) {
+    return {};
+}
+
+RelocatableInst::SharedPtrVec getReturnStackCheck(uint16_t instID, Offset top, Offset entries) {
+    return {};
+}
+
 }
@@ -29,12 +29,55 @@ class PatchRule;
 
 static const uint32_t MINIMAL_BLOCK_SIZE = 32;
 
+// Indirect branch target cache is not supported on ARM
+static const uint32_t TARGET_CACHE_SIZE = 256;
+
+static const uint32_t TARGET_CACHE_EXIT_SIZE = 0;
+
+static const uint32_t CONDITIONAL_EXIT_SIZE = 0;
+
+// Shadow return stack is not supported on ARM
+static const bool SHADOW_RETURN_STACK = false;
+
+static const uint32_t RETURN_STACK_SIZE = 256;
+
+static const uint32_t RETURN_STACK_PUSH_SIZE = 0;
+
+static const uint32_t RETURN_STACK_CHECK_SIZE = 0;
+
+// Lazy FPR switching is not supported on ARM
+static const bool LAZY_FPR = false;
+
+// Trace formation is not supported on ARM
+static const uint32_t TRACE_THRESHOLD = 32;
+
+static const uint32_t TRACE_MAX_BLOCKS = 1;
+
 RelocatableInst::SharedPtrVec getExecBlockPrologue();
 
 RelocatableInst::SharedPtrVec getExecBlockEpilogue();
 
+RelocatableInst::SharedPtrVec getFastCallbackTrampoline(rword dispatcher, bool state);
+
 RelocatableInst::SharedPtrVec getTerminator(rword address);
 
+std::vector<rword> getChainTargets(const InstMetadata& metadata);
+
+RelocatableInst::SharedPtrVec getChainExit(const InstMetadata& metadata, uint16_t instID, const std::vector<Offset>& slots,
+                                           const std::vector<Offset>& counters);
+
+RelocatableInst::SharedPtrVec getSideExit(const InstMetadata& metadata, uint16_t instID, rword next, Offset slot);
+
+RelocatableInst::SharedPtrVec getTargetCacheExit(uint16_t instID, Offset cache, Offset hits, Offset misses);
+
+rword getReturnAddress(const InstMetadata& metadata);
+
+bool isReturn(const InstMetadata& metadata);
+
+RelocatableInst::SharedPtrVec getReturnStackPush(Offset top, Offset entries, Offset record);
+
+RelocatableInst::SharedPtrVec getReturnStackCheck(uint16_t instID, Offset top, Offset entries);
+
 std::vector<std::shared_ptr<PatchRule>> getDefaultPatchRules();
 
 
@@ -22,7 +22,7 @@
 
 namespace QBDI {
 
-class MemoryConstant: public RelocatableInst, public AutoAlloc<RelocatableInst, MemoryConstant> {
+class MemoryConstant: public RelocatableInst, public ArenaAutoAlloc<RelocatableInst, MemoryConstant> {
     unsigned int opn;
     rword        value;
 
@@ -41,7 +41,7 @@ public:
     }
 };
 
-class HostPCRel : public RelocatableInst, public AutoAlloc<RelocatableInst, HostPCRel> {
+class HostPCRel : public RelocatableInst, public ArenaAutoAlloc<RelocatableInst, HostPCRel> {
     unsigned int opn;
     rword        offset;
 
@@ -59,7 +59,7 @@ public:
     }
 };
 
-class InstId : public RelocatableInst, public AutoAlloc<RelocatableInst, InstId> {
+class InstId : public RelocatableInst, public ArenaAutoAlloc<RelocatableInst, InstId> {
     unsigned int opn;
 
 public:
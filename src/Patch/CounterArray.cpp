@@ -0,0 +1,64 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <algorithm>
+
+#include "Patch/CounterArray.h"
+#include "Utility/LogSys.h"
+
+namespace QBDI {
+
+rword* CounterArray::getCounter(rword address) {
+    std::map<rword, size_t>::const_iterator it = index.find(address);
+    if(it != index.end()) {
+        return &chunks[it->second / COUNTER_CHUNK_SIZE][it->second % COUNTER_CHUNK_SIZE];
+    }
+    size_t idx = index.size();
+    // The existing counters are referenced by the instrumented code, a new chunk is added
+    if(idx / COUNTER_CHUNK_SIZE >= chunks.size()) {
+        LogDebug("CounterArray::getCounter", "Allocating counter chunk %zu", chunks.size());
+        chunks.push_back(std::unique_ptr<rword[]>(new rword[COUNTER_CHUNK_SIZE]()));
+    }
+    index[address] = idx;
+    return &chunks[idx / COUNTER_CHUNK_SIZE][idx % COUNTER_CHUNK_SIZE];
+}
+
+const rword* CounterArray::getCounters(size_t idx, size_t* size) const {
+    if(idx >= index.size()) {
+        *size = 0;
+        return nullptr;
+    }
+    *size = std::min(COUNTER_CHUNK_SIZE - idx % COUNTER_CHUNK_SIZE, index.size() - idx);
+    return &chunks[idx / COUNTER_CHUNK_SIZE][idx % COUNTER_CHUNK_SIZE];
+}
+
+bool CounterArray::getIndex(rword address, size_t* idx) const {
+    std::map<rword, size_t>::const_iterator it = index.find(address);
+    if(it == index.end()) {
+        return false;
+    }
+    *idx = it->second;
+    return true;
+}
+
+void CounterArray::reset() {
+    for(const std::unique_ptr<rword[]>& chunk: chunks) {
+        std::fill(chunk.get(), chunk.get() + COUNTER_CHUNK_SIZE, 0);
+    }
+}
+
+}
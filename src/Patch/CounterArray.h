@@ -0,0 +1,80 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef COUNTERARRAY_H
+#define COUNTERARRAY_H
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "State.h"
+
+namespace QBDI {
+
+// Number of counters of a chunk of a CounterArray, the chunks are never reallocated
+static const size_t COUNTER_CHUNK_SIZE = 4096;
+
+/*! Execution counters of a counter registration, incremented directly by the instrumented code.
+ *  Each counted address is given a slot the first time it is instrumented and keeps it for the
+ *  life of the array, such that the counts survive the retranslations of the code. The array
+ *  grows by chunks which never move, as the address of the counters is written in the code.
+ */
+class CounterArray {
+private:
+
+    std::vector<std::unique_ptr<rword[]>>   chunks;
+    std::map<rword, size_t>                 index;
+
+public:
+
+    /*! Obtain the counter of an address, allocating a new one if needed.
+     *
+     * @param[in] address  The counted address.
+     *
+     * @return A pointer to the counter.
+     */
+    rword* getCounter(rword address);
+
+    /*! Obtain the counters starting at an index, without copying them. The pointer stays valid
+     *  for the life of the array.
+     *
+     * @param[in]  idx   The index of the first counter.
+     * @param[out] size  Will be set to the number of consecutive counters in the same chunk, 0 if
+     *                   the index is not in use.
+     *
+     * @return A pointer to the counter of the index, or nullptr if the index is not in use.
+     */
+    const rword* getCounters(size_t idx, size_t* size) const;
+
+    /*! Obtain the index of the counter of an address in the counter array.
+     *
+     * @param[in]  address  The counted address.
+     * @param[out] idx      Will be set to the index of the counter.
+     *
+     * @return True if the address has a counter.
+     */
+    bool getIndex(rword address, size_t* idx) const;
+
+    /*! Set all the counters to zero, the slots stay allocated.
+     */
+    void reset();
+};
+
+}
+
+#endif // COUNTERARRAY_H
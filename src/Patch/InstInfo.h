@@ -16,6 +16,8 @@
  * limitations under the License.
  */
 #include <stdint.h>
+#include "llvm/MC/MCInstrInfo.h"
+#include "llvm/MC/MCRegisterInfo.h"
 #include "Patch/Types.h"
 
 #ifndef INSTINFO_H
@@ -31,6 +33,8 @@ bool isStackWrite(const llvm::MCInst* inst);
 
 unsigned getImmediateSize(const llvm::MCInst* inst, const llvm::MCInstrDesc* desc);
 
+bool useFPR(const llvm::MCInst* inst, const llvm::MCInstrInfo* MCII, const llvm::MCRegisterInfo* MRI);
+
 };
 
 #endif // INSTCLASSES_H
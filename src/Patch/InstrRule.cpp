@@ -16,12 +16,29 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+
+#include "Patch/InstInfo.h"
 #include "Patch/InstrRule.h"
+#include "Patch/InstrRules.h"
+#include "Patch/MemoryFilter.h"
+#include "Utility/LogSys.h"
 
 namespace QBDI {
 
+// The filter only catches the accesses starting at most MEMORY_FILTER_MAX_ACCESS bytes before a
+// watched range, the accesses of an unknown size or larger than that can't be filtered.
+static bool isFilterable(const llvm::MCInst* inst) {
+    unsigned int size = std::max(getReadSize(inst), getWriteSize(inst));
+    return size > 0 && size <= MEMORY_FILTER_MAX_ACCESS;
+}
+
 bool InstrRule::canBeApplied(const Patch &patch, llvm::MCInstrInfo* MCII) {
-    return condition->test(&patch.metadata.inst, patch.metadata.address, patch.metadata.instSize, MCII);
+    return canBeApplied(patch.metadata, MCII);
+}
+
+bool InstrRule::canBeApplied(const InstMetadata &metadata, llvm::MCInstrInfo* MCII) {
+    return condition->test(&metadata.inst, metadata.address, metadata.instSize, MCII);
 }
 
 void InstrRule::instrument(Patch &patch, llvm::MCInstrInfo* MCII, llvm::MCRegisterInfo* MRI) {
@@ -32,13 +49,49 @@ void InstrRule::instrument(Patch &patch, llvm::MCInstrInfo* MCII, llvm::MCRegist
     RelocatableInst::SharedPtrVec instru;
     TempManager tempManager(&patch.metadata.inst, MCII, MRI);
 
+    // Without break to host the registers dead across the instruction are used first as
+    // temporaries, they are neither saved nor restored.
+    if(!breakToHost) {
+        tempManager.setLiveness(patch.deadRegisters, patch.deadFlags);
+    }
+
+    // Accesses which can't be filtered always call the filter callback
+    PatchGenerator::SharedPtrVec generators = patchGen;
+    bool filtered = filter != nullptr;
+    if(filtered && !isFilterable(&patch.metadata.inst)) {
+        generators = getCallbackGenerator(filter->getCallback(), filter->getData());
+        filtered = false;
+    }
+
     // Generate the instrumentation code from the original instruction context
-    for(PatchGenerator::SharedPtr& g : patchGen) {
+    for(PatchGenerator::SharedPtr& g : generators) {
         append(instru,
             g->generate(&patch.metadata.inst, patch.metadata.address, patch.metadata.instSize, &tempManager, nullptr)
         );
     }
 
+    // A filtered break to host sets the callback and PC only if the address passes the filter and
+    // handles the restoration of the temporary registers itself.
+    if(filtered) {
+        bool setPC = position == InstPosition::PREINST || patch.metadata.modifyPC == false;
+        rword pc = patch.metadata.address;
+        if(position == InstPosition::POSTINST) {
+            pc += patch.metadata.instSize;
+        }
+        append(instru, getFilteredBreakToHost(filter, &tempManager, setPC, pc));
+        Reg::Vec usedRegisters = tempManager.getUsedRegisters();
+        for(uint32_t i = 0; i < usedRegisters.size(); i++) {
+            prepend(instru, SaveReg(usedRegisters[i], Offset(usedRegisters[i])));
+        }
+        if(position == PREINST) {
+            patch.prepend(instru);
+        }
+        else if(position == POSTINST) {
+            patch.append(instru);
+        }
+        return;
+    }
+
     // In case we break to the host, we need to ensure the value of PC in the context is
     // correct. This value needs to be set when instrumenting before the instruction or when
     // instrumenting after an instruction which does not set PC.
@@ -86,7 +139,7 @@ void InstrRule::instrument(Patch &patch, llvm::MCInstrInfo* MCII, llvm::MCRegist
         tempManager.getRegForTemp(Temp(0));
     }
     // Prepend the temporary register saving code to the instrumentation
-    Reg::Vec usedRegisters = tempManager.getUsedRegisters();
+    Reg::Vec usedRegisters = tempManager.getSavedRegisters();
     for(uint32_t i = 0; i < usedRegisters.size(); i++) {
         prepend(instru, SaveReg(usedRegisters[i], Offset(usedRegisters[i])));
     }
@@ -97,7 +150,7 @@ void InstrRule::instrument(Patch &patch, llvm::MCInstrInfo* MCII, llvm::MCRegist
         for(uint32_t i = 1; i < usedRegisters.size(); i++) {
             append(instru, LoadReg(usedRegisters[i], Offset(usedRegisters[i])));
         }
-        append(instru, getBreakToHost(usedRegisters[0]));
+        append(instru, getBreakToHost(usedRegisters[0], fastCallback, callbackState));
     }
     // Normal case where we append the temporary register restoration code to the instrumentation
     else {
@@ -115,5 +168,101 @@ void InstrRule::instrument(Patch &patch, llvm::MCInstrInfo* MCII, llvm::MCRegist
     }
 }
 
+void InstrRuleIndex::build(const std::vector<std::pair<uint32_t, InstrRule::SharedPtr>>& rules, llvm::MCInstrInfo* MCII) {
+    unsigned int numOpcodes = MCII->getNumOpcodes();
+    std::vector<std::vector<unsigned int>> ruleOpcodes(rules.size());
+
+    intervals.clear();
+    opcodeStart.assign(numOpcodes + 1, 0);
+    opcodeRules.clear();
+    genericRules.clear();
+    for(uint32_t i = 0; i < rules.size(); i++) {
+        const InstrRule::SharedPtr& rule = rules[i].second;
+        // Address ranges are the most selective
+        RangeSet<rword> range = rule->affectedRange();
+        if(!range.contains(Range<rword>(0, (rword) -1))) {
+            for(const Range<rword>& r : range.getRanges()) {
+                intervals.push_back(Interval {r.start, r.end, 0, i});
+            }
+            continue;
+        }
+        std::vector<unsigned int>& opcodes = ruleOpcodes[i];
+        if(rule->getOpcodes(opcodes, MCII) == false) {
+            opcodes.clear();
+            genericRules.push_back(i);
+            continue;
+        }
+        std::sort(opcodes.begin(), opcodes.end());
+        opcodes.erase(std::unique(opcodes.begin(), opcodes.end()), opcodes.end());
+        for(unsigned int opcode : opcodes) {
+            if(opcode < numOpcodes) {
+                opcodeStart[opcode + 1] += 1;
+            }
+        }
+    }
+    for(unsigned int opcode = 0; opcode < numOpcodes; opcode++) {
+        opcodeStart[opcode + 1] += opcodeStart[opcode];
+    }
+    std::vector<uint32_t> fill(opcodeStart.begin(), opcodeStart.end() - 1);
+    opcodeRules.resize(opcodeStart[numOpcodes]);
+    for(uint32_t i = 0; i < rules.size(); i++) {
+        for(unsigned int opcode : ruleOpcodes[i]) {
+            if(opcode < numOpcodes) {
+                opcodeRules[fill[opcode]++] = i;
+            }
+        }
+    }
+    // The sorted intervals form an implicit balanced tree, each node holding the largest end of
+    // its subtree
+    std::sort(intervals.begin(), intervals.end(), [](const Interval& a, const Interval& b) {
+        return a.start < b.start;
+    });
+    buildTree(0, intervals.size());
+    LogDebug("InstrRuleIndex::build", "Indexed %zu address intervals, %zu opcode entries and %zu generic rules",
+             intervals.size(), opcodeRules.size(), genericRules.size());
+}
+
+rword InstrRuleIndex::buildTree(size_t lo, size_t hi) {
+    if(lo >= hi) {
+        return 0;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    rword maxEnd = std::max(intervals[mid].end, std::max(buildTree(lo, mid), buildTree(mid + 1, hi)));
+    intervals[mid].maxEnd = maxEnd;
+    return maxEnd;
+}
+
+void InstrRuleIndex::queryTree(size_t lo, size_t hi, Range<rword> range, std::vector<uint32_t>& candidates) const {
+    if(lo >= hi) {
+        return;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    // No interval of this subtree ends after the start of the range
+    if(intervals[mid].maxEnd <= range.start) {
+        return;
+    }
+    queryTree(lo, mid, range, candidates);
+    // The intervals of the right subtree start after this one
+    if(intervals[mid].start < range.end) {
+        if(intervals[mid].end > range.start) {
+            candidates.push_back(intervals[mid].rule);
+        }
+        queryTree(mid + 1, hi, range, candidates);
+    }
+}
+
+void InstrRuleIndex::getCandidates(const InstMetadata& metadata, std::vector<uint32_t>& candidates) const {
+    candidates.clear();
+    queryTree(0, intervals.size(), Range<rword>(metadata.address, metadata.address + metadata.instSize), candidates);
+    unsigned int opcode = metadata.inst.getOpcode();
+    if(opcode + 1 < opcodeStart.size()) {
+        candidates.insert(candidates.end(), opcodeRules.begin() + opcodeStart[opcode],
+                          opcodeRules.begin() + opcodeStart[opcode + 1]);
+    }
+    candidates.insert(candidates.end(), genericRules.begin(), genericRules.end());
+    // Keep the order of the list, a rule with several ranges can be found several times
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
 }
 
+}
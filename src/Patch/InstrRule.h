@@ -19,6 +19,7 @@
 #define INSTRRULE_H
 
 #include <memory>
+#include <utility>
 #include <vector>
 
 #include "llvm/MC/MCInst.h"
@@ -38,6 +39,8 @@
 
 namespace QBDI {
 
+class MemoryFilter;
+
 /*! An instrumentation rule written in PatchDSL.
 */
 class InstrRule : public AutoAlloc<InstrRule, InstrRule> {
@@ -46,6 +49,9 @@ class InstrRule : public AutoAlloc<InstrRule, InstrRule> {
     PatchGenerator::SharedPtrVec  patchGen;
     InstPosition                  position;
     bool                          breakToHost;
+    bool                          fastCallback;
+    bool                          callbackState;
+    const MemoryFilter*           filter;
 
 public:
 
@@ -63,17 +69,52 @@ public:
      *                         before the instruction or after it.
      * @param[in] breakToHost  A boolean determining whether this instrumentation should end with
      *                         a break to host (in the case of a callback for example).
+     * @param[in] fastCallback A boolean determining whether the break to host should call the
+     *                         callback directly from the ExecBlock instead of leaving it.
+     * @param[in] callbackState A boolean determining whether the guest state is saved for a fast
+     *                          callback. Otherwise the callback receives NULL state pointers.
+    */
+    InstrRule(PatchCondition::SharedPtr condition, PatchGenerator::SharedPtrVec patchGen,
+              InstPosition position, bool breakToHost, bool fastCallback = false, bool callbackState = true) :
+              condition(condition), patchGen(patchGen), position(position), breakToHost(breakToHost),
+              fastCallback(fastCallback), callbackState(callbackState), filter(nullptr) {}
+
+    /*! Allocate a new instrumentation rule breaking to the host to call the callback of a memory
+     *  filter, only for the memory accesses passing the filter. The accesses the filter can't
+     *  check always break to the host.
+     *
+     * @param[in] condition    A PatchCondition which determine wheter or not this PatchRule
+     *                         applies.
+     * @param[in] patchGen     A vector of PatchGenerator which compute the accessed address in
+     *                         Temp(0).
+     * @param[in] position     An enum indicating wether this instrumentation should be positioned
+     *                         before the instruction or after it.
+     * @param[in] filter       The memory filter checking the accessed address.
     */
     InstrRule(PatchCondition::SharedPtr condition, PatchGenerator::SharedPtrVec patchGen,
-              InstPosition position, bool breakToHost) : condition(condition),
-              patchGen(patchGen), position(position), breakToHost(breakToHost) {}
+              InstPosition position, const MemoryFilter* filter) : condition(condition),
+              patchGen(patchGen), position(position), breakToHost(true), fastCallback(false),
+              callbackState(true), filter(filter) {}
 
     InstPosition getPosition() { return position; }
 
+    bool getBreakToHost() const { return breakToHost; }
+
     RangeSet<rword> affectedRange() const {
         return condition->affectedRange();
     }
 
+    /*! Collect the opcodes for which this rule can apply.
+     *
+     * @param[out] opcodes  The list receiving the opcodes.
+     * @param[in]  MCII     An LLVM MC instruction info context.
+     *
+     * @return False if this rule is not limited to a set of opcodes.
+    */
+    bool getOpcodes(std::vector<unsigned int>& opcodes, llvm::MCInstrInfo* MCII) const {
+        return condition->getOpcodes(opcodes, MCII);
+    }
+
     /*! Determine wheter this rule applies by evaluating this rule condition on the current
      *  context.
      *
@@ -84,6 +125,15 @@ public:
     */
     bool canBeApplied(const Patch &patch, llvm::MCInstrInfo* MCII);
 
+    /*! Determine wheter this rule applies to an already translated instruction.
+     *
+     * @param[in] metadata  The metadata of the translated instruction.
+     * @param[in] MCII      An LLVM MC instruction info context.
+     *
+     * @return True if this instrumentation condition evaluate to true on this instruction.
+    */
+    bool canBeApplied(const InstMetadata &metadata, llvm::MCInstrInfo* MCII);
+
     /*! Instrument a patch by evaluating its generators on the current context. Also handles the
      *  temporary register management for this patch.
      *
@@ -96,6 +146,46 @@ public:
     void instrument(Patch &patch, llvm::MCInstrInfo* MCII, llvm::MCRegisterInfo* MRI);
 };
 
+/*! An index of a list of instrumentation rules. The rules limited to an address range are
+ *  stored in an interval tree, the rules limited to a set of opcodes in an opcode table and the
+ *  other rules are candidates for every instruction.
+*/
+class InstrRuleIndex {
+
+    struct Interval {
+        rword    start;
+        rword    end;
+        rword    maxEnd;
+        uint32_t rule;
+    };
+
+    std::vector<Interval> intervals;
+    std::vector<uint32_t> opcodeStart;
+    std::vector<uint32_t> opcodeRules;
+    std::vector<uint32_t> genericRules;
+
+    rword buildTree(size_t lo, size_t hi);
+
+    void queryTree(size_t lo, size_t hi, Range<rword> range, std::vector<uint32_t>& candidates) const;
+
+public:
+
+    /*! Build the index of a list of instrumentation rules.
+     *
+     * @param[in] rules  The list of instrumentation rules and their ids.
+     * @param[in] MCII   An LLVM MC instruction info context.
+    */
+    void build(const std::vector<std::pair<uint32_t, InstrRule::SharedPtr>>& rules, llvm::MCInstrInfo* MCII);
+
+    /*! Get the rules which can apply to an instruction.
+     *
+     * @param[in]  metadata    The metadata of the instruction.
+     * @param[out] candidates  Will be set to the sorted indexes of the candidate rules within the
+     *                         list used to build the index.
+    */
+    void getCandidates(const InstMetadata& metadata, std::vector<uint32_t>& candidates) const;
+};
+
 }
 
 #endif
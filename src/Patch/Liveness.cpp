@@ -0,0 +1,155 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "Platform.h"
+#include "Patch/Liveness.h"
+#include "Utility/String.h"
+
+namespace QBDI {
+
+#if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
+// The arithmetic flags are only killed by the instructions writing all of them, those ones modify
+// a subset of the flags or only the system flags.
+static const char* PARTIAL_FLAGS_WRITERS[] = {
+    "INC", "DEC", "SHL", "SHR", "SAL", "SAR", "ROL", "ROR", "RCL", "RCR", "BT", "BSF", "BSR",
+    "CLC", "STC", "CMC", "CLD", "STD", "CLI", "STI", "CLAC", "STAC", "SAHF", "LAR", "LSL",
+    "VERR", "VERW", "ARPL", "CMPXCHG8B", "CMPXCHG16B", "ADCX", "ADOX"
+};
+
+static const unsigned int FLAGS_REGISTER = llvm::X86::EFLAGS;
+
+// RAX is often used implicitly without LLVM telling us, it is never considered dead
+static const uint32_t NEVER_DEAD = 1;
+#endif
+
+static const uint32_t ALL_REGISTERS = (1u << AVAILABLE_GPR) - 1;
+
+Liveness::Liveness(llvm::MCInstrInfo* MCII, llvm::MCRegisterInfo* MRI) : MCII(MCII), MRI(MRI) {
+    partialFlagsWriters.assign(MCII->getNumOpcodes(), false);
+#if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
+    for(unsigned int op = 0; op < MCII->getNumOpcodes(); op++) {
+        for(const char* prefix : PARTIAL_FLAGS_WRITERS) {
+            if(String::startsWith(prefix, MCII->getName(op).data())) {
+                partialFlagsWriters[op] = true;
+                break;
+            }
+        }
+    }
+#endif
+}
+
+uint32_t Liveness::getRegisterMask(unsigned int reg) const {
+    uint32_t mask = 0;
+    for(unsigned int i = 0; i < AVAILABLE_GPR; i++) {
+        if(MRI->isSubRegisterEq(GPR_ID[i], reg)) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+uint32_t Liveness::getDefinitionMask(unsigned int reg) const {
+    // The partial writes merge with the previous value of the register
+    for(unsigned int i = 0; i < AVAILABLE_GPR; i++) {
+        if(reg == GPR_ID[i]) {
+            return 1u << i;
+        }
+#if defined(QBDI_ARCH_X86_64)
+        // 32 bits writes clear the upper half of the register
+        if(reg == MRI->getSubReg(GPR_ID[i], llvm::X86::sub_32bit)) {
+            return 1u << i;
+        }
+#endif
+    }
+    return 0;
+}
+
+void Liveness::compute(std::vector<Patch>& basicBlock, const std::vector<bool>& observed) const {
+#if defined(QBDI_ARCH_ARM)
+    // The definitions of the predicated instructions are conditional, nothing is considered dead
+    for(Patch& patch : basicBlock) {
+        patch.deadRegisters = 0;
+        patch.deadFlags = false;
+    }
+#else
+    uint32_t liveRegisters = ALL_REGISTERS;
+    bool liveFlags = true;
+
+    for(size_t i = basicBlock.size(); i > 0; i--) {
+        Patch& patch = basicBlock[i - 1];
+        patch.deadRegisters = 0;
+        patch.deadFlags = false;
+        if(observed[i - 1]) {
+            liveRegisters = ALL_REGISTERS;
+            liveFlags = true;
+        }
+        uint32_t liveAfter = liveRegisters;
+        bool flagsAfter = liveFlags;
+        const llvm::MCInst& inst = patch.metadata.inst;
+        const llvm::MCInstrDesc& desc = MCII->get(inst.getOpcode());
+
+        // The instructions with effects unknown to LLVM are considered to read everything
+        if(desc.isCall() || desc.isReturn() || desc.isBranch() || desc.isIndirectBranch() ||
+           desc.hasUnmodeledSideEffects() || desc.isVariadic()) {
+            liveRegisters = ALL_REGISTERS;
+            liveFlags = true;
+            continue;
+        }
+        // Definitions
+        for(unsigned int j = 0; j < desc.getNumDefs() && j < inst.getNumOperands(); j++) {
+            const llvm::MCOperand& op = inst.getOperand(j);
+            if(op.isReg()) {
+                liveRegisters &= ~getDefinitionMask(op.getReg());
+            }
+        }
+        for(const uint16_t* reg = desc.getImplicitDefs(); reg && *reg; ++reg) {
+            if(*reg == FLAGS_REGISTER) {
+                if(!partialFlagsWriters[inst.getOpcode()]) {
+                    liveFlags = false;
+                }
+            }
+            else {
+                liveRegisters &= ~getDefinitionMask(*reg);
+            }
+        }
+        // Uses, including the tied operands and the memory operands
+        for(unsigned int j = desc.getNumDefs(); j < inst.getNumOperands(); j++) {
+            const llvm::MCOperand& op = inst.getOperand(j);
+            if(op.isReg() && op.getReg() != 0) {
+                liveRegisters |= getRegisterMask(op.getReg());
+            }
+        }
+        for(const uint16_t* reg = desc.getImplicitUses(); reg && *reg; ++reg) {
+            if(*reg == FLAGS_REGISTER) {
+                liveFlags = true;
+            }
+            else {
+                liveRegisters |= getRegisterMask(*reg);
+            }
+        }
+        if(observed[i - 1]) {
+            liveRegisters = ALL_REGISTERS;
+            liveFlags = true;
+        }
+        // Dead both before and after the instruction
+        patch.deadRegisters = ALL_REGISTERS & ~(liveRegisters | liveAfter | NEVER_DEAD);
+        patch.deadFlags = !liveFlags && !flagsAfter;
+    }
+#endif
+}
+
+}
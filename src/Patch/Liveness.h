@@ -0,0 +1,75 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef LIVENESS_H
+#define LIVENESS_H
+
+#include <vector>
+
+#include "llvm/MC/MCInstrInfo.h"
+#include "llvm/MC/MCRegisterInfo.h"
+
+#include "Patch/Patch.h"
+
+namespace QBDI {
+
+/*! A backward liveness analysis of the general purpose registers and of the flags over the patches
+ *  of a basic block, using the explicit operands and the implicit uses and definitions of the
+ *  instructions. A register dead across an instruction can be used as a temporary by its
+ *  instrumentation without being saved and restored.
+ */
+class Liveness {
+    llvm::MCInstrInfo*    MCII;
+    llvm::MCRegisterInfo* MRI;
+    // Opcodes defining the flags for LLVM while leaving some of them unchanged
+    std::vector<bool>     partialFlagsWriters;
+
+public:
+
+    Liveness(llvm::MCInstrInfo* MCII, llvm::MCRegisterInfo* MRI);
+
+    /*! Get the mask of the GPR_ID indexes overlapping a register.
+     *
+     * @param[in] reg  An LLVM register.
+     *
+     * @return The mask of the general purpose registers read when the register is read.
+     */
+    uint32_t getRegisterMask(unsigned int reg) const;
+
+    /*! Get the mask of the GPR_ID indexes entirely overwritten by a write to a register.
+     *
+     * @param[in] reg  An LLVM register.
+     *
+     * @return The mask of the general purpose registers whose previous value is lost.
+     */
+    uint32_t getDefinitionMask(unsigned int reg) const;
+
+    /*! Compute the registers and the flags dead across each instruction of a basic block and
+     *  store them in the deadRegisters and deadFlags of its patches. Everything is live at the end
+     *  of the basic block and around the observed instructions, where the host can read the
+     *  guest state.
+     *
+     * @param[in] basicBlock  The patches of the basic block, before their instrumentation.
+     * @param[in] observed    For each patch, whether the host observes the guest state before or
+     *                        after its instruction (a callback for example).
+     */
+    void compute(std::vector<Patch>& basicBlock, const std::vector<bool>& observed) const;
+};
+
+}
+
+#endif // LIVENESS_H
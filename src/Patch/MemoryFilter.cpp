@@ -0,0 +1,48 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <string.h>
+
+#include "Patch/MemoryFilter.h"
+
+namespace QBDI {
+
+MemoryFilter::MemoryFilter(InstCallback cbk, void* data) :
+    table(new uint8_t[MEMORY_FILTER_SIZE]()), cbk(cbk), data(data) {}
+
+void MemoryFilter::add(Range<rword> range) {
+    if(range.size() == 0) {
+        return;
+    }
+    rword start = range.start > MEMORY_FILTER_MAX_ACCESS ? range.start - MEMORY_FILTER_MAX_ACCESS : 0;
+    rword first = start >> 16;
+    rword last = (range.end - 1) >> 16;
+    // Every entry is reached past 4 GB
+    if(last - first >= MEMORY_FILTER_SIZE - 1) {
+        memset(table.get(), 1, MEMORY_FILTER_SIZE);
+        return;
+    }
+    for(rword slice = first; slice <= last; slice++) {
+        table[getIndex(slice << 16)] = 1;
+    }
+}
+
+void MemoryFilter::clear() {
+    memset(table.get(), 0, MEMORY_FILTER_SIZE);
+}
+
+}
@@ -0,0 +1,87 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef MEMORYFILTER_H
+#define MEMORYFILTER_H
+
+#include <memory>
+
+#include "Callback.h"
+#include "Range.h"
+
+namespace QBDI {
+
+// Number of entries of a MemoryFilter table, one per 64 KB slice of the address space modulo 4 GB
+static const size_t MEMORY_FILTER_SIZE = 65536;
+
+// Largest access checked by a MemoryFilter (FXSAVE), an access starting before a range can overlap
+// it. The larger accesses (XSAVE) and the accesses of an unknown size are never filtered.
+static const rword MEMORY_FILTER_MAX_ACCESS = 512;
+
+/*! Coarse filter of the memory accesses guarding the break to host of a memory callback. The
+ *  instrumented code looks up the slice of the accessed address in a table and only calls the
+ *  callback if a watched range may overlap the slice. The table is read at execution time and can
+ *  be modified without retranslating the code. False positives are possible and the callback
+ *  needs to check the exact ranges.
+ */
+class MemoryFilter {
+private:
+
+    std::unique_ptr<uint8_t[]>  table;
+    InstCallback                cbk;
+    void*                       data;
+
+public:
+
+    /*! Create an empty filter guarding a callback.
+     *
+     * @param[in] cbk   The callback called for the accesses passing the filter.
+     * @param[in] data  User defined data passed to the callback.
+     */
+    MemoryFilter(InstCallback cbk, void* data);
+
+    /*! Obtain the table index of an address. The instrumented code swaps the bytes of the low 32
+     *  bits of the address and keeps the low 16 bits of the result.
+     *
+     * @param[in] address  An accessed address.
+     *
+     * @return The index of the table entry of the address.
+     */
+    static size_t getIndex(rword address) {
+        return static_cast<size_t>(((address >> 24) & 0xFF) | ((address >> 8) & 0xFF00));
+    }
+
+    /*! Let the accesses which may overlap a range pass the filter.
+     *
+     * @param[in] range  A watched range.
+     */
+    void add(Range<rword> range);
+
+    /*! Block all the accesses.
+     */
+    void clear();
+
+    const uint8_t* getTable() const { return table.get(); }
+
+    InstCallback getCallback() const { return cbk; }
+
+    void* getData() const { return data; }
+};
+
+}
+
+#endif // MEMORYFILTER_H
@@ -30,15 +30,20 @@ public:
 
     InstMetadata metadata;
     RelocatableInst::SharedPtrVec insts;
+    // Mask of the GPR_ID indexes and flags dead across the instruction, set by the Liveness
+    uint32_t deadRegisters;
+    bool deadFlags;
 
     using Vec = std::vector<Patch>;
     
-    Patch() {
+    Patch() : deadRegisters(0), deadFlags(false) {
         metadata.patchSize = 0;
+        metadata.useFPR = false;
     }
 
-    Patch(llvm::MCInst inst, rword address, rword instSize) {
+    Patch(llvm::MCInst inst, rword address, rword instSize) : deadRegisters(0), deadFlags(false) {
         metadata.patchSize = 0;
+        metadata.useFPR = false;
         setInst(inst, address, instSize);
     }
 
@@ -50,28 +55,32 @@ public:
         metadata.modifyPC = modifyPC;
     }
 
+    void setUseFPR(bool useFPR) {
+        metadata.useFPR = useFPR;
+    }
+
     void setInst(llvm::MCInst inst, rword address, rword instSize) {
         metadata.inst = inst;
         metadata.address = address;
         metadata.instSize = instSize;
     }
 
-    void append(const RelocatableInst::SharedPtrVec v) {
+    void append(const RelocatableInst::SharedPtrVec& v) {
         insts.insert(insts.end(), v.begin(), v.end());
         metadata.patchSize += v.size();
     }
 
-    void prepend(const RelocatableInst::SharedPtrVec v) {
+    void prepend(const RelocatableInst::SharedPtrVec& v) {
         insts.insert(insts.begin(), v.begin(), v.end());
         metadata.patchSize += v.size();
     } 
 
-    void append(const RelocatableInst::SharedPtr r) {
+    void append(const RelocatableInst::SharedPtr& r) {
         insts.push_back(r);
         metadata.patchSize += 1;
     }
 
-    void prepend(const RelocatableInst::SharedPtr r) {
+    void prepend(const RelocatableInst::SharedPtr& r) {
         insts.insert(insts.begin(), r);
         metadata.patchSize += 1;
     } 
@@ -23,6 +23,7 @@
 #include <string>
 
 #include "llvm/MC/MCInst.h"
+#include "llvm/MC/MCInstrInfo.h"
 
 #include "Range.h"
 #include "Patch/Types.h"
@@ -52,11 +53,33 @@ public:
         return r;
     }
 
+    /*! Collect the opcodes for which this condition can be true.
+     *
+     * @param[out] opcodes  The list receiving the opcodes.
+     * @param[in]  MCII     An LLVM MC instruction info context.
+     *
+     * @return False if this condition is not limited to a set of opcodes.
+    */
+    virtual bool getOpcodes(std::vector<unsigned int>& opcodes, llvm::MCInstrInfo* MCII) {
+        return false;
+    }
+
     virtual ~PatchCondition() {};
 };
 
 class MnemonicIs : public PatchCondition, public AutoAlloc<PatchCondition, MnemonicIs> {
     std::string mnemonic;
+    std::vector<bool> matching;
+    llvm::MCInstrInfo* matchingMCII;
+
+    // The mnemonic is matched once against every opcode name
+    void computeMatching(llvm::MCInstrInfo* MCII) {
+        matching.assign(MCII->getNumOpcodes(), false);
+        for(unsigned int op = 0; op < MCII->getNumOpcodes(); op++) {
+            matching[op] = QBDI::String::startsWith(mnemonic.c_str(), MCII->getName(op).data());
+        }
+        matchingMCII = MCII;
+    }
 
 public:
 
@@ -64,10 +87,25 @@ public:
      *
      * @param[in] mnemonic   A null terminated instruction mnemonic (using LLVM style)
     */
-    MnemonicIs(const char *mnemonic) : mnemonic(mnemonic) {};
+    MnemonicIs(const char *mnemonic) : mnemonic(mnemonic), matchingMCII(nullptr) {};
 
     bool test(const llvm::MCInst* inst, rword address, rword instSize, llvm::MCInstrInfo* MCII) {
-        return QBDI::String::startsWith(mnemonic.c_str(), MCII->getName(inst->getOpcode()).data());
+        if(MCII != matchingMCII) {
+            computeMatching(MCII);
+        }
+        return inst->getOpcode() < matching.size() && matching[inst->getOpcode()];
+    }
+
+    bool getOpcodes(std::vector<unsigned int>& opcodes, llvm::MCInstrInfo* MCII) {
+        if(MCII != matchingMCII) {
+            computeMatching(MCII);
+        }
+        for(unsigned int op = 0; op < matching.size(); op++) {
+            if(matching[op]) {
+                opcodes.push_back(op);
+            }
+        }
+        return true;
     }
 };
 
@@ -85,6 +123,11 @@ public:
     bool test(const llvm::MCInst* inst, rword address, rword instSize, llvm::MCInstrInfo* MCII) { // refactor all test() add MCII
         return inst->getOpcode() == op;
     }
+
+    bool getOpcodes(std::vector<unsigned int>& opcodes, llvm::MCInstrInfo* MCII) {
+        opcodes.push_back(op);
+        return true;
+    }
 };
 
 class RegIs : public PatchCondition, public AutoAlloc<PatchCondition, RegIs> {
@@ -233,6 +276,18 @@ public:
         }
         return r;
     }
+
+    bool getOpcodes(std::vector<unsigned int>& opcodes, llvm::MCInstrInfo* MCII) {
+        // Limited by the opcodes of the first limited condition
+        for(unsigned int i = 0; i < conditions.size(); i++) {
+            std::vector<unsigned int> limited;
+            if(conditions[i]->getOpcodes(limited, MCII)) {
+                opcodes.insert(opcodes.end(), limited.begin(), limited.end());
+                return true;
+            }
+        }
+        return false;
+    }
 };
 
 class Or : public PatchCondition, public AutoAlloc<PatchCondition, Or> {
@@ -262,6 +317,16 @@ public:
         }
         return r;
     }
+
+    bool getOpcodes(std::vector<unsigned int>& opcodes, llvm::MCInstrInfo* MCII) {
+        // Limited only if every condition is limited
+        for(unsigned int i = 0; i < conditions.size(); i++) {
+            if(conditions[i]->getOpcodes(opcodes, MCII) == false) {
+                return false;
+            }
+        }
+        return true;
+    }
 };
 
 class Not : public PatchCondition, public AutoAlloc<PatchCondition, Not> {
@@ -83,7 +83,7 @@ public:
         if(toMerge != nullptr) {
             append(out, toMerge->insts);
         }
-        out.push_back(NoReloc(a));
+        out.push_back(GuestInst(a));
         return out;
     }
 };
@@ -0,0 +1,242 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <algorithm>
+
+#include "Platform.h"
+#include "Patch/PatchOptimizer.h"
+#include "Patch/RelocatableInst.h"
+
+namespace QBDI {
+
+#if defined(QBDI_ARCH_X86_64)
+// SaveReg, LoadReg and GetConstant as generated by the X86_64 layer 2
+static const unsigned int SAVE_OPCODE = llvm::X86::MOV64mr;
+static const unsigned int LOAD_OPCODE = llvm::X86::MOV64rm;
+static const unsigned int CONSTANT_OPCODE = llvm::X86::MOV64ri;
+#elif defined(QBDI_ARCH_X86)
+static const unsigned int SAVE_OPCODE = llvm::X86::MOV32mr;
+static const unsigned int LOAD_OPCODE = llvm::X86::MOV32rm;
+static const unsigned int CONSTANT_OPCODE = llvm::X86::MOV32ri;
+#endif
+
+static unsigned int getGPRIndex(unsigned int reg) {
+    for(unsigned int i = 0; i < AVAILABLE_GPR; i++) {
+        if(GPR_ID[i] == reg) {
+            return i;
+        }
+    }
+    return AVAILABLE_GPR;
+}
+
+// Masks of the general purpose registers read, entirely overwritten and modified by an instruction
+static void getRegisterMasks(const llvm::MCInst& inst, const llvm::MCInstrDesc& desc, const Liveness& liveness,
+                             uint32_t* uses, uint32_t* defs, uint32_t* modified) {
+    *uses = 0;
+    *defs = 0;
+    *modified = 0;
+    for(unsigned int j = 0; j < inst.getNumOperands(); j++) {
+        const llvm::MCOperand& op = inst.getOperand(j);
+        if(!op.isReg() || op.getReg() == 0) {
+            continue;
+        }
+        if(j < desc.getNumDefs()) {
+            *defs |= liveness.getDefinitionMask(op.getReg());
+            *modified |= liveness.getRegisterMask(op.getReg());
+        }
+        else {
+            *uses |= liveness.getRegisterMask(op.getReg());
+        }
+    }
+    for(const uint16_t* reg = desc.getImplicitDefs(); reg && *reg; ++reg) {
+        *defs |= liveness.getDefinitionMask(*reg);
+        *modified |= liveness.getRegisterMask(*reg);
+    }
+    for(const uint16_t* reg = desc.getImplicitUses(); reg && *reg; ++reg) {
+        *uses |= liveness.getRegisterMask(*reg);
+    }
+}
+
+PatchOptimizer::SlotAccess PatchOptimizer::getSlotAccess(const RelocatableInst::SharedPtr& inst) const {
+    SlotAccess access = {SlotAccess::NONE, 0, 0};
+#if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
+    rword slot;
+    unsigned int opcode = inst->inst.getOpcode();
+    if((opcode != SAVE_OPCODE && opcode != LOAD_OPCODE) || !inst->getDataBlockSlot(&slot)) {
+        return access;
+    }
+    // The stored register is the last operand of a store, the loaded register the first of a load
+    unsigned int reg = getGPRIndex(inst->inst.getOperand(opcode == SAVE_OPCODE ? 5 : 0).getReg());
+    if(reg < AVAILABLE_GPR) {
+        access.kind = opcode == SAVE_OPCODE ? SlotAccess::SAVE : SlotAccess::LOAD;
+        access.reg = reg;
+        access.slot = slot;
+    }
+#endif
+    return access;
+}
+
+bool PatchOptimizer::getConstant(const RelocatableInst::SharedPtr& inst, unsigned int* reg, rword* value) const {
+#if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
+    // Only the fixed instructions, the relocated immediates are not known
+    if(inst->inst.getOpcode() != CONSTANT_OPCODE || inst->getTemplateOperand() != TEMPLATE_WHOLE) {
+        return false;
+    }
+    *reg = getGPRIndex(inst->inst.getOperand(0).getReg());
+    *value = static_cast<rword>(inst->inst.getOperand(1).getImm());
+    return *reg < AVAILABLE_GPR;
+#else
+    return false;
+#endif
+}
+
+bool PatchOptimizer::isBarrier(const RelocatableInst::SharedPtr& inst) const {
+    const llvm::MCInstrDesc& desc = MCII->get(inst->inst.getOpcode());
+    return desc.isBranch() || desc.isIndirectBranch() || desc.isCall() || desc.isReturn() ||
+           desc.hasUnmodeledSideEffects() || desc.isVariadic();
+}
+
+bool PatchOptimizer::isOverwritten(const RelocatableInst::SharedPtrVec& insts, size_t start, unsigned int reg) const {
+    uint32_t uses, defs, modified;
+    for(size_t i = start; i < insts.size(); i++) {
+        if(isBarrier(insts[i])) {
+            return false;
+        }
+        getRegisterMasks(insts[i]->inst, MCII->get(insts[i]->inst.getOpcode()), liveness, &uses, &defs, &modified);
+        if((uses & (1u << reg)) != 0) {
+            return false;
+        }
+        if((defs & (1u << reg)) != 0) {
+            return true;
+        }
+        if((modified & (1u << reg)) != 0) {
+            return false;
+        }
+    }
+    // The register must hold the guest value at the end of the patch
+    return false;
+}
+
+void PatchOptimizer::removeSpills(Patch& patch) const {
+    RelocatableInst::SharedPtrVec insts;
+    insts.reserve(patch.insts.size());
+
+    for(size_t i = 0; i < patch.insts.size(); i++) {
+        const RelocatableInst::SharedPtr& inst = patch.insts[i];
+        SlotAccess current = getSlotAccess(inst);
+        if(current.kind != SlotAccess::NONE && !insts.empty()) {
+            SlotAccess previous = getSlotAccess(insts.back());
+            if(previous.kind != SlotAccess::NONE && previous.reg == current.reg && previous.slot == current.slot) {
+                // The register and the slot already hold the same value
+                if(previous.kind == SlotAccess::SAVE || current.kind == SlotAccess::LOAD) {
+                    continue;
+                }
+                // A register restored and saved again by the next instrumentation doesn't need
+                // to be restored if it is overwritten before being read
+                if(isOverwritten(patch.insts, i + 1, current.reg)) {
+                    insts.pop_back();
+                    continue;
+                }
+            }
+        }
+        insts.push_back(inst);
+    }
+    patch.insts.swap(insts);
+}
+
+void PatchOptimizer::removeConstants(Patch& patch) const {
+    static const size_t NONE = (size_t) -1;
+    RelocatableInst::SharedPtrVec insts;
+    bool known[AVAILABLE_GPR] = {false};
+    rword values[AVAILABLE_GPR] = {0};
+    // Position of the last constant loaded in each register and not read yet
+    size_t pending[AVAILABLE_GPR];
+    bool removed = false;
+
+    std::fill(pending, pending + AVAILABLE_GPR, NONE);
+    insts.reserve(patch.insts.size());
+    for(const RelocatableInst::SharedPtr& inst : patch.insts) {
+        unsigned int reg;
+        rword value;
+        if(isBarrier(inst)) {
+            std::fill(known, known + AVAILABLE_GPR, false);
+            std::fill(pending, pending + AVAILABLE_GPR, NONE);
+        }
+        else if(getConstant(inst, &reg, &value)) {
+            // The register already holds the constant
+            if(known[reg] && values[reg] == value) {
+                continue;
+            }
+            // The previous constant was never read
+            if(pending[reg] != NONE) {
+                insts[pending[reg]] = nullptr;
+                removed = true;
+            }
+            known[reg] = true;
+            values[reg] = value;
+            pending[reg] = insts.size();
+        }
+        else {
+            uint32_t uses, defs, modified;
+            getRegisterMasks(inst->inst, MCII->get(inst->inst.getOpcode()), liveness, &uses, &defs, &modified);
+            for(unsigned int r = 0; r < AVAILABLE_GPR; r++) {
+                if((uses & (1u << r)) == 0 && (defs & (1u << r)) != 0 && pending[r] != NONE) {
+                    insts[pending[r]] = nullptr;
+                    removed = true;
+                }
+                if((uses & (1u << r)) != 0 || (modified & (1u << r)) != 0) {
+                    pending[r] = NONE;
+                }
+                if((modified & (1u << r)) != 0) {
+                    known[r] = false;
+                }
+            }
+        }
+        insts.push_back(inst);
+    }
+    if(removed) {
+        insts.erase(std::remove(insts.begin(), insts.end(), nullptr), insts.end());
+    }
+    patch.insts.swap(insts);
+}
+
+void PatchOptimizer::optimize(std::vector<Patch>& basicBlock) const {
+#if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
+    for(Patch& patch : basicBlock) {
+        // The fixed offsets of the jumps would be invalidated by removing instructions, the guest
+        // jumps are copied with their offsets too
+        bool fixedJump = false;
+        for(const RelocatableInst::SharedPtr& inst : patch.insts) {
+            unsigned int opn = 0;
+            rword offset = 0;
+            if(MCII->get(inst->inst.getOpcode()).isBranch() &&
+               (inst->getTemplateOperand() == TEMPLATE_WHOLE || inst->getKind(&opn, &offset) == RELOC_GUEST_INST)) {
+                fixedJump = true;
+                break;
+            }
+        }
+        if(fixedJump) {
+            continue;
+        }
+        removeSpills(patch);
+        removeConstants(patch);
+        patch.metadata.patchSize = patch.insts.size();
+    }
+#endif
+}
+
+}
@@ -0,0 +1,71 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef PATCHOPTIMIZER_H
+#define PATCHOPTIMIZER_H
+
+#include <vector>
+
+#include "llvm/MC/MCInstrInfo.h"
+
+#include "Patch/Liveness.h"
+#include "Patch/Patch.h"
+
+namespace QBDI {
+
+/*! A peephole optimizer of the instrumented patches, removing the redundant code produced when
+ *  several instrumentations are stacked on the same instruction: temporary registers restored and
+ *  saved again, duplicated spills and reloads, and constants loaded twice or never read. Each
+ *  patch is optimized alone as the execution can enter a basic block at any of its instructions.
+ */
+class PatchOptimizer {
+    llvm::MCInstrInfo* MCII;
+    const Liveness&    liveness;
+
+    struct SlotAccess {
+        enum { NONE, SAVE, LOAD } kind;
+        unsigned int reg;
+        rword        slot;
+    };
+
+    SlotAccess getSlotAccess(const RelocatableInst::SharedPtr& inst) const;
+
+    bool getConstant(const RelocatableInst::SharedPtr& inst, unsigned int* reg, rword* value) const;
+
+    bool isBarrier(const RelocatableInst::SharedPtr& inst) const;
+
+    bool isOverwritten(const RelocatableInst::SharedPtrVec& insts, size_t start, unsigned int reg) const;
+
+    void removeSpills(Patch& patch) const;
+
+    void removeConstants(Patch& patch) const;
+
+public:
+
+    PatchOptimizer(llvm::MCInstrInfo* MCII, const Liveness& liveness) : MCII(MCII), liveness(liveness) {}
+
+    /*! Optimize the patches of an instrumented basic block. The patches containing jumps with
+     *  fixed offsets are left unchanged.
+     *
+     * @param[in] basicBlock  The instrumented patches of the basic block.
+     */
+    void optimize(std::vector<Patch>& basicBlock) const;
+};
+
+}
+
+#endif // PATCHOPTIMIZER_H
@@ -18,12 +18,14 @@
 #ifndef PATCHRULES_H
 #define PATCHRULES_H
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 
 #include "llvm/MC/MCInst.h"
 #include "llvm/MC/MCRegisterInfo.h"
 
+#include "Patch/InstInfo.h"
 #include "Patch/PatchGenerator.h"
 #include "Patch/PatchCondition.h"
 #include "Patch/Patch.h"
@@ -70,6 +72,17 @@ public:
         return condition->test(inst, address, instSize, MCII);
     }
 
+    /*! Collect the opcodes for which this rule can apply.
+     *
+     * @param[out] opcodes  The list receiving the opcodes.
+     * @param[in]  MCII     An LLVM MC instruction info context.
+     *
+     * @return False if this rule is not limited to a set of opcodes.
+    */
+    bool getOpcodes(std::vector<unsigned int>& opcodes, llvm::MCInstrInfo* MCII) {
+        return condition->getOpcodes(opcodes, MCII);
+    }
+
     /*! Generate this rule output patch by evaluating its generators on the current context. Also
      *  handles the temporary register management for this patch.
      *
@@ -95,19 +108,24 @@ public:
         bool modifyPC = false;
         bool merge = false;
 
-        for(auto g : generators) {
+        for(const auto& g : generators) {
             patch.append(g->generate(inst, address, instSize, &temp_manager, toMerge));
             modifyPC |= g->modifyPC();
             merge |= g->doNotInstrument();
         }
         patch.setMerge(merge);
         patch.setModifyPC(modifyPC);
+        patch.setUseFPR(useFPR(inst, MCII, MRI) || (toMerge != nullptr && toMerge->metadata.useFPR));
 
         Reg::Vec used_registers = temp_manager.getUsedRegisters();
 
-        for(unsigned int i = 0; i < used_registers.size(); i++) {
-            patch.prepend(SaveReg(used_registers[i], Offset(used_registers[i])));
+        // Saves are inserted at once, in the order the successive prepends used to produce
+        RelocatableInst::SharedPtrVec saves;
+        saves.reserve(used_registers.size());
+        for(size_t i = used_registers.size(); i > 0; i--) {
+            saves.push_back(SaveReg(used_registers[i - 1], Offset(used_registers[i - 1])));
         }
+        patch.prepend(saves);
 
         for(unsigned int i = 0; i < used_registers.size(); i++) {
             patch.append(LoadReg(used_registers[i], Offset(used_registers[i])));
@@ -117,6 +135,95 @@ public:
     }
 };
 
+/*! An opcode index of a list of patch rules. The rules limited to a set of opcodes are only
+ *  tested for those opcodes while the other rules are tested for every instruction, keeping the
+ *  order of the list.
+*/
+class PatchRuleIndex {
+    std::vector<uint32_t> opcodeStart;
+    std::vector<uint32_t> opcodeRules;
+    std::vector<uint32_t> genericRules;
+
+public:
+
+    static const uint32_t NOT_FOUND = 0xFFFFFFFF;
+
+    /*! Build the index of a list of patch rules.
+     *
+     * @param[in] rules  The list of patch rules, which must not change afterward.
+     * @param[in] MCII   An LLVM MC instruction info context.
+    */
+    void build(const PatchRule::SharedPtrVec& rules, llvm::MCInstrInfo* MCII) {
+        unsigned int numOpcodes = MCII->getNumOpcodes();
+        std::vector<std::vector<unsigned int>> ruleOpcodes(rules.size());
+        opcodeStart.assign(numOpcodes + 1, 0);
+        opcodeRules.clear();
+        genericRules.clear();
+        for(uint32_t i = 0; i < rules.size(); i++) {
+            std::vector<unsigned int>& opcodes = ruleOpcodes[i];
+            if(rules[i]->getOpcodes(opcodes, MCII) == false) {
+                opcodes.clear();
+                genericRules.push_back(i);
+                continue;
+            }
+            std::sort(opcodes.begin(), opcodes.end());
+            opcodes.erase(std::unique(opcodes.begin(), opcodes.end()), opcodes.end());
+            for(unsigned int opcode : opcodes) {
+                if(opcode < numOpcodes) {
+                    opcodeStart[opcode + 1] += 1;
+                }
+            }
+        }
+        for(unsigned int opcode = 0; opcode < numOpcodes; opcode++) {
+            opcodeStart[opcode + 1] += opcodeStart[opcode];
+        }
+        // Rules are visited in order, the rules of an opcode stay sorted
+        std::vector<uint32_t> fill(opcodeStart.begin(), opcodeStart.end() - 1);
+        opcodeRules.resize(opcodeStart[numOpcodes]);
+        for(uint32_t i = 0; i < rules.size(); i++) {
+            for(unsigned int opcode : ruleOpcodes[i]) {
+                if(opcode < numOpcodes) {
+                    opcodeRules[fill[opcode]++] = i;
+                }
+            }
+        }
+    }
+
+    /*! Find the first rule of the list which applies to an instruction.
+     *
+     * @param[in] rules     The list of patch rules used to build the index.
+     * @param[in] inst      The current instruction.
+     * @param[in] address   The current instruction address.
+     * @param[in] instSize  The current instruction size.
+     * @param[in] MCII      An LLVM MC instruction info context.
+     *
+     * @return The index of the rule within the list or NOT_FOUND.
+    */
+    uint32_t find(const PatchRule::SharedPtrVec& rules, const llvm::MCInst *inst, rword address,
+                  rword instSize, llvm::MCInstrInfo* MCII) const {
+        unsigned int opcode = inst->getOpcode();
+        size_t o = 0, oEnd = 0, g = 0;
+        if(opcode + 1 < opcodeStart.size()) {
+            o = opcodeStart[opcode];
+            oEnd = opcodeStart[opcode + 1];
+        }
+        // Merge the rules of the opcode with the generic rules
+        while(o < oEnd || g < genericRules.size()) {
+            uint32_t rule;
+            if(g >= genericRules.size() || (o < oEnd && opcodeRules[o] < genericRules[g])) {
+                rule = opcodeRules[o++];
+            }
+            else {
+                rule = genericRules[g++];
+            }
+            if(rules[rule]->canBeApplied(inst, address, instSize, MCII)) {
+                return rule;
+            }
+        }
+        return NOT_FOUND;
+    }
+};
+
 }
 
 #endif //PATCHRULES_H
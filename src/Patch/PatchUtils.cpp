@@ -32,6 +32,38 @@
 namespace QBDI {
 
 
+bool TempManager::isFree(unsigned int i) {
+    // Check if the register is already allocated
+    for(auto p : temps) {
+        if(p.second == i) {
+            return false;
+        }
+    }
+    // Check for explicit registers
+    for(unsigned int j = 0; inst && j < inst->getNumOperands(); j++) {
+        const llvm::MCOperand &op = inst->getOperand(j);
+        if (op.isReg() && MRI->isSubRegisterEq(GPR_ID[i], op.getReg())) {
+            return false;
+        }
+    }
+    const llvm::MCInstrDesc &desc = MCII->get(inst->getOpcode());
+    // Check for implicitly used registers
+    const uint16_t* implicitRegs = desc.getImplicitUses();
+    for (; implicitRegs && *implicitRegs; ++implicitRegs) {
+        if (MRI->isSubRegisterEq(GPR_ID[i], *implicitRegs)) {
+            return false;
+        }
+    }
+    // Check for implicitly modified registers
+    implicitRegs = desc.getImplicitDefs();
+    for (; implicitRegs && *implicitRegs; ++implicitRegs) {
+        if (MRI->isSubRegisterEq(GPR_ID[i], *implicitRegs)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 Reg TempManager::getRegForTemp(unsigned int id) {
     unsigned int i;
 
@@ -42,47 +74,17 @@ Reg TempManager::getRegForTemp(unsigned int id) {
         }
     }
 
-    // Start from the last free register found (or default)
-    if(temps.size() > 0) {
-        i = temps.back().second + 1;
-    }
-    else {
-        i = _QBDI_FIRST_FREE_REGISTER;
+    // Prefer the dead registers, they don't need to be saved
+    for(i = _QBDI_FIRST_FREE_REGISTER; deadRegisters != 0 && i < AVAILABLE_GPR; i++) {
+        if((deadRegisters & (1u << i)) != 0 && isFree(i)) {
+            temps.push_back(std::make_pair(id, i));
+            return Reg(i);
+        }
     }
 
-    const llvm::MCInstrDesc &desc = MCII->get(inst->getOpcode());
     // Find a free register
-    for(; i < AVAILABLE_GPR; i++) {
-        bool free = true;
-        // Check for explicit registers
-        for(unsigned int j = 0; inst && j < inst->getNumOperands(); j++) {
-            const llvm::MCOperand &op = inst->getOperand(j);
-            if (op.isReg() && MRI->isSubRegisterEq(GPR_ID[i], op.getReg())) {
-                free = false;
-                break;
-            }
-        }
-        // Check for implicitly used registers
-        if (free) {
-            const uint16_t* implicitRegs = desc.getImplicitUses();
-            for (; implicitRegs && *implicitRegs; ++implicitRegs) {
-                if (MRI->isSubRegisterEq(GPR_ID[i], *implicitRegs)) {
-                    free = false;
-                    break;
-                }
-            }
-        }
-        // Check for implicitly modified registers
-        if (free) {
-            const uint16_t* implicitRegs = desc.getImplicitDefs();
-            for (; implicitRegs && *implicitRegs; ++implicitRegs) {
-                if (MRI->isSubRegisterEq(GPR_ID[i], *implicitRegs)) {
-                    free = false;
-                    break;
-                }
-            }
-        }
-        if(free) {
+    for(i = _QBDI_FIRST_FREE_REGISTER; i < AVAILABLE_GPR; i++) {
+        if(isFree(i)) {
             // store it and return it
             temps.push_back(std::make_pair(id, i));
             return Reg(i);
@@ -99,6 +101,16 @@ Reg::Vec TempManager::getUsedRegisters() {
     return list;
 }
 
+Reg::Vec TempManager::getSavedRegisters() {
+    Reg::Vec list;
+    for(auto p: temps) {
+        if((deadRegisters & (1u << p.second)) == 0) {
+            list.push_back(Reg(p.second));
+        }
+    }
+    return list;
+}
+
 size_t TempManager::getUsedRegisterNumber() {
     return temps.size();
 }
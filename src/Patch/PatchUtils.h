@@ -25,6 +25,7 @@
 #include "llvm/MC/MCInst.h"
 #include "llvm/MC/MCRegisterInfo.h"
 #include "Patch/Types.h"
+#include "Utility/Arena.h"
 
 namespace QBDI {
 
@@ -41,27 +42,37 @@ public:
     }
 };
 
-void inline append(std::vector<std::shared_ptr<RelocatableInst>> &u, const std::vector<std::shared_ptr<RelocatableInst>> v) {
+// Same as AutoAlloc for the objects only living as long as a translation, they are allocated from
+// the translation arena of the current thread
+template<typename T, typename U> class ArenaAutoAlloc {
+public:
+
+    operator std::shared_ptr<T>() {
+        return std::allocate_shared<U>(ArenaAllocator<U>(), *static_cast<U*>(this));
+    }
+};
+
+void inline append(std::vector<std::shared_ptr<RelocatableInst>, ArenaAllocator<std::shared_ptr<RelocatableInst>>> &u, const std::vector<std::shared_ptr<RelocatableInst>, ArenaAllocator<std::shared_ptr<RelocatableInst>>>& v) {
     u.insert(u.end(), v.begin(), v.end());
 }
 
-void inline prepend(std::vector<std::shared_ptr<RelocatableInst>> &u, const std::vector<std::shared_ptr<RelocatableInst>> v) {
+void inline prepend(std::vector<std::shared_ptr<RelocatableInst>, ArenaAllocator<std::shared_ptr<RelocatableInst>>> &u, const std::vector<std::shared_ptr<RelocatableInst>, ArenaAllocator<std::shared_ptr<RelocatableInst>>>& v) {
     u.insert(u.begin(), v.begin(), v.end());
 }
 
-void inline insert(std::vector<std::shared_ptr<RelocatableInst>> &u, size_t pos, const std::vector<std::shared_ptr<RelocatableInst>> v) {
+void inline insert(std::vector<std::shared_ptr<RelocatableInst>, ArenaAllocator<std::shared_ptr<RelocatableInst>>> &u, size_t pos, const std::vector<std::shared_ptr<RelocatableInst>, ArenaAllocator<std::shared_ptr<RelocatableInst>>>& v) {
     u.insert(u.begin() + pos, v.begin(), v.end());
 }
 
-void inline append(std::vector<std::shared_ptr<PatchGenerator>> &u, const std::vector<std::shared_ptr<PatchGenerator>> v) {
+void inline append(std::vector<std::shared_ptr<PatchGenerator>> &u, const std::vector<std::shared_ptr<PatchGenerator>>& v) {
     u.insert(u.end(), v.begin(), v.end());
 }
 
-void inline prepend(std::vector<std::shared_ptr<PatchGenerator>> &u, const std::vector<std::shared_ptr<PatchGenerator>> v) {
+void inline prepend(std::vector<std::shared_ptr<PatchGenerator>> &u, const std::vector<std::shared_ptr<PatchGenerator>>& v) {
     u.insert(u.begin(), v.begin(), v.end());
 }
 
-void inline insert(std::vector<std::shared_ptr<PatchGenerator>> &u, size_t pos, const std::vector<std::shared_ptr<PatchGenerator>> v) {
+void inline insert(std::vector<std::shared_ptr<PatchGenerator>> &u, size_t pos, const std::vector<std::shared_ptr<PatchGenerator>>& v) {
     u.insert(u.begin() + pos, v.begin(), v.end());
 }
 
@@ -73,15 +84,36 @@ class TempManager {
     const llvm::MCInst* inst;
     llvm::MCInstrInfo* MCII;
     llvm::MCRegisterInfo* MRI;
+    uint32_t deadRegisters;
+    bool deadFlags;
+
+    bool isFree(unsigned int i);
 
 public:
 
-    TempManager(const llvm::MCInst *inst, llvm::MCInstrInfo* MCII, llvm::MCRegisterInfo *MRI) : inst(inst), MCII(MCII), MRI(MRI) {};
+    TempManager(const llvm::MCInst *inst, llvm::MCInstrInfo* MCII, llvm::MCRegisterInfo *MRI) : inst(inst), MCII(MCII), MRI(MRI), deadRegisters(0), deadFlags(false) {};
+
+    /*! Set the registers and the flags dead across the instruction. The dead registers are
+     *  allocated first and don't need to be saved and restored.
+     *
+     * @param[in] deadRegisters  Mask of the GPR_ID indexes of the dead registers.
+     * @param[in] deadFlags      Whether the flags are dead and can be modified.
+    */
+    void setLiveness(uint32_t deadRegisters, bool deadFlags) {
+        this->deadRegisters = deadRegisters;
+        this->deadFlags = deadFlags;
+    }
+
+    bool areFlagsDead() const { return deadFlags; }
 
     Reg getRegForTemp(unsigned int id);
 
     Reg::Vec getUsedRegisters();
 
+    /*! Get the used registers which are not dead and need to be saved and restored.
+    */
+    Reg::Vec getSavedRegisters();
+
     size_t getUsedRegisterNumber();
 
     unsigned getRegSize(unsigned reg);
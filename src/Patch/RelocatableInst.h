@@ -26,14 +26,27 @@
 #include "Patch/Types.h"
 #include "ExecBlock/ExecBlock.h"
 #include "Patch/PatchUtils.h"
+#include "Utility/Arena.h"
 
 namespace QBDI {
 
+// Kinds of the relocations which can be persisted by the DecodeCache
+enum RelocatableInstKind : uint8_t {
+    RELOC_NONE = 0,
+    RELOC_NO_RELOC = 1,
+    RELOC_DATA_BLOCK_REL = 2,
+    RELOC_DATA_BLOCK_ABS_REL = 3,
+    RELOC_EPILOGUE_REL = 4,
+    RELOC_GUEST_INST = 5,
+};
+
 class RelocatableInst {
 public:
 
     using SharedPtr    = std::shared_ptr<RelocatableInst>;
-    using SharedPtrVec = std::vector<std::shared_ptr<RelocatableInst>>;
+    // The instruction lists of a translation grow with each patch, their storage comes from the
+    // translation arena like the instructions
+    using SharedPtrVec = std::vector<SharedPtr, ArenaAllocator<SharedPtr>>;
 
     llvm::MCInst inst;
 
@@ -45,10 +58,40 @@ public:
         return inst;
     }
 
+    /*! Get the operand modified by the relocation, which lets the Assembly reuse a template of
+     *  the encoding.
+     */
+    virtual int getTemplateOperand() const {
+        return TEMPLATE_NONE;
+    }
+
+    /*! Get the data block offset accessed by the instruction, which lets the PatchOptimizer
+     *  recognize the accesses to the same context slot.
+     *
+     * @param[out] offset  The offset stored by the relocation.
+     *
+     * @return False if the instruction is not relocated relative to the data block.
+     */
+    virtual bool getDataBlockSlot(rword* offset) const {
+        return false;
+    }
+
+    /*! Get the parameters of the relocation, which lets the DecodeCache persist the patches and
+     *  create them again with makeRelocatableInst.
+     *
+     * @param[out] opn     The operand modified by the relocation.
+     * @param[out] offset  The offset stored by the relocation.
+     *
+     * @return The kind of the relocation, RELOC_NONE if it can't be persisted.
+     */
+    virtual RelocatableInstKind getKind(unsigned int* opn, rword* offset) const {
+        return RELOC_NONE;
+    }
+
     virtual ~RelocatableInst() {};
 };
 
-class NoReloc : public RelocatableInst, public AutoAlloc<RelocatableInst, NoReloc> {
+class NoReloc : public RelocatableInst, public ArenaAutoAlloc<RelocatableInst, NoReloc> {
 public:
 
     NoReloc(llvm::MCInst inst) : RelocatableInst(inst) {}
@@ -56,9 +99,37 @@ public:
     llvm::MCInst reloc(ExecBlock *exec_block) {
         return inst;
     }
+
+    int getTemplateOperand() const {
+        return TEMPLATE_WHOLE;
+    }
+
+    RelocatableInstKind getKind(unsigned int* opn, rword* offset) const {
+        *opn = 0;
+        *offset = 0;
+        return RELOC_NO_RELOC;
+    }
+};
+
+// A guest instruction, possibly transformed. Unlike the instructions generated by QBDI, the guest
+// instructions are unbounded and always encoded by LLVM instead of filling the encoding cache.
+class GuestInst : public RelocatableInst, public ArenaAutoAlloc<RelocatableInst, GuestInst> {
+public:
+
+    GuestInst(llvm::MCInst inst) : RelocatableInst(inst) {}
+
+    llvm::MCInst reloc(ExecBlock *exec_block) {
+        return inst;
+    }
+
+    RelocatableInstKind getKind(unsigned int* opn, rword* offset) const {
+        *opn = 0;
+        *offset = 0;
+        return RELOC_GUEST_INST;
+    }
 };
 
-class DataBlockRel : public RelocatableInst, public AutoAlloc<RelocatableInst, DataBlockRel> {
+class DataBlockRel : public RelocatableInst, public ArenaAutoAlloc<RelocatableInst, DataBlockRel> {
     unsigned int opn;
     rword        offset;
 
@@ -70,9 +141,24 @@ public:
         inst.getOperand(opn).setImm(offset + exec_block->getDataBlockOffset());
         return inst;
     }
+
+    int getTemplateOperand() const {
+        return opn;
+    }
+
+    bool getDataBlockSlot(rword* offset) const {
+        *offset = this->offset;
+        return true;
+    }
+
+    RelocatableInstKind getKind(unsigned int* opn, rword* offset) const {
+        *opn = this->opn;
+        *offset = this->offset;
+        return RELOC_DATA_BLOCK_REL;
+    }
 };
 
-class DataBlockAbsRel : public RelocatableInst, public AutoAlloc<RelocatableInst, DataBlockAbsRel> {
+class DataBlockAbsRel : public RelocatableInst, public ArenaAutoAlloc<RelocatableInst, DataBlockAbsRel> {
     unsigned int opn;
     rword        offset;
 
@@ -84,9 +170,24 @@ public:
         inst.getOperand(opn).setImm(exec_block->getDataBlockBase() + offset);
         return inst;
     }
+
+    int getTemplateOperand() const {
+        return opn;
+    }
+
+    bool getDataBlockSlot(rword* offset) const {
+        *offset = this->offset;
+        return true;
+    }
+
+    RelocatableInstKind getKind(unsigned int* opn, rword* offset) const {
+        *opn = this->opn;
+        *offset = this->offset;
+        return RELOC_DATA_BLOCK_ABS_REL;
+    }
 };
 
-class EpilogueRel : public RelocatableInst, public AutoAlloc<RelocatableInst, EpilogueRel> {
+class EpilogueRel : public RelocatableInst, public ArenaAutoAlloc<RelocatableInst, EpilogueRel> {
     unsigned int opn;
     rword        offset;
 
@@ -98,8 +199,44 @@ public:
         inst.getOperand(opn).setImm(offset + exec_block->getEpilogueOffset());
         return inst;
     }
+
+    int getTemplateOperand() const {
+        return opn;
+    }
+
+    RelocatableInstKind getKind(unsigned int* opn, rword* offset) const {
+        *opn = this->opn;
+        *offset = this->offset;
+        return RELOC_EPILOGUE_REL;
+    }
 };
 
+/*! Create a relocatable instruction from the parameters returned by RelocatableInst::getKind.
+ *
+ * @param[in] kind    The kind of the relocation.
+ * @param[in] inst    The instruction.
+ * @param[in] opn     The operand modified by the relocation.
+ * @param[in] offset  The offset stored by the relocation.
+ *
+ * @return The relocatable instruction, nullptr if the kind is unknown.
+ */
+inline RelocatableInst::SharedPtr makeRelocatableInst(RelocatableInstKind kind, llvm::MCInst inst, unsigned int opn, rword offset) {
+    switch(kind) {
+        case RELOC_NO_RELOC:
+            return NoReloc(inst);
+        case RELOC_DATA_BLOCK_REL:
+            return DataBlockRel(inst, opn, offset);
+        case RELOC_DATA_BLOCK_ABS_REL:
+            return DataBlockAbsRel(inst, opn, offset);
+        case RELOC_EPILOGUE_REL:
+            return EpilogueRel(inst, opn, offset);
+        case RELOC_GUEST_INST:
+            return GuestInst(inst);
+        default:
+            return nullptr;
+    }
+}
+
 }
 
 #endif
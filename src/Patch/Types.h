@@ -189,6 +189,7 @@ public:
     uint32_t patchSize;
     bool modifyPC;
     bool merge;
+    bool useFPR;
 
     inline rword endAddress() const {
         return address + instSize;
@@ -1115,4 +1115,75 @@ unsigned getImmediateSize(const llvm::MCInst* inst, const llvm::MCInstrDesc* des
     }
 }
 
+// Register classes of the x87, MMX, SSE, AVX and AVX-512 registers
+static const unsigned FPR_REGCLASSES[] = {
+    llvm::X86::RFP80RegClassID, llvm::X86::RSTRegClassID, llvm::X86::VR64RegClassID,
+    llvm::X86::VR128XRegClassID, llvm::X86::VR256XRegClassID, llvm::X86::VR512RegClassID,
+    llvm::X86::VK64RegClassID
+};
+
+// Instructions accessing the FPR state without any FPR operand
+static const unsigned FPR_OPCODES[] = {
+    llvm::X86::LDMXCSR, llvm::X86::STMXCSR, llvm::X86::VLDMXCSR, llvm::X86::VSTMXCSR,
+    llvm::X86::FXSAVE, llvm::X86::FXSAVE64, llvm::X86::FXRSTOR, llvm::X86::FXRSTOR64,
+    llvm::X86::XSAVE, llvm::X86::XSAVE64, llvm::X86::XSAVEOPT, llvm::X86::XSAVEOPT64,
+    llvm::X86::XSAVEC, llvm::X86::XSAVEC64, llvm::X86::XSAVES, llvm::X86::XSAVES64,
+    llvm::X86::XRSTOR, llvm::X86::XRSTOR64, llvm::X86::XRSTORS, llvm::X86::XRSTORS64,
+    llvm::X86::FNINIT, llvm::X86::FNCLEX, llvm::X86::FLDCW16m, llvm::X86::FNSTCW16m,
+    llvm::X86::FLDENVm, llvm::X86::FSTENVm, llvm::X86::FRSTORm, llvm::X86::FSAVEm,
+    llvm::X86::MMX_EMMS, llvm::X86::FEMMS, llvm::X86::VZEROUPPER, llvm::X86::VZEROALL,
+    llvm::X86::WAIT
+};
+
+// Every x87 instruction is encoded with one of the escape opcodes of the one-byte map, the
+// FPType of the TSFlags is only set on the pseudo instructions and never on a decoded MCInst
+static bool isX87(const llvm::MCInstrDesc& desc) {
+    uint8_t opcode = llvm::X86II::getBaseOpcodeFor(desc.TSFlags);
+    return (desc.TSFlags & llvm::X86II::OpMapMask) == llvm::X86II::OB &&
+           opcode >= 0xD8 && opcode <= 0xDF;
+}
+
+static bool isFPR(unsigned reg, const llvm::MCRegisterInfo* MRI) {
+    if(reg == llvm::X86::FPSW) {
+        return true;
+    }
+    for(unsigned regClass : FPR_REGCLASSES) {
+        if(MRI->getRegClass(regClass).contains(reg)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool useFPR(const llvm::MCInst* inst, const llvm::MCInstrInfo* MCII, const llvm::MCRegisterInfo* MRI) {
+    const llvm::MCInstrDesc& desc = MCII->get(inst->getOpcode());
+
+    // x87 instructions, including the memory forms without any register operand
+    if(isX87(desc)) {
+        return true;
+    }
+    for(unsigned opcode : FPR_OPCODES) {
+        if(inst->getOpcode() == opcode) {
+            return true;
+        }
+    }
+    for(unsigned i = 0; i < inst->getNumOperands(); i++) {
+        const llvm::MCOperand& op = inst->getOperand(i);
+        if(op.isReg() && op.getReg() != 0 && isFPR(op.getReg(), MRI)) {
+            return true;
+        }
+    }
+    for(unsigned i = 0; i < desc.getNumImplicitUses(); i++) {
+        if(isFPR(desc.getImplicitUses()[i], MRI)) {
+            return true;
+        }
+    }
+    for(unsigned i = 0; i < desc.getNumImplicitDefs(); i++) {
+        if(isFPR(desc.getImplicitDefs()[i], MRI)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 };
@@ -16,34 +16,124 @@
  * limitations under the License.
  */
 #include "Patch/X86_64/InstrRules_X86_64.h"
+#include "Patch/X86_64/RelocatableInst_X86_64.h"
+#include "Patch/MemoryFilter.h"
+#include "Utility/LogSys.h"
 
 namespace QBDI {
 
 /* Generate a series of RelocatableInst which when appended to an instrumentation code trigger a
  * break to host. It receive in argument a temporary reg which will be used for computations then
- * finally restored.
+ * finally restored. Fast callbacks jump to one of the fast callback trampolines, depending on
+ * whether they need the guest state, instead of the epilogue.
 */
-RelocatableInst::SharedPtrVec getBreakToHost(Reg temp) {
+RelocatableInst::SharedPtrVec getBreakToHost(Reg temp, bool fastCallback, bool callbackState) {
     RelocatableInst::SharedPtrVec breakToHost;
 
     // Use the temporary register to compute RIP + offset which is the address which will follow this
-    // patch and where the execution needs to be resumed 
+    // patch and where the execution needs to be resumed. JMP *[trampoline] is one byte longer than
+    // the JMP to the epilogue.
 #if defined(QBDI_ARCH_X86)
-    breakToHost.push_back(HostPCRel(mov32ri(temp, 0), 1, 22));
+    breakToHost.push_back(HostPCRel(mov32ri(temp, 0), 1, fastCallback ? 23 : 22));
 #else
-    breakToHost.push_back(HostPCRel(mov64ri(temp, 0), 1, 29));
+    breakToHost.push_back(HostPCRel(mov64ri(temp, 0), 1, fastCallback ? 30 : 29));
 #endif
     // Set the selector to this address so the execution can be resumed when the exec block will be 
     // reexecuted
     append(breakToHost, SaveReg(temp, Offset(offsetof(Context, hostState.selector))));
     // Restore the temporary register
     append(breakToHost, LoadReg(temp, Offset(temp)));
-    // Jump to the epilogue to break to the host
-    append(breakToHost, JmpEpilogue());
+    // Jump to the fast callback trampoline or to the epilogue to break to the host
+    if(fastCallback && callbackState) {
+        breakToHost.push_back(JmpM(Offset(offsetof(Context, hostState.fastCallback))));
+    }
+    else if(fastCallback) {
+        breakToHost.push_back(JmpM(Offset(offsetof(Context, hostState.fastCallbackNoState))));
+    }
+    else {
+        append(breakToHost, JmpEpilogue());
+    }
 
     return breakToHost;
 }
 
+/* Generate a break to host guarded by a memory filter, the accessed address needs to be computed
+ * in Temp(0) beforehand. The slice of the address is looked up in the filter table and, if its
+ * entry is zero, the callback setup and the break to host are skipped. The lookup ends in RCX and
+ * is tested with jrcxz such that the guest EFLAGS are never modified. All the temporary registers
+ * are restored on both paths, the offsets are computed from the size of the fixed encodings.
+*/
+RelocatableInst::SharedPtrVec getFilteredBreakToHost(const MemoryFilter* filter, TempManager* temp_manager, bool setPC, rword pc) {
+#if defined(QBDI_ARCH_X86)
+    const unsigned int movSize = 5, memSize = 6, breakSize = 22;
+#else
+    const unsigned int movSize = 10, memSize = 7, breakSize = 29;
+#endif
+    RelocatableInst::SharedPtrVec check, hit, miss;
+    Reg address = temp_manager->getRegForTemp(0);
+    Reg table = temp_manager->getRegForTemp(1);
+    Reg::Vec usedRegisters = temp_manager->getUsedRegisters();
+    unsigned int hitSize = 0, missSize = 0;
+
+    // RCX is saved and restored with the temporaries if it isn't one of them
+    bool saveRCX = true;
+    for(Reg r : usedRegisters) {
+        if((unsigned int) r == (unsigned int) Reg(2)) {
+            saveRCX = false;
+        }
+    }
+    if(saveRCX) {
+        append(check, SaveReg(Reg(2), Offset(Reg(2))));
+    }
+    // ECX = table[bswap(address) & 0xFFFF]
+    unsigned int address32 = temp_manager->getSizedSubReg(address, 4);
+    check.push_back(Mov(table, Constant(reinterpret_cast<rword>(filter->getTable()))));
+    check.push_back(NoReloc(bswap32r(address32)));
+    check.push_back(NoReloc(movzx32rr16(address32, temp_manager->getSizedSubReg(address, 2))));
+    check.push_back(NoReloc(mov32rm8(temp_manager->getSizedSubReg(Reg(2), 4), table, 1, address, 0, 0)));
+
+    // Hit: setup the callback in the host state and break to the host
+    hit.push_back(Mov(address, Constant(reinterpret_cast<rword>(filter->getCallback()))));
+    append(hit, SaveReg(address, Offset(offsetof(Context, hostState.callback))));
+    hit.push_back(Mov(address, Constant(reinterpret_cast<rword>(filter->getData()))));
+    append(hit, SaveReg(address, Offset(offsetof(Context, hostState.data))));
+    hit.push_back(InstId(movri(address, 0), 1));
+    append(hit, SaveReg(address, Offset(offsetof(Context, hostState.origin))));
+    hitSize += 3 * (movSize + memSize);
+    if(setPC) {
+        hit.push_back(Mov(address, Constant(pc)));
+        append(hit, SaveReg(address, Offset(Reg(REG_PC))));
+        hitSize += movSize + memSize;
+    }
+    if(saveRCX) {
+        append(hit, LoadReg(Reg(2), Offset(Reg(2))));
+        append(miss, LoadReg(Reg(2), Offset(Reg(2))));
+        hitSize += memSize;
+        missSize += memSize;
+    }
+    for(size_t i = 0; i < usedRegisters.size(); i++) {
+        if(i > 0) {
+            append(hit, LoadReg(usedRegisters[i], Offset(usedRegisters[i])));
+            hitSize += memSize;
+        }
+        append(miss, LoadReg(usedRegisters[i], Offset(usedRegisters[i])));
+        missSize += memSize;
+    }
+    append(hit, getBreakToHost(usedRegisters[0]));
+    hitSize += breakSize;
+    // The execution resumes here after the callback, skip the miss path. The relative offsets are
+    // encoded relative to the start of the immediate.
+    hit.push_back(NoReloc(jmp(missSize + 4)));
+    hitSize += 5;
+
+    RequireAction("getFilteredBreakToHost", hitSize < 128, abort());
+    check.push_back(NoReloc(jcxz(hitSize + 1)));
+    append(check, hit);
+    append(check, miss);
+
+    return check;
+}
+
 std::vector<std::shared_ptr<InstrRule>> getMemAccessInstrRules() {
     // TODO: Insert here memory access rules
     return {};
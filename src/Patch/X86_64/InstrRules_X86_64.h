@@ -30,8 +30,11 @@
 namespace QBDI {
 
 class InstrRule;
+class MemoryFilter;
 
-RelocatableInst::SharedPtrVec getBreakToHost(Reg temp);
+RelocatableInst::SharedPtrVec getBreakToHost(Reg temp, bool fastCallback = false, bool callbackState = true);
+
+RelocatableInst::SharedPtrVec getFilteredBreakToHost(const MemoryFilter* filter, TempManager* temp_manager, bool setPC, rword pc);
 
 std::vector<std::shared_ptr<InstrRule>> getMemAccessInstrRules();
 
@@ -40,6 +40,20 @@ llvm::MCInst mov32ri(unsigned int reg, rword imm) {
     return inst;
 }
 
+llvm::MCInst mov8mr(unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg, unsigned int src) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::MOV8mr);
+    inst.addOperand(llvm::MCOperand::createReg(base));
+    inst.addOperand(llvm::MCOperand::createImm(scale));
+    inst.addOperand(llvm::MCOperand::createReg(offset));
+    inst.addOperand(llvm::MCOperand::createImm(displacement));
+    inst.addOperand(llvm::MCOperand::createReg(seg));
+    inst.addOperand(llvm::MCOperand::createReg(src));
+
+    return inst;
+}
+
 llvm::MCInst mov32mr(unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg, unsigned int src) {
     llvm::MCInst inst;
 
@@ -54,6 +68,20 @@ llvm::MCInst mov32mr(unsigned int base, rword scale, unsigned int offset, rword
     return inst;
 }
 
+llvm::MCInst mov32mi(unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg, rword imm) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::MOV32mi);
+    inst.addOperand(llvm::MCOperand::createReg(base));
+    inst.addOperand(llvm::MCOperand::createImm(scale));
+    inst.addOperand(llvm::MCOperand::createReg(offset));
+    inst.addOperand(llvm::MCOperand::createImm(displacement));
+    inst.addOperand(llvm::MCOperand::createReg(seg));
+    inst.addOperand(llvm::MCOperand::createImm(imm));
+
+    return inst;
+}
+
 
 llvm::MCInst mov64rr(unsigned int dst, unsigned int src) {
     llvm::MCInst inst;
@@ -90,6 +118,20 @@ llvm::MCInst mov64mr(unsigned int base, rword scale, unsigned int offset, rword
     return inst;
 }
 
+llvm::MCInst mov64mi32(unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg, rword imm) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::MOV64mi32);
+    inst.addOperand(llvm::MCOperand::createReg(base));
+    inst.addOperand(llvm::MCOperand::createImm(scale));
+    inst.addOperand(llvm::MCOperand::createReg(offset));
+    inst.addOperand(llvm::MCOperand::createImm(displacement));
+    inst.addOperand(llvm::MCOperand::createReg(seg));
+    inst.addOperand(llvm::MCOperand::createImm(imm));
+
+    return inst;
+}
+
 llvm::MCInst mov64rm(unsigned int dst, unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg) {
     llvm::MCInst inst;
 
@@ -147,6 +189,56 @@ llvm::MCInst mov32rm(unsigned int dst, unsigned int base, rword scale, unsigned
     return inst;
 }
 
+llvm::MCInst movzx32rr8(unsigned int dst, unsigned int src) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::MOVZX32rr8);
+    inst.addOperand(llvm::MCOperand::createReg(dst));
+    inst.addOperand(llvm::MCOperand::createReg(src));
+
+    return inst;
+}
+
+llvm::MCInst movzx32rr16(unsigned int dst, unsigned int src) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::MOVZX32rr16);
+    inst.addOperand(llvm::MCOperand::createReg(dst));
+    inst.addOperand(llvm::MCOperand::createReg(src));
+
+    return inst;
+}
+
+llvm::MCInst bswap32r(unsigned int reg) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::BSWAP32r);
+    inst.addOperand(llvm::MCOperand::createReg(reg));
+    inst.addOperand(llvm::MCOperand::createReg(reg));
+
+    return inst;
+}
+
+llvm::MCInst not32r(unsigned int reg) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::NOT32r);
+    inst.addOperand(llvm::MCOperand::createReg(reg));
+    inst.addOperand(llvm::MCOperand::createReg(reg));
+
+    return inst;
+}
+
+llvm::MCInst not64r(unsigned int reg) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::NOT64r);
+    inst.addOperand(llvm::MCOperand::createReg(reg));
+    inst.addOperand(llvm::MCOperand::createReg(reg));
+
+    return inst;
+}
+
 llvm::MCInst jmp32m(unsigned int base, rword offset) {
     llvm::MCInst inst;
 
@@ -182,6 +274,24 @@ llvm::MCInst jmp(rword offset) {
     return inst;
 }
 
+llvm::MCInst jecxz(rword offset) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::JECXZ);
+    inst.addOperand(llvm::MCOperand::createImm(offset));
+
+    return inst;
+}
+
+llvm::MCInst jrcxz(rword offset) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::JRCXZ);
+    inst.addOperand(llvm::MCOperand::createImm(offset));
+
+    return inst;
+}
+
 llvm::MCInst fxsave(unsigned int base, rword offset) {
     llvm::MCInst inst;
 
@@ -275,6 +385,28 @@ llvm::MCInst pop64r(unsigned int reg) {
     return inst;
 }
 
+llvm::MCInst and32ri8(unsigned int reg, rword imm) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::AND32ri8);
+    inst.addOperand(llvm::MCOperand::createReg(reg));
+    inst.addOperand(llvm::MCOperand::createReg(reg));
+    inst.addOperand(llvm::MCOperand::createImm(imm));
+
+    return inst;
+}
+
+llvm::MCInst and64ri8(unsigned int reg, rword imm) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::AND64ri8);
+    inst.addOperand(llvm::MCOperand::createReg(reg));
+    inst.addOperand(llvm::MCOperand::createReg(reg));
+    inst.addOperand(llvm::MCOperand::createImm(imm));
+
+    return inst;
+}
+
 llvm::MCInst addr32i(unsigned int dst, unsigned int src, rword imm) {
 
     // We use LEA to avoid flags to be modified
@@ -287,6 +419,36 @@ llvm::MCInst addr64i(unsigned int dst, unsigned int src, rword imm) {
     return lea64(dst, src, 1, 0, imm, 0);
 }
 
+llvm::MCInst add32mi8(unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg, rword imm) {
+    llvm::MCInst inst;
+
+    // Modifies the flags, only usable when they are dead
+    inst.setOpcode(llvm::X86::ADD32mi8);
+    inst.addOperand(llvm::MCOperand::createReg(base));
+    inst.addOperand(llvm::MCOperand::createImm(scale));
+    inst.addOperand(llvm::MCOperand::createReg(offset));
+    inst.addOperand(llvm::MCOperand::createImm(displacement));
+    inst.addOperand(llvm::MCOperand::createReg(seg));
+    inst.addOperand(llvm::MCOperand::createImm(imm));
+
+    return inst;
+}
+
+llvm::MCInst add64mi8(unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg, rword imm) {
+    llvm::MCInst inst;
+
+    // Modifies the flags, only usable when they are dead
+    inst.setOpcode(llvm::X86::ADD64mi8);
+    inst.addOperand(llvm::MCOperand::createReg(base));
+    inst.addOperand(llvm::MCOperand::createImm(scale));
+    inst.addOperand(llvm::MCOperand::createReg(offset));
+    inst.addOperand(llvm::MCOperand::createImm(displacement));
+    inst.addOperand(llvm::MCOperand::createReg(seg));
+    inst.addOperand(llvm::MCOperand::createImm(imm));
+
+    return inst;
+}
+
 llvm::MCInst lea32(unsigned int dst, unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg) {
     llvm::MCInst inst;
 
@@ -347,6 +509,24 @@ llvm::MCInst pushf64() {
     return inst;
 }
 
+llvm::MCInst call32r(unsigned int reg) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::CALL32r);
+    inst.addOperand(llvm::MCOperand::createReg(reg));
+
+    return inst;
+}
+
+llvm::MCInst call64r(unsigned int reg) {
+    llvm::MCInst inst;
+
+    inst.setOpcode(llvm::X86::CALL64r);
+    inst.addOperand(llvm::MCOperand::createReg(reg));
+
+    return inst;
+}
+
 llvm::MCInst ret() {
     llvm::MCInst inst;
 
@@ -371,6 +551,10 @@ RelocatableInst::SharedPtr Mov(Reg reg, Offset offset) {
     return DataBlockRelx86(movrm(reg, 0, 0, 0, 0, 0), 4, offset, 1, 7);
 }
 
+RelocatableInst::SharedPtr Mov(Offset offset, Constant cst) {
+    return DataBlockRelx86(movmi(0, 0, 0, 0, 0, cst), 3, offset, 0, 11);
+}
+
 RelocatableInst::SharedPtr JmpM(Offset offset) {
     return DataBlockRelx86(jmpm(0, 0), 3, offset, 0, 6);
 }
@@ -28,26 +28,38 @@ namespace QBDI {
 #define movri mov64ri
 #define movmr mov64mr
 #define movrm mov64rm
+#define movmi mov64mi32
 #define pushr push64r
 #define popr pop64r
 #define addri addr64i
+#define addmi add64mi8
 #define lea lea64
 #define popf popf64
 #define pushf pushf64
 #define jmpm jmp64m
+#define notr not64r
+#define andri and64ri8
+#define callr call64r
+#define jcxz jrcxz
 
 #else /* QBDI_ARCH_X86 */
 #define movrr mov32rr
 #define movri mov32ri
 #define movmr mov32mr
 #define movrm mov32rm
+#define movmi mov32mi
 #define pushr push32r
 #define popr pop32r
 #define addri addr32i
+#define addmi add32mi8
 #define lea lea32
 #define popf popf32
 #define pushf pushf32
 #define jmpm jmp32m
+#define notr not32r
+#define andri and32ri8
+#define callr call32r
+#define jcxz jecxz
 
 #endif
 
@@ -59,12 +71,18 @@ llvm::MCInst mov64ri(unsigned int reg, rword imm);
 
 llvm::MCInst mov64mr(unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg, unsigned int src);
 
+llvm::MCInst mov64mi32(unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg, rword imm);
+
+llvm::MCInst mov8mr(unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg, unsigned int src);
+
 llvm::MCInst mov32rr(unsigned int dst, unsigned int src);
 
 llvm::MCInst mov32ri(unsigned int reg, rword imm);
 
 llvm::MCInst mov32mr(unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg, unsigned int src);
 
+llvm::MCInst mov32mi(unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg, rword imm);
+
 llvm::MCInst mov32rm8(unsigned int dst, unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg);
 
 llvm::MCInst mov32rm16(unsigned int dst, unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg);
@@ -73,6 +91,16 @@ llvm::MCInst mov32rm(unsigned int dst, unsigned int base, rword scale, unsigned
 
 llvm::MCInst mov64rm(unsigned int dst, unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg);
 
+llvm::MCInst movzx32rr8(unsigned int dst, unsigned int src);
+
+llvm::MCInst movzx32rr16(unsigned int dst, unsigned int src);
+
+llvm::MCInst bswap32r(unsigned int reg);
+
+llvm::MCInst not32r(unsigned int reg);
+
+llvm::MCInst not64r(unsigned int reg);
+
 llvm::MCInst jmp32m(unsigned int base, rword offset);
 
 llvm::MCInst jmp64m(unsigned int base, rword offset);
@@ -93,10 +121,18 @@ llvm::MCInst pop32r(unsigned int reg);
 
 llvm::MCInst pop64r(unsigned int reg);
 
+llvm::MCInst and32ri8(unsigned int reg, rword imm);
+
+llvm::MCInst and64ri8(unsigned int reg, rword imm);
+
 llvm::MCInst addr32i(unsigned int reg, rword imm);
 
 llvm::MCInst addr64i(unsigned int reg, rword imm);
 
+llvm::MCInst add32mi8(unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg, rword imm);
+
+llvm::MCInst add64mi8(unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg, rword imm);
+
 llvm::MCInst lea32(unsigned int dst, unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg);
 
 llvm::MCInst lea64(unsigned int dst, unsigned int base, rword scale, unsigned int offset, rword displacement, unsigned int seg);
@@ -111,6 +147,14 @@ llvm::MCInst popf64();
 
 llvm::MCInst jmp(rword offset);
 
+llvm::MCInst jecxz(rword offset);
+
+llvm::MCInst jrcxz(rword offset);
+
+llvm::MCInst call32r(unsigned int reg);
+
+llvm::MCInst call64r(unsigned int reg);
+
 llvm::MCInst ret();
 
 // high level layer 2
@@ -123,6 +167,8 @@ RelocatableInst::SharedPtr Mov(Offset offset, Reg reg);
 
 RelocatableInst::SharedPtr Mov(Reg reg, Offset offset);
 
+RelocatableInst::SharedPtr Mov(Offset offset, Constant cst);
+
 RelocatableInst::SharedPtr JmpM(Offset offset);
 
 RelocatableInst::SharedPtr Fxsave(Offset offset);
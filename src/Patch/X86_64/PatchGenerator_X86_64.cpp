@@ -16,6 +16,8 @@
  * limitations under the License.
  */
 
+#include <cstddef>
+
 #include "Patch/X86_64/PatchGenerator_X86_64.h"
 #include "Patch/X86_64/RelocatableInst_X86_64.h"
 #include "Utility/LogSys.h"
@@ -397,4 +399,62 @@ RelocatableInst::SharedPtrVec SimulateRet::generate(const llvm::MCInst* inst,
     return {patch};
 }
 
+RelocatableInst::SharedPtrVec IncrementCounter::generate(const llvm::MCInst* inst,
+    rword address, rword instSize, TempManager *temp_manager, const Patch *toMerge) {
+    rword* counter = counters->getCounter(address);
+    Reg counterReg = temp_manager->getRegForTemp(temp);
+    // The counter is incremented in memory when the flags are dead
+    if(temp_manager->areFlagsDead()) {
+        return {
+            Mov(counterReg, Constant(reinterpret_cast<rword>(counter))),
+            NoReloc(addmi(counterReg, 1, 0, 0, 0, 1)),
+        };
+    }
+    Reg valueReg = temp_manager->getRegForTemp(value);
+
+    return {
+        Mov(counterReg, Constant(reinterpret_cast<rword>(counter))),
+        NoReloc(movrm(valueReg, counterReg, 1, 0, 0, 0)),
+        NoReloc(lea(valueReg, valueReg, 1, 0, 1, 0)),
+        NoReloc(movmr(counterReg, 1, 0, 0, 0, valueReg)),
+    };
+}
+
+// The size of the record is written with a 32 bits store which must not overwrite the type
+static_assert(offsetof(MemoryAccess, type) >= offsetof(MemoryAccess, size) + 4,
+              "MemoryAccess layout is not compatible with TraceMemoryAccess");
+
+RelocatableInst::SharedPtrVec TraceMemoryAccess::generate(const llvm::MCInst* inst,
+    rword address, rword instSize, TempManager *temp_manager, const Patch *toMerge) {
+    Reg tempReg = temp_manager->getRegForTemp(temp);
+    Reg cursorReg = temp_manager->getRegForTemp(cursor);
+    Reg cellReg = temp_manager->getRegForTemp(cell);
+    RelocatableInst::SharedPtrVec patch;
+    unsigned size;
+
+    patch.push_back(Mov(cellReg, Constant(reinterpret_cast<rword>(cursorCell))));
+    patch.push_back(NoReloc(movrm(cursorReg, cellReg, 1, 0, 0, 0)));
+    if(type == MEMORY_READ) {
+        size = getReadSize(inst);
+        append(patch, GetReadAddress(temp).generate(inst, address, instSize, temp_manager, nullptr));
+        patch.push_back(NoReloc(movmr(cursorReg, 1, 0, offsetof(MemoryAccess, accessAddress), 0, tempReg)));
+        append(patch, GetReadValue(temp).generate(inst, address, instSize, temp_manager, nullptr));
+    }
+    else {
+        RequireAction("TraceMemoryAccess::generate", type == MEMORY_WRITE, abort());
+        size = getWriteSize(inst);
+        append(patch, GetWriteAddress(temp).generate(inst, address, instSize, temp_manager, nullptr));
+        patch.push_back(NoReloc(movmr(cursorReg, 1, 0, offsetof(MemoryAccess, accessAddress), 0, tempReg)));
+        append(patch, GetWriteValue(temp).generate(inst, address, instSize, temp_manager, nullptr));
+    }
+    patch.push_back(NoReloc(movmr(cursorReg, 1, 0, offsetof(MemoryAccess, value), 0, tempReg)));
+    patch.push_back(Mov(tempReg, Constant(address)));
+    patch.push_back(NoReloc(movmr(cursorReg, 1, 0, offsetof(MemoryAccess, instAddress), 0, tempReg)));
+    patch.push_back(NoReloc(mov32mi(cursorReg, 1, 0, offsetof(MemoryAccess, size), 0, size)));
+    patch.push_back(NoReloc(mov32mi(cursorReg, 1, 0, offsetof(MemoryAccess, type), 0, type)));
+    patch.push_back(NoReloc(lea(cursorReg, cursorReg, 1, 0, sizeof(MemoryAccess), 0)));
+    patch.push_back(NoReloc(movmr(cellReg, 1, 0, 0, 0, cursorReg)));
+    return patch;
+}
+
 }
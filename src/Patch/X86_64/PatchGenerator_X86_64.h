@@ -21,6 +21,8 @@
 #include "Patch/X86_64/Layer2_X86_64.h"
 #include "Patch/PatchGenerator.h"
 #include "Patch/InstInfo.h"
+#include "Patch/CounterArray.h"
+#include "Callback.h"
 
 namespace QBDI {
 
@@ -412,6 +414,83 @@ public:
     bool modifyPC() {return true;}
 };
 
+class IncrementCounter : public PatchGenerator, public AutoAlloc<PatchGenerator, IncrementCounter> {
+
+    Temp          temp;
+    Temp          value;
+    CounterArray* counters;
+
+public:
+
+    /*! Increment the counter of the current instruction address in a counter array. The counter
+     * is allocated when the instruction is instrumented. The increment doesn't modify the flags
+     * unless they are dead across the instruction.
+     *
+     * @param[in] temp      Any unused temporary, overwritten by this generator.
+     * @param[in] value     Any unused temporary, overwritten by this generator.
+     * @param[in] counters  The counter array which holds the counter.
+    */
+    IncrementCounter(Temp temp, Temp value, CounterArray* counters) : temp(temp), value(value), counters(counters) {}
+
+    /*! Output:
+     *
+     * MOV REG64 temp, IMM64 counter
+     * MOV REG64 value, MEM64 [temp]
+     * LEA REG64 value, MEM64 [value + 1]
+     * MOV MEM64 [temp], REG64 value
+     *
+     * Or if the flags are dead:
+     *
+     * MOV REG64 temp, IMM64 counter
+     * ADD MEM64 [temp], IMM8 1
+    */
+    RelocatableInst::SharedPtrVec generate(const llvm::MCInst* inst,
+        rword address, rword instSize, TempManager *temp_manager, const Patch *toMerge);
+};
+
+class TraceMemoryAccess : public PatchGenerator, public AutoAlloc<PatchGenerator, TraceMemoryAccess> {
+
+    Temp             temp;
+    Temp             cursor;
+    Temp             cell;
+    MemoryAccessType type;
+    MemoryAccess**   cursorCell;
+
+public:
+
+    /*! Append a MemoryAccess record describing the read or the write access of the instruction
+     * to a trace buffer and advance the trace cursor. The buffer is not bound checked, the host
+     * needs to ensure enough records are available before executing the instruction. The record
+     * doesn't modify the flags.
+     *
+     * @param[in] temp        Any unused temporary, overwritten by this generator.
+     * @param[in] cursor      Any unused temporary, overwritten by this generator.
+     * @param[in] cell        Any unused temporary, overwritten by this generator.
+     * @param[in] type        Either MEMORY_READ or MEMORY_WRITE.
+     * @param[in] cursorCell  Host memory holding the address of the next free record.
+    */
+    TraceMemoryAccess(Temp temp, Temp cursor, Temp cell, MemoryAccessType type, MemoryAccess** cursorCell)
+        : temp(temp), cursor(cursor), cell(cell), type(type), cursorCell(cursorCell) {}
+
+    /*! Output:
+     *
+     * MOV REG64 cell, IMM64 cursorCell
+     * MOV REG64 cursor, MEM64 [cell]
+     * <GetReadAddress / GetWriteAddress temp>
+     * MOV MEM64 [cursor + accessAddress], REG64 temp
+     * <GetReadValue / GetWriteValue temp>
+     * MOV MEM64 [cursor + value], REG64 temp
+     * MOV REG64 temp, IMM64 address
+     * MOV MEM64 [cursor + instAddress], REG64 temp
+     * MOV MEM32 [cursor + size], IMM32 size
+     * MOV MEM32 [cursor + type], IMM32 type
+     * LEA REG64 cursor, MEM64 [cursor + sizeof(MemoryAccess)]
+     * MOV MEM64 [cell], REG64 cursor
+    */
+    RelocatableInst::SharedPtrVec generate(const llvm::MCInst* inst,
+        rword address, rword instSize, TempManager *temp_manager, const Patch *toMerge);
+};
+
 
 }
 
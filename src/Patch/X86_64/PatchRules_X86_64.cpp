@@ -15,6 +15,8 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <iterator>
+
 #include "Patch/PatchRule.h"
 #include "Patch/X86_64/PatchRules_X86_64.h"
 #include "Patch/X86_64/Layer2_X86_64.h"
@@ -23,38 +25,98 @@
 
 namespace QBDI {
 
-RelocatableInst::SharedPtrVec getExecBlockPrologue() {
-    RelocatableInst::SharedPtrVec prologue;
+// Restore the guest FPR from the context
+static RelocatableInst::SharedPtrVec getFPRRestore() {
+    RelocatableInst::SharedPtrVec fpr;
 
+#ifndef _QBDI_ASAN_ENABLED_ // Disabled if ASAN is enabled as it breaks context alignment
+    fpr.push_back(Fxrstor(Offset(offsetof(Context, fprState))));
+    if(isHostCPUFeaturePresent("avx")) {
+        LogDebug("getFPRRestore", "AVX support enabled in guest context switches");
+        fpr.push_back(Vinsertf128(llvm::X86::YMM0, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm0)), 1));
+        fpr.push_back(Vinsertf128(llvm::X86::YMM1, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm1)), 1));
+        fpr.push_back(Vinsertf128(llvm::X86::YMM2, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm2)), 1));
+        fpr.push_back(Vinsertf128(llvm::X86::YMM3, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm3)), 1));
+        fpr.push_back(Vinsertf128(llvm::X86::YMM4, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm4)), 1));
+        fpr.push_back(Vinsertf128(llvm::X86::YMM5, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm5)), 1));
+        fpr.push_back(Vinsertf128(llvm::X86::YMM6, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm6)), 1));
+        fpr.push_back(Vinsertf128(llvm::X86::YMM7, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm7)), 1));
+#if defined(QBDI_ARCH_X86_64)
+        fpr.push_back(Vinsertf128(llvm::X86::YMM8, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm8)), 1));
+        fpr.push_back(Vinsertf128(llvm::X86::YMM9, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm9)), 1));
+        fpr.push_back(Vinsertf128(llvm::X86::YMM10, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm10)), 1));
+        fpr.push_back(Vinsertf128(llvm::X86::YMM11, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm11)), 1));
+        fpr.push_back(Vinsertf128(llvm::X86::YMM12, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm12)), 1));
+        fpr.push_back(Vinsertf128(llvm::X86::YMM13, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm13)), 1));
+        fpr.push_back(Vinsertf128(llvm::X86::YMM14, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm14)), 1));
+        fpr.push_back(Vinsertf128(llvm::X86::YMM15, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm15)), 1));
+#endif // QBDI_ARCH_X86_64
+    }
+#endif
+    return fpr;
+}
+
+// Save the guest FPR in the context
+static RelocatableInst::SharedPtrVec getFPRSave() {
+    RelocatableInst::SharedPtrVec fpr;
 
-    // Save host BP, SP
-    append(prologue, SaveReg(Reg(REG_BP), Offset(offsetof(Context, hostState.bp))));
-    append(prologue, SaveReg(Reg(REG_SP), Offset(offsetof(Context, hostState.sp))));
-    // Restore FPR
 #ifndef _QBDI_ASAN_ENABLED_ // Disabled if ASAN is enabled as it breaks context alignment
-    prologue.push_back(Fxrstor(Offset(offsetof(Context, fprState))));
+    fpr.push_back(Fxsave(Offset(offsetof(Context, fprState))));
     if(isHostCPUFeaturePresent("avx")) {
-        LogDebug("getExecBlockPrologue", "AVX support enabled in guest context switches");
-        prologue.push_back(Vinsertf128(llvm::X86::YMM0, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm0)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM1, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm1)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM2, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm2)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM3, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm3)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM4, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm4)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM5, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm5)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM6, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm6)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM7, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm7)), 1));
+        LogDebug("getFPRSave", "AVX support enabled in guest context switches");
+        fpr.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm0)), llvm::X86::YMM0, 1));
+        fpr.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm1)), llvm::X86::YMM1, 1));
+        fpr.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm2)), llvm::X86::YMM2, 1));
+        fpr.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm3)), llvm::X86::YMM3, 1));
+        fpr.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm4)), llvm::X86::YMM4, 1));
+        fpr.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm5)), llvm::X86::YMM5, 1));
+        fpr.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm6)), llvm::X86::YMM6, 1));
+        fpr.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm7)), llvm::X86::YMM7, 1));
 #if defined(QBDI_ARCH_X86_64)
-        prologue.push_back(Vinsertf128(llvm::X86::YMM8, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm8)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM9, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm9)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM10, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm10)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM11, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm11)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM12, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm12)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM13, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm13)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM14, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm14)), 1));
-        prologue.push_back(Vinsertf128(llvm::X86::YMM15, Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm15)), 1));
+        fpr.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm8)), llvm::X86::YMM8, 1));
+        fpr.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm9)), llvm::X86::YMM9, 1));
+        fpr.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm10)), llvm::X86::YMM10, 1));
+        fpr.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm11)), llvm::X86::YMM11, 1));
+        fpr.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm12)), llvm::X86::YMM12, 1));
+        fpr.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm13)), llvm::X86::YMM13, 1));
+        fpr.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm14)), llvm::X86::YMM14, 1));
+        fpr.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm15)), llvm::X86::YMM15, 1));
 #endif // QBDI_ARCH_X86_64
     }
 #endif
+    return fpr;
+}
+
+// Size of a FPR save or restore sequence. Fxsave and fxrstor are encoded on 7 bytes and every
+// vextractf128 or vinsertf128 on 10 bytes, all of them using a 32 bits displacement.
+static rword getFPRSize(const RelocatableInst::SharedPtrVec& fpr) {
+    return fpr.empty() ? 0 : 7 + 10 * (fpr.size() - 1);
+}
+
+// Skip a FPR save or restore sequence if the guest FPR are not switched by this ExecBlock. Clobbers
+// Reg(2) and thus needs to be used while the guest value of Reg(2) is saved in the context.
+static RelocatableInst::SharedPtrVec getLazyFPR(const RelocatableInst::SharedPtrVec& fpr) {
+    RelocatableInst::SharedPtrVec lazy;
+
+    append(lazy, LoadReg(Reg(2), Offset(offsetof(Context, hostState.skipFPR))));
+    // Jump over the jmp if skipFPR is zero, the relative offsets are encoded relative to the
+    // start of the immediate
+    lazy.push_back(NoReloc(jcxz(5 + 1)));
+    lazy.push_back(NoReloc(jmp(getFPRSize(fpr) + 4)));
+    append(lazy, fpr);
+
+    return lazy;
+}
+
+RelocatableInst::SharedPtrVec getExecBlockPrologue() {
+    RelocatableInst::SharedPtrVec prologue;
+
+
+    // Save host BP, SP
+    append(prologue, SaveReg(Reg(REG_BP), Offset(offsetof(Context, hostState.bp))));
+    append(prologue, SaveReg(Reg(REG_SP), Offset(offsetof(Context, hostState.sp))));
+    // Restore FPR if needed
+    append(prologue, getLazyFPR(getFPRRestore()));
     // Restore EFLAGS
     append(prologue, LoadReg(Reg(0), Offset(offsetof(Context, gprState.eflags))));
     prologue.push_back(Pushr(Reg(0)));
@@ -74,31 +136,8 @@ RelocatableInst::SharedPtrVec getExecBlockEpilogue() {
     // Save GPR
     for(unsigned int i = 0; i < NUM_GPR-1; i++)
         append(epilogue, SaveReg(Reg(i), Offset(Reg(i))));
-    // Save FPR
-#ifndef _QBDI_ASAN_ENABLED_ // Disabled if ASAN is enabled as it breaks context alignment
-    epilogue.push_back(Fxsave(Offset(offsetof(Context, fprState))));
-    if(isHostCPUFeaturePresent("avx")) {
-        LogDebug("getExecBlockEpilogue", "AVX support enabled in guest context switches");
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm0)), llvm::X86::YMM0, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm1)), llvm::X86::YMM1, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm2)), llvm::X86::YMM2, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm3)), llvm::X86::YMM3, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm4)), llvm::X86::YMM4, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm5)), llvm::X86::YMM5, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm6)), llvm::X86::YMM6, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm7)), llvm::X86::YMM7, 1));
-#if defined(QBDI_ARCH_X86_64)
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm8)), llvm::X86::YMM8, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm9)), llvm::X86::YMM9, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm10)), llvm::X86::YMM10, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm11)), llvm::X86::YMM11, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm12)), llvm::X86::YMM12, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm13)), llvm::X86::YMM13, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm14)), llvm::X86::YMM14, 1));
-        epilogue.push_back(Vextractf128(Offset(offsetof(Context, fprState) + offsetof(FPRState, ymm15)), llvm::X86::YMM15, 1));
-#endif // QBDI_ARCH_X86_64
-    }
-#endif
+    // Save FPR if needed
+    append(epilogue, getLazyFPR(getFPRSave()));
     // Restore host BP, SP
     append(epilogue, LoadReg(Reg(REG_BP), Offset(offsetof(Context, hostState.bp))));
     append(epilogue, LoadReg(Reg(REG_SP), Offset(offsetof(Context, hostState.sp))));
@@ -112,6 +151,67 @@ RelocatableInst::SharedPtrVec getExecBlockEpilogue() {
     return epilogue;
 }
 
+// Index of the GPR which can be modified by a call following the host calling convention
+#if defined(QBDI_ARCH_X86)
+static const unsigned int CALLER_SAVED_GPR[] = {0, 2, 3};
+#elif defined(QBDI_OS_WIN)
+static const unsigned int CALLER_SAVED_GPR[] = {0, 2, 3, 6, 7, 8, 9};
+#else
+static const unsigned int CALLER_SAVED_GPR[] = {0, 2, 3, 4, 5, 6, 7, 8, 9};
+#endif
+
+// Call the host dispatcher of fast callbacks on the host stack without leaving the ExecBlock. With
+// state, the guest context is saved like in the epilogue so the callback can inspect and modify it.
+// Without state, only the stack pointer and the registers the dispatcher call can modify are saved.
+// They are then restored like in the prologue before resuming at the selector.
+RelocatableInst::SharedPtrVec getFastCallbackTrampoline(rword dispatcher, bool state) {
+    RelocatableInst::SharedPtrVec trampoline;
+    std::vector<unsigned int> saved;
+
+    if(state) {
+        for(unsigned int i = 0; i < NUM_GPR-1; i++)
+            saved.push_back(i);
+    }
+    else {
+        saved.assign(std::begin(CALLER_SAVED_GPR), std::end(CALLER_SAVED_GPR));
+        saved.push_back(REG_SP);
+    }
+    // Save GPR and FPR if needed
+    for(unsigned int i : saved)
+        append(trampoline, SaveReg(Reg(i), Offset(Reg(i))));
+    append(trampoline, getLazyFPR(getFPRSave()));
+    // Switch to the host stack and save EFLAGS
+    append(trampoline, LoadReg(Reg(REG_SP), Offset(offsetof(Context, hostState.sp))));
+    trampoline.push_back(Pushf());
+    trampoline.push_back(Popr(Reg(0)));
+    append(trampoline, SaveReg(Reg(0), Offset(offsetof(Context, gprState.eflags))));
+    // Align the host stack and call the dispatcher with the ExecBlock as argument
+    trampoline.push_back(NoReloc(andri(Reg(REG_SP), -16)));
+#if defined(QBDI_ARCH_X86)
+    trampoline.push_back(Add(Reg(REG_SP), Constant(-12)));
+    append(trampoline, LoadReg(Reg(0), Offset(offsetof(Context, hostState.execBlock))));
+    trampoline.push_back(Pushr(Reg(0)));
+#elif defined(QBDI_OS_WIN)
+    append(trampoline, LoadReg(Reg(2), Offset(offsetof(Context, hostState.execBlock))));
+    // Home space of the register arguments
+    trampoline.push_back(Add(Reg(REG_SP), Constant(-32)));
+#else
+    append(trampoline, LoadReg(Reg(5), Offset(offsetof(Context, hostState.execBlock))));
+#endif
+    trampoline.push_back(NoReloc(movri(Reg(0), dispatcher)));
+    trampoline.push_back(NoReloc(callr(Reg(0))));
+    // Restore FPR if needed, EFLAGS and GPR, the selector was updated by the dispatcher
+    append(trampoline, getLazyFPR(getFPRRestore()));
+    append(trampoline, LoadReg(Reg(0), Offset(offsetof(Context, gprState.eflags))));
+    trampoline.push_back(Pushr(Reg(0)));
+    trampoline.push_back(Popf());
+    for(unsigned int i : saved)
+        append(trampoline, LoadReg(Reg(i), Offset(Reg(i))));
+    trampoline.push_back(JmpM(Offset(offsetof(Context, hostState.selector))));
+
+    return trampoline;
+}
+
 PatchRule::SharedPtrVec getDefaultPatchRules() {
     PatchRule::SharedPtrVec rules;
 
@@ -501,4 +601,277 @@ RelocatableInst::SharedPtrVec getTerminator(rword address) {
     return terminator;
 }
 
+// Size of the PC relative immediate of a conditional jump, 0 if the opcode is not a conditional jump.
+static unsigned getJccImmSize(unsigned opcode) {
+    switch(opcode) {
+        case llvm::X86::JNE_1: case llvm::X86::JE_1:  case llvm::X86::JG_1:  case llvm::X86::JGE_1:
+        case llvm::X86::JA_1:  case llvm::X86::JAE_1: case llvm::X86::JL_1:  case llvm::X86::JLE_1:
+        case llvm::X86::JB_1:  case llvm::X86::JBE_1: case llvm::X86::JP_1:  case llvm::X86::JNP_1:
+        case llvm::X86::JO_1:  case llvm::X86::JNO_1: case llvm::X86::JS_1:  case llvm::X86::JNS_1:
+            return 1;
+        case llvm::X86::JNE_2: case llvm::X86::JE_2:  case llvm::X86::JG_2:  case llvm::X86::JGE_2:
+        case llvm::X86::JA_2:  case llvm::X86::JAE_2: case llvm::X86::JL_2:  case llvm::X86::JLE_2:
+        case llvm::X86::JB_2:  case llvm::X86::JBE_2: case llvm::X86::JP_2:  case llvm::X86::JNP_2:
+        case llvm::X86::JO_2:  case llvm::X86::JNO_2: case llvm::X86::JS_2:  case llvm::X86::JNS_2:
+            return 2;
+        case llvm::X86::JNE_4: case llvm::X86::JE_4:  case llvm::X86::JG_4:  case llvm::X86::JGE_4:
+        case llvm::X86::JA_4:  case llvm::X86::JAE_4: case llvm::X86::JL_4:  case llvm::X86::JLE_4:
+        case llvm::X86::JB_4:  case llvm::X86::JBE_4: case llvm::X86::JP_4:  case llvm::X86::JNP_4:
+        case llvm::X86::JO_4:  case llvm::X86::JNO_4: case llvm::X86::JS_4:  case llvm::X86::JNS_4:
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+// Statically known successors of a basic block ending with this instruction. Conditional jumps
+// return the taken target first and the fallthrough second.
+std::vector<rword> getChainTargets(const InstMetadata& metadata) {
+    const llvm::MCInst& inst = metadata.inst;
+
+    if(inst.getNumOperands() == 0 || !inst.getOperand(0).isImm()) {
+        return {};
+    }
+    rword target = metadata.endAddress() + inst.getOperand(0).getImm();
+
+    switch(inst.getOpcode()) {
+        case llvm::X86::JMP_1:
+        case llvm::X86::JMP_2:
+        case llvm::X86::JMP_4:
+        case llvm::X86::CALL64pcrel32:
+        case llvm::X86::CALLpcrel16:
+        case llvm::X86::CALLpcrel32:
+            return {target};
+        default:
+            if(getJccImmSize(inst.getOpcode()) != 0) {
+                return {target, metadata.endAddress()};
+            }
+            return {};
+    }
+}
+
+// Sequence exit jumping through the chain slots. The instruction ID the sequence is exiting from
+// is written in hostState.origin as the host cannot know which sequences were chained.
+// Conditional jumps select the slot by comparing the guest PC written by the Jcc patch with the
+// taken target. The POSTINST callbacks may have modified the guest EFLAGS, so the Jcc is not
+// evaluated a second time: like the target cache, the comparison is done with lea / not / jrcxz.
+// Each path increments the counter of its successor, also with lea.
+RelocatableInst::SharedPtrVec getChainExit(const InstMetadata& metadata, uint16_t instID, const std::vector<Offset>& slots,
+                                           const std::vector<Offset>& counters) {
+    RelocatableInst::SharedPtrVec exit;
+
+    exit.push_back(Mov(Offset(offsetof(Context, hostState.origin)), Constant(instID)));
+    if(slots.size() == 2) {
+        append(exit, SaveReg(Reg(0), Offset(Reg(0))));
+        append(exit, SaveReg(Reg(2), Offset(Reg(2))));
+        // RCX = target - PC, computed as target + ~PC + 1
+        append(exit, LoadReg(Reg(2), Offset(Reg(REG_PC))));
+        exit.push_back(Mov(Reg(0), Constant(getChainTargets(metadata)[0])));
+        exit.push_back(NoReloc(notr(Reg(2))));
+        exit.push_back(NoReloc(lea(Reg(2), Reg(0), 1, Reg(2), 1, 0)));
+        // Skip the fallthrough path, the relative offset is encoded relative to the start of the
+        // immediate
+#if defined(QBDI_ARCH_X86_64)
+        exit.push_back(NoReloc(jcxz(38 + 1)));
+#else
+        exit.push_back(NoReloc(jcxz(33 + 1)));
+#endif
+        // The fallthrough path comes first
+        for(int i : {1, 0}) {
+            append(exit, LoadReg(Reg(0), counters[i]));
+            exit.push_back(NoReloc(lea(Reg(0), Reg(0), 1, 0, 1, 0)));
+            append(exit, SaveReg(Reg(0), counters[i]));
+            append(exit, LoadReg(Reg(0), Offset(Reg(0))));
+            append(exit, LoadReg(Reg(2), Offset(Reg(2))));
+            exit.push_back(JmpM(slots[i]));
+        }
+    }
+    else if(slots.size() == 1) {
+        exit.push_back(JmpM(slots[0]));
+    }
+    else {
+        append(exit, JmpEpilogue());
+    }
+
+    return exit;
+}
+
+// Side exit after the conditional jump ending an inner basic block of a trace. Like in the chain
+// exit, the guest PC is compared with the next basic block of the trace and only the other
+// successor writes hostState.origin and leaves through the slot. The relative offsets are encoded
+// relative to the start of the immediate.
+RelocatableInst::SharedPtrVec getSideExit(const InstMetadata& metadata, uint16_t instID, rword next, Offset slot) {
+    RelocatableInst::SharedPtrVec exit;
+
+    RequireAction("getSideExit", getJccImmSize(metadata.inst.getOpcode()) != 0, return exit);
+    append(exit, SaveReg(Reg(0), Offset(Reg(0))));
+    append(exit, SaveReg(Reg(2), Offset(Reg(2))));
+    // RCX = next - PC, computed as next + ~PC + 1
+    append(exit, LoadReg(Reg(2), Offset(Reg(REG_PC))));
+    exit.push_back(Mov(Reg(0), Constant(next)));
+    exit.push_back(NoReloc(notr(Reg(2))));
+    exit.push_back(NoReloc(lea(Reg(2), Reg(0), 1, Reg(2), 1, 0)));
+    append(exit, LoadReg(Reg(0), Offset(Reg(0))));
+    // The trace continues on the next basic block which skips the exit: MOV [origin], imm32, the
+    // restore of RCX and JMP *[slot]
+#if defined(QBDI_ARCH_X86_64)
+    exit.push_back(NoReloc(jcxz(11 + 7 + 6 + 1)));
+#else
+    exit.push_back(NoReloc(jcxz(10 + 6 + 6 + 1)));
+#endif
+    exit.push_back(Mov(Offset(offsetof(Context, hostState.origin)), Constant(instID)));
+    append(exit, LoadReg(Reg(2), Offset(Reg(2))));
+    exit.push_back(JmpM(slot));
+    append(exit, LoadReg(Reg(2), Offset(Reg(2))));
+
+    return exit;
+}
+
+// Indirect exits look up the guest target in a direct mapped table indexed by its low byte. RAX, RCX
+// and RDX are used as scratch registers and the comparison is done with lea / not / jrcxz such
+// that the guest EFLAGS are never modified.
+RelocatableInst::SharedPtrVec getTargetCacheExit(uint16_t instID, Offset cache, Offset hits, Offset misses) {
+    RelocatableInst::SharedPtrVec exit;
+
+    exit.push_back(Mov(Offset(offsetof(Context, hostState.origin)), Constant(instID)));
+    append(exit, SaveReg(Reg(0), Offset(Reg(0))));
+    append(exit, SaveReg(Reg(2), Offset(Reg(2))));
+    append(exit, SaveReg(Reg(3), Offset(Reg(3))));
+    // RDX = &keys[target & 0xFF], RAX = keys[target & 0xFF]
+    append(exit, LoadReg(Reg(2), Offset(Reg(REG_PC))));
+    exit.push_back(NoReloc(movzx32rr8(llvm::X86::EAX, llvm::X86::CL)));
+    exit.push_back(DataBlockRelx86(lea(Reg(3), 0, 1, 0, 0, 0), 4, cache, 1, 7));
+    exit.push_back(NoReloc(lea(Reg(3), Reg(3), sizeof(rword), Reg(0), 0, 0)));
+    exit.push_back(NoReloc(movrm(Reg(0), Reg(3), 1, 0, 0, 0)));
+    // RCX = key - target, computed as key + ~target + 1
+    exit.push_back(NoReloc(notr(Reg(2))));
+    exit.push_back(NoReloc(lea(Reg(2), Reg(0), 1, Reg(2), 1, 0)));
+    // Skip the miss path, the relative offset is encoded relative to the start of the immediate
+#if defined(QBDI_ARCH_X86_64)
+    exit.push_back(NoReloc(jcxz(44 + 1)));
+#else
+    exit.push_back(NoReloc(jcxz(38 + 1)));
+#endif
+    // Miss: count it and return to the host
+    append(exit, LoadReg(Reg(0), misses));
+    exit.push_back(NoReloc(lea(Reg(0), Reg(0), 1, 0, 1, 0)));
+    append(exit, SaveReg(Reg(0), misses));
+    append(exit, LoadReg(Reg(0), Offset(Reg(0))));
+    append(exit, LoadReg(Reg(2), Offset(Reg(2))));
+    append(exit, LoadReg(Reg(3), Offset(Reg(3))));
+    append(exit, JmpEpilogue());
+    // Hit: count it and jump to the cached sequence through the selector
+    append(exit, LoadReg(Reg(0), hits));
+    exit.push_back(NoReloc(lea(Reg(0), Reg(0), 1, 0, 1, 0)));
+    append(exit, SaveReg(Reg(0), hits));
+    exit.push_back(NoReloc(movrm(Reg(0), Reg(3), 1, 0, TARGET_CACHE_SIZE * sizeof(rword), 0)));
+    append(exit, SaveReg(Reg(0), Offset(offsetof(Context, hostState.selector))));
+    append(exit, LoadReg(Reg(0), Offset(Reg(0))));
+    append(exit, LoadReg(Reg(2), Offset(Reg(2))));
+    append(exit, LoadReg(Reg(3), Offset(Reg(3))));
+    exit.push_back(JmpM(Offset(offsetof(Context, hostState.selector))));
+
+    return exit;
+}
+
+// Return address pushed by a call, 0 if the instruction is not a call.
+rword getReturnAddress(const InstMetadata& metadata) {
+    switch(metadata.inst.getOpcode()) {
+        case llvm::X86::CALL64pcrel32:
+        case llvm::X86::CALLpcrel16:
+        case llvm::X86::CALLpcrel32:
+        case llvm::X86::CALL32r:
+        case llvm::X86::CALL64r:
+        case llvm::X86::CALL32m:
+        case llvm::X86::CALL64m:
+            return metadata.endAddress();
+        default:
+            return 0;
+    }
+}
+
+bool isReturn(const InstMetadata& metadata) {
+    switch(metadata.inst.getOpcode()) {
+        case llvm::X86::RETL:
+        case llvm::X86::RETQ:
+        case llvm::X86::RETW:
+        case llvm::X86::RETIL:
+        case llvm::X86::RETIQ:
+        case llvm::X86::RETIW:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Push the address of a return record {guest return address, translated continuation} on the
+// shadow return stack. Like the target cache, it only uses lea to avoid modifying EFLAGS.
+RelocatableInst::SharedPtrVec getReturnStackPush(Offset top, Offset entries, Offset record) {
+    RelocatableInst::SharedPtrVec push;
+
+    append(push, SaveReg(Reg(0), Offset(Reg(0))));
+    append(push, SaveReg(Reg(3), Offset(Reg(3))));
+    // top = (top + 1) & 0xFF
+    push.push_back(DataBlockRelx86(mov32rm8(llvm::X86::EAX, 0, 1, 0, 0, 0), 4, top, 1, 7));
+    push.push_back(NoReloc(lea(Reg(0), Reg(0), 1, 0, 1, 0)));
+    push.push_back(DataBlockRelx86(mov8mr(0, 1, 0, 0, 0, llvm::X86::AL), 3, top, 0, 6));
+    // entries[top] = &record
+    push.push_back(DataBlockRelx86(lea(Reg(3), 0, 1, 0, 0, 0), 4, entries, 1, 7));
+    push.push_back(NoReloc(lea(Reg(3), Reg(3), sizeof(rword), Reg(0), 0, 0)));
+    push.push_back(DataBlockRelx86(lea(Reg(0), 0, 1, 0, 0, 0), 4, record, 1, 7));
+    push.push_back(NoReloc(movmr(Reg(3), 1, 0, 0, 0, Reg(0))));
+    append(push, LoadReg(Reg(0), Offset(Reg(0))));
+    append(push, LoadReg(Reg(3), Offset(Reg(3))));
+
+    return push;
+}
+
+// Pop the top return record of the shadow return stack and jump to its continuation if the guest
+// return address matches. On a mismatch (longjmp, stack pivot, ...) the execution falls through to
+// the code following the check.
+RelocatableInst::SharedPtrVec getReturnStackCheck(uint16_t instID, Offset top, Offset entries) {
+    RelocatableInst::SharedPtrVec check;
+
+    check.push_back(Mov(Offset(offsetof(Context, hostState.origin)), Constant(instID)));
+    append(check, SaveReg(Reg(0), Offset(Reg(0))));
+    append(check, SaveReg(Reg(2), Offset(Reg(2))));
+    append(check, SaveReg(Reg(3), Offset(Reg(3))));
+    // RDX = entries[top], top = (top - 1) & 0xFF
+    check.push_back(DataBlockRelx86(mov32rm8(llvm::X86::EAX, 0, 1, 0, 0, 0), 4, top, 1, 7));
+    check.push_back(DataBlockRelx86(lea(Reg(3), 0, 1, 0, 0, 0), 4, entries, 1, 7));
+    check.push_back(NoReloc(movrm(Reg(3), Reg(3), sizeof(rword), Reg(0), 0, 0)));
+    check.push_back(NoReloc(lea(Reg(0), Reg(0), 1, 0, 255, 0)));
+    check.push_back(DataBlockRelx86(mov8mr(0, 1, 0, 0, 0, llvm::X86::AL), 3, top, 0, 6));
+    // RCX = record.target - target, computed as record.target + ~target + 1
+    check.push_back(NoReloc(movrm(Reg(0), Reg(3), 1, 0, 0, 0)));
+    append(check, LoadReg(Reg(2), Offset(Reg(REG_PC))));
+    check.push_back(NoReloc(notr(Reg(2))));
+    check.push_back(NoReloc(lea(Reg(2), Reg(0), 1, Reg(2), 1, 0)));
+    // Skip the mismatch path, the relative offsets are encoded relative to the start of the
+    // immediate
+#if defined(QBDI_ARCH_X86_64)
+    check.push_back(NoReloc(jcxz(26 + 1)));
+#else
+    check.push_back(NoReloc(jcxz(23 + 1)));
+#endif
+    // Mismatch: restore the scratch registers and skip the match path
+    append(check, LoadReg(Reg(0), Offset(Reg(0))));
+    append(check, LoadReg(Reg(2), Offset(Reg(2))));
+    append(check, LoadReg(Reg(3), Offset(Reg(3))));
+#if defined(QBDI_ARCH_X86_64)
+    check.push_back(NoReloc(jmp(38 + 4)));
+#else
+    check.push_back(NoReloc(jmp(33 + 4)));
+#endif
+    // Match: jump to the continuation through the selector
+    check.push_back(NoReloc(movrm(Reg(0), Reg(3), 1, 0, sizeof(rword), 0)));
+    append(check, SaveReg(Reg(0), Offset(offsetof(Context, hostState.selector))));
+    append(check, LoadReg(Reg(0), Offset(Reg(0))));
+    append(check, LoadReg(Reg(2), Offset(Reg(2))));
+    append(check, LoadReg(Reg(3), Offset(Reg(3))));
+    check.push_back(JmpM(Offset(offsetof(Context, hostState.selector))));
+
+    return check;
+}
+
 }
@@ -29,12 +29,66 @@ class PatchRule;
 
 static const uint32_t MINIMAL_BLOCK_SIZE = 64;
 
+static const uint32_t TARGET_CACHE_SIZE = 256;
+
+static const uint32_t TARGET_CACHE_EXIT_SIZE = 192;
+
+// Space needed by the chain exit of a conditional jump, it is not chained below
+static const uint32_t CONDITIONAL_EXIT_SIZE = 144;
+
+#if defined(_QBDI_SHADOW_RETURN_STACK)
+static const bool SHADOW_RETURN_STACK = true;
+#else
+static const bool SHADOW_RETURN_STACK = false;
+#endif
+
+// The top of the shadow return stack is a byte counter, it wraps around after 256 entries
+static const uint32_t RETURN_STACK_SIZE = 256;
+
+// Size of the code emitted by getReturnStackPush and getReturnStackCheck
+#if defined(QBDI_ARCH_X86_64)
+static const uint32_t RETURN_STACK_PUSH_SIZE = 66;
+
+static const uint32_t RETURN_STACK_CHECK_SIZE = 147;
+#else
+static const uint32_t RETURN_STACK_PUSH_SIZE = 57;
+
+static const uint32_t RETURN_STACK_CHECK_SIZE = 134;
+#endif
+
+// The guest FPR are only switched by the ExecBlocks using them
+static const bool LAZY_FPR = true;
+
+// Number of dispatches after which a basic block is retranslated as the head of a trace
+static const uint32_t TRACE_THRESHOLD = 32;
+
+static const uint32_t TRACE_MAX_BLOCKS = 8;
+
 RelocatableInst::SharedPtrVec getExecBlockPrologue();
 
 RelocatableInst::SharedPtrVec getExecBlockEpilogue();
 
+RelocatableInst::SharedPtrVec getFastCallbackTrampoline(rword dispatcher, bool state);
+
 RelocatableInst::SharedPtrVec getTerminator(rword address);
 
+std::vector<rword> getChainTargets(const InstMetadata& metadata);
+
+RelocatableInst::SharedPtrVec getChainExit(const InstMetadata& metadata, uint16_t instID, const std::vector<Offset>& slots,
+                                           const std::vector<Offset>& counters);
+
+RelocatableInst::SharedPtrVec getSideExit(const InstMetadata& metadata, uint16_t instID, rword next, Offset slot);
+
+RelocatableInst::SharedPtrVec getTargetCacheExit(uint16_t instID, Offset cache, Offset hits, Offset misses);
+
+rword getReturnAddress(const InstMetadata& metadata);
+
+bool isReturn(const InstMetadata& metadata);
+
+RelocatableInst::SharedPtrVec getReturnStackPush(Offset top, Offset entries, Offset record);
+
+RelocatableInst::SharedPtrVec getReturnStackCheck(uint16_t instID, Offset top, Offset entries);
+
 std::vector<std::shared_ptr<PatchRule>> getDefaultPatchRules();
 
 }
@@ -22,7 +22,7 @@
 
 namespace QBDI {
 
-class HostPCRel : public RelocatableInst, public AutoAlloc<RelocatableInst, HostPCRel> {
+class HostPCRel : public RelocatableInst, public ArenaAutoAlloc<RelocatableInst, HostPCRel> {
     unsigned int opn;
     rword        offset;
 
@@ -34,9 +34,13 @@ public:
         inst.getOperand(opn).setImm(offset + exec_block->getCurrentPC());
         return inst;
     }
+
+    int getTemplateOperand() const {
+        return opn;
+    }
 };
 
-class InstId : public RelocatableInst, public AutoAlloc<RelocatableInst, InstId> {
+class InstId : public RelocatableInst, public ArenaAutoAlloc<RelocatableInst, InstId> {
     unsigned int opn;
 
 public:
@@ -47,9 +51,13 @@ public:
         inst.getOperand(opn).setImm(exec_block->getNextInstID());
         return inst;
     }
+
+    int getTemplateOperand() const {
+        return opn;
+    }
 };
 
-class TaggedShadow : public RelocatableInst, public AutoAlloc<RelocatableInst, TaggedShadow> {
+class TaggedShadow : public RelocatableInst, public ArenaAutoAlloc<RelocatableInst, TaggedShadow> {
 
     unsigned int opn;
     uint16_t tag;
@@ -66,9 +74,13 @@ public:
         );
         return inst;
     }
+
+    int getTemplateOperand() const {
+        return opn;
+    }
 };
 
-class TaggedShadowAbs : public RelocatableInst, public AutoAlloc<RelocatableInst, TaggedShadowAbs> {
+class TaggedShadowAbs : public RelocatableInst, public ArenaAutoAlloc<RelocatableInst, TaggedShadowAbs> {
 
     unsigned int opn;
     uint16_t tag;
@@ -84,6 +96,10 @@ public:
         );
         return inst;
     }
+
+    int getTemplateOperand() const {
+        return opn;
+    }
 };
 
 inline std::shared_ptr<RelocatableInst> DataBlockRelx86(llvm::MCInst inst, unsigned int opn, rword offset, unsigned int opn2, rword inst_size) {
@@ -0,0 +1,100 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <atomic>
+#include <stdlib.h>
+
+#include "Utility/Arena.h"
+#include "Utility/LogSys.h"
+
+namespace QBDI {
+
+struct ArenaChunk {
+    // Live allocations, plus one while the chunk is the current chunk of its thread
+    std::atomic<size_t> live;
+    size_t              used;
+};
+
+// Every allocation is preceded by a header pointing to its chunk (or nullptr if it was too large
+// for a chunk), which keeps the allocation aligned for any type.
+static const size_t ARENA_HEADER_SIZE = 16;
+static const size_t ARENA_CHUNK_SIZE = 64 * 1024;
+static const size_t ARENA_MAX_ALLOCATION = ARENA_CHUNK_SIZE / 8;
+
+static void releaseChunk(ArenaChunk* chunk) {
+    if(chunk != nullptr && chunk->live.fetch_sub(1) == 1) {
+        chunk->~ArenaChunk();
+        free(chunk);
+    }
+}
+
+struct ArenaHolder {
+    ArenaChunk* current;
+
+    ~ArenaHolder() {
+        releaseChunk(current);
+    }
+};
+
+static thread_local ArenaHolder holder = {nullptr};
+
+static inline size_t alignSize(size_t size) {
+    return (size + ARENA_HEADER_SIZE - 1) & ~(ARENA_HEADER_SIZE - 1);
+}
+
+void* arenaAllocate(size_t size) {
+    size_t needed = ARENA_HEADER_SIZE + alignSize(size);
+    char* ptr;
+    if(needed > ARENA_MAX_ALLOCATION) {
+        ptr = static_cast<char*>(malloc(needed));
+        RequireAction("arenaAllocate", ptr != nullptr, abort());
+        *reinterpret_cast<ArenaChunk**>(ptr) = nullptr;
+        return ptr + ARENA_HEADER_SIZE;
+    }
+    ArenaChunk* chunk = holder.current;
+    if(chunk == nullptr || chunk->used + needed > ARENA_CHUNK_SIZE) {
+        // The previous chunk is freed with its last allocation
+        releaseChunk(chunk);
+        void* block = malloc(ARENA_CHUNK_SIZE);
+        RequireAction("arenaAllocate", block != nullptr, abort());
+        chunk = new(block) ArenaChunk();
+        chunk->live.store(1);
+        chunk->used = alignSize(sizeof(ArenaChunk));
+        holder.current = chunk;
+    }
+    ptr = reinterpret_cast<char*>(chunk) + chunk->used;
+    chunk->used += needed;
+    chunk->live.fetch_add(1);
+    *reinterpret_cast<ArenaChunk**>(ptr) = chunk;
+    return ptr + ARENA_HEADER_SIZE;
+}
+
+void arenaDeallocate(void* ptr) {
+    if(ptr == nullptr) {
+        return;
+    }
+    char* header = static_cast<char*>(ptr) - ARENA_HEADER_SIZE;
+    ArenaChunk* chunk = *reinterpret_cast<ArenaChunk**>(header);
+    if(chunk == nullptr) {
+        free(header);
+    }
+    else {
+        releaseChunk(chunk);
+    }
+}
+
+}
@@ -0,0 +1,69 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <memory>
+
+namespace QBDI {
+
+/*! Allocate memory from the translation arena of the current thread. The arena is made of
+ *  chunks released once every allocation they hold has been freed, the short lived objects of a
+ *  translation are thus bump allocated.
+ *
+ * @param[in] size  The size of the allocation.
+ *
+ * @return A pointer aligned for any type.
+ */
+void* arenaAllocate(size_t size);
+
+/*! Free memory allocated by arenaAllocate, from any thread.
+ *
+ * @param[in] ptr  The pointer returned by arenaAllocate.
+ */
+void arenaDeallocate(void* ptr);
+
+/*! A standard allocator using the translation arena, used to allocate a shared object and its
+ *  control block at once.
+ */
+template<typename T> class ArenaAllocator {
+public:
+
+    using value_type = T;
+
+    ArenaAllocator() {}
+
+    template<typename U> ArenaAllocator(const ArenaAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(arenaAllocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* ptr, size_t) {
+        arenaDeallocate(ptr);
+    }
+
+    template<typename U> bool operator==(const ArenaAllocator<U>&) const { return true; }
+
+    template<typename U> bool operator!=(const ArenaAllocator<U>&) const { return false; }
+};
+
+}
+
+#endif // ARENA_H
@@ -15,6 +15,10 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <algorithm>
+
+#include "llvm/ADT/SmallVector.h"
+
 #include "Utility/Assembly.h"
 #include "Utility/LogSys.h"
 #include "Platform.h"
@@ -70,10 +74,139 @@ llvm::MCDisassembler::DecodeStatus Assembly::getInstruction(llvm::MCInst &instr,
 }
 
 
-void Assembly::writeInstruction(const llvm::MCInst inst, memory_ostream *stream) const {
+size_t Assembly::encodeInstruction(const llvm::MCInst& inst, llvm::SmallVectorImpl<char>& out) const {
     // MCCodeEmitter needs a fixups array
     llvm::SmallVector<llvm::MCFixup,4> fixups;
 
+    out.clear();
+    llvm::raw_svector_ostream os(out);
+    assembler->getEmitter().encodeInstruction(inst, os, fixups, MSTI);
+
+    if(fixups.size() > 0) {
+        llvm::MCValue target = llvm::MCValue();
+        llvm::MCFixup fixup = fixups.pop_back_val();
+        int64_t value;
+        if(fixup.getValue()->evaluateAsAbsolute(value)) {
+            assembler->getBackend().applyFixup(*assembler, fixup, target, llvm::MutableArrayRef<char>(out.data(), out.size()), (uint64_t) value, true, &MSTI);
+        }
+        else {
+            LogWarning("Assembly::writeInstruction", "Could not evalutate fixup, might crash!");
+        }
+    }
+    return out.size();
+}
+
+bool Assembly::getEncodingKey(const llvm::MCInst& inst, int operand, EncodingKey& key) const {
+    if(inst.getNumOperands() > 8) {
+        return false;
+    }
+    memset(&key, 0, sizeof(key));
+    key.opcode = inst.getOpcode();
+    // The X86 disassembler stores the REP, REPNE and LOCK prefixes in the flags
+    key.flags = inst.getFlags();
+    key.operand = operand;
+    key.numOperands = inst.getNumOperands();
+    for(unsigned int i = 0; i < inst.getNumOperands(); i++) {
+        const llvm::MCOperand& op = inst.getOperand(i);
+        if(op.isReg()) {
+            key.kinds[i] = 1;
+            key.values[i] = op.getReg();
+        }
+        else if(op.isImm()) {
+            key.kinds[i] = 2;
+            // The templated operand is patched in the encoding
+            key.values[i] = (static_cast<int>(i) == operand) ? 0 : op.getImm();
+        }
+        else {
+            return false;
+        }
+    }
+    return operand < static_cast<int>(inst.getNumOperands()) &&
+           (operand < 0 || inst.getOperand(operand).isImm());
+}
+
+static inline uint64_t fieldMask(unsigned int size) {
+    return size >= 8 ? ~0ull : (1ull << (size * 8)) - 1;
+}
+
+static inline uint64_t readField(const char* bytes, unsigned int size) {
+    uint64_t value = 0;
+    for(unsigned int i = 0; i < size; i++) {
+        value |= static_cast<uint64_t>(static_cast<uint8_t>(bytes[i])) << (i * 8);
+    }
+    return value;
+}
+
+static inline void writeField(uint8_t* bytes, unsigned int size, uint64_t value) {
+    for(unsigned int i = 0; i < size; i++) {
+        bytes[i] = static_cast<uint8_t>(value >> (i * 8));
+    }
+}
+
+EncodingTemplate Assembly::createTemplate(llvm::MCInst inst, int operand) const {
+    EncodingTemplate t;
+    llvm::SmallVector<char, 16> first;
+    llvm::SmallVector<char, 16> second;
+
+    memset(&t, 0, sizeof(t));
+    t.usable = false;
+    if(operand == TEMPLATE_WHOLE) {
+        encodeInstruction(inst, first);
+        if(first.size() <= sizeof(t.bytes)) {
+            memcpy(t.bytes, first.data(), first.size());
+            t.size = first.size();
+            t.usable = true;
+        }
+        return t;
+    }
+    // Two large probes of opposite sign locate the field, including the upper bytes of 64 bits
+    // immediates
+    const int64_t probe1 = 0x12345678;
+    const int64_t probe2 = -0x23456789;
+    inst.getOperand(operand).setImm(probe1);
+    encodeInstruction(inst, first);
+    inst.getOperand(operand).setImm(probe2);
+    encodeInstruction(inst, second);
+    if(first.size() != second.size() || first.size() > sizeof(t.bytes)) {
+        return t;
+    }
+    size_t lo = first.size(), hi = 0;
+    for(size_t i = 0; i < first.size(); i++) {
+        if(first[i] != second[i]) {
+            lo = std::min(lo, i);
+            hi = i;
+        }
+    }
+    if(lo > hi || hi - lo + 1 > 8) {
+        return t;
+    }
+    unsigned int size = hi - lo + 1;
+    unsigned int shift = 64 - size * 8;
+    uint64_t mask = fieldMask(size);
+    // The field can hold the operand plus a constant, like the pc relative fixups
+    uint64_t bias = (readField(first.data() + lo, size) - static_cast<uint64_t>(probe1)) & mask;
+    bias = shift == 0 ? bias : static_cast<uint64_t>(static_cast<int64_t>(bias << shift) >> shift);
+    if(((static_cast<uint64_t>(probe2) + bias) & mask) != readField(second.data() + lo, size)) {
+        return t;
+    }
+    memcpy(t.bytes, first.data(), first.size());
+    t.size = first.size();
+    t.fieldOffset = lo;
+    t.fieldSize = size;
+    t.bias = bias;
+    t.usable = true;
+    // Memory displacements use a shorter encoding for small values
+    const int64_t probe3 = 0x11;
+    inst.getOperand(operand).setImm(probe3);
+    encodeInstruction(inst, second);
+    uint8_t patched[sizeof(t.bytes)];
+    memcpy(patched, t.bytes, t.size);
+    writeField(patched + lo, size, static_cast<uint64_t>(probe3) + bias);
+    t.smallValues = second.size() == t.size && memcmp(patched, second.data(), t.size) == 0;
+    return t;
+}
+
+void Assembly::writeInstruction(const llvm::MCInst inst, memory_ostream *stream, int operand) const {
     uint64_t pos = stream->current_pos();
     LogCallback(LogPriority::DEBUG, "Assembly::writeInstruction", [&] (FILE *log) -> void {
         std::string disass;
@@ -82,20 +215,51 @@ void Assembly::writeInstruction(const llvm::MCInst inst, memory_ostream *stream)
         disassOs.flush();
         fprintf(log, "Assembling %s at 0x%" PRIRWORD, disass.c_str(), (rword) stream->get_ptr() + (rword) pos);
     });
-    assembler->getEmitter().encodeInstruction(inst, *stream, fixups, MSTI);
-    uint64_t size = stream->current_pos() - pos;
-
-    if(fixups.size() > 0) {
-        llvm::MCValue target = llvm::MCValue();
-        llvm::MCFixup fixup = fixups.pop_back_val();
-        int64_t value;
-        if(fixup.getValue()->evaluateAsAbsolute(value)) {
-            assembler->getBackend().applyFixup(*assembler, fixup, target, llvm::MutableArrayRef<char>((char*) stream->get_ptr() + pos, size), (uint64_t) value, true, &MSTI);
+#if defined(QBDI_ARCH_ARM)
+    // ARM immediates are not byte aligned fields
+    if(operand >= 0) {
+        operand = TEMPLATE_NONE;
+    }
+#endif
+    // The fixed sequences of the ExecBlock are encoded once and patched
+    const EncodingTemplate* encoding = nullptr;
+    EncodingKey key;
+    if(operand != TEMPLATE_NONE && getEncodingKey(inst, operand, key)) {
+        auto it = templates.find(key);
+        if(it == templates.end() && templates.size() < MAX_ENCODING_TEMPLATES) {
+            it = templates.emplace(key, createTemplate(inst, operand)).first;
+        }
+        if(it != templates.end() && it->second.usable) {
+            encoding = &it->second;
+        }
+    }
+    if(encoding != nullptr && operand >= 0) {
+        int64_t imm = inst.getOperand(operand).getImm();
+        int64_t value = static_cast<int64_t>(static_cast<uint64_t>(imm) + encoding->bias);
+        unsigned int bits = encoding->fieldSize * 8;
+        // The displacements and most immediates narrower than the operand are sign extended, an
+        // unsigned value only representable in the field is encoded by LLVM instead
+        bool fits = bits >= 64 || (value >= -(1ll << (bits - 1)) && value < (1ll << (bits - 1)));
+        bool small = imm >= -128 && imm <= 127;
+        if(fits && (encoding->smallValues || !small)) {
+            uint8_t bytes[sizeof(encoding->bytes)];
+            memcpy(bytes, encoding->bytes, encoding->size);
+            writeField(bytes + encoding->fieldOffset, encoding->fieldSize, static_cast<uint64_t>(value));
+            stream->write(reinterpret_cast<const char*>(bytes), encoding->size);
         }
         else {
-            LogWarning("Assembly::writeInstruction", "Could not evalutate fixup, might crash!");
+            encoding = nullptr;
         }
     }
+    else if(encoding != nullptr) {
+        stream->write(reinterpret_cast<const char*>(encoding->bytes), encoding->size);
+    }
+    if(encoding == nullptr) {
+        llvm::SmallVector<char, 16> bytes;
+        encodeInstruction(inst, bytes);
+        stream->write(bytes.data(), bytes.size());
+    }
+    uint64_t size = stream->current_pos() - pos;
 
     LogCallback(LogPriority::DEBUG, "Assembly::writeInstruction", [&] (FILE *log) -> void {
         fprintf(log, "Assembly result at 0x%" PRIRWORD " is:", (rword) stream->get_ptr() + (rword) pos);
@@ -19,6 +19,8 @@
 #define ASSEMBLY_H
 
 #include <memory>
+#include <string.h>
+#include <unordered_map>
 
 #include "llvm/MC/MCAsmBackend.h"
 #include "llvm/MC/MCAsmInfo.h"
@@ -40,6 +42,52 @@
 
 namespace QBDI {
 
+// The instruction is always encoded by LLVM
+static const int TEMPLATE_NONE = -2;
+// The encoding of the complete instruction is reused
+static const int TEMPLATE_WHOLE = -1;
+
+/*! An instruction encoding reused for instructions differing only by one immediate operand. The
+ *  field holding the operand is located by encoding two probe values.
+ */
+struct EncodingTemplate {
+    uint8_t  bytes[16];
+    uint8_t  size;
+    uint8_t  fieldOffset;
+    uint8_t  fieldSize;
+    bool     usable;
+    bool     smallValues;
+    uint64_t bias;
+};
+
+struct EncodingKey {
+    unsigned int opcode;
+    unsigned int flags;
+    int          operand;
+    unsigned int numOperands;
+    uint8_t      kinds[8];
+    int64_t      values[8];
+
+    bool operator==(const EncodingKey& o) const {
+        return opcode == o.opcode && flags == o.flags && operand == o.operand && numOperands == o.numOperands &&
+               memcmp(kinds, o.kinds, numOperands) == 0 &&
+               memcmp(values, o.values, numOperands * sizeof(int64_t)) == 0;
+    }
+};
+
+struct EncodingKeyHash {
+    size_t operator()(const EncodingKey& k) const {
+        uint64_t h = k.opcode * 0x9E3779B97F4A7C15ull ^ static_cast<uint64_t>(k.operand) ^ (static_cast<uint64_t>(k.flags) << 32);
+        for(unsigned int i = 0; i < k.numOperands; i++) {
+            h = (h ^ static_cast<uint64_t>(k.values[i]) ^ (static_cast<uint64_t>(k.kinds[i]) << 56)) * 0x100000001B3ull;
+        }
+        return static_cast<size_t>(h ^ (h >> 32));
+    }
+};
+
+// Maximum number of cached encodings, the guest instructions would make it grow without bound
+static const size_t MAX_ENCODING_TEMPLATES = 16384;
+
 class Assembly {
 protected:
 
@@ -52,11 +100,27 @@ protected:
     std::unique_ptr<llvm::MCInstPrinter>     asmPrinter;
     std::unique_ptr<llvm::raw_pwrite_stream> null_ostream;
 
+    mutable std::unordered_map<EncodingKey, EncodingTemplate, EncodingKeyHash> templates;
+
+    size_t encodeInstruction(const llvm::MCInst& inst, llvm::SmallVectorImpl<char>& out) const;
+
+    bool getEncodingKey(const llvm::MCInst& inst, int operand, EncodingKey& key) const;
+
+    EncodingTemplate createTemplate(llvm::MCInst inst, int operand) const;
+
 public:
     Assembly(llvm::MCContext &context, std::unique_ptr<llvm::MCAsmBackend> MAB, llvm::MCInstrInfo &MCII,
              const llvm::Target &target, llvm::MCSubtargetInfo &MSTI);
 
-    void writeInstruction(llvm::MCInst inst, memory_ostream* stream) const;
+    /*! Encode an instruction to a stream.
+     *
+     * @param[in] inst      The instruction to encode.
+     * @param[in] stream    The stream receiving the encoding.
+     * @param[in] operand   The index of the immediate operand which changes between the
+     *                      encodings of this instruction, TEMPLATE_WHOLE if the instruction is
+     *                      always the same or TEMPLATE_NONE to always encode it with LLVM.
+     */
+    void writeInstruction(llvm::MCInst inst, memory_ostream* stream, int operand = TEMPLATE_NONE) const;
 
     llvm::MCDisassembler::DecodeStatus getInstruction(llvm::MCInst &inst, uint64_t &size,
                                             llvm::ArrayRef<uint8_t> bytes, uint64_t address) const;
@@ -17,6 +17,18 @@
  */
 #include "Platform.h"
 
+#include <algorithm>
+
+#if defined(QBDI_OS_LINUX) || defined(QBDI_OS_ANDROID)
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#elif defined(QBDI_OS_DARWIN)
+#include <mach/mach.h>
+#elif defined(QBDI_OS_WIN)
+#include <windows.h>
+#endif
+
 #include "llvm/Support/Host.h"
 #include "llvm/Support/Process.h"
 
@@ -78,4 +90,36 @@ bool isHostCPUFeaturePresent(const char* query) {
    return false;
 }
 
+static bool readPage(void* buffer, rword address, size_t size) {
+#if defined(QBDI_OS_LINUX) || defined(QBDI_OS_ANDROID)
+    // The kernel reports the faults instead of raising a signal
+    struct iovec local = {buffer, size};
+    struct iovec remote = {reinterpret_cast<void*>(address), size};
+    return syscall(SYS_process_vm_readv, getpid(), &local, 1, &remote, 1, 0) == static_cast<long>(size);
+#elif defined(QBDI_OS_DARWIN)
+    vm_size_t read = 0;
+    return vm_read_overwrite(mach_task_self(), static_cast<vm_address_t>(address), size,
+                             reinterpret_cast<vm_address_t>(buffer), &read) == KERN_SUCCESS && read == size;
+#elif defined(QBDI_OS_WIN)
+    SIZE_T read = 0;
+    return ReadProcessMemory(GetCurrentProcess(), reinterpret_cast<LPCVOID>(address), buffer, size, &read) && read == size;
+#else
+    return false;
+#endif
+}
+
+size_t readMemory(void* buffer, rword address, size_t size) {
+    static const size_t pageSize = llvm::sys::Process::getPageSize();
+    size_t done = 0;
+    // Read page by page to stop at the first one which is not mapped
+    while(done < size) {
+        size_t chunk = std::min(size - done, pageSize - static_cast<size_t>((address + done) % pageSize));
+        if(!readPage(static_cast<uint8_t*>(buffer) + done, address + done, chunk)) {
+            break;
+        }
+        done += chunk;
+    }
+    return done;
+}
+
 }
@@ -23,16 +23,23 @@
 
 #include "llvm/Support/Memory.h"
 
+#include "State.h"
+
 namespace QBDI {
     bool isRWXSupported();
     llvm::sys::MemoryBlock allocateMappedMemory(size_t NumBytes,
                                                 const llvm::sys::MemoryBlock *const NearBlock,
                                                 unsigned PFlags,
                                                 std::error_code &EC);
+    llvm::sys::MemoryBlock allocateDualMappedMemory(size_t NumBytes,
+                                                    size_t ExecBytes,
+                                                    llvm::sys::MemoryBlock &WriteBlock,
+                                                    std::error_code &EC);
     void releaseMappedMemory(llvm::sys::MemoryBlock& block);
     const std::string getHostCPUName();
     const std::vector<std::string> getHostCPUFeatures();
     bool isHostCPUFeaturePresent(const char* f);
+    size_t readMemory(void* buffer, rword address, size_t size);
 }
 
 #endif // SYSTEM_H
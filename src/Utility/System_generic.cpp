@@ -20,6 +20,17 @@
 #include "llvm/Support/Host.h"
 #include "llvm/Support/Process.h"
 
+#if defined(QBDI_OS_LINUX) || defined(QBDI_OS_ANDROID)
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#endif
+
 #include "Utility/LogSys.h"
 #include "System.h"
 
@@ -40,6 +51,55 @@ llvm::sys::MemoryBlock allocateMappedMemory(size_t numBytes,
 }
 
 
+// Allocate numBytes of RW memory whose first execBytes are RX and mapped a second time as RW in
+// writeBlock. Only the execBytes are shared between the two mappings.
+llvm::sys::MemoryBlock allocateDualMappedMemory(size_t numBytes,
+                                                size_t execBytes,
+                                                llvm::sys::MemoryBlock &writeBlock,
+                                                std::error_code &ec) {
+    llvm::sys::MemoryBlock empty = llvm::sys::MemoryBlock();
+#if (defined(QBDI_OS_LINUX) || defined(QBDI_OS_ANDROID)) && defined(SYS_memfd_create)
+    int fd = static_cast<int>(syscall(SYS_memfd_create, "qbdi", MFD_CLOEXEC));
+    if(fd < 0) {
+        ec = std::error_code(errno, std::generic_category());
+        return empty;
+    }
+    if(ftruncate(fd, execBytes) != 0) {
+        ec = std::error_code(errno, std::generic_category());
+        close(fd);
+        return empty;
+    }
+    void* base = mmap(nullptr, numBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED) {
+        ec = std::error_code(errno, std::generic_category());
+        close(fd);
+        return empty;
+    }
+    // errno is saved right after each call, the following ones may clobber it
+    void* exec = mmap(base, execBytes, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, fd, 0);
+    int execErrno = errno;
+    void* write = mmap(nullptr, execBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int writeErrno = errno;
+    // The mappings keep the memory file alive
+    close(fd);
+    if(exec == MAP_FAILED || write == MAP_FAILED) {
+        ec = std::error_code(exec == MAP_FAILED ? execErrno : writeErrno, std::generic_category());
+        munmap(base, numBytes);
+        if(write != MAP_FAILED) {
+            munmap(write, execBytes);
+        }
+        return empty;
+    }
+    ec = std::error_code();
+    writeBlock = llvm::sys::MemoryBlock(write, execBytes);
+    return llvm::sys::MemoryBlock(base, numBytes);
+#else
+    ec = std::make_error_code(std::errc::not_supported);
+    return empty;
+#endif
+}
+
+
 void releaseMappedMemory(llvm::sys::MemoryBlock& block) {
     llvm::sys::Memory::releaseMappedMemory(block);
 }
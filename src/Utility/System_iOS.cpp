@@ -180,6 +180,15 @@ llvm::sys::MemoryBlock allocateMappedMemory(size_t numBytes,
     return Result;
 }
 
+llvm::sys::MemoryBlock allocateDualMappedMemory(size_t numBytes,
+                                                size_t execBytes,
+                                                llvm::sys::MemoryBlock &writeBlock,
+                                                std::error_code &ec) {
+    // Code is written in RWX pages or through the JIT server
+    ec = std::make_error_code(std::errc::not_supported);
+    return llvm::sys::MemoryBlock();
+}
+
 void releaseMappedMemory(llvm::sys::MemoryBlock& block) {
     vm_deallocate(mach_task_self(), (vm_address_t) block.base(), block.size());
 }
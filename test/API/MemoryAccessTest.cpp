@@ -142,6 +142,28 @@ QBDI::rword mad(volatile uint32_t* a, volatile uint32_t* b, volatile uint32_t* c
     return *c;
 }
 
+QBDI_NOINLINE QBDI::rword branchyWrite8(volatile uint8_t* buffer, size_t size) {
+    // The loop body is made of several basic blocks accessing the memory
+    QBDI::rword sum = 0;
+    for(size_t i = 0; i < size; i++) {
+        if(i % 3 == 0) {
+            buffer[i] = (uint8_t) i;
+        }
+        else {
+            buffer[i] = buffer[i / 2] ^ (uint8_t) i;
+        }
+        sum += buffer[i];
+    }
+    return sum;
+}
+
+struct BBAccessInfo {
+    std::vector<QBDI::MemoryAccess> expected;
+    bool newBasicBlock;
+    size_t checked;
+    size_t mismatches;
+};
+
 void MemoryAccessTest::SetUp() {
     // Constructing a new QBDI vm
     vm = new QBDI::VM();
@@ -310,6 +332,52 @@ QBDI::VMAction checkUnrolledWrite(QBDI::VMInstanceRef vm, const QBDI::VMState* v
     return QBDI::VMAction::CONTINUE;
 }
 
+QBDI::VMAction bufferUnrolledRead(QBDI::VMInstanceRef vm, const QBDI::VMState* vmState, QBDI::GPRState* gprState, QBDI::FPRState* fprState, void* data) {
+
+    TestInfo* info = (TestInfo*) data;
+    QBDI::MemoryAccess memaccesses[4];
+    // Read the accesses in two steps to check the truncation
+    size_t count = vm->getBBMemoryAccess(nullptr, 0);
+    if(vm->getBBMemoryAccess(memaccesses, 4) != count) {
+        return QBDI::VMAction::STOP;
+    }
+    std::vector<QBDI::MemoryAccess> all(count);
+    vm->getBBMemoryAccess(all.data(), all.size());
+    QBDI::Range<QBDI::rword> brange((QBDI::rword) info->buffer, ((QBDI::rword) info->buffer) + info->buffer_size);
+    for(size_t i = 0; i < count; i++) {
+        if(i < 4 && (memaccesses[i].accessAddress != all[i].accessAddress || memaccesses[i].value != all[i].value)) {
+            return QBDI::VMAction::STOP;
+        }
+        if(all[i].type == QBDI::MEMORY_READ && brange.contains(all[i].accessAddress)) {
+            size_t offset = all[i].accessAddress - brange.start;
+            if((QBDI::rword) ((uint8_t*)info->buffer)[offset] == all[i].value) {
+                info->i += offset;
+            }
+        }
+    }
+    return QBDI::VMAction::CONTINUE;
+}
+
+void traceArrayWrite8(QBDI::VMInstanceRef vm, const QBDI::MemoryAccess* accesses, size_t count, void* data) {
+
+    TestInfo* info = (TestInfo*) data;
+    QBDI::Range<QBDI::rword> brange((QBDI::rword) info->buffer, ((QBDI::rword) info->buffer) + info->buffer_size);
+    for(size_t i = 0; i < count; i++) {
+        if(accesses[i].type == QBDI::MEMORY_WRITE && brange.contains(accesses[i].accessAddress)) {
+            size_t offset = accesses[i].accessAddress - brange.start;
+            if((QBDI::rword) ((uint8_t*)info->buffer)[offset] == accesses[i].value && accesses[i].size == 1) {
+                info->i += offset;
+            }
+        }
+    }
+}
+
+void traceStopArrayWrite8(QBDI::VMInstanceRef vm, const QBDI::MemoryAccess* accesses, size_t count, void* data) {
+    // The records stay readable after the trace is stopped by its own callback
+    vm->stopMemoryTrace();
+    traceArrayWrite8(vm, accesses, count, data);
+}
+
 QBDI::VMAction readSnooper(QBDI::VMInstanceRef vm, QBDI::GPRState* gprState, QBDI::FPRState* fprState, void* data) {
 
     std::vector<QBDI::MemoryAccess> memaccesses = vm->getInstMemoryAccess();
@@ -325,6 +393,34 @@ QBDI::VMAction readSnooper(QBDI::VMInstanceRef vm, QBDI::GPRState* gprState, QBD
     return QBDI::VMAction::CONTINUE;
 }
 
+QBDI::VMAction checkBBAccess(QBDI::VMInstanceRef vm, QBDI::GPRState* gprState, QBDI::FPRState* fprState, void* data) {
+
+    BBAccessInfo* info = (BBAccessInfo*) data;
+    // The accesses of the basic block are the ones of its instructions executed so far
+    if(info->newBasicBlock) {
+        info->expected.clear();
+    }
+    std::vector<QBDI::MemoryAccess> instAccesses = vm->getInstMemoryAccess();
+    info->expected.insert(info->expected.end(), instAccesses.begin(), instAccesses.end());
+    info->newBasicBlock = vm->getInstAnalysis(QBDI::ANALYSIS_INSTRUCTION)->affectControlFlow;
+
+    std::vector<QBDI::MemoryAccess> bbAccesses = vm->getBBMemoryAccess();
+    info->checked++;
+    if(bbAccesses.size() != info->expected.size()) {
+        info->mismatches++;
+        return QBDI::VMAction::CONTINUE;
+    }
+    for(size_t i = 0; i < bbAccesses.size(); i++) {
+        if(bbAccesses[i].instAddress != info->expected[i].instAddress ||
+           bbAccesses[i].accessAddress != info->expected[i].accessAddress ||
+           bbAccesses[i].type != info->expected[i].type) {
+            info->mismatches++;
+            break;
+        }
+    }
+    return QBDI::VMAction::CONTINUE;
+}
+
 QBDI::VMAction writeSnooper(QBDI::VMInstanceRef vm, QBDI::GPRState* gprState, QBDI::FPRState* fprState, void* data) {
     std::vector<QBDI::MemoryAccess> memaccesses = vm->getInstMemoryAccess();
     for(const QBDI::MemoryAccess& memaccess : memaccesses) {
@@ -481,6 +577,27 @@ TEST_F(MemoryAccessTest, DISABLED_BasicBlockRead) {
     ASSERT_EQ(OFFSET_SUM(buffer_size), info.i);
 }
 
+#if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
+TEST_F(MemoryAccessTest, BasicBlockReadBuffer) {
+#else
+TEST_F(MemoryAccessTest, DISABLED_BasicBlockReadBuffer) {
+#endif
+    char buffer[] = "p0p30fd0p3";
+    size_t buffer_size = sizeof(buffer) / sizeof(char);
+    TestInfo info = {(void*)buffer, sizeof(buffer), 0};
+
+    vm->recordMemoryAccess(QBDI::MEMORY_READ);
+    vm->addVMEventCB(QBDI::VMEvent::BASIC_BLOCK_EXIT, bufferUnrolledRead, &info);
+
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) buffer});
+    bool ran = vm->run((QBDI::rword) unrolledRead, (QBDI::rword) FAKE_RET_ADDR);
+
+    ASSERT_EQ(true, ran);
+    QBDI::rword ret = QBDI_GPR_GET(state, QBDI::REG_RETURN);
+    ASSERT_EQ(ret, (QBDI::rword) unrolledRead(buffer));
+    ASSERT_EQ(OFFSET_SUM(buffer_size), info.i);
+}
+
 #if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
 TEST_F(MemoryAccessTest, BasicBlockWrite) {
 #else
@@ -620,3 +737,87 @@ TEST_F(MemoryAccessTest, DISABLED_MemorySnooping) {
     ret = QBDI_GPR_GET(state, QBDI::REG_RETURN);
     ASSERT_EQ(original, ret);
 }
+
+#if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
+TEST_F(MemoryAccessTest, MemoryTrace) {
+#else
+TEST_F(MemoryAccessTest, DISABLED_MemoryTrace) {
+#endif
+    const size_t buffer_size = 10;
+    uint8_t buffer[buffer_size];
+    TestInfo info = {(void*)buffer, sizeof(buffer), 0};
+
+    // A tiny trace buffer is grown and flushed between the sequences
+    bool started = vm->startMemoryTrace(QBDI::MEMORY_READ_WRITE, 1, traceArrayWrite8, &info);
+    ASSERT_TRUE(started);
+    ASSERT_FALSE(vm->startMemoryTrace(QBDI::MEMORY_WRITE, 1, traceArrayWrite8, &info));
+
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) buffer, (QBDI::rword) buffer_size});
+    bool ran = vm->run((QBDI::rword) arrayWrite8, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(true, ran);
+    QBDI::rword ret = QBDI_GPR_GET(state, QBDI::REG_RETURN);
+    ASSERT_EQ(ret, (QBDI::rword) arrayWrite8(buffer, buffer_size));
+    // All the records have been delivered at the end of the run
+    ASSERT_EQ(OFFSET_SUM(buffer_size), info.i);
+
+    vm->stopMemoryTrace();
+    info.i = 0;
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) buffer, (QBDI::rword) buffer_size});
+    ran = vm->run((QBDI::rword) arrayWrite8, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(true, ran);
+    ASSERT_EQ(0u, info.i);
+}
+
+#if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
+TEST_F(MemoryAccessTest, MemoryTraceStopInCallback) {
+#else
+TEST_F(MemoryAccessTest, DISABLED_MemoryTraceStopInCallback) {
+#endif
+    const size_t buffer_size = 10;
+    uint8_t buffer[buffer_size];
+    TestInfo info = {(void*)buffer, sizeof(buffer), 0};
+
+    // The tiny buffer is flushed by the gate during the run, where the callback stops the trace
+    ASSERT_TRUE(vm->startMemoryTrace(QBDI::MEMORY_READ_WRITE, 1, traceStopArrayWrite8, &info));
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) buffer, (QBDI::rword) buffer_size});
+    bool ran = vm->run((QBDI::rword) arrayWrite8, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(true, ran);
+    QBDI::rword ret = QBDI_GPR_GET(state, QBDI::REG_RETURN);
+    ASSERT_EQ(ret, (QBDI::rword) arrayWrite8(buffer, buffer_size));
+    ASSERT_LE(info.i, OFFSET_SUM(buffer_size));
+
+    // The trace is stopped and a new one can be started
+    vm->stopMemoryTrace();
+    info.i = 0;
+    ASSERT_TRUE(vm->startMemoryTrace(QBDI::MEMORY_READ_WRITE, 1, traceArrayWrite8, &info));
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) buffer, (QBDI::rword) buffer_size});
+    ran = vm->run((QBDI::rword) arrayWrite8, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(true, ran);
+    ASSERT_EQ(OFFSET_SUM(buffer_size), info.i);
+    vm->stopMemoryTrace();
+}
+
+#if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
+TEST_F(MemoryAccessTest, BasicBlockAccessInTrace) {
+#else
+TEST_F(MemoryAccessTest, DISABLED_BasicBlockAccessInTrace) {
+#endif
+    const size_t buffer_size = 200;
+    uint8_t buffer[buffer_size];
+    BBAccessInfo info = {std::vector<QBDI::MemoryAccess>(), true, 0, 0};
+
+    // The loop becomes hot and its basic blocks are executed from a trace
+    vm->recordMemoryAccess(QBDI::MEMORY_READ_WRITE);
+    vm->addCodeCB(QBDI::InstPosition::POSTINST, checkBBAccess, &info);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) buffer, (QBDI::rword) buffer_size});
+    bool ran = vm->run((QBDI::rword) branchyWrite8, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(true, ran);
+    QBDI::rword ret = QBDI_GPR_GET(state, QBDI::REG_RETURN);
+    ASSERT_EQ(ret, (QBDI::rword) branchyWrite8(buffer, buffer_size));
+
+    QBDI::CacheStats stats;
+    vm->getCacheStats(&stats);
+    ASSERT_LE((QBDI::rword) 1, stats.traces);
+    ASSERT_LT(0u, info.checked);
+    ASSERT_EQ(0u, info.mismatches);
+}
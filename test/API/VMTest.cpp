@@ -16,6 +16,7 @@
  * limitations under the License.
  */
 #include <algorithm>
+#include <vector>
 #include <gtest/gtest.h>
 #include "VMTest.h"
 
@@ -60,6 +61,21 @@ QBDI_NOINLINE int dummyFun8(int arg0, int arg1, int arg2, int arg3, int arg4, in
 	return arg0 + arg1 + arg2 + arg3 + arg4 + arg5 + arg6 + arg7;
 }
 
+QBDI_NOINLINE int dummyFunFPR(int arg0) {
+    volatile double d = arg0;
+    return (int) (d * 1.5);
+}
+
+#if (defined(QBDI_ARCH_X86) || defined(QBDI_ARCH_X86_64)) && !defined(QBDI_OS_WIN)
+QBDI_NOINLINE int dummyFunX87(int arg0) {
+    // Only x87 memory forms, the result depends on the rounding mode of the FPU
+    static const int two = 2;
+    int result = 0;
+    asm volatile("fildl %1\n\tfidivl %2\n\tfistpl %0" : "=m"(result) : "m"(arg0), "m"(two));
+    return result;
+}
+#endif
+
 QBDI_NOINLINE int dummyFunCall(int arg0) {
     // use simple BUT multiplatform functions to test external calls
     uint8_t* useless = (uint8_t*) QBDI::alignedAlloc(256, 16);
@@ -70,6 +86,30 @@ QBDI_NOINLINE int dummyFunCall(int arg0) {
     return dummyFun1(arg0);
 }
 
+QBDI_NOINLINE int dummyFunIndirect(int arg0) {
+    int (* volatile fun)(int) = dummyFun1;
+    int r = 0;
+    for(int i = 0; i < arg0; i++) {
+        r += fun(i);
+    }
+    return r;
+}
+
+QBDI_NOINLINE int dummyFunLoop(int arg0) {
+    // The branches store to different volatile variables and can't be turned into a select
+    volatile int r = 0;
+    volatile int x = 0;
+    for(int i = 0; i < arg0; i++) {
+        if(i % 3 == 0) {
+            r = r + i;
+        }
+        else {
+            x = x ^ i;
+        }
+    }
+    return r + x;
+}
+
 
 #if defined(QBDI_ARCH_X86) || defined(QBDI_ARCH_X86_64)
 #define MNEM_COUNT 5u
@@ -302,6 +342,422 @@ TEST_F(VMTest, Breakpoint) {
 }
 
 
+/* Address callbacks are indexed, unrelated breakpoints must not change the instrumentation */
+TEST_F(VMTest, ManyBreakpoints) {
+    uint32_t counter = 0;
+    uint32_t unused = 0;
+    QBDI::rword retval = 0;
+    for(QBDI::rword i = 1; i <= 1000; i++) {
+        vm->addCodeAddrCB(i * 0x10, QBDI::InstPosition::PREINST, countInstruction, &unused);
+    }
+    uint32_t instrId = vm->addCodeAddrCB((QBDI::rword)dummyFun0, QBDI::InstPosition::PREINST, countInstruction, &counter);
+    vm->addMnemonicCB("UNKNOWN_MNEMONIC*", QBDI::InstPosition::PREINST, countInstruction, &unused);
+    vm->call(&retval, (QBDI::rword) dummyFun0);
+    ASSERT_EQ(retval, (QBDI::rword) 42);
+    ASSERT_EQ(counter, 1u);
+
+    vm->deleteInstrumentation(instrId);
+    vm->call(&retval, (QBDI::rword) dummyFun0);
+    ASSERT_EQ(retval, (QBDI::rword) 42);
+    ASSERT_EQ(counter, 1u);
+    ASSERT_EQ(unused, 0u);
+
+    SUCCEED();
+}
+
+
+QBDI::VMAction stopAfterInstruction(QBDI::VMInstanceRef vm, QBDI::GPRState *gprState, QBDI::FPRState *fprState, void *data) {
+    uint32_t* info = (uint32_t*) data;
+    info[0] += 1;
+    return info[0] == info[1] ? QBDI::VMAction::STOP : QBDI::VMAction::CONTINUE;
+}
+
+
+TEST_F(VMTest, FastCodeCallback) {
+    uint32_t counter = 0;
+    uint32_t fastCounter = 0;
+
+    uint32_t instrId = vm->addCodeCB(QBDI::InstPosition::PREINST, countInstruction, &counter);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1, 2, 3, 5, 8, 13, 21, 34});
+    vm->run((QBDI::rword) dummyFun8, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_TRUE(vm->deleteInstrumentation(instrId));
+
+    // Fast callbacks are triggered as many times and preserve the execution
+    instrId = vm->addFastCodeCB(QBDI::InstPosition::PREINST, countInstruction, &fastCounter);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1, 2, 3, 5, 8, 13, 21, 34});
+    vm->run((QBDI::rword) dummyFun8, (QBDI::rword) FAKE_RET_ADDR);
+    QBDI::rword ret = QBDI_GPR_GET(state, QBDI::REG_RETURN);
+    ASSERT_EQ(ret, (QBDI::rword) dummyFun8(1, 2, 3, 5, 8, 13, 21, 34));
+    ASSERT_NE(0u, counter);
+    ASSERT_EQ(counter, fastCounter);
+    ASSERT_TRUE(vm->deleteInstrumentation(instrId));
+
+    // Without state, only the registers modified by the call are saved
+    fastCounter = 0;
+    instrId = vm->addFastCodeCB(QBDI::InstPosition::PREINST, countInstruction, &fastCounter, false);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1, 2, 3, 5, 8, 13, 21, 34});
+    vm->run((QBDI::rword) dummyFun8, (QBDI::rword) FAKE_RET_ADDR);
+    ret = QBDI_GPR_GET(state, QBDI::REG_RETURN);
+    ASSERT_EQ(ret, (QBDI::rword) dummyFun8(1, 2, 3, 5, 8, 13, 21, 34));
+    ASSERT_EQ(counter, fastCounter);
+    ASSERT_TRUE(vm->deleteInstrumentation(instrId));
+
+    // STOP leaves the ExecBlock and stops the VM
+    uint32_t info[2] = {0, 3};
+    instrId = vm->addFastCodeCB(QBDI::InstPosition::PREINST, stopAfterInstruction, info);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1, 2, 3, 5, 8, 13, 21, 34});
+    vm->run((QBDI::rword) dummyFun8, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(3u, info[0]);
+    ASSERT_TRUE(vm->deleteInstrumentation(instrId));
+
+    // Also without state
+    info[0] = 0;
+    instrId = vm->addFastCodeCB(QBDI::InstPosition::PREINST, stopAfterInstruction, info, false);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1, 2, 3, 5, 8, 13, 21, 34});
+    vm->run((QBDI::rword) dummyFun8, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(3u, info[0]);
+    ASSERT_TRUE(vm->deleteInstrumentation(instrId));
+
+    SUCCEED();
+}
+
+
+#if defined(QBDI_ARCH_X86) || defined(QBDI_ARCH_X86_64)
+TEST_F(VMTest, LazyFPRState) {
+    uint32_t counter = 0;
+    QBDI::FPRState* fprState = vm->getFPRState();
+    memset(fprState->xmm7, 0x42, sizeof(fprState->xmm7));
+
+    // The guest FPR survive the host callbacks whether the ExecBlock switches them or not
+    uint32_t instrId = vm->addCodeCB(QBDI::InstPosition::PREINST, countInstruction, &counter);
+    uint32_t fastInstrId = vm->addFastCodeCB(QBDI::InstPosition::POSTINST, countInstruction, &counter);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1, 2, 3, 5, 8, 13, 21, 34});
+    vm->run((QBDI::rword) dummyFun8, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ((QBDI::rword) dummyFun8(1, 2, 3, 5, 8, 13, 21, 34), QBDI_GPR_GET(state, QBDI::REG_RETURN));
+    for(size_t i = 0; i < sizeof(fprState->xmm7); i++) {
+        ASSERT_EQ(0x42, fprState->xmm7[i]);
+    }
+
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {21});
+    vm->run((QBDI::rword) dummyFunFPR, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ((QBDI::rword) dummyFunFPR(21), QBDI_GPR_GET(state, QBDI::REG_RETURN));
+    ASSERT_TRUE(vm->deleteInstrumentation(instrId));
+    ASSERT_TRUE(vm->deleteInstrumentation(fastInstrId));
+
+    SUCCEED();
+}
+#endif
+
+
+#if (defined(QBDI_ARCH_X86) || defined(QBDI_ARCH_X86_64)) && !defined(QBDI_OS_WIN)
+TEST_F(VMTest, LazyFPRStateX87) {
+    QBDI::FPRState* fprState = vm->getFPRState();
+    // Round toward +inf in the guest while the host keeps rounding to nearest
+    fprState->rfcw = 0xB7F;
+
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {5});
+    vm->run((QBDI::rword) dummyFunX87, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ((QBDI::rword) 3, QBDI_GPR_GET(state, QBDI::REG_RETURN));
+    ASSERT_EQ(2, dummyFunX87(5));
+    ASSERT_EQ(0xB7F, fprState->rfcw);
+
+    SUCCEED();
+}
+#endif
+
+
+#if defined(QBDI_ARCH_X86) || defined(QBDI_ARCH_X86_64)
+TEST_F(VMTest, TargetCacheStats) {
+    QBDI::CacheStats stats;
+    vm->getCacheStats(&stats);
+    ASSERT_EQ((QBDI::rword) 0, stats.targetCacheHits);
+    ASSERT_EQ((QBDI::rword) 0, stats.targetCacheMisses);
+
+    // The indirect call only misses until its target is cached
+    QBDI::rword retval = 0;
+    ASSERT_TRUE(vm->call(&retval, (QBDI::rword) dummyFunIndirect, {(QBDI::rword) 20}));
+    ASSERT_EQ((QBDI::rword) dummyFunIndirect(20), retval);
+    vm->getCacheStats(&stats);
+    ASSERT_NE((QBDI::rword) 0, stats.targetCacheMisses);
+    ASSERT_LT(stats.targetCacheMisses, stats.targetCacheHits);
+
+    // The counters of each indirect branch are included in the global ones
+    std::vector<QBDI::TargetCacheStats> sites = vm->getTargetCacheStats();
+    ASSERT_LT(0u, sites.size());
+    QBDI::rword hits = 0;
+    QBDI::rword misses = 0;
+    for(const QBDI::TargetCacheStats& site : sites) {
+        ASSERT_NE((QBDI::rword) 0, site.address);
+        hits += site.hits;
+        misses += site.misses;
+    }
+    ASSERT_LT((QBDI::rword) 0, hits);
+    ASSERT_LE(hits, stats.targetCacheHits);
+    ASSERT_LE(misses, stats.targetCacheMisses);
+
+    // The counters of the cleared blocks are kept, but not the ones of their indirect branches
+    QBDI::CacheStats cleared;
+    vm->clearAllCache();
+    vm->getCacheStats(&cleared);
+    ASSERT_EQ(stats.targetCacheHits, cleared.targetCacheHits);
+    ASSERT_EQ(stats.targetCacheMisses, cleared.targetCacheMisses);
+    ASSERT_EQ(0u, vm->getTargetCacheStats().size());
+
+    SUCCEED();
+}
+#endif
+
+
+TEST_F(VMTest, DecodeCache) {
+    const char* path = "VMTest_DecodeCache.bin";
+    remove(path);
+
+    ASSERT_FALSE(vm->saveDecodeCache(path));
+    ASSERT_FALSE(vm->loadDecodeCache(path));
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1, 2, 3, 5, 8, 13, 21, 34});
+    vm->run((QBDI::rword) dummyFun8, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ((QBDI::rword) dummyFun8(1, 2, 3, 5, 8, 13, 21, 34), QBDI_GPR_GET(state, QBDI::REG_RETURN));
+    ASSERT_TRUE(vm->saveDecodeCache(path));
+
+    // Translate again from the decoded instructions
+    vm->clearAllCache();
+    ASSERT_TRUE(vm->loadDecodeCache(path));
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1, 2, 3, 5, 8, 13, 21, 34});
+    vm->run((QBDI::rword) dummyFun8, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ((QBDI::rword) dummyFun8(1, 2, 3, 5, 8, 13, 21, 34), QBDI_GPR_GET(state, QBDI::REG_RETURN));
+    remove(path);
+
+    SUCCEED();
+}
+
+
+TEST_F(VMTest, SpeculativeTranslation) {
+    vm->setSpeculativeTranslation(true);
+    for(int i = 0; i < 3; i++) {
+        QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) i});
+        vm->run((QBDI::rword) dummyFunCall, (QBDI::rword) FAKE_RET_ADDR);
+        ASSERT_EQ((QBDI::rword) dummyFunCall(i), QBDI_GPR_GET(state, QBDI::REG_RETURN));
+    }
+    vm->setSpeculativeTranslation(false);
+
+    SUCCEED();
+}
+
+
+TEST_F(VMTest, StopAddress) {
+    uint32_t counter = 0;
+    uint32_t instrId = vm->addCodeCB(QBDI::InstPosition::PREINST, countInstruction, &counter);
+    ASSERT_NE(instrId, QBDI::INVALID_EVENTID);
+
+    // Same stop address between the runs, the cache is reused
+    uint32_t firstCount = 0;
+    for(int i = 0; i < 3; i++) {
+        counter = 0;
+        QBDI::rword retval = 0;
+        bool ran = vm->call(&retval, (QBDI::rword) dummyFun4, {1, 2, 3, (QBDI::rword) i});
+        ASSERT_TRUE(ran);
+        ASSERT_EQ(retval, (QBDI::rword) dummyFun4(1, 2, 3, i));
+        if(i == 0) {
+            firstCount = counter;
+        }
+        ASSERT_NE(counter, 0u);
+        ASSERT_EQ(counter, firstCount);
+    }
+
+    // Stop address inside the instrumented code, reached by a chained call
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {(QBDI::rword) 42});
+    vm->run((QBDI::rword) dummyFunCall, (QBDI::rword) dummyFun1);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_PC), (QBDI::rword) dummyFun1);
+    vm->run((QBDI::rword) dummyFun1, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), (QBDI::rword) dummyFunCall(42));
+
+    vm->deleteInstrumentation(instrId);
+    SUCCEED();
+}
+
+
+QBDI::VMAction recordInstruction(QBDI::VMInstanceRef vm, QBDI::GPRState *gprState, QBDI::FPRState *fprState, void *data) {
+    ((std::vector<QBDI::rword>*) data)->push_back(vm->getInstAnalysis(QBDI::ANALYSIS_INSTRUCTION)->address);
+    return QBDI::VMAction::CONTINUE;
+}
+
+TEST_F(VMTest, StopAddressCallbacks) {
+    std::vector<QBDI::rword> executed;
+    uint32_t instrId = vm->addCodeCB(QBDI::InstPosition::PREINST, recordInstruction, &executed);
+    ASSERT_NE(instrId, QBDI::INVALID_EVENTID);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1, 2, 3, 4});
+    vm->run((QBDI::rword) dummyFun4, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_LE(2u, executed.size());
+    // The second instruction is in the middle of the first basic block
+    const QBDI::rword stop = executed[1];
+
+    // The PREINST callbacks of the stop address are not called
+    uint32_t counter = 0;
+    uint32_t stopId = vm->addCodeAddrCB(stop, QBDI::InstPosition::PREINST, countInstruction, &counter);
+    ASSERT_NE(stopId, QBDI::INVALID_EVENTID);
+    executed.clear();
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1, 2, 3, 4});
+    vm->run((QBDI::rword) dummyFun4, stop);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_PC), stop);
+    ASSERT_EQ(0u, counter);
+    ASSERT_EQ(1u, executed.size());
+
+    // They are called once when the execution resumes
+    vm->run(stop, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(1u, counter);
+    ASSERT_EQ(stop, executed[1]);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), (QBDI::rword) dummyFun4(1, 2, 3, 4));
+
+    vm->deleteInstrumentation(stopId);
+    vm->deleteInstrumentation(instrId);
+}
+
+QBDI::VMAction recordNewBasicBlock(QBDI::VMInstanceRef vm, const QBDI::VMState *state, QBDI::GPRState *gprState, QBDI::FPRState *fprState, void *data) {
+    ((std::vector<QBDI::rword>*) data)->push_back(state->basicBlockStart);
+    return QBDI::VMAction::CONTINUE;
+}
+
+TEST_F(VMTest, StopAddressRetranslation) {
+    std::vector<QBDI::rword> newBlocks;
+    uint32_t eventId = vm->addVMEventCB(QBDI::VMEvent::BASIC_BLOCK_NEW, recordNewBasicBlock, &newBlocks);
+    ASSERT_NE(eventId, QBDI::INVALID_EVENTID);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {42});
+    vm->run((QBDI::rword) dummyFunCall, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_NE(0u, newBlocks.size());
+
+    // Stopping at a new address only retranslates its basic block
+    newBlocks.clear();
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {42});
+    vm->run((QBDI::rword) dummyFunCall, (QBDI::rword) dummyFun1);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_PC), (QBDI::rword) dummyFun1);
+    ASSERT_EQ(0u, newBlocks.size());
+    vm->run((QBDI::rword) dummyFun1, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(1u, newBlocks.size());
+    ASSERT_EQ((QBDI::rword) dummyFun1, newBlocks[0]);
+    ASSERT_EQ(QBDI_GPR_GET(state, QBDI::REG_RETURN), (QBDI::rword) dummyFunCall(42));
+
+    vm->deleteInstrumentation(eventId);
+}
+
+TEST_F(VMTest, InlineCounters) {
+    uint32_t counter = 0;
+    uint32_t cbId = vm->addCodeCB(QBDI::InstPosition::PREINST, countInstruction, &counter);
+    ASSERT_NE(cbId, QBDI::INVALID_EVENTID);
+    uint32_t instId = vm->addInstCounter(0, (QBDI::rword) -1);
+    ASSERT_NE(instId, QBDI::INVALID_EVENTID);
+    uint32_t blockId = vm->addBlockCounter((QBDI::rword) dummyFun4, ((QBDI::rword) dummyFun4) + 1);
+    ASSERT_NE(blockId, QBDI::INVALID_EVENTID);
+
+    for(int i = 0; i < 3; i++) {
+        QBDI::rword retval = 0;
+        bool ran = vm->call(&retval, (QBDI::rword) dummyFun4, {1, 2, 3, (QBDI::rword) i});
+        ASSERT_TRUE(ran);
+        ASSERT_EQ(retval, (QBDI::rword) dummyFun4(1, 2, 3, i));
+    }
+
+    // The counters of overlapping instrumentations are separate
+    size_t size = 0;
+    size_t index = 0;
+    ASSERT_TRUE(vm->getCounterIndex(instId, (QBDI::rword) dummyFun4, &index));
+    const QBDI::rword* counter4 = vm->getCounters(instId, index, &size);
+    ASSERT_NE(nullptr, counter4);
+    ASSERT_NE(0u, size);
+    ASSERT_EQ((QBDI::rword) 3, *counter4);
+    QBDI::rword total = 0;
+    size_t count = 0;
+    for(const QBDI::rword* counters = vm->getCounters(instId, 0, &size); size != 0;
+        counters = vm->getCounters(instId, count, &size)) {
+        for(size_t i = 0; i < size; i++) {
+            total += counters[i];
+        }
+        count += size;
+    }
+    ASSERT_EQ((QBDI::rword) counter, total);
+    ASSERT_LT(index, count);
+    ASSERT_EQ(nullptr, vm->getCounters(instId, count, &size));
+    ASSERT_TRUE(vm->getCounterIndex(blockId, (QBDI::rword) dummyFun4, &index));
+    const QBDI::rword* counters = vm->getCounters(blockId, index, &size);
+    ASSERT_EQ(1u, size);
+    ASSERT_EQ((QBDI::rword) 3, counters[0]);
+
+    // The counters are read in place, without copy
+    vm->resetCounters();
+    ASSERT_EQ((QBDI::rword) 0, *counter4);
+    ASSERT_TRUE(vm->getCounterIndex(instId, (QBDI::rword) dummyFun4, &index));
+    ASSERT_EQ(counter4, vm->getCounters(instId, index, &size));
+    ASSERT_FALSE(vm->getCounterIndex(instId, (QBDI::rword) FAKE_RET_ADDR, &index));
+    ASSERT_FALSE(vm->getCounterIndex(cbId, (QBDI::rword) dummyFun4, &index));
+
+    vm->deleteInstrumentation(blockId);
+    vm->deleteInstrumentation(instId);
+    vm->deleteInstrumentation(cbId);
+    SUCCEED();
+}
+
+
+QBDI::VMAction countBasicBlock(QBDI::VMInstanceRef vm, const QBDI::VMState *state, QBDI::GPRState *gprState, QBDI::FPRState *fprState, void *data) {
+    *((uint32_t*) data) += 1;
+    return QBDI::VMAction::CONTINUE;
+}
+
+TEST_F(VMTest, TraceFormation) {
+    uint32_t counter = 0;
+    uint32_t bbCounter = 0;
+    uint32_t firstCount = 0;
+    uint32_t cbId = vm->addCodeCB(QBDI::InstPosition::PREINST, countInstruction, &counter);
+    ASSERT_NE(cbId, QBDI::INVALID_EVENTID);
+
+    // The loop becomes hot during the first run, the next ones execute its trace
+    for(int i = 0; i < 3; i++) {
+        counter = 0;
+        QBDI::rword retval = 0;
+        bool ran = vm->call(&retval, (QBDI::rword) dummyFunLoop, {(QBDI::rword) 200});
+        ASSERT_TRUE(ran);
+        ASSERT_EQ(retval, (QBDI::rword) dummyFunLoop(200));
+        if(i == 0) {
+            firstCount = counter;
+        }
+        ASSERT_EQ(counter, firstCount);
+    }
+#if defined(QBDI_ARCH_X86) || defined(QBDI_ARCH_X86_64)
+    // The branch of the loop body which is not in the trace leaves it through a side exit, which
+    // is linked to its target the first time it is taken
+    QBDI::CacheStats stats;
+    vm->getCacheStats(&stats);
+    ASSERT_LE((QBDI::rword) 1, stats.traces);
+    ASSERT_LE((QBDI::rword) 1, stats.traceSideExits);
+#endif
+
+    // Basic block events are signaled for every iteration once the traces are removed
+    uint32_t eventId = vm->addVMEventCB(QBDI::VMEvent::BASIC_BLOCK_ENTRY, countBasicBlock, &bbCounter);
+    ASSERT_NE(eventId, QBDI::INVALID_EVENTID);
+    counter = 0;
+    QBDI::rword retval = 0;
+    ASSERT_TRUE(vm->call(&retval, (QBDI::rword) dummyFunLoop, {(QBDI::rword) 200}));
+    ASSERT_EQ(retval, (QBDI::rword) dummyFunLoop(200));
+    ASSERT_EQ(counter, firstCount);
+    ASSERT_LE(200u, bbCounter);
+
+    // And formed again after
+    vm->deleteInstrumentation(eventId);
+    for(int i = 0; i < 2; i++) {
+        counter = 0;
+        ASSERT_TRUE(vm->call(&retval, (QBDI::rword) dummyFunLoop, {(QBDI::rword) 200}));
+        ASSERT_EQ(retval, (QBDI::rword) dummyFunLoop(200));
+        ASSERT_EQ(counter, firstCount);
+    }
+#if defined(QBDI_ARCH_X86) || defined(QBDI_ARCH_X86_64)
+    QBDI::CacheStats formed;
+    vm->getCacheStats(&formed);
+    ASSERT_LT(stats.traces, formed.traces);
+    ASSERT_LT(stats.traceSideExits, formed.traceSideExits);
+#endif
+
+    vm->deleteInstrumentation(cbId);
+    SUCCEED();
+}
+
+
 TEST_F(VMTest, InstCallback) {
     QBDI::rword info[2] = {42, 0};
     QBDI::simulateCall(state, FAKE_RET_ADDR, {info[0]});
@@ -486,6 +942,98 @@ TEST_F(VMTest, VMEvent_ExecTransfer) {
     vm->deleteAllInstrumentations();
 }
 
+QBDI::VMAction recordEntry(QBDI::VMInstanceRef vm, const QBDI::VMState *state, QBDI::GPRState *gprState, QBDI::FPRState *fprState, void *data) {
+    QBDI::rword* entry = (QBDI::rword*) data;
+    if (*entry == 0 && (state->event & QBDI::VMEvent::BASIC_BLOCK_ENTRY)) {
+        *entry = state->basicBlockStart;
+    }
+    return QBDI::VMAction::CONTINUE;
+}
+
+TEST_F(VMTest, VMEvent_MultipleVM) {
+    QBDI::rword entry = 0;
+    QBDI::rword entry2 = 0;
+    QBDI::VM vm2;
+    uint8_t* fakestack2 = nullptr;
+    QBDI::GPRState* state2 = vm2.getGPRState();
+    ASSERT_TRUE(vm2.addInstrumentedModuleFromAddr((QBDI::rword) &dummyFun0));
+    ASSERT_TRUE(QBDI::allocateVirtualStack(state2, STACK_SIZE, &fakestack2));
+
+    // Each VM reports its own state
+    ASSERT_NE(vm->addVMEventCB(QBDI::VMEvent::BASIC_BLOCK_ENTRY, recordEntry, &entry), QBDI::INVALID_EVENTID);
+    ASSERT_NE(vm2.addVMEventCB(QBDI::VMEvent::SEQUENCE_ENTRY | QBDI::VMEvent::BASIC_BLOCK_ENTRY, recordEntry, &entry2),
+              QBDI::INVALID_EVENTID);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {42});
+    vm->run((QBDI::rword) dummyFun1, (QBDI::rword) FAKE_RET_ADDR);
+    QBDI::simulateCall(state2, FAKE_RET_ADDR, {1, 2, 3, 4});
+    vm2.run((QBDI::rword) dummyFun4, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ((QBDI::rword) dummyFun1(42), QBDI_GPR_GET(state, QBDI::REG_RETURN));
+    ASSERT_EQ((QBDI::rword) dummyFun4(1, 2, 3, 4), QBDI_GPR_GET(state2, QBDI::REG_RETURN));
+    ASSERT_EQ((QBDI::rword) &dummyFun1, entry);
+    ASSERT_EQ((QBDI::rword) &dummyFun4, entry2);
+    vm->deleteAllInstrumentations();
+    QBDI::alignedFree(fakestack2);
+}
+
+struct DeleteCallback {
+    uint32_t id;
+    uint32_t calls;
+};
+
+QBDI::VMAction deleteCallback(QBDI::VMInstanceRef vm, const QBDI::VMState *state, QBDI::GPRState *gprState, QBDI::FPRState *fprState, void *data) {
+    DeleteCallback* info = (DeleteCallback*) data;
+    info->calls++;
+    vm->deleteInstrumentation(info->id);
+    return QBDI::VMAction::CONTINUE;
+}
+
+QBDI::VMAction deleteAllCallback(QBDI::VMInstanceRef vm, const QBDI::VMState *state, QBDI::GPRState *gprState, QBDI::FPRState *fprState, void *data) {
+    (*((uint32_t*) data))++;
+    vm->deleteAllInstrumentations();
+    return QBDI::VMAction::CONTINUE;
+}
+
+TEST_F(VMTest, VMEvent_DeleteDuringDispatch) {
+    uint32_t reference = 0;
+    uint32_t counter = 0;
+    uint32_t deleted = 0;
+    DeleteCallback info = {0, 0};
+
+    uint32_t refId = vm->addVMEventCB(QBDI::VMEvent::BASIC_BLOCK_ENTRY, countBasicBlock, &reference);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1, 2, 3, 4});
+    vm->run((QBDI::rword) dummyFun4, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_NE(0u, reference);
+    ASSERT_TRUE(vm->deleteInstrumentation(refId));
+
+    // A callback deleting itself doesn't skip the next one
+    info.id = vm->addVMEventCB(QBDI::VMEvent::BASIC_BLOCK_ENTRY, deleteCallback, &info);
+    ASSERT_NE(vm->addVMEventCB(QBDI::VMEvent::BASIC_BLOCK_ENTRY, countBasicBlock, &counter), QBDI::INVALID_EVENTID);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1, 2, 3, 4});
+    vm->run((QBDI::rword) dummyFun4, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(1u, info.calls);
+    ASSERT_EQ(reference, counter);
+
+    // A callback deleted by a previous one of the same event is not called anymore
+    info.calls = 0;
+    counter = 0;
+    ASSERT_NE(vm->addVMEventCB(QBDI::VMEvent::BASIC_BLOCK_ENTRY, deleteCallback, &info), QBDI::INVALID_EVENTID);
+    info.id = vm->addVMEventCB(QBDI::VMEvent::BASIC_BLOCK_ENTRY, countBasicBlock, &deleted);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1, 2, 3, 4});
+    vm->run((QBDI::rword) dummyFun4, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(0u, deleted);
+    ASSERT_EQ(reference, info.calls);
+    ASSERT_EQ(reference, counter);
+    vm->deleteAllInstrumentations();
+
+    // Deleting all the callbacks during the dispatch stops it
+    uint32_t calls = 0;
+    ASSERT_NE(vm->addVMEventCB(QBDI::VMEvent::BASIC_BLOCK_ENTRY, deleteAllCallback, &calls), QBDI::INVALID_EVENTID);
+    ASSERT_NE(vm->addVMEventCB(QBDI::VMEvent::BASIC_BLOCK_ENTRY, deleteAllCallback, &calls), QBDI::INVALID_EVENTID);
+    QBDI::simulateCall(state, FAKE_RET_ADDR, {1, 2, 3, 4});
+    vm->run((QBDI::rword) dummyFun4, (QBDI::rword) FAKE_RET_ADDR);
+    ASSERT_EQ(1u, calls);
+}
+
 TEST_F(VMTest, CacheInvalidation) {
     uint32_t count1 = 0;
     uint32_t count2 = 0;
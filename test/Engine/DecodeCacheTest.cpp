@@ -0,0 +1,178 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <cstdio>
+
+#include "DecodeCacheTest.h"
+
+#include "Platform.h"
+
+static const char* FINGERPRINT = "DecodeCacheTest";
+// Flags of the instruction prefixes, they are opaque to the cache
+static const unsigned FLAGS = 0x2;
+
+QBDI_NOINLINE int decodeCacheTarget(int arg0) {
+    return arg0 + 1;
+}
+
+static llvm::ArrayRef<uint8_t> codeAt(QBDI::rword address) {
+    // Enough bytes for the instructions of the tests
+    return llvm::ArrayRef<uint8_t>((const uint8_t*) address, 4);
+}
+
+static llvm::MCInst makeInst(unsigned opcode, unsigned reg) {
+    llvm::MCInst inst;
+    inst.setOpcode(opcode);
+    inst.setFlags(FLAGS);
+    inst.addOperand(llvm::MCOperand::createReg(reg));
+    inst.addOperand(llvm::MCOperand::createImm(42));
+    return inst;
+}
+
+TEST_F(DecodeCacheTest, SaveLoad) {
+    const char* path = "DecodeCacheTest_SaveLoad.bin";
+    const QBDI::rword address = (QBDI::rword) decodeCacheTarget;
+    llvm::MCInst inst;
+    uint64_t size = 0;
+
+    QBDI::DecodeCache cache(FINGERPRINT);
+    ASSERT_FALSE(cache.lookup(inst, size, address, codeAt(address)));
+    cache.insert(makeInst(1, 1), 1, address, codeAt(address));
+    ASSERT_TRUE(cache.save(path));
+
+    // The entries of the file are used without being decoded again
+    QBDI::DecodeCache loaded(FINGERPRINT);
+    ASSERT_TRUE(loaded.load(path, MCII.get(), MRI.get()));
+    ASSERT_TRUE(loaded.lookup(inst, size, address, codeAt(address)));
+    ASSERT_EQ(1u, size);
+    ASSERT_EQ(1u, inst.getOpcode());
+    ASSERT_EQ(FLAGS, inst.getFlags());
+    ASSERT_EQ(2u, inst.getNumOperands());
+    ASSERT_EQ(1u, inst.getOperand(0).getReg());
+    ASSERT_EQ(42, inst.getOperand(1).getImm());
+
+    // Files of another disassembler configuration are rejected
+    QBDI::DecodeCache other("DecodeCacheTest_Other");
+    ASSERT_FALSE(other.load(path, MCII.get(), MRI.get()));
+    ASSERT_FALSE(other.lookup(inst, size, address, codeAt(address)));
+    remove(path);
+}
+
+TEST_F(DecodeCacheTest, RejectUnknown) {
+    const char* path = "DecodeCacheTest_RejectUnknown.bin";
+    const QBDI::rword address = (QBDI::rword) decodeCacheTarget;
+    llvm::MCInst inst;
+    uint64_t size = 0;
+
+    // Unknown opcode
+    QBDI::DecodeCache badOpcode(FINGERPRINT);
+    badOpcode.insert(makeInst(MCII->getNumOpcodes(), 1), 1, address, codeAt(address));
+    ASSERT_TRUE(badOpcode.save(path));
+    QBDI::DecodeCache loadedOpcode(FINGERPRINT);
+    ASSERT_FALSE(loadedOpcode.load(path, MCII.get(), MRI.get()));
+    ASSERT_FALSE(loadedOpcode.lookup(inst, size, address, codeAt(address)));
+
+    // Unknown register
+    QBDI::DecodeCache badReg(FINGERPRINT);
+    badReg.insert(makeInst(1, MRI->getNumRegs()), 1, address, codeAt(address));
+    ASSERT_TRUE(badReg.save(path));
+    QBDI::DecodeCache loadedReg(FINGERPRINT);
+    ASSERT_FALSE(loadedReg.load(path, MCII.get(), MRI.get()));
+    ASSERT_FALSE(loadedReg.lookup(inst, size, address, codeAt(address)));
+    remove(path);
+}
+
+TEST_F(DecodeCacheTest, Bounded) {
+    const char* path = "DecodeCacheTest_Bounded.bin";
+    const QBDI::rword address = (QBDI::rword) decodeCacheTarget;
+    llvm::MCInst inst;
+    uint64_t size = 0;
+
+    // The entries beyond the maximum are dropped while their module is in use
+    QBDI::DecodeCache cache(FINGERPRINT, 2);
+    cache.insert(makeInst(1, 1), 1, address, codeAt(address));
+    cache.insert(makeInst(1, 1), 1, address + 1, codeAt(address + 1));
+    cache.insert(makeInst(1, 1), 1, address + 2, codeAt(address + 2));
+    ASSERT_TRUE(cache.lookup(inst, size, address, codeAt(address)));
+    ASSERT_TRUE(cache.lookup(inst, size, address + 1, codeAt(address + 1)));
+    ASSERT_FALSE(cache.lookup(inst, size, address + 2, codeAt(address + 2)));
+
+    // Loading more entries than the maximum evicts the modules
+    QBDI::DecodeCache other(FINGERPRINT);
+    other.insert(makeInst(1, 1), 1, address + 2, codeAt(address + 2));
+    ASSERT_TRUE(other.save(path));
+    ASSERT_TRUE(cache.load(path, MCII.get(), MRI.get()));
+    ASSERT_FALSE(cache.lookup(inst, size, address, codeAt(address)));
+    ASSERT_FALSE(cache.lookup(inst, size, address + 2, codeAt(address + 2)));
+    remove(path);
+}
+
+TEST_F(DecodeCacheTest, PersistPatch) {
+    const char* path = "DecodeCacheTest_PersistPatch.bin";
+    const QBDI::rword address = (QBDI::rword) decodeCacheTarget;
+    llvm::MCInst inst;
+    uint64_t size = 0;
+
+    // A constant derived from the address and a context access
+    QBDI::Patch patch(makeInst(1, 1), address, 1);
+    QBDI::Patch probe(makeInst(1, 1), address + QBDI::DECODE_CACHE_PROBE_DELTA, 1);
+    for(QBDI::Patch* p: {&patch, &probe}) {
+        llvm::MCInst constant = makeInst(2, 1);
+        constant.getOperand(1).setImm(p->metadata.address + 4);
+        p->setModifyPC(true);
+        p->setMerge(false);
+        p->append(QBDI::NoReloc(constant));
+        p->append(QBDI::DataBlockRel(makeInst(3, 2), 1, 8));
+        p->append(QBDI::GuestInst(makeInst(4, 1)));
+    }
+    QBDI::DecodeCache cache(FINGERPRINT);
+    cache.insert(makeInst(1, 1), 1, address, codeAt(address));
+    cache.insertPatch(patch, probe, address);
+    ASSERT_TRUE(cache.save(path));
+
+    QBDI::DecodeCache loaded(FINGERPRINT);
+    ASSERT_TRUE(loaded.load(path, MCII.get(), MRI.get()));
+    QBDI::Patch persisted;
+    ASSERT_TRUE(loaded.lookup(inst, size, address, codeAt(address), &persisted));
+    ASSERT_EQ(address, persisted.metadata.address);
+    ASSERT_EQ(1u, persisted.metadata.instSize);
+    ASSERT_TRUE(persisted.metadata.modifyPC);
+    ASSERT_FALSE(persisted.metadata.merge);
+    ASSERT_EQ(3u, persisted.metadata.patchSize);
+    ASSERT_EQ(2u, persisted.insts[0]->inst.getOpcode());
+    ASSERT_EQ((int64_t) address + 4, persisted.insts[0]->inst.getOperand(1).getImm());
+    QBDI::rword slot = 0;
+    ASSERT_TRUE(persisted.insts[1]->getDataBlockSlot(&slot));
+    ASSERT_EQ(8u, slot);
+    // The guest instructions are never encoded from the cached encodings
+    ASSERT_EQ(4u, persisted.insts[2]->inst.getOpcode());
+    ASSERT_EQ(QBDI::TEMPLATE_NONE, persisted.insts[2]->getTemplateOperand());
+
+    // The immediates which don't follow the address can't be rebased
+    QBDI::Patch other(makeInst(1, 1), address + QBDI::DECODE_CACHE_PROBE_DELTA, 1);
+    other.setModifyPC(true);
+    other.setMerge(false);
+    other.append(QBDI::NoReloc(makeInst(2, 1)));
+    other.append(QBDI::DataBlockRel(makeInst(3, 2), 1, 8));
+    other.append(QBDI::GuestInst(makeInst(4, 1)));
+    cache.insert(makeInst(1, 1), 1, address, codeAt(address));
+    cache.insertPatch(patch, other, address);
+    QBDI::Patch dropped;
+    ASSERT_TRUE(cache.lookup(inst, size, address, codeAt(address), &dropped));
+    ASSERT_EQ(0u, dropped.insts.size());
+    remove(path);
+}
@@ -0,0 +1,168 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include "llvm/Support/Process.h"
+
+#include "SpeculativeTranslatorTest.h"
+
+#include "Platform.h"
+
+#ifndef QBDI_OS_WIN
+#include <sys/mman.h>
+#endif
+
+static const uint8_t CODE[16] = {0x90};
+static const uint8_t INVALID_CODE[16] = {0xff};
+static uint8_t MUTABLE_CODE[16] = {0x90};
+// Below the lowest address which can be mapped
+static const QBDI::rword UNMAPPED_ADDRESS = 0x10;
+
+static bool waitTake(QBDI::SpeculativeTranslator& translator, QBDI::rword address, std::vector<QBDI::Patch>& basicBlock) {
+    // The worker patches the basic blocks in the background
+    for(int i = 0; i < 1000; i++) {
+        if(translator.take(address, basicBlock)) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+}
+
+TEST_F(SpeculativeTranslatorTest, Take) {
+    const QBDI::rword address = (QBDI::rword) CODE;
+    std::atomic<uint32_t> patched(0);
+    QBDI::SpeculativeTranslator translator(std::move(assembly),
+        [&patched] (QBDI::rword start, llvm::ArrayRef<uint8_t> code, const QBDI::Assembly& disassembler, std::vector<QBDI::Patch>& basicBlock) -> bool {
+            patched++;
+            basicBlock.push_back(QBDI::Patch(llvm::MCInst(), start, 1));
+            return code.size() != 0;
+        }
+    );
+    std::vector<QBDI::Patch> basicBlock;
+
+    translator.request(address);
+    ASSERT_TRUE(waitTake(translator, address, basicBlock));
+    ASSERT_EQ(1u, basicBlock.size());
+    ASSERT_EQ(address, basicBlock[0].metadata.address);
+    ASSERT_EQ(1u, patched.load());
+    // A result is only used once
+    ASSERT_FALSE(translator.take(address, basicBlock));
+
+    // Discarded results are never used
+    translator.request(address);
+    for(int i = 0; i < 1000 && patched.load() < 2; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    translator.discard(QBDI::Range<QBDI::rword>(address, address + 1));
+    ASSERT_FALSE(translator.take(address, basicBlock));
+}
+
+TEST_F(SpeculativeTranslatorTest, DropFailures) {
+    const QBDI::rword address = (QBDI::rword) CODE;
+    const QBDI::rword invalid = (QBDI::rword) INVALID_CODE;
+    std::atomic<bool> unmappedPatched(false);
+    QBDI::SpeculativeTranslator translator(std::move(assembly),
+        [&unmappedPatched, invalid] (QBDI::rword start, llvm::ArrayRef<uint8_t> code, const QBDI::Assembly& disassembler, std::vector<QBDI::Patch>& basicBlock) -> bool {
+            if(start == UNMAPPED_ADDRESS) {
+                unmappedPatched = true;
+            }
+            // Behave like a decoding failure
+            if(start == invalid) {
+                return false;
+            }
+            basicBlock.push_back(QBDI::Patch(llvm::MCInst(), start, 1));
+            return true;
+        }
+    );
+    std::vector<QBDI::Patch> basicBlock;
+
+    // The requests are handled in order, the failures are dropped before the last one is ready
+    translator.request(UNMAPPED_ADDRESS);
+    translator.request(invalid);
+    translator.request(address);
+    ASSERT_TRUE(waitTake(translator, address, basicBlock));
+    ASSERT_FALSE(unmappedPatched.load());
+    ASSERT_FALSE(translator.take(UNMAPPED_ADDRESS, basicBlock));
+    ASSERT_FALSE(translator.take(invalid, basicBlock));
+}
+
+TEST_F(SpeculativeTranslatorTest, ModifiedCode) {
+    const QBDI::rword address = (QBDI::rword) MUTABLE_CODE;
+    std::atomic<size_t> modifiedByte(0);
+    QBDI::SpeculativeTranslator translator(std::move(assembly),
+        [address, &modifiedByte] (QBDI::rword start, llvm::ArrayRef<uint8_t> code, const QBDI::Assembly& disassembler, std::vector<QBDI::Patch>& basicBlock) -> bool {
+            // The code is modified after it was copied
+            if(start == address) {
+                MUTABLE_CODE[modifiedByte.load()] ^= 0xff;
+            }
+            basicBlock.push_back(QBDI::Patch(llvm::MCInst(), start, 2));
+            return true;
+        }
+    );
+    std::vector<QBDI::Patch> basicBlock;
+
+    // The modified byte follows the patched instruction, the result is used
+    modifiedByte = 2;
+    translator.request(address);
+    ASSERT_TRUE(waitTake(translator, address, basicBlock));
+    // The patched instruction was modified, the result is dropped
+    modifiedByte = 1;
+    translator.request(address);
+    translator.request((QBDI::rword) CODE);
+    ASSERT_TRUE(waitTake(translator, (QBDI::rword) CODE, basicBlock));
+    ASSERT_FALSE(translator.take(address, basicBlock));
+}
+
+#ifndef QBDI_OS_WIN
+TEST_F(SpeculativeTranslatorTest, CopyMappedCode) {
+    const size_t pageSize = llvm::sys::Process::getPageSize();
+    uint8_t* pages = (uint8_t*) mmap(nullptr, 2 * pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(MAP_FAILED, (void*) pages);
+    // The code stops at the page which is not mapped anymore
+    ASSERT_EQ(0, munmap(pages + pageSize, pageSize));
+    const QBDI::rword address = (QBDI::rword) pages + pageSize - sizeof(CODE);
+    memcpy((void*) address, CODE, sizeof(CODE));
+    std::atomic<size_t> codeSize(0);
+    std::atomic<bool> copied(false);
+    QBDI::SpeculativeTranslator translator(std::move(assembly),
+        [&codeSize, &copied] (QBDI::rword start, llvm::ArrayRef<uint8_t> code, const QBDI::Assembly& disassembler, std::vector<QBDI::Patch>& basicBlock) -> bool {
+            codeSize = code.size();
+            copied = code.data() != (const uint8_t*) start && memcmp(code.data(), CODE, sizeof(CODE)) == 0;
+            basicBlock.push_back(QBDI::Patch(llvm::MCInst(), start, 1));
+            return true;
+        }
+    );
+    std::vector<QBDI::Patch> basicBlock;
+
+    translator.request(address);
+    ASSERT_TRUE(waitTake(translator, address, basicBlock));
+    ASSERT_EQ(sizeof(CODE), codeSize.load());
+    ASSERT_TRUE(copied.load());
+
+    // Unmapped code is never patched
+    ASSERT_EQ(0, munmap(pages, pageSize));
+    translator.request(address);
+    translator.request((QBDI::rword) CODE);
+    ASSERT_TRUE(waitTake(translator, (QBDI::rword) CODE, basicBlock));
+    ASSERT_FALSE(translator.take(address, basicBlock));
+}
+#endif
@@ -42,6 +42,24 @@ TEST_F(ExecBlockManagerTest, ClearCache) {
     ASSERT_EQ(nullptr, execBlockManager.getProgrammedExecBlock(0x42424242));
 }
 
+TEST_F(ExecBlockManagerTest, ClearBasicBlocks) {
+    QBDI::ExecBlockManager execBlockManager(*MCII, *MRI, *assembly);
+    QBDI::RangeSet<QBDI::rword> range;
+    range.add(QBDI::Range<QBDI::rword>(0x42424242, 0x42424243));
+
+    execBlockManager.writeBasicBlock(getEmptyBB(0x42424242));
+    execBlockManager.writeBasicBlock(getEmptyBB(0x42424243));
+    QBDI::ExecBlock* block = execBlockManager.getProgrammedExecBlock(0x42424243);
+    // Only the basic block in the range is dropped, without flushing its region
+    execBlockManager.clearBasicBlocks(range);
+    ASSERT_FALSE(execBlockManager.isFlushPending());
+    ASSERT_EQ(nullptr, execBlockManager.getProgrammedExecBlock(0x42424242));
+    ASSERT_EQ(block, execBlockManager.getProgrammedExecBlock(0x42424243));
+    // It is written again in the same region
+    execBlockManager.writeBasicBlock(getEmptyBB(0x42424242));
+    ASSERT_EQ(block, execBlockManager.getProgrammedExecBlock(0x42424242));
+}
+
 TEST_F(ExecBlockManagerTest, ExecBlockReuse) {
     QBDI::ExecBlockManager execBlockManager(*MCII, *MRI, *assembly);
 
@@ -128,3 +146,105 @@ TEST_F(ExecBlockManagerTest, Stresstest) {
         ASSERT_EQ(address - 1, QBDI_GPR_GET(&block->getContext()->gprState, QBDI::REG_PC));
     }
 }
+
+TEST_F(ExecBlockManagerTest, LookupCacheInvalidation) {
+    QBDI::ExecBlockManager execBlockManager(*MCII, *MRI, *assembly);
+
+    execBlockManager.writeBasicBlock(getEmptyBB(0x42424242));
+    QBDI::ExecBlock* block = execBlockManager.getProgrammedExecBlock(0x42424242);
+    ASSERT_NE(nullptr, block);
+    // Inserting a region before the first one shifts the regions
+    execBlockManager.writeBasicBlock(getEmptyBB(0x24242424));
+    ASSERT_EQ(block, execBlockManager.getProgrammedExecBlock(0x42424242));
+    const QBDI::SeqLoc* seqLoc = execBlockManager.getSeqLoc(0x42424242);
+    ASSERT_NE(nullptr, seqLoc);
+    ASSERT_EQ((QBDI::rword) 0x42424242, seqLoc->seqStart);
+    // Flushing a region must drop its lookup entries
+    execBlockManager.clearCache(QBDI::Range<QBDI::rword>(0x42424242, 0x42424243));
+    ASSERT_TRUE(execBlockManager.isFlushPending());
+    execBlockManager.flushCommit();
+    ASSERT_EQ(nullptr, execBlockManager.getProgrammedExecBlock(0x42424242));
+    ASSERT_EQ(nullptr, execBlockManager.getSeqLoc(0x42424242));
+    ASSERT_NE(nullptr, execBlockManager.getProgrammedExecBlock(0x24242424));
+}
+
+TEST_F(ExecBlockManagerTest, CacheBudgetEviction) {
+    QBDI::ExecBlockManager execBlockManager(*MCII, *MRI, *assembly);
+
+    execBlockManager.writeBasicBlock(getEmptyBB(0x10000000));
+    size_t blockSize = execBlockManager.getCacheSize();
+    ASSERT_NE(0u, blockSize);
+    execBlockManager.setCacheBudget(4 * blockSize);
+    execBlockManager.writeBasicBlock(getEmptyBB(0x20000000));
+    execBlockManager.writeBasicBlock(getEmptyBB(0x30000000));
+    execBlockManager.writeBasicBlock(getEmptyBB(0x40000000));
+    ASSERT_FALSE(execBlockManager.isFlushPending());
+    // Use the first region so that the second and third ones are the least recently used
+    ASSERT_NE(nullptr, execBlockManager.getProgrammedExecBlock(0x10000000));
+    execBlockManager.writeBasicBlock(getEmptyBB(0x50000000));
+    ASSERT_TRUE(execBlockManager.isFlushPending());
+    // The eviction is deferred until the flush is committed
+    ASSERT_NE(nullptr, execBlockManager.getProgrammedExecBlock(0x20000000));
+    execBlockManager.flushCommit();
+    // The cache is evicted down to the low water mark
+    ASSERT_EQ(3 * blockSize, execBlockManager.getCacheSize());
+    ASSERT_EQ(nullptr, execBlockManager.getProgrammedExecBlock(0x20000000));
+    ASSERT_EQ(nullptr, execBlockManager.getProgrammedExecBlock(0x30000000));
+    ASSERT_NE(nullptr, execBlockManager.getProgrammedExecBlock(0x10000000));
+    ASSERT_NE(nullptr, execBlockManager.getProgrammedExecBlock(0x40000000));
+    ASSERT_NE(nullptr, execBlockManager.getProgrammedExecBlock(0x50000000));
+    // So the next translation fits in the budget without evicting
+    execBlockManager.writeBasicBlock(getEmptyBB(0x60000000));
+    ASSERT_FALSE(execBlockManager.isFlushPending());
+    ASSERT_EQ(4 * blockSize, execBlockManager.getCacheSize());
+}
+
+TEST_F(ExecBlockManagerTest, LazyInstrumentationInvalidation) {
+    QBDI::ExecBlockManager execBlockManager(*MCII, *MRI, *assembly);
+
+    execBlockManager.writeBasicBlock(getEmptyBB(0x42424242));
+    execBlockManager.writeBasicBlock(getEmptyBB(0x13371337));
+    // A rule which doesn't apply to the translated instructions keeps the regions
+    execBlockManager.invalidateInstrumentation(std::make_shared<QBDI::InstrRule>(
+        QBDI::Not(QBDI::True()), QBDI::PatchGenerator::SharedPtrVec(), QBDI::InstPosition::PREINST, false));
+    ASSERT_FALSE(execBlockManager.isFlushPending());
+    execBlockManager.revalidate(0x42424242);
+    ASSERT_FALSE(execBlockManager.isFlushPending());
+    // A rule which applies only retranslates the regions dispatched again
+    execBlockManager.invalidateInstrumentation(std::make_shared<QBDI::InstrRule>(
+        QBDI::True(), QBDI::PatchGenerator::SharedPtrVec(), QBDI::InstPosition::PREINST, false));
+    ASSERT_FALSE(execBlockManager.isFlushPending());
+    execBlockManager.revalidate(0x42424242);
+    ASSERT_TRUE(execBlockManager.isFlushPending());
+    execBlockManager.flushCommit();
+    ASSERT_EQ(nullptr, execBlockManager.getProgrammedExecBlock(0x42424242));
+    ASSERT_NE(nullptr, execBlockManager.getProgrammedExecBlock(0x13371337));
+    // A region translated after the change is up to date
+    execBlockManager.writeBasicBlock(getEmptyBB(0x42424242));
+    execBlockManager.revalidate(0x42424242);
+    ASSERT_FALSE(execBlockManager.isFlushPending());
+}
+
+TEST_F(ExecBlockManagerTest, BoundedInstrumentationChanges) {
+    QBDI::ExecBlockManager execBlockManager(*MCII, *MRI, *assembly);
+
+    execBlockManager.writeBasicBlock(getEmptyBB(0x42424242));
+    execBlockManager.writeBasicBlock(getEmptyBB(0x13371337));
+    // Only the last changes are kept, even if a region is never dispatched again
+    for(size_t i = 0; i <= QBDI::INSTR_CHANGES_MAX; i++) {
+        execBlockManager.invalidateInstrumentation(std::make_shared<QBDI::InstrRule>(
+            QBDI::Not(QBDI::True()), QBDI::PatchGenerator::SharedPtrVec(), QBDI::InstPosition::PREINST, false));
+        if(i == 0) {
+            execBlockManager.revalidate(0x42424242);
+        }
+    }
+    // The region checked after the first change is still checked against the kept ones
+    execBlockManager.revalidate(0x42424242);
+    ASSERT_FALSE(execBlockManager.isFlushPending());
+    // The region which missed the dropped change is retranslated
+    execBlockManager.revalidate(0x13371337);
+    ASSERT_TRUE(execBlockManager.isFlushPending());
+    execBlockManager.flushCommit();
+    ASSERT_NE(nullptr, execBlockManager.getProgrammedExecBlock(0x42424242));
+    ASSERT_EQ(nullptr, execBlockManager.getProgrammedExecBlock(0x13371337));
+}
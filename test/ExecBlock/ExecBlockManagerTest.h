@@ -23,6 +23,7 @@
 #include "Utility/Assembly.h"
 #include "ExecBlock/ExecBlockManager.h"
 #include "Patch/PatchRule.h"
+#include "Patch/InstrRule.h"
 #include "Patch/Patch.h"
 
 class ExecBlockManagerTest : public LLVMTestEnv {
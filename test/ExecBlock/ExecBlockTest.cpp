@@ -55,6 +55,34 @@ TEST_F(ExecBlockTest, MultipleBasicBlock) {
     ASSERT_EQ(pc1, pc3);
 }
 
+TEST_F(ExecBlockTest, DualMappedCode) {
+    // Allocate ExecBlock with a second RW mapping of its code
+    QBDI::ExecBlock execBlock(*assembly, nullptr, true);
+#if defined(QBDI_OS_LINUX) || defined(QBDI_OS_ANDROID)
+    ASSERT_TRUE(execBlock.isDualMapped());
+#endif
+    // The sequences are written through the RW mapping and executed from the RX one
+    QBDI::Patch::Vec terminator1;
+    QBDI::Patch::Vec terminator2;
+    terminator1.push_back(QBDI::Patch());
+    terminator2.push_back(QBDI::Patch());
+    terminator1[0].append(QBDI::getTerminator(0x42424242));
+    terminator2[0].append(QBDI::getTerminator(0x13371337));
+    QBDI::SeqWriteResult block1 = execBlock.writeSequence(terminator1.begin(), terminator1.end(), QBDI::SeqType::Exit);
+    execBlock.selectSeq(block1.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x42424242, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+    // Writing after an execution doesn't switch the permissions of the code
+    QBDI::SeqWriteResult block2 = execBlock.writeSequence(terminator2.begin(), terminator2.end(), QBDI::SeqType::Exit);
+    ASSERT_GT(block2.seqID, block1.seqID);
+    execBlock.selectSeq(block2.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x13371337, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+    execBlock.selectSeq(block1.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x42424242, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+}
+
 TEST_F(ExecBlockTest, BasicBlockOverload) {
     // Allocate ExecBlock
     QBDI::ExecBlock execBlock(*assembly);
@@ -71,3 +99,239 @@ TEST_F(ExecBlockTest, BasicBlockOverload) {
     }
     printf("Maximum basic block per exec block: %d\n", i);
 }
+
+TEST_F(ExecBlockTest, SequenceChaining) {
+    // Allocate ExecBlock
+    QBDI::ExecBlock execBlock(*assembly);
+    // Write a basic block as two sequences, the first one falling through to the second one
+    QBDI::Patch::Vec basicBlock;
+    basicBlock.push_back(QBDI::Patch(llvm::MCInst(), 0x1000, 1));
+    basicBlock.push_back(QBDI::Patch(llvm::MCInst(), 0x2000, 1));
+    basicBlock[1].append(QBDI::getTerminator(0x42424242));
+    QBDI::SeqWriteResult seq1 = execBlock.writeSequence(basicBlock.begin(), basicBlock.begin() + 1, QBDI::SeqType::Entry);
+    QBDI::SeqWriteResult seq2 = execBlock.writeSequence(basicBlock.begin() + 1, basicBlock.end(), QBDI::SeqType::Exit);
+    // Unlinked, the first sequence returns to the host
+    execBlock.selectSeq(seq1.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x2000, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+    uint16_t exitInstID = execBlock.getCurrentInstID();
+    // Linked, the second sequence is executed without returning to the host
+    ASSERT_FALSE(execBlock.linkExit(exitInstID, 0x3000, seq2.seqID));
+    ASSERT_TRUE(execBlock.linkExit(exitInstID, 0x2000, seq2.seqID));
+    execBlock.selectSeq(seq1.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x42424242, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+    ASSERT_EQ(seq2.seqID, execBlock.getCurrentSeqID());
+    // Unlinked again
+    execBlock.unlinkAll();
+    execBlock.selectSeq(seq1.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x2000, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+    ASSERT_EQ(seq1.seqID, execBlock.getCurrentSeqID());
+}
+
+TEST_F(ExecBlockTest, EncodingTemplates) {
+    // Allocate ExecBlock
+    QBDI::ExecBlock execBlock(*assembly);
+    QBDI::RelocatableInst::SharedPtrVec insts = QBDI::getExecBlockPrologue();
+    QBDI::RelocatableInst::SharedPtrVec epilogue = QBDI::getExecBlockEpilogue();
+    QBDI::RelocatableInst::SharedPtrVec terminator1 = QBDI::getTerminator(0x42424242);
+    QBDI::RelocatableInst::SharedPtrVec terminator2 = QBDI::getTerminator(0x10);
+    insts.insert(insts.end(), epilogue.begin(), epilogue.end());
+    insts.insert(insts.end(), terminator1.begin(), terminator1.end());
+    insts.insert(insts.end(), terminator2.begin(), terminator2.end());
+    // Encode every instruction with LLVM and from the templates, twice to use the cached ones
+    std::vector<uint8_t> encoded(8192, 0);
+    std::vector<uint8_t> templated(8192, 0);
+    llvm::sys::MemoryBlock encodedBlock(encoded.data(), encoded.size());
+    llvm::sys::MemoryBlock templatedBlock(templated.data(), templated.size());
+    memory_ostream encodedStream(encodedBlock);
+    memory_ostream templatedStream(templatedBlock);
+    for(int pass = 0; pass < 2; pass++) {
+        for(QBDI::RelocatableInst::SharedPtr& inst : insts) {
+            llvm::MCInst relocated = inst->reloc(&execBlock);
+            assembly->writeInstruction(relocated, &encodedStream);
+            assembly->writeInstruction(relocated, &templatedStream, inst->getTemplateOperand());
+        }
+    }
+    ASSERT_EQ(encodedStream.current_pos(), templatedStream.current_pos());
+    ASSERT_EQ(encoded, templated);
+}
+
+#if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
+TEST_F(ExecBlockTest, EncodingTemplatesPrefixes) {
+    // The unprefixed forms are encoded first, the prefixed ones must not reuse their encodings
+    const std::vector<std::vector<uint8_t>> guestInsts = {
+        {0xa4},                     // movsb
+        {0xf3, 0xa4},               // rep movsb
+        {0x0f, 0xb1, 0x0a},         // cmpxchg [rdx], ecx
+        {0xf0, 0x0f, 0xb1, 0x0a},   // lock cmpxchg [rdx], ecx
+    };
+    for(int pass = 0; pass < 2; pass++) {
+        for(const std::vector<uint8_t>& bytes : guestInsts) {
+            llvm::MCInst inst;
+            uint64_t size = 0;
+            ASSERT_EQ(llvm::MCDisassembler::Success,
+                      assembly->getInstruction(inst, size, llvm::ArrayRef<uint8_t>(bytes), 0));
+            ASSERT_EQ(bytes.size(), size);
+            std::vector<uint8_t> encoded(16, 0);
+            llvm::sys::MemoryBlock encodedBlock(encoded.data(), encoded.size());
+            memory_ostream encodedStream(encodedBlock);
+            assembly->writeInstruction(inst, &encodedStream, QBDI::TEMPLATE_WHOLE);
+            ASSERT_EQ(bytes.size(), encodedStream.current_pos());
+            encoded.resize(bytes.size());
+            ASSERT_EQ(bytes, encoded);
+        }
+    }
+}
+#endif
+
+TEST_F(ExecBlockTest, TargetCache) {
+    // Allocate ExecBlock
+    QBDI::ExecBlock execBlock(*assembly);
+    // Write three exit sequences without static successors
+    QBDI::Patch::Vec basicBlock;
+    basicBlock.push_back(QBDI::Patch(llvm::MCInst(), 0x1000, 1));
+    basicBlock[0].append(QBDI::getTerminator(0x2000));
+    basicBlock.push_back(QBDI::Patch(llvm::MCInst(), 0x2000, 1));
+    basicBlock[1].append(QBDI::getTerminator(0x42424242));
+    basicBlock.push_back(QBDI::Patch(llvm::MCInst(), 0x3000, 1));
+    basicBlock[2].append(QBDI::getTerminator(0x4000));
+    QBDI::SeqWriteResult seq1 = execBlock.writeSequence(basicBlock.begin(), basicBlock.begin() + 1, QBDI::SeqType::Exit);
+    QBDI::SeqWriteResult seq2 = execBlock.writeSequence(basicBlock.begin() + 1, basicBlock.begin() + 2, QBDI::SeqType::Exit);
+    QBDI::SeqWriteResult seq3 = execBlock.writeSequence(basicBlock.begin() + 2, basicBlock.end(), QBDI::SeqType::Exit);
+    // Empty cache, the first sequence returns to the host
+    execBlock.selectSeq(seq1.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x2000, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+    uint16_t exitInstID = execBlock.getCurrentInstID();
+    // Cached, the second sequence is executed without returning to the host
+    ASSERT_TRUE(execBlock.linkExit(exitInstID, 0x2000, seq2.seqID));
+    execBlock.selectSeq(seq1.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x42424242, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+    ASSERT_EQ(seq2.seqID, execBlock.getCurrentSeqID());
+    // 0x4000 shares the cache entry of 0x2000 but must not match it
+    execBlock.selectSeq(seq3.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x4000, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+    ASSERT_EQ(seq3.seqID, execBlock.getCurrentSeqID());
+    // Check the counters
+    std::vector<QBDI::TargetCacheStats> stats = execBlock.getTargetCacheStats();
+    ASSERT_EQ(3u, stats.size());
+    ASSERT_EQ((QBDI::rword) 0x1000, stats[0].address);
+    ASSERT_EQ((QBDI::rword) 1, stats[0].hits);
+    ASSERT_EQ((QBDI::rword) 1, stats[0].misses);
+    ASSERT_EQ((QBDI::rword) 0, stats[1].hits);
+    ASSERT_EQ((QBDI::rword) 1, stats[1].misses);
+    ASSERT_EQ((QBDI::rword) 0, stats[2].hits);
+    ASSERT_EQ((QBDI::rword) 1, stats[2].misses);
+    // Emptied cache
+    execBlock.unlinkAll();
+    execBlock.selectSeq(seq1.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x2000, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+}
+
+#if (defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)) && defined(_QBDI_SHADOW_RETURN_STACK)
+TEST_F(ExecBlockTest, ShadowReturnStack) {
+    // Allocate ExecBlock
+    QBDI::ExecBlock execBlock(*assembly);
+    // Write a call, the return and its continuation as exit sequences
+    llvm::MCInst call;
+    llvm::MCInst ret;
+#if defined(QBDI_ARCH_X86_64)
+    call.setOpcode(llvm::X86::CALL64pcrel32);
+    ret.setOpcode(llvm::X86::RETQ);
+#else
+    call.setOpcode(llvm::X86::CALLpcrel32);
+    ret.setOpcode(llvm::X86::RETL);
+#endif
+    call.addOperand(llvm::MCOperand::createImm(0x100));
+    QBDI::Patch::Vec basicBlock;
+    basicBlock.push_back(QBDI::Patch(call, 0x1000, 5));
+    basicBlock[0].append(QBDI::getTerminator(0x1105));
+    basicBlock.push_back(QBDI::Patch(ret, 0x1105, 1));
+    basicBlock[1].append(QBDI::getTerminator(0x1005));
+    basicBlock.push_back(QBDI::Patch(llvm::MCInst(), 0x1005, 1));
+    basicBlock[2].append(QBDI::getTerminator(0x42424242));
+    QBDI::SeqWriteResult seq1 = execBlock.writeSequence(basicBlock.begin(), basicBlock.begin() + 1, QBDI::SeqType::Exit);
+    QBDI::SeqWriteResult seq2 = execBlock.writeSequence(basicBlock.begin() + 1, basicBlock.begin() + 2, QBDI::SeqType::Exit);
+    QBDI::SeqWriteResult seq3 = execBlock.writeSequence(basicBlock.begin() + 2, basicBlock.end(), QBDI::SeqType::Exit);
+    // Unlinked return record, the return goes back to the host
+    execBlock.selectSeq(seq1.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x1105, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+    execBlock.selectSeq(seq2.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x1005, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+    uint16_t retInstID = execBlock.getCurrentInstID();
+    // Linked return record, the return jumps to the continuation
+    ASSERT_TRUE(execBlock.linkExit(retInstID, 0x1005, seq3.seqID));
+    execBlock.selectSeq(seq1.seqID);
+    execBlock.execute();
+    execBlock.selectSeq(seq2.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x42424242, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+    ASSERT_EQ(seq3.seqID, execBlock.getCurrentSeqID());
+    // The return stack was matched each time, the target cache was never used
+    std::vector<QBDI::TargetCacheStats> stats = execBlock.getTargetCacheStats();
+    ASSERT_EQ(2u, stats.size());
+    ASSERT_EQ((QBDI::rword) 0x1105, stats[0].address);
+    ASSERT_EQ((QBDI::rword) 0, stats[0].hits);
+    ASSERT_EQ((QBDI::rword) 0, stats[0].misses);
+    // A return without call mismatches and falls back to the target cache
+    execBlock.selectSeq(seq2.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x42424242, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+    stats = execBlock.getTargetCacheStats();
+    ASSERT_EQ((QBDI::rword) 1, stats[0].hits);
+    ASSERT_EQ((QBDI::rword) 0, stats[0].misses);
+}
+#endif
+
+#if defined(QBDI_ARCH_X86_64) || defined(QBDI_ARCH_X86)
+TEST_F(ExecBlockTest, ConditionalExit) {
+    // Allocate ExecBlock
+    QBDI::ExecBlock execBlock(*assembly);
+    // Write two conditional jumps, the first one taken and the second one falling through
+    llvm::MCInst je;
+    je.setOpcode(llvm::X86::JE_1);
+    je.addOperand(llvm::MCOperand::createImm(0x10));
+    QBDI::Patch::Vec basicBlock;
+    basicBlock.push_back(QBDI::Patch(je, 0x1000, 2));
+    basicBlock[0].append(QBDI::getTerminator(0x1012));
+    basicBlock.push_back(QBDI::Patch(llvm::MCInst(), 0x1012, 1));
+    basicBlock[1].append(QBDI::getTerminator(0x42424242));
+    basicBlock.push_back(QBDI::Patch(je, 0x2000, 2));
+    basicBlock[2].append(QBDI::getTerminator(0x2002));
+    QBDI::SeqWriteResult seq1 = execBlock.writeSequence(basicBlock.begin(), basicBlock.begin() + 1, QBDI::SeqType::Exit);
+    QBDI::SeqWriteResult seq2 = execBlock.writeSequence(basicBlock.begin() + 1, basicBlock.begin() + 2, QBDI::SeqType::Exit);
+    QBDI::SeqWriteResult seq3 = execBlock.writeSequence(basicBlock.begin() + 2, basicBlock.end(), QBDI::SeqType::Exit);
+    // ZF is clear, the slot is selected from the guest PC and not from the guest EFLAGS
+    execBlock.getContext()->gprState.eflags = 0;
+    execBlock.selectSeq(seq1.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x1012, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+    uint16_t exitInstID = execBlock.getCurrentInstID();
+    ASSERT_TRUE(execBlock.linkExit(exitInstID, 0x1012, seq2.seqID));
+    execBlock.selectSeq(seq1.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x42424242, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+    ASSERT_EQ(seq2.seqID, execBlock.getCurrentSeqID());
+    ASSERT_EQ((QBDI::rword) 0, execBlock.getContext()->gprState.eflags & 0x40);
+    // Each exit counts the successor it went to
+    execBlock.selectSeq(seq3.seqID);
+    execBlock.execute();
+    ASSERT_EQ((QBDI::rword) 0x2002, QBDI_GPR_GET(&execBlock.getContext()->gprState, QBDI::REG_PC));
+    QBDI::rword taken = 0;
+    QBDI::rword fallthrough = 0;
+    ASSERT_TRUE(execBlock.getSeqBranchCounts(seq1.seqID, &taken, &fallthrough));
+    ASSERT_EQ((QBDI::rword) 2, taken);
+    ASSERT_EQ((QBDI::rword) 0, fallthrough);
+    ASSERT_TRUE(execBlock.getSeqBranchCounts(seq3.seqID, &taken, &fallthrough));
+    ASSERT_EQ((QBDI::rword) 0, taken);
+    ASSERT_EQ((QBDI::rword) 1, fallthrough);
+    ASSERT_FALSE(execBlock.getSeqBranchCounts(seq2.seqID, &taken, &fallthrough));
+}
+#endif
@@ -0,0 +1,101 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <gtest/gtest.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "Utility/Arena.h"
+
+
+// Sizes in chunk and larger than the maximum chunk allocation
+static const size_t ARENA_TEST_SIZES[] = {1, 24, 100, 1000, 16 * 1024};
+
+
+static std::vector<void*> allocateAll(size_t count) {
+    std::vector<void*> ptrs;
+    for(size_t i = 0; i < count; i++) {
+        size_t size = ARENA_TEST_SIZES[i % (sizeof(ARENA_TEST_SIZES) / sizeof(size_t))];
+        void* ptr = QBDI::arenaAllocate(size);
+        memset(ptr, static_cast<int>(i & 0xff), size);
+        ptrs.push_back(ptr);
+    }
+    return ptrs;
+}
+
+
+static void checkAndFree(const std::vector<void*>& ptrs) {
+    for(size_t i = 0; i < ptrs.size(); i++) {
+        size_t size = ARENA_TEST_SIZES[i % (sizeof(ARENA_TEST_SIZES) / sizeof(size_t))];
+        const uint8_t* bytes = static_cast<const uint8_t*>(ptrs[i]);
+        for(size_t j = 0; j < size; j++) {
+            ASSERT_EQ(static_cast<uint8_t>(i & 0xff), bytes[j]);
+        }
+        QBDI::arenaDeallocate(ptrs[i]);
+    }
+}
+
+
+TEST(ArenaTest, Alignment) {
+    std::vector<void*> ptrs = allocateAll(100);
+    for(void* ptr: ptrs) {
+        EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(ptr) % alignof(std::max_align_t));
+    }
+    checkAndFree(ptrs);
+    QBDI::arenaDeallocate(nullptr);
+}
+
+
+TEST(ArenaTest, FreeFromAnotherThread) {
+    // The allocating thread exits before its allocations are freed
+    std::vector<void*> ptrs;
+    std::thread allocator([&ptrs] {
+        ptrs = allocateAll(1000);
+    });
+    allocator.join();
+    checkAndFree(ptrs);
+
+    // The allocating thread keeps allocating from the chunks while they are freed
+    ptrs = allocateAll(1000);
+    std::thread deallocator([&ptrs] {
+        checkAndFree(ptrs);
+    });
+    std::vector<void*> others = allocateAll(1000);
+    deallocator.join();
+    checkAndFree(others);
+}
+
+
+TEST(ArenaTest, SharedFromAnotherThread) {
+    std::shared_ptr<std::vector<int>> shared;
+    std::thread allocator([&shared] {
+        shared = std::allocate_shared<std::vector<int>>(QBDI::ArenaAllocator<std::vector<int>>(), 16, 42);
+    });
+    allocator.join();
+    ASSERT_EQ(16u, shared->size());
+    ASSERT_EQ(42, shared->back());
+    // The last reference is released by another thread than the allocating one
+    std::thread deallocator([&shared] {
+        shared.reset();
+    });
+    deallocator.join();
+    ASSERT_EQ(nullptr, shared);
+}
@@ -0,0 +1,58 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <gtest/gtest.h>
+#include <vector>
+
+#include "Patch/CounterArray.h"
+
+
+TEST(CounterArray, Growth) {
+    QBDI::CounterArray counters;
+    std::vector<QBDI::rword*> slots;
+    size_t size = 0;
+
+    ASSERT_EQ(nullptr, counters.getCounters(0, &size));
+    ASSERT_EQ(0u, size);
+    // The counters never move once their address is written in the instrumented code
+    for(QBDI::rword address = 0; address < 3 * QBDI::COUNTER_CHUNK_SIZE; address++) {
+        QBDI::rword* counter = counters.getCounter(address);
+        ASSERT_NE(nullptr, counter);
+        *counter += address;
+        slots.push_back(counter);
+    }
+    for(QBDI::rword address = 0; address < 3 * QBDI::COUNTER_CHUNK_SIZE; address++) {
+        ASSERT_EQ(slots[address], counters.getCounter(address));
+    }
+
+    // The counters are read in place, one chunk at a time
+    for(QBDI::rword address = 0; address < 3 * QBDI::COUNTER_CHUNK_SIZE; address++) {
+        size_t idx = 0;
+        ASSERT_TRUE(counters.getIndex(address, &idx));
+        const QBDI::rword* counter = counters.getCounters(idx, &size);
+        ASSERT_EQ(slots[address], counter);
+        ASSERT_EQ(QBDI::COUNTER_CHUNK_SIZE - idx % QBDI::COUNTER_CHUNK_SIZE, size);
+        ASSERT_EQ(address, *counter);
+    }
+    ASSERT_EQ(nullptr, counters.getCounters(3 * QBDI::COUNTER_CHUNK_SIZE, &size));
+    ASSERT_EQ(0u, size);
+
+    counters.reset();
+    for(size_t i = 0; i < slots.size(); i++) {
+        ASSERT_EQ((QBDI::rword) 0, *slots[i]);
+    }
+}
@@ -15,6 +15,8 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <vector>
+
 #include "Instr_X86_64Test.h"
 
 QBDI::VMAction increment(QBDI::VMInstanceRef vm, QBDI::GPRState *gprState, QBDI::FPRState *fprState, void *data) {
@@ -22,6 +24,23 @@ QBDI::VMAction increment(QBDI::VMInstanceRef vm, QBDI::GPRState *gprState, QBDI:
     return QBDI::VMAction::CONTINUE;
 }
 
+QBDI::VMAction recordGPRState(QBDI::VMInstanceRef vm, QBDI::GPRState *gprState, QBDI::FPRState *fprState, void *data) {
+    ((std::vector<QBDI::GPRState>*) data)->push_back(*gprState);
+    return QBDI::VMAction::CONTINUE;
+}
+
+QBDI::VMAction clobberCallerSaved(QBDI::VMInstanceRef vm, QBDI::GPRState *gprState, QBDI::FPRState *fprState, void *data) {
+    uint64_t* info = (uint64_t*) data;
+    // Formatting a string uses most of the caller saved registers, GPR and FPR
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%" PRIu64 " %f", info[0], (double) info[0] / 3);
+    info[0] += strlen(buffer) != 0 ? 1 : 0;
+    if(gprState != nullptr || fprState != nullptr) {
+        info[1]++;
+    }
+    return QBDI::VMAction::CONTINUE;
+}
+
 TEST_F(Instr_X86_64Test, GPRSave_IC) {
     uint64_t count1 = 0;
     uint64_t count2 = 0;
@@ -62,6 +81,54 @@ TEST_F(Instr_X86_64Test, GPRShuffle_IC) {
     printf("Took %" PRIu64 " instructions\n", count1);
 }
 
+TEST_F(Instr_X86_64Test, GPRShuffle_FastCallback_IC) {
+    std::vector<QBDI::GPRState> states;
+    std::vector<QBDI::GPRState> fastStates;
+
+    QBDI::Context inputState;
+    memset(&inputState, 0, sizeof(QBDI::Context));
+    for(uint32_t i = 0; i < QBDI::AVAILABLE_GPR; i++)
+        QBDI_GPR_SET(&inputState.gprState, i, i);
+
+    // The fast callback sees the same state as a regular callback on the same instruction
+    vm.deleteAllInstrumentations();
+    vm.addCodeCB(QBDI::PREINST, recordGPRState, (void*) &states);
+    vm.addFastCodeCB(QBDI::PREINST, recordGPRState, (void*) &fastStates);
+
+    comparedExec(GPRShuffle_s, inputState, 4096);
+
+    ASSERT_LT((size_t) 0, states.size());
+    ASSERT_EQ(states.size(), fastStates.size());
+    for(size_t i = 0; i < states.size(); i++) {
+        for(uint32_t j = 0; j < QBDI::NUM_GPR; j++) {
+            ASSERT_EQ(QBDI_GPR_GET(&states[i], j), QBDI_GPR_GET(&fastStates[i], j));
+        }
+    }
+
+    vm.deleteAllInstrumentations();
+}
+
+TEST_F(Instr_X86_64Test, GPRShuffle_FastCallbackNoState_IC) {
+    uint64_t info[2] = {0, 0};
+
+    QBDI::Context inputState;
+    memset(&inputState, 0, sizeof(QBDI::Context));
+    for(uint32_t i = 0; i < QBDI::AVAILABLE_GPR; i++)
+        QBDI_GPR_SET(&inputState.gprState, i, i);
+
+    // The callback without state clobbers the caller saved registers, the execution must not see it
+    vm.deleteAllInstrumentations();
+    vm.addFastCodeCB(QBDI::PREINST, clobberCallerSaved, (void*) info, false);
+    vm.addFastCodeCB(QBDI::POSTINST, clobberCallerSaved, (void*) info, false);
+
+    comparedExec(GPRShuffle_s, inputState, 4096);
+
+    ASSERT_LT((uint64_t) 0, info[0]);
+    ASSERT_EQ((uint64_t) 0, info[1]);
+
+    vm.deleteAllInstrumentations();
+}
+
 TEST_F(Instr_X86_64Test, RelativeAddressing_IC) {
     uint64_t count1 = 0;
     uint64_t count2 = 0;
@@ -118,6 +185,45 @@ TEST_F(Instr_X86_64Test, ConditionalBranching_IC) {
     printf("Took %" PRIu64 " instructions\n", count1);
 }
 
+TEST_F(Instr_X86_64Test, ConditionalBranching_Counter_IC) {
+    QBDI::Context inputState;
+    memset(&inputState, 0, sizeof(QBDI::Context));
+#if defined(QBDI_ARCH_X86)
+    inputState.gprState.eax = (QBDI::rword)rand();
+    inputState.gprState.ebx = (QBDI::rword)rand();
+    inputState.gprState.ecx = (QBDI::rword)rand();
+    inputState.gprState.edx = (QBDI::rword)rand();
+#else
+    inputState.gprState.rax = ((QBDI::rword)rand() << 32) | rand();
+    inputState.gprState.rbx = ((QBDI::rword)rand() << 32) | rand();
+    inputState.gprState.rcx = ((QBDI::rword)rand() << 32) | rand();
+    inputState.gprState.rdx = ((QBDI::rword)rand() << 32) | rand();
+#endif
+
+    // Inline counters use the dead registers and flags without saving them
+    vm.deleteAllInstrumentations();
+    uint32_t instId = vm.addInstCounter(0, (QBDI::rword) -1);
+    uint32_t blockId = vm.addBlockCounter(0, (QBDI::rword) -1);
+
+    comparedExec(ConditionalBranching_s, inputState, 4096);
+
+    for(uint32_t id : {instId, blockId}) {
+        size_t size = 0;
+        size_t count = 0;
+        QBDI::rword total = 0;
+        for(const QBDI::rword* counters = vm.getCounters(id, 0, &size); size != 0;
+            counters = vm.getCounters(id, count, &size)) {
+            for(size_t i = 0; i < size; i++) {
+                total += counters[i];
+            }
+            count += size;
+        }
+        ASSERT_LT((QBDI::rword) 0, total);
+    }
+
+    vm.deleteAllInstrumentations();
+}
+
 TEST_F(Instr_X86_64Test, FibonacciRecursion_IC) {
     uint64_t count1 = 0;
     uint64_t count2 = 0;
@@ -166,3 +272,75 @@ TEST_F(Instr_X86_64Test, StackTricks_IC) {
 
     printf("Took %" PRIu64 " instructions\n", count1);
 }
+
+TEST_F(Instr_X86_64Test, FibonacciRecursion_MemRange_IC) {
+    uint64_t count1 = 0;
+    uint64_t count2 = 0;
+    uint64_t count3 = 0;
+
+    QBDI::Context inputState;
+    memset(&inputState, 0, sizeof(QBDI::Context));
+#if defined(QBDI_ARCH_X86)
+    inputState.gprState.eax = (QBDI::rword) (rand() % 20) + 2;
+#else
+    inputState.gprState.rax = (QBDI::rword) (rand() % 20) + 2;
+#endif
+
+    // No access hits the range, every access takes the miss path of the filter
+    vm.deleteAllInstrumentations();
+    vm.addMemRangeCB(1, 2, QBDI::MEMORY_READ, increment, (void*) &count1);
+    vm.addMemRangeCB(1, 2, QBDI::MEMORY_WRITE, increment, (void*) &count1);
+
+    comparedExec(FibonacciRecursion_s, inputState, 4096);
+
+    ASSERT_EQ((uint64_t) 0, count1);
+
+    // Every access hits the range
+    vm.addMemRangeCB(0, (QBDI::rword) -1, QBDI::MEMORY_READ, increment, (void*) &count2);
+    vm.addMemRangeCB(0, (QBDI::rword) -1, QBDI::MEMORY_WRITE, increment, (void*) &count2);
+
+    comparedExec(FibonacciRecursion_s, inputState, 4096);
+
+    ASSERT_EQ((uint64_t) 0, count1);
+    ASSERT_LT((uint64_t) 0, count2);
+
+    // A read and write range is triggered once per instruction, whatever its number of accesses
+    count2 = 0;
+    vm.addMemRangeCB(0, (QBDI::rword) -1, QBDI::MEMORY_READ_WRITE, increment, (void*) &count3);
+
+    comparedExec(FibonacciRecursion_s, inputState, 4096);
+
+    ASSERT_LT((uint64_t) 0, count3);
+    ASSERT_LE(count3, count2);
+
+    printf("Took %" PRIu64 " memory accesses\n", count2);
+}
+
+TEST_F(Instr_X86_64Test, StackTricks_Stacked_IC) {
+    uint64_t count[2] = {0, 0};
+
+    QBDI::Context inputState;
+    memset(&inputState, 0, sizeof(QBDI::Context));
+#if defined(QBDI_ARCH_X86)
+    inputState.gprState.eax = (QBDI::rword) (rand() % 20) + 2;
+#else
+    inputState.gprState.rax = (QBDI::rword) (rand() % 20) + 2;
+#endif
+
+    // Stacked instrumentations, executed without and with the patch optimization
+    for(int optimize = 0; optimize < 2; optimize++) {
+        vm.deleteAllInstrumentations();
+        vm.setPatchOptimization(optimize == 1);
+        vm.recordMemoryAccess(QBDI::MEMORY_READ_WRITE);
+        vm.addInstCounter(0, (QBDI::rword) -1);
+        vm.addBlockCounter(0, (QBDI::rword) -1);
+        vm.addCodeCB(QBDI::POSTINST, increment, (void*) &count[optimize]);
+
+        comparedExec(StackTricks_s, inputState, 4096);
+    }
+
+    ASSERT_LT((uint64_t) 0, count[0]);
+    ASSERT_EQ(count[0], count[1]);
+
+    vm.deleteAllInstrumentations();
+}
@@ -0,0 +1,86 @@
+/*
+ * This file is part of QBDI.
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <string>
+
+#include "PatchRuleIndexTest.h"
+
+static const QBDI::rword ADDR_BREAK = 0x1000;
+static const QBDI::rword ADDR_RANGE_START = 0x2000;
+static const QBDI::rword ADDR_RANGE_END = 0x3000;
+static const QBDI::rword ADDR_OTHER = 0x4000;
+
+// The first rule of the list which applies, as found without the index
+static uint32_t findLinear(const QBDI::PatchRule::SharedPtrVec& rules, const llvm::MCInst* inst,
+                           QBDI::rword address, QBDI::rword instSize, llvm::MCInstrInfo* MCII) {
+    for(uint32_t i = 0; i < rules.size(); i++) {
+        if(rules[i]->canBeApplied(inst, address, instSize, MCII)) {
+            return i;
+        }
+    }
+    return QBDI::PatchRuleIndex::NOT_FOUND;
+}
+
+TEST_F(PatchRuleIndexTest, SameRuleAsLinearScan) {
+    using namespace QBDI;
+    unsigned int numOpcodes = MCII->getNumOpcodes();
+    unsigned int opA = numOpcodes / 7;
+    unsigned int opB = numOpcodes / 5;
+    unsigned int opC = numOpcodes / 3;
+    unsigned int opD = numOpcodes / 2;
+    std::string mnemonic = MCII->getName(opB).str();
+
+    // Generic rules are interleaved with the rules limited to some opcodes, several rules can
+    // apply to the same instruction
+    PatchRule::SharedPtrVec rules;
+    rules.push_back(PatchRule(AddressIs(ADDR_BREAK), {}));
+    rules.push_back(PatchRule(OpIs(opA), {}));
+    rules.push_back(PatchRule(MnemonicIs(mnemonic.c_str()), {}));
+    rules.push_back(PatchRule(And({InstructionInRange(ADDR_RANGE_START, ADDR_RANGE_END), OpIs(opC)}), {}));
+    rules.push_back(PatchRule(Or({OpIs(opA), OpIs(opD)}), {}));
+    rules.push_back(PatchRule(And({Not(OpIs(opD)), InstructionInRange(ADDR_RANGE_START, ADDR_RANGE_END)}), {}));
+    rules.push_back(PatchRule(OpIs(opC), {}));
+    rules.push_back(PatchRule(Or({OpIs(opB), AddressIs(ADDR_OTHER)}), {}));
+    rules.push_back(PatchRule(OpIs(opD), {}));
+
+    PatchRuleIndex index;
+    index.build(rules, MCII.get());
+
+    const rword addresses[] = {0, ADDR_BREAK, ADDR_RANGE_START, ADDR_RANGE_END - 1, ADDR_OTHER};
+    for(unsigned int opcode = 0; opcode <= numOpcodes; opcode++) {
+        llvm::MCInst inst;
+        inst.setOpcode(opcode);
+        for(rword address : addresses) {
+            ASSERT_EQ(findLinear(rules, &inst, address, 1, MCII.get()),
+                      index.find(rules, &inst, address, 1, MCII.get()))
+                << "opcode " << opcode << " at address " << address;
+        }
+    }
+
+    // The rule applying to every instruction ends the list
+    rules.push_back(PatchRule(True(), {}));
+    index.build(rules, MCII.get());
+    for(unsigned int opcode = 0; opcode <= numOpcodes; opcode++) {
+        llvm::MCInst inst;
+        inst.setOpcode(opcode);
+        for(rword address : addresses) {
+            uint32_t rule = index.find(rules, &inst, address, 1, MCII.get());
+            ASSERT_EQ(findLinear(rules, &inst, address, 1, MCII.get()), rule);
+            ASSERT_NE(PatchRuleIndex::NOT_FOUND, rule);
+        }
+    }
+}
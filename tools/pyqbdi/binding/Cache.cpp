@@ -0,0 +1,45 @@
+/*
+ * This file is part of pyQBDI (python binding for QBDI).
+ *
+ * Copyright 2017 Quarkslab
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pyqbdi.hpp"
+
+namespace QBDI {
+namespace pyQBDI {
+
+void init_binding_Cache(py::module& m) {
+
+    py::class_<CacheStats>(m, "CacheStats")
+        .def_readonly("targetCacheHits", &CacheStats::targetCacheHits,
+                "Indirect branches which found their target in the target cache")
+        .def_readonly("targetCacheMisses", &CacheStats::targetCacheMisses,
+                "Indirect branches which returned to the VM to find their target")
+        .def_readonly("traces", &CacheStats::traces,
+                "Hot basic blocks retranslated as the head of a trace")
+        .def_readonly("traceSideExits", &CacheStats::traceSideExits,
+                "Side exits of the traces which returned to the VM and were linked");
+
+    py::class_<TargetCacheStats>(m, "TargetCacheStats")
+        .def_readonly("address", &TargetCacheStats::address,
+                "Address of the indirect branch")
+        .def_readonly("hits", &TargetCacheStats::hits,
+                "Executions which found their target in the target cache")
+        .def_readonly("misses", &TargetCacheStats::misses,
+                "Executions which returned to the VM to find their target");
+}
+
+}}
@@ -49,14 +49,32 @@ static py::object addTrampData(uint32_t n, std::map<uint32_t, std::unique_ptr<Tr
 // Python Callback
 using PyInstCallback = std::function<VMAction(VMInstanceRef, GPRState*, FPRState*, py::object&)>;
 using PyVMCallback = std::function<VMAction(VMInstanceRef, const VMState*, GPRState*, FPRState*, py::object&)>;
+using PyMemoryTraceCallback = std::function<void(VMInstanceRef, std::vector<MemoryAccess>, py::object&)>;
 
 // Map of python callback <=> QBDI number
 static std::map<uint32_t, std::unique_ptr<TrampData<PyInstCallback>>> InstCallbackMap;
 static std::map<uint32_t, std::unique_ptr<TrampData<PyVMCallback>>> VMCallbackMap;
+// Memory trace of a VM, the data of a trace stopped from its callback is kept until it returns
+struct MemoryTraceTramp {
+    std::unique_ptr<TrampData<PyMemoryTraceCallback>> data;
+    std::vector<std::unique_ptr<TrampData<PyMemoryTraceCallback>>> retired;
+    unsigned int delivering = 0;
+};
+static std::map<const VM*, MemoryTraceTramp> MemoryTraceMap;
+
+static void retireMemoryTraceData(MemoryTraceTramp& tramp) {
+    if(tramp.delivering > 0) {
+        tramp.retired.push_back(std::move(tramp.data));
+    }
+    else {
+        tramp.data.reset();
+    }
+}
 
 static void clearTrampDataMap() {
     InstCallbackMap.clear();
     VMCallbackMap.clear();
+    MemoryTraceMap.clear();
 }
 
 // QBDI trampoline for python callback
@@ -84,6 +102,22 @@ static VMAction trampoline_VMCallback(VMInstanceRef vm, const VMState *vmState,
     return res;
 }
 
+static void trampoline_MemoryTraceCallback(VMInstanceRef vm, const MemoryAccess *accesses, size_t count, void *data) {
+    TrampData<PyMemoryTraceCallback>* cbk = static_cast<TrampData<PyMemoryTraceCallback>*>(data);
+    MemoryTraceTramp& tramp = MemoryTraceMap[static_cast<const VM*>(vm)];
+    tramp.delivering++;
+    try {
+        cbk->cbk(vm, std::vector<MemoryAccess>(accesses, accesses + count), cbk->obj);
+    } catch (const std::exception& e) {
+        std::cerr << "Error during MemoryTraceCallback : " << e.what() << std::endl;
+        exit(1);
+    }
+    tramp.delivering--;
+    if(tramp.delivering == 0) {
+        tramp.retired.clear();
+    }
+}
+
 
 void init_binding_VM(py::module& m) {
 
@@ -155,6 +189,14 @@ void init_binding_VM(py::module& m) {
                 },
                 "Register a callback event for every instruction executed.",
                 "pos"_a, "cbk"_a, "data"_a)
+        .def("addFastCodeCB",
+                [](VM& vm, InstPosition pos, PyInstCallback& cbk, py::object& obj) {
+                    std::unique_ptr<TrampData<PyInstCallback>> data {new TrampData<PyInstCallback>(cbk, obj)};
+                    uint32_t n = vm.addFastCodeCB(pos, &trampoline_InstCallback, static_cast<void*>(data.get()));
+                    return addTrampData(n, InstCallbackMap, std::move(data));
+                },
+                "Register a fast callback event for every instruction executed, called without leaving the instrumented code.",
+                "pos"_a, "cbk"_a, "data"_a)
         .def("addCodeAddrCB",
                 [](VM& vm, rword address, InstPosition pos, PyInstCallback& cbk, py::object& obj) {
                     std::unique_ptr<TrampData<PyInstCallback>> data {new TrampData<PyInstCallback>(cbk, obj)};
@@ -187,7 +229,9 @@ void init_binding_VM(py::module& m) {
                 },
                 "Add a virtual callback which is triggered for any memory access at a specific address "
                 "matching the access type. Virtual callbacks are called via callback forwarding by a "
-                "gate callback triggered on every memory access. This incurs a high performance cost.",
+                "gate callback which the instrumented code only calls for the accesses which may hit a "
+                "watched range, MEMORY_READ_WRITE ranges are checked after every instruction accessing "
+                "the memory.",
                 "address"_a ,"type"_a, "cbk"_a, "data"_a)
         .def("addMemRangeCB",
                 [](VM& vm, rword start, rword end, MemoryAccessType type, PyInstCallback& cbk, py::object& obj) {
@@ -197,8 +241,41 @@ void init_binding_VM(py::module& m) {
                 },
                 "Add a virtual callback which is triggered for any memory access at a specific address range "
                 "matching the access type. Virtual callbacks are called via callback forwarding by a "
-                "gate callback triggered on every memory access. This incurs a high performance cost.",
+                "gate callback which the instrumented code only calls for the accesses which may hit a "
+                "watched range, MEMORY_READ_WRITE ranges are checked after every instruction accessing "
+                "the memory.",
                 "start"_a, "end"_a ,"type"_a, "cbk"_a, "data"_a)
+        .def("addBlockCounter", &VM::addBlockCounter,
+                "Count the executions of the basic blocks starting in an address range.",
+                "start"_a, "end"_a)
+        .def("addInstCounter", &VM::addInstCounter,
+                "Count the executions of the instructions in an address range.",
+                "start"_a, "end"_a)
+        .def("getCounters",
+                [](const VM& vm, uint32_t id) {
+                    std::vector<rword> values;
+                    size_t size = 0;
+                    for(const rword* counters = vm.getCounters(id, 0, &size); size != 0;
+                        counters = vm.getCounters(id, values.size(), &size)) {
+                        values.insert(values.end(), counters, counters + size);
+                    }
+                    return values;
+                },
+                "Obtain a copy of the execution counters of a counter instrumentation.",
+                "id"_a)
+        .def("getCounterIndex",
+                [](const VM& vm, uint32_t id, rword address) -> py::object {
+                    size_t index = 0;
+                    if(vm.getCounterIndex(id, address, &index)) {
+                        return py::int_(index);
+                    }
+                    return py::none();
+                },
+                "Obtain the index of the counter of an address in the counters of a counter "
+                "instrumentation, or None.",
+                "id"_a, "address"_a)
+        .def("resetCounters", &VM::resetCounters,
+                "Set all the execution counters to zero.")
         .def("addVMEventCB",
                 [](VM& vm, VMEvent mask, PyVMCallback& cbk, py::object& obj) {
                     std::unique_ptr<TrampData<PyVMCallback>> data {new TrampData<PyVMCallback>(cbk, obj)};
@@ -246,12 +323,59 @@ void init_binding_VM(py::module& m) {
         .def("recordMemoryAccess", &VM::recordMemoryAccess,
                 "Add instrumentation rules to log memory access using inline instrumentation and instruction shadows.",
                 "type"_a)
-        .def("getInstMemoryAccess", &VM::getInstMemoryAccess,
+        .def("getInstMemoryAccess",
+                [](const VM& vm) {
+                    return vm.getInstMemoryAccess();
+                },
                 "Obtain the memory accesses made by the last executed instruction.",
                 py::return_value_policy::copy)
-        .def("getBBMemoryAccess", &VM::getBBMemoryAccess,
+        .def("getBBMemoryAccess",
+                [](const VM& vm) {
+                    return vm.getBBMemoryAccess();
+                },
                 "Obtain the memory accesses made by the last executed basic block.",
                 py::return_value_policy::copy)
+        .def("readInstMemoryAccess",
+                [](const VM& vm, py::buffer buffer) {
+                    py::buffer_info info = buffer.request(true);
+                    size_t cap = (info.size * info.itemsize) / sizeof(MemoryAccess);
+                    return vm.getInstMemoryAccess(static_cast<MemoryAccess*>(info.ptr), cap);
+                },
+                "Copy the memory accesses made by the last executed instruction to a writable buffer "
+                "using the MemoryAccess C structure layout. Return the number of memory accesses, only "
+                "those fitting in the buffer are copied.",
+                "buffer"_a)
+        .def("readBBMemoryAccess",
+                [](const VM& vm, py::buffer buffer) {
+                    py::buffer_info info = buffer.request(true);
+                    size_t cap = (info.size * info.itemsize) / sizeof(MemoryAccess);
+                    return vm.getBBMemoryAccess(static_cast<MemoryAccess*>(info.ptr), cap);
+                },
+                "Copy the memory accesses made by the last executed basic block to a writable buffer "
+                "using the MemoryAccess C structure layout. Return the number of memory accesses, only "
+                "those fitting in the buffer are copied.",
+                "buffer"_a)
+        .def("startMemoryTrace",
+                [](VM& vm, MemoryAccessType type, size_t size, PyMemoryTraceCallback& cbk, py::object& obj) {
+                    std::unique_ptr<TrampData<PyMemoryTraceCallback>> data {new TrampData<PyMemoryTraceCallback>(cbk, obj)};
+                    if(!vm.startMemoryTrace(type, size, &trampoline_MemoryTraceCallback, static_cast<void*>(data.get()))) {
+                        return false;
+                    }
+                    // The previous trace can have been stopped by deleteAllInstrumentations
+                    MemoryTraceTramp& tramp = MemoryTraceMap[&vm];
+                    retireMemoryTraceData(tramp);
+                    tramp.data = std::move(data);
+                    return true;
+                },
+                "Stream the memory accesses to a trace buffer using inline instrumentation. The records are "
+                "delivered in batches to the callback.",
+                "type"_a, "size"_a, "cbk"_a, "data"_a)
+        .def("stopMemoryTrace",
+                [](VM& vm) {
+                    vm.stopMemoryTrace();
+                    retireMemoryTraceData(MemoryTraceMap[&vm]);
+                },
+                "Deliver the remaining records of the memory trace and remove its instrumentation.")
         .def("precacheBasicBlock", &VM::precacheBasicBlock,
                 "Pre-cache a known basic block",
                 "pc"_a)
@@ -259,7 +383,34 @@ void init_binding_VM(py::module& m) {
                 "Clear a specific address range from the translation cache.",
                 "start"_a, "end"_a)
         .def("clearAllCache", &VM::clearAllCache,
-                "Clear the entire translation cache.");
+                "Clear the entire translation cache.")
+        .def("setCacheBudget", &VM::setCacheBudget,
+                "Set the maximum amount of memory used by the translation cache.",
+                "budget"_a)
+        .def("getCacheStats", [](const VM& vm) {
+                    CacheStats stats;
+                    vm.getCacheStats(&stats);
+                    return stats;
+                },
+                "Obtain the statistics of the translation cache.")
+        .def("getTargetCacheStats", &VM::getTargetCacheStats,
+                "Obtain the hits and misses of every indirect branch using the target cache.")
+        .def("loadDecodeCache", [](VM& vm, const std::string& path) {
+                    return vm.loadDecodeCache(path.c_str());
+                },
+                "Enable the persistent decode cache and load a cache file created by a previous run.",
+                "path"_a)
+        .def("saveDecodeCache", [](VM& vm, const std::string& path) {
+                    return vm.saveDecodeCache(path.c_str());
+                },
+                "Save the decode cache to a file which can be loaded by the next runs.",
+                "path"_a)
+        .def("setSpeculativeTranslation", &VM::setSpeculativeTranslation,
+                "Enable or disable the speculative translation of the basic block successors.",
+                "enable"_a)
+        .def("setPatchOptimization", &VM::setPatchOptimization,
+                "Enable or disable the peephole optimization of the instrumented code.",
+                "enable"_a);
 
 }
 
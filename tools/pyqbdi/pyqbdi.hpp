@@ -45,6 +45,7 @@ void init_binding_Memory(py::module& m);
 void init_binding_Range(py::module& m);
 void init_binding_State(py::module& m);
 void init_binding_InstAnalysis(py::module& m);
+void init_binding_Cache(py::module& m);
 void init_binding_Callback(py::module& m);
 void init_binding_VM(py::module& m);
 void init_binding_Logs(py::module& m);
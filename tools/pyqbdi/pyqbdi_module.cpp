@@ -36,6 +36,7 @@ PYBIND11_MODULE(pyqbdi, m) {
     init_binding_State(m);
     init_binding_Memory(m);
     init_binding_InstAnalysis(m);
+    init_binding_Cache(m);
     init_binding_Callback(m);
     init_binding_VM(m);
     init_binding_Logs(m);